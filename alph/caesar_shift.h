@@ -13,104 +13,47 @@
 void shift(buffered_container* input, buffered_container* output, 
 	const int amt, const crypto_op operation) {
 	
-	unsigned int i = 0;
+	// Decryption is just encryption by the opposite amount
+	byte n_amt;
 	switch (operation) {
-			
 		case ENCRYPT:
-			while (i < input->buffer_len) {
-				byte c = input->buffer[i];
-				bool original_is_lower = is_lower(c);
-				
-				if (original_is_lower) {
-					// Character is a lowercase letter
-					// Adjust to uppercase
-					c = to_upper(c);
-				}
-				
-				if (is_upper(c)) {
-					// Encrypt character of input text
-					c += amt;
-					
-					// Wrap back around to valid range by repeatedly subtracting 26
-					// Technically, the 26 should be ('Z' - 'A' + 1)
-					while (c > 'Z') {
-						c -= 26;
-					}
-					
-					while (c < 'A') {
-						c += 26;
-					}
-					
-					if (original_is_lower) {
-						c = to_lower(c);
-					}
-				}
-				
-				bc_write_byte(output, c);
-				
-				i++;
-				if (i == input->buffer_len) {
-					if (bc_rnext(input) != 0) {
-						// There is more data! Reset i to 0
-						i = 0;
-					} // Else there is no more data, we can finish
-				}
-			}
-			
-			bc_flush(output);
+			n_amt = alph_amount(amt);
 			break;
 			
-			
 		case DECRYPT:
-		
-			while (i < input->buffer_len) {
-				byte c = input->buffer[i];
-				bool original_is_lower = is_lower(c);
-				
-				if (original_is_lower) {
-					// Character is a lowercase letter
-					// Adjust to uppercase
-					c = to_upper(c);
-				}
-				
-				if (is_upper(c)) {
-					// Encrypt character of input text
-					c -= amt;
-					
-					// Wrap back around to valid range by repeatedly subtracting 26
-					// Technically, the 26 should be ('Z' - 'A' + 1)
-					while (c < 'A') {
-						c += 26;
-					}
-					
-					while (c > 'Z') {
-						c -= 26;
-					}
-					
-					if (original_is_lower) {
-						c = to_lower(c);
-					}
-				}
-				
-				bc_write_byte(output, c);
-				
-				i++;
-				if (i == input->buffer_len) {
-					if (bc_rnext(input) != 0) {
-						// There is more data! Reset i to 0
-						i = 0;
-					} // Else there is no more data, we can finish
-				}
-			}
-			
-			bc_flush(output);
+			n_amt = alph_amount(-amt);
 			break;
 		
-		
 		default:
-			printf("Error: Unsupported operation: '%d'\n", operation);
+			fprintf(stderr, "Error: Unsupported operation: '%d'\n", operation);
 			exit(1);
 	}
+	
+	unsigned int i = 0;
+	while (i < input->buffer_len) {
+		
+		// Shift straight into the output buffer, as much as will fit
+		size_t space;
+		byte* dst = bc_write_space(output, &space);
+		
+		size_t n = input->buffer_len - i;
+		if (space < n) {
+			n = space;
+		}
+		
+		shift_bytes(dst, &input->buffer[i], n, n_amt);
+		bc_write_commit(output, n);
+		
+		i += n;
+		if (i == input->buffer_len) {
+			if (bc_rnext(input) != 0) {
+				// There is more data! Reset i to 0
+				i = 0;
+			} // Else there is no more data, we can finish
+		}
+	}
+	
+	bc_flush(output);
 }
 
 void caesar(buffered_container* input, buffered_container* output, const crypto_op operation) {
@@ -0,0 +1,245 @@
+#ifndef ALPH__CRACK_H
+#define ALPH__CRACK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "util.h"
+#include "buffered_container.h"
+#include "threads.h"
+#include "alph/util.h"
+#include "alph/caesar_shift.h"
+#include "alph/vigenere.h"
+
+// Vigenere periods tried when looking for the key length
+#define CRACK_MAX_PERIOD 40
+
+// Letters kept for finding the Vigenere period. A few megabytes of text is far
+// more than the statistics need, so larger inputs are only partly sampled.
+#define CRACK_SAMPLE_LETTERS (1 << 22)
+
+// Relative frequency of each letter in English text
+const double english_freq[ALPH_SIZE] = {
+	0.08167, 0.01492, 0.02782, 0.04253, 0.12702, 0.02228, 0.02015,
+	0.06094, 0.06966, 0.00153, 0.00772, 0.04025, 0.02406, 0.06749,
+	0.07507, 0.01929, 0.00095, 0.05987, 0.06327, 0.09056, 0.02758,
+	0.00978, 0.02360, 0.00150, 0.01974, 0.00074
+};
+
+// Adds the letters of src to hist. Four separate tables are counted into so
+// that runs of the same letter do not stall on the same counter.
+void letter_histogram(const byte* src, const size_t len, uint64_t* hist) {
+	uint64_t sub[4][ALPH_SIZE + 1] = { { 0 } };
+	size_t i = 0;
+	
+	for (; i + 4 <= len; i += 4) {
+		for (unsigned int s = 0; s < 4; s++) {
+			// Letters fold onto 0-25, everything else lands in the spare slot
+			byte t = letter_index(src[i + s]);
+			sub[s][t < ALPH_SIZE ? t : ALPH_SIZE]++;
+		}
+	}
+	
+	for (; i < len; i++) {
+		byte t = letter_index(src[i]);
+		sub[0][t < ALPH_SIZE ? t : ALPH_SIZE]++;
+	}
+	
+	for (unsigned int l = 0; l < ALPH_SIZE; l++) {
+		hist[l] += sub[0][l] + sub[1][l] + sub[2][l] + sub[3][l];
+	}
+}
+
+// How far the letter counts are from English if the text was shifted by amt
+double chi_squared(const uint64_t* hist, const byte amt) {
+	uint64_t total = 0;
+	for (unsigned int l = 0; l < ALPH_SIZE; l++) {
+		total += hist[l];
+	}
+	
+	double score = 0;
+	for (unsigned int p = 0; p < ALPH_SIZE; p++) {
+		double expected = total * english_freq[p];
+		double diff = hist[(p + amt) % ALPH_SIZE] - expected;
+		score += diff * diff / expected;
+	}
+	
+	return score;
+}
+
+// Tries all 26 shifts, returning the one that makes the text most like English
+byte best_shift(const uint64_t* hist) {
+	byte best = 0;
+	double best_score = chi_squared(hist, 0);
+	
+	for (byte amt = 1; amt < ALPH_SIZE; amt++) {
+		double score = chi_squared(hist, amt);
+		if (score < best_score) {
+			best_score = score;
+			best = amt;
+		}
+	}
+	
+	return best;
+}
+
+void crack_shift(buffered_container* input, buffered_container* output) {
+	uint64_t hist[ALPH_SIZE] = { 0 };
+	
+	// Single pass over the whole input to count the letters
+	while (input->buffer_len > 0) {
+		letter_histogram(input->buffer, input->buffer_len, hist);
+		
+		if (bc_rnext(input) == 0) {
+			break;
+		}
+	}
+	
+	byte amt = best_shift(hist);
+	fprintf(MESSAGES, "Recovered shift: %d\n", amt);
+	
+	// Then go back over it to decrypt with the shift we found
+	bc_rewind(input);
+	shift(input, output, amt, DECRYPT);
+}
+
+typedef struct {
+	const byte* letters;
+	size_t letters_len;
+	unsigned int first_period;
+	unsigned int period_step;
+	double* ioc;
+} ioc_task;
+
+// Average index of coincidence of the columns the text splits into when the
+// key has the given period. Close to 0.066 for English and 0.038 for random.
+double period_ioc(const byte* letters, const size_t letters_len, const unsigned int period) {
+	uint64_t (*hist)[ALPH_SIZE] = (uint64_t (*)[ALPH_SIZE])calloc(period, sizeof(*hist));
+	assert(hist != NULL);
+	
+	unsigned int column = 0;
+	for (size_t i = 0; i < letters_len; i++) {
+		hist[column][letters[i]]++;
+		
+		column++;
+		if (column == period) {
+			column = 0;
+		}
+	}
+	
+	double total = 0;
+	for (unsigned int c = 0; c < period; c++) {
+		uint64_t n = 0;
+		uint64_t pairs = 0;
+		
+		for (unsigned int l = 0; l < ALPH_SIZE; l++) {
+			n += hist[c][l];
+			
+			if (hist[c][l] > 1) {
+				pairs += hist[c][l] * (hist[c][l] - 1);
+			}
+		}
+		
+		if (n > 1) {
+			total += (double)pairs / (n * (n - 1));
+		}
+	}
+	
+	free(hist);
+	return total / period;
+}
+
+void ioc_task_run(void* arg) {
+	ioc_task* task = (ioc_task*)arg;
+	
+	for (unsigned int p = task->first_period; p <= CRACK_MAX_PERIOD; p += task->period_step) {
+		task->ioc[p] = period_ioc(task->letters, task->letters_len, p);
+	}
+}
+
+void crack_vigenere(buffered_container* input, buffered_container* output, const unsigned int threads) {
+	byte* letters = (byte*)malloc(CRACK_SAMPLE_LETTERS);
+	assert(letters != NULL);
+	
+	// Pull out a sample of the letters as 0-25
+	size_t letters_len = 0;
+	while (input->buffer_len > 0 && letters_len < CRACK_SAMPLE_LETTERS) {
+		for (unsigned int i = 0; i < input->buffer_len && letters_len < CRACK_SAMPLE_LETTERS; i++) {
+			byte t = letter_index(input->buffer[i]);
+			if (t < ALPH_SIZE) {
+				letters[letters_len++] = t;
+			}
+		}
+		
+		if (bc_rnext(input) == 0) {
+			break;
+		}
+	}
+	
+	if (letters_len == 0) {
+		fprintf(stderr, "Error: there are no letters in the input to crack.\n");
+		exit(1);
+	}
+	
+	// Score every candidate period, the threads take turns through them
+	double ioc[CRACK_MAX_PERIOD + 1] = { 0 };
+	unsigned int task_count = threads < CRACK_MAX_PERIOD ? threads : CRACK_MAX_PERIOD;
+	ioc_task* tasks = (ioc_task*)malloc(task_count * sizeof(ioc_task));
+	assert(tasks != NULL);
+	
+	for (unsigned int t = 0; t < task_count; t++) {
+		tasks[t].letters = letters;
+		tasks[t].letters_len = letters_len;
+		tasks[t].first_period = t + 1;
+		tasks[t].period_step = task_count;
+		tasks[t].ioc = ioc;
+	}
+	
+	run_parallel(ioc_task_run, tasks, sizeof(ioc_task), task_count);
+	free(tasks);
+	
+	// Multiples of the real period score just as well, so take the smallest
+	// divisor of the best period that comes within 10% of its score
+	unsigned int best = 1;
+	for (unsigned int p = 2; p <= CRACK_MAX_PERIOD && p <= letters_len; p++) {
+		if (ioc[p] > ioc[best]) {
+			best = p;
+		}
+	}
+	
+	unsigned int period = best;
+	for (unsigned int p = 1; p < best; p++) {
+		if (best % p == 0 && ioc[p] >= 0.9 * ioc[best]) {
+			period = p;
+			break;
+		}
+	}
+	
+	// Each column of the key is then just a shift cipher
+	byte* key = (byte*)malloc(period + 1);
+	assert(key != NULL);
+	
+	for (unsigned int c = 0; c < period; c++) {
+		uint64_t hist[ALPH_SIZE] = { 0 };
+		
+		for (size_t i = c; i < letters_len; i += period) {
+			hist[letters[i]]++;
+		}
+		
+		key[c] = 'A' + best_shift(hist);
+	}
+	
+	key[period] = '\0';
+	fprintf(MESSAGES, "Recovered key: %s\n", key);
+	
+	bc_rewind(input);
+	vigenere(input, output, key, period, DECRYPT);
+	
+	free(key);
+	free(letters);
+}
+
+#endif
\ No newline at end of file
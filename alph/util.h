@@ -5,8 +5,18 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSSE3__)
+  #include <tmmintrin.h>
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
 #include "util.h"
 
+#define ALPH_SIZE ('Z' - 'A' + 1)
+
 bool is_lower(const char);
 inline bool is_lower(const char c) {
 	return c <= 'z' && c >= 'a';
@@ -32,4 +42,173 @@ inline char to_lower(const char c) {
 	return is_upper(c) ? c + ('a' - 'A') : c;
 }
 
+// Normalizes any shift amount into the range [0, 26)
+byte alph_amount(const int amt);
+inline byte alph_amount(const int amt) {
+	return (byte)(((amt % ALPH_SIZE) + ALPH_SIZE) % ALPH_SIZE);
+}
+
+// The letter's place in the alphabet, 0 to 25 in either case, or ALPH_SIZE
+// or more for anything else. Both cases are folded onto lowercase, so there
+// are no branches on the case of the character.
+byte letter_index(const byte);
+inline byte letter_index(const byte c) {
+	return (byte)((c | 0x20) - 'a');
+}
+
+// Shifts a letter forward by amt (already normalized) and leaves anything else
+// untouched
+byte shift_letter(const byte, const byte);
+inline byte shift_letter(const byte c, const byte amt) {
+	byte t = letter_index(c);
+	
+	if (t >= ALPH_SIZE) {
+		return c;
+	}
+	
+	byte s = t + amt;
+	if (s >= ALPH_SIZE) {
+		s -= ALPH_SIZE;
+	}
+	
+	return ('A' + s) | (c & 0x20);
+}
+
+#if defined(__SSE2__)
+// The vector version of shift_letter, with a separate amount for each lane
+__m128i shift_letters_sse(const __m128i x, const __m128i amt) {
+	const __m128i case_bit = _mm_set1_epi8(0x20);
+	const __m128i max_t = _mm_set1_epi8(ALPH_SIZE - 1);
+	
+	__m128i t = _mm_sub_epi8(_mm_or_si128(x, case_bit), _mm_set1_epi8('a'));
+	__m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(t, max_t), t);
+	
+	__m128i s = _mm_add_epi8(t, amt);
+	__m128i no_wrap = _mm_cmpeq_epi8(_mm_min_epu8(s, max_t), s);
+	s = _mm_sub_epi8(s, _mm_andnot_si128(no_wrap, _mm_set1_epi8(ALPH_SIZE)));
+	
+	__m128i r = _mm_or_si128(_mm_add_epi8(s, _mm_set1_epi8('A')), _mm_and_si128(x, case_bit));
+	return _mm_or_si128(_mm_and_si128(is_letter, r), _mm_andnot_si128(is_letter, x));
+}
+#endif
+
+#if defined(__AVX2__)
+__m256i shift_letters_avx2(const __m256i x, const __m256i amt) {
+	const __m256i case_bit = _mm256_set1_epi8(0x20);
+	const __m256i max_t = _mm256_set1_epi8(ALPH_SIZE - 1);
+	
+	__m256i t = _mm256_sub_epi8(_mm256_or_si256(x, case_bit), _mm256_set1_epi8('a'));
+	__m256i is_letter = _mm256_cmpeq_epi8(_mm256_min_epu8(t, max_t), t);
+	
+	__m256i s = _mm256_add_epi8(t, amt);
+	__m256i no_wrap = _mm256_cmpeq_epi8(_mm256_min_epu8(s, max_t), s);
+	s = _mm256_sub_epi8(s, _mm256_andnot_si256(no_wrap, _mm256_set1_epi8(ALPH_SIZE)));
+	
+	__m256i r = _mm256_or_si256(_mm256_add_epi8(s, _mm256_set1_epi8('A')), _mm256_and_si256(x, case_bit));
+	return _mm256_blendv_epi8(x, r, is_letter);
+}
+#endif
+
+// Shifts every letter in src by the same amount, writing the result to dst
+void shift_bytes(byte* dst, const byte* src, const size_t len, const byte amt) {
+	size_t i = 0;
+	
+	#if defined(__AVX2__)
+	const __m256i amt_256 = _mm256_set1_epi8(amt);
+	for (; i + 32 <= len; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)&src[i]);
+		_mm256_storeu_si256((__m256i*)&dst[i], shift_letters_avx2(x, amt_256));
+	}
+	#endif
+	
+	#if defined(__SSE2__)
+	const __m128i amt_128 = _mm_set1_epi8(amt);
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)&src[i]);
+		_mm_storeu_si128((__m128i*)&dst[i], shift_letters_sse(x, amt_128));
+	}
+	#endif
+	
+	for (; i < len; i++) {
+		dst[i] = shift_letter(src[i], amt);
+	}
+}
+
+// Shifts letters by a repeating key, where the key only advances on letters.
+// shifts holds the normalized amount for each key position, followed by the
+// first 16 of them again so a vector can always be loaded from any position.
+// key_i is where in the key this run starts, and is updated for the next run.
+void vigenere_bytes(byte* dst, const byte* src, const size_t len,
+	const byte* shifts, const size_t key_len, size_t* key_i) {
+	
+	size_t i = 0;
+	size_t k = *key_i;
+	
+	#if defined(__SSSE3__)
+	const __m128i case_bit = _mm_set1_epi8(0x20);
+	const __m128i max_t = _mm_set1_epi8(ALPH_SIZE - 1);
+	
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)&src[i]);
+		
+		// Mark the letters, then count how many come before each lane
+		__m128i t = _mm_sub_epi8(_mm_or_si128(x, case_bit), _mm_set1_epi8('a'));
+		__m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(t, max_t), t);
+		__m128i ones = _mm_and_si128(is_letter, _mm_set1_epi8(1));
+		
+		__m128i prefix = _mm_add_epi8(ones, _mm_slli_si128(ones, 1));
+		prefix = _mm_add_epi8(prefix, _mm_slli_si128(prefix, 2));
+		prefix = _mm_add_epi8(prefix, _mm_slli_si128(prefix, 4));
+		prefix = _mm_add_epi8(prefix, _mm_slli_si128(prefix, 8));
+		prefix = _mm_sub_epi8(prefix, ones);
+		
+		// Each letter takes the key position at our offset plus its prefix count
+		__m128i window = _mm_loadu_si128((const __m128i*)&shifts[k]);
+		__m128i amt = _mm_shuffle_epi8(window, prefix);
+		
+		_mm_storeu_si128((__m128i*)&dst[i], shift_letters_sse(x, amt));
+		
+		k = (k + __builtin_popcount(_mm_movemask_epi8(is_letter))) % key_len;
+	}
+	#endif
+	
+	for (; i < len; i++) {
+		byte c = src[i];
+		dst[i] = shift_letter(c, shifts[k]);
+		
+		if (is_alpha(c)) {
+			k++;
+			if (k == key_len) {
+				k = 0;
+			}
+		}
+	}
+	
+	*key_i = k;
+}
+
+// Counts the letters in src, which is how far a Vigenere key advances over it
+size_t count_letters(const byte* src, const size_t len) {
+	size_t i = 0;
+	size_t count = 0;
+	
+	#if defined(__SSE2__)
+	const __m128i case_bit = _mm_set1_epi8(0x20);
+	const __m128i max_t = _mm_set1_epi8(ALPH_SIZE - 1);
+	
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)&src[i]);
+		__m128i t = _mm_sub_epi8(_mm_or_si128(x, case_bit), _mm_set1_epi8('a'));
+		__m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(t, max_t), t);
+		count += __builtin_popcount(_mm_movemask_epi8(is_letter));
+	}
+	#endif
+	
+	for (; i < len; i++) {
+		count += is_alpha(src[i]);
+	}
+	
+	return count;
+}
+
 #endif
\ No newline at end of file
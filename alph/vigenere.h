@@ -9,141 +9,193 @@
 #include "util.h"
 #include "buffered_container.h"
 #include "alph/util.h"
+#include "threads.h"
+
+// How much input each thread takes per batch in the parallel mode
+#define VIGENERE_MT_CHUNK (1 << 20)
 
 bool vigenere_keycheck(const byte* key, const size_t key_len) {
 	// Input text can be invalid as that character is
 	// skipped, but the key cannot
-	byte* key_cpy = (byte*)clone_buffer(key, key_len);
-	
 	for (unsigned int i = 0; i < key_len; i++) {
-		if (is_lower(key_cpy[i])) {
-			// Character is a lowercase letter
-			// Adjust to uppercase
-			key_cpy[i] = to_upper(key_cpy[i]);
-		}
-		
-		if (!is_upper(key_cpy[i])) {
-			// Character (after case correction) is outside range
-			free(key_cpy);
+		if (!is_alpha(key[i])) {
 			return false;
 		}
 	}
 	
-	free(key_cpy);
 	return true;
 }
 
+// Fills shifts with the shift amount for each key position, repeating the
+// start of the key afterwards so vigenere_bytes can load a full vector from
+// any position. shifts must have room for key_len + 16 amounts.
+void vigenere_fill_shifts(byte* shifts, const byte* key, const size_t key_len, const crypto_op operation) {
+	for (unsigned int i = 0; i < key_len + 16; i++) {
+		// Subtracting 'A' from the key to normalize A to 0 instead 
+		// of the ASCII value of 65
+		int k = to_upper(key[i % key_len]) - 'A';
+		shifts[i] = alph_amount(operation == ENCRYPT ? k : -k);
+	}
+}
+
+byte* vigenere_shifts(const byte* key, const size_t key_len, const crypto_op operation) {
+	byte* shifts = (byte*)malloc(key_len + 16);
+	assert(shifts != NULL);
+	
+	vigenere_fill_shifts(shifts, key, key_len, operation);
+	return shifts;
+}
+
 void vigenere(buffered_container* input, buffered_container* output, 
 	const byte* key, const size_t key_len, const crypto_op operation) {
 	
 	output->buffer_len = 0;
-
+	
+	switch (operation) {
+		case ENCRYPT:
+		case DECRYPT:
+			break;
+		
+		default:
+			fprintf(stderr, "Error: Unsupported operation: '%d'\n", operation);
+			exit(1);
+	}
+	
+	byte* shifts = vigenere_shifts(key, key_len, operation);
+	
 	unsigned int i = 0;
-	unsigned int key_i = 0;
+	size_t key_i = 0;
+	
+	while (i < input->buffer_len) {
+		
+		// Encrypt straight into the output buffer, as much as will fit
+		size_t space;
+		byte* dst = bc_write_space(output, &space);
+		
+		size_t n = input->buffer_len - i;
+		if (space < n) {
+			n = space;
+		}
+		
+		vigenere_bytes(dst, &input->buffer[i], n, shifts, key_len, &key_i);
+		bc_write_commit(output, n);
+		
+		i += n;
+		if (i == input->buffer_len) {
+			if (bc_rnext(input) != 0) {
+				// There is more data! Reset i to 0
+				i = 0;
+			} // Else there is no more data, we can finish
+		}
+	}
+	
+	free(shifts);
+	bc_flush(output);
+}
+
+typedef struct {
+	byte* data;
+	size_t len;
+	size_t letters;
+	size_t key_start;
+	const byte* shifts;
+	size_t key_len;
+} vigenere_task;
+
+void vigenere_count_task(void* arg) {
+	vigenere_task* task = (vigenere_task*)arg;
+	task->letters = count_letters(task->data, task->len);
+}
+
+void vigenere_crypt_task(void* arg) {
+	vigenere_task* task = (vigenere_task*)arg;
+	size_t key_i = task->key_start;
+	vigenere_bytes(task->data, task->data, task->len, task->shifts, task->key_len, &key_i);
+}
+
+// Parallel Vigenere. The key only advances on letters, so the input is read in
+// batches and each batch is done in two passes. First every thread counts the
+// letters in its chunk, then a prefix sum over those counts gives each chunk
+// its starting key position, and finally every chunk is encrypted on its own.
+// The output is identical to vigenere().
+void vigenere_mt(buffered_container* input, buffered_container* output, 
+	const byte* key, const size_t key_len, const crypto_op operation, const unsigned int threads) {
+	
+	output->buffer_len = 0;
 	
 	switch (operation) {
 		case ENCRYPT:
-			while (i < input->buffer_len) {
-				byte c = input->buffer[i];
-				
-				bool original_is_lower = is_lower(c);
-				
-				if (is_lower(c)) {
-					// Character is a lowercase letter
-					// Adjust to uppercase
-					c = to_upper(c);
-				}
-				
-				
-				if (is_upper(c)) {
-					// Encrypt character of input text
-					// Subtracting 'A' from the key to normalize A to 0 instead 
-					// of the ASCII value of 65
-					byte k = key[key_i % key_len];
-					k = to_upper(k);
-					key_i++;
-					
-					c += k - 'A';
-					
-					// Wrap back around to valid range by repeatedly subtracting 26
-					// Technically, the 26 should be ('Z' - 'A' + 1)
-					while (c > 'Z') {
-						c -= 26;
-					}
-					
-					if (original_is_lower) {
-						c = to_lower(c);
-					}
-				}
-				
-				bc_write_byte(output, c);
-				
-				i++;
-				if (i == input->buffer_len) {
-					if (bc_rnext(input) != 0) {
-						// There is more data! Reset i to 0
-						i = 0;
-					} // Else there is no more data, we can finish
-				}
-			}
-			
-			bc_flush(output);
+		case DECRYPT:
 			break;
+		
+		default:
+			fprintf(stderr, "Error: Unsupported operation: '%d'\n", operation);
+			exit(1);
+	}
+	
+	byte* shifts = vigenere_shifts(key, key_len, operation);
+	
+	// Full batches give each thread the same chunk every time, so chunks are
+	// kept in memory local to their thread
+	size_t batch_size = (size_t)threads * VIGENERE_MT_CHUNK;
+	byte* batch = pool_alloc_local(VIGENERE_MT_CHUNK, threads);
+	vigenere_task* tasks = (vigenere_task*)malloc(threads * sizeof(vigenere_task));
+	assert(tasks != NULL);
+	
+	unsigned int i = 0;
+	size_t key_i = 0;
+	
+	while (i < input->buffer_len) {
+		
+		// Gather a batch of input
+		size_t filled = 0;
+		while (filled < batch_size && i < input->buffer_len) {
+			size_t n = input->buffer_len - i;
+			if (batch_size - filled < n) {
+				n = batch_size - filled;
+			}
 			
+			memcpy(&batch[filled], &input->buffer[i], n);
+			filled += n;
+			i += n;
 			
-		case DECRYPT:
-			while (i < input->buffer_len) {
-				byte c = input->buffer[i];
-				
-				bool original_is_lower = is_lower(c);
-				
-				if (is_lower(c)) {
-					// Character is a lowercase letter
-					// Adjust to uppercase
-					c = to_upper(c);
-				}
-				
-				
-				if (is_upper(c)) {
-					// Decrypt character of input text
-					// Subtracting 'A' from the key to normalize A to 0 instead 
-					// of the ASCII value of 65
-					byte k = key[key_i % key_len];
-					k = to_upper(k);
-					key_i++;
-					
-					c -= k - 'A';
-					
-					// Wrap back around to valid range by repeatedly subtracting 26
-					// Technically, the 26 should be ('Z' - 'A' + 1)
-					while (c < 'A') {
-						c += 26;
-					}
-					
-					if (original_is_lower) {
-						c = to_lower(c);
-					}
-				}
-				
-				bc_write_byte(output, c);
-				
-				i++;
-				if (i == input->buffer_len) {
-					if (bc_rnext(input) != 0) {
-						// There is more data! Reset i to 0
-						i = 0;
-					} // Else there is no more data, we can finish
-				}
+			if (i == input->buffer_len) {
+				if (bc_rnext(input) != 0) {
+					// There is more data! Reset i to 0
+					i = 0;
+				} // Else there is no more data, we can finish
 			}
+		}
+		
+		// Split it evenly between the threads
+		size_t chunk = (filled + threads - 1) / threads;
+		for (unsigned int t = 0; t < threads; t++) {
+			size_t start = t * chunk < filled ? t * chunk : filled;
+			size_t end = start + chunk < filled ? start + chunk : filled;
 			
-			bc_flush(output);
-			break;
+			tasks[t].data = &batch[start];
+			tasks[t].len = end - start;
+			tasks[t].shifts = shifts;
+			tasks[t].key_len = key_len;
+		}
 		
+		run_parallel(vigenere_count_task, tasks, sizeof(vigenere_task), threads);
 		
-		default:
-			printf("Error: Unsupported operation: '%d'\n", operation);
-			exit(1);
+		// Prefix sum of the letter counts gives each chunk its key position
+		for (unsigned int t = 0; t < threads; t++) {
+			tasks[t].key_start = key_i;
+			key_i = (key_i + tasks[t].letters) % key_len;
+		}
+		
+		run_parallel(vigenere_crypt_task, tasks, sizeof(vigenere_task), threads);
+		
+		bc_write_block(output, batch, filled);
 	}
+	
+	free(tasks);
+	bc_free_buffer(batch);
+	free(shifts);
+	bc_flush(output);
 }
 
 #endif
\ No newline at end of file
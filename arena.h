@@ -0,0 +1,139 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#define ARENA_ALIGNMENT 64
+#define ARENA_HUGE_PAGE (2 << 20)
+#define ARENA_BUFFERS   24		// Buffers' worth of space reserved for a run
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#if !defined(_WIN32)
+  #include <sys/mman.h>
+#endif
+
+#include "util.h"
+
+// A bump allocator for everything a run needs: I/O buffers, cipher contexts
+// and scratch blocks. Allocations are taken off the front of one reserved
+// region and released together at the end, so the cipher loops never go to
+// the heap. Only pages that get touched are backed, and with --huge-pages
+// they are 2 MiB pages to cut TLB misses on long runs. Once the region is
+// used up, allocations fall back to the heap. Only the main thread allocates
+// from it.
+
+typedef struct {
+	byte* base;
+	size_t size;
+	size_t used;
+} arena;
+
+// The arena for the whole run, unused until arena_init is called on it
+arena run_arena = { NULL, 0, 0 };
+
+// Reserves size bytes, rounded up to whole huge pages. Returns false if the
+// space could not be reserved, leaving every allocation on the heap.
+bool arena_init(arena* a, size_t size, const bool huge) {
+	size = (size + ARENA_HUGE_PAGE - 1) / ARENA_HUGE_PAGE * ARENA_HUGE_PAGE;
+	memset(a, 0, sizeof(arena));
+	
+	#if defined(_WIN32)
+	// Without overcommit the whole region would be committed up front, so
+	// Windows stays on the heap
+	(void)huge;
+	return false;
+	#else
+	void* base = MAP_FAILED;
+	
+	#if defined(MAP_HUGETLB)
+	if (huge) {
+		// Reserved huge pages, if the system has any set aside
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+	#endif
+	
+	if (base == MAP_FAILED) {
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		
+		#if defined(MADV_HUGEPAGE)
+		if (huge && base != MAP_FAILED) {
+			// Otherwise ask for transparent huge pages
+			madvise(base, size, MADV_HUGEPAGE);
+		}
+		#endif
+	}
+	
+	if (base == MAP_FAILED) {
+		return false;
+	}
+	
+	a->base = (byte*)base;
+	a->size = size;
+	return true;
+	#endif
+}
+
+// Returns size bytes aligned to align, a power of two, or NULL if the arena
+// is unused or full
+void* arena_alloc(arena* a, const size_t size, const size_t align) {
+	if (a->base == NULL) {
+		return NULL;
+	}
+	
+	uintptr_t start = ((uintptr_t)a->base + a->used + align - 1) & ~(uintptr_t)(align - 1);
+	size_t offset = start - (uintptr_t)a->base;
+	
+	if (offset > a->size || size > a->size - offset) {
+		return NULL;
+	}
+	
+	a->used = offset + size;
+	return (void*)start;
+}
+
+bool arena_owns(const arena* a, const void* p) {
+	return a->base != NULL && (const byte*)p >= a->base && (const byte*)p < a->base + a->size;
+}
+
+void arena_release(arena* a) {
+	if (a->base == NULL) {
+		return;
+	}
+	
+	#if !defined(_WIN32)
+	munmap(a->base, a->size);
+	#endif
+	
+	memset(a, 0, sizeof(arena));
+}
+
+// Memory for the run, from the arena when there is room
+void* scratch_alloc(const size_t size) {
+	void* p = arena_alloc(&run_arena, size, ARENA_ALIGNMENT);
+	
+	if (p == NULL) {
+		p = malloc(size > 0 ? size : 1);
+		assert(p != NULL);
+	}
+	
+	return p;
+}
+
+void* scratch_clone(const void* src, const size_t size) {
+	void* p = scratch_alloc(size);
+	memcpy(p, src, size);
+	return p;
+}
+
+// Arena memory is given back all at once, only heap memory is freed here
+void scratch_free(void* p) {
+	if (!arena_owns(&run_arena, p)) {
+		free(p);
+	}
+}
+
+#endif
@@ -11,6 +11,7 @@
 #include "util.h"
 #include "types.h"
 #include "buffered_container.h"
+#include "block/aes.h"
 
 void print_help_msg();
 inline void print_help_msg() {
@@ -25,6 +26,9 @@ inline void print_help_msg() {
                     TEXT:<ascii text>\n\
                     HEX:<hexadecimal>\n\
                     BASE64:<base64>\n\
+                    STDIN  (binary, can be a pipe)\n\
+                    HEX:FILE:<filename>     HEX:STDIN\n\
+                    BASE64:FILE:<filename>  BASE64:STDIN\n\
 \n\
 \n\
 * Data output (plaintext or ciphertext)\n\
@@ -33,6 +37,9 @@ inline void print_help_msg() {
                     TEXT   (will output to stdout)\n\
                     HEX    (will output to stdout)\n\
                     BASE64 (will output to stdout)\n\
+                    HEX:FILE:<filename>\n\
+                    BASE64:FILE:<filename>\n\
+                    STDOUT (binary, messages move to stderr)\n\
 \n\
 \n\
 * Cipher selection\n\
@@ -44,6 +51,11 @@ inline void print_help_msg() {
 \n\
                     RC4           RC4 Stream cipher. Accepts arbitrary size\n\
                                   key of any kind up to 2048 bits.\n\
+\n\
+                    XOR           One-time pad. Key is the pad, usually a\n\
+                                  FILE:<>, and must be as long as the input.\n\
+                    XOR:CYCLE     Repeating XOR. The key is reused from the\n\
+                                  start whenever it runs out.\n\
 \n\
                     AES:128:___   AES with a 128 bit key.\n\
                     AES:192:___   AES with a 192 bit key.\n\
@@ -79,20 +91,162 @@ inline void print_help_msg() {
                     BASE64:<base64>\n\
 \n\
 \n\
-* Operation. Select encryption or decryption.\n\
+* Operation. Select encryption or decryption, or crack a classical cipher.\n\
 \n\
     --encrypt\n\
     --decrypt\n\
+    --crack         Find the key of SHIFT, CAESAR or VIGENERE ciphertext\n\
+                    written in English, and output the decrypted text.\n\
+\n\
+\n\
+* Buffer size. How much data is read and written at a time, rounded up to\n\
+  a multiple of 64 bytes. Accepts K, M and G suffixes. Defaults to 64K.\n\
+\n\
+    --buffer-size   <size>\n\
+\n\
+\n\
+* Streaming stores. Writes output buffers with non-temporal stores, so\n\
+  ciphertext does not push the input and key out of the CPU cache. auto\n\
+  does so once a buffer is larger than the last level cache. Defaults to auto.\n\
+\n\
+    --stream-stores <auto | on | off>\n\
+\n\
+\n\
+* Asynchronous I/O. Reads files ahead and writes them behind the cipher with\n\
+  io_uring, on Linux. Falls back to normal reads and writes elsewhere.\n\
+\n\
+    --async-io\n\
+\n\
+\n\
+* Huge pages. Backs the buffers and cipher state of a run with 2 MiB pages,\n\
+  for fewer TLB misses on long runs. Uses reserved huge pages if the system\n\
+  has them, transparent huge pages otherwise.\n\
+\n\
+    --huge-pages\n\
+\n\
+\n\
+* Direct I/O. Opens files with O_DIRECT, so large files are read and\n\
+  written straight to disk without filling the page cache. Buffers are\n\
+  rounded up to whole 4 KiB sectors. Linux only.\n\
+\n\
+    --direct-io\n\
+\n\
+\n\
+* Preallocate. Reserves the whole output file up front and writes it\n\
+  through a memory mapping, trimming it to size at the end. Linux only.\n\
+\n\
+    --preallocate\n\
+\n\
+\n\
+* In-place. Writes the output back over the input file instead of to a\n\
+  separate one. Only for ciphers that keep the length of the data, so not\n\
+  ECB or CBC. Progress is journaled, and an interrupted run carries on\n\
+  where it stopped when run again.\n\
+\n\
+    --in-place\n\
+\n\
+\n\
+* Sparse. Encrypts only the data extents of a sparse file, such as a VM\n\
+  image, and records where the holes are. Decrypting with --sparse puts the\n\
+  holes back. AES in CTR mode only.\n\
+\n\
+    --sparse\n\
+\n\
+\n\
+* Threads. Ciphers that support it will split the work between this many\n\
+  threads. Currently VIGENERE and --crack. Defaults to 1. auto uses every\n\
+  allowed CPU, capped by the cgroup CPU quota.\n\
+\n\
+    -t, --threads   <count | auto>\n\
+\n\
+\n\
+* CPUs. Pins the threads to these CPUs, in order, so each keeps its buffers\n\
+  on its own NUMA node. Defaults to the CPUs the process may run on.\n\
+\n\
+    --cpus          <list, such as 0-3,8>\n\
+\n\
+\n\
+* Daemon. Serves requests on a UNIX domain socket with the keys in a key\n\
+  file set up once, so many small files can be encrypted without a process\n\
+  start and key schedule for each. Each line of the key file is\n\
+  <id> <cipher> [key], the key given as for -k. -t sets the workers,\n\
+  defaulting to auto. Not available on Windows.\n\
+\n\
+    --serve         <socket> --keys <key file>\n\
+\n\
+\n\
+* Client. Encrypts or decrypts a file on a daemon, with the key of that id.\n\
+  The files are opened here and handed to the daemon, so only FILE:<>\n\
+  inputs and outputs can be used, or STDIN with STDOUT, which are passed in\n\
+  shared memory. -iv is given as usual. With --in-place the daemon maps the\n\
+  input file and works on it where it is, except with ECB and CBC. With\n\
+  --by-path the daemon is sent the paths and opens the files itself, with\n\
+  its own access rather than the client's.\n\
+\n\
+    --client        <socket> --key-id <id>\n\
+    --in-place\n\
+    --by-path\n\
+\n\
+\n\
+* Batch. Encrypts or decrypts every file under a directory, or every path\n\
+  listed one per line in a manifest, into the same relative paths under an\n\
+  output directory, on -t threads. Large files are split between threads\n\
+  in CTR, ECB and CAESAR or SHIFT, and in CBC and CFB when decrypting.\n\
+  Failures are listed at the end, and --report writes a line for every\n\
+  file. Not available on Windows.\n\
+\n\
+    --batch         <directory | manifest> --output-dir <directory>\n\
+    --report        <file>\n\
 ");
 	
 	exit(0);
 }
 
+// Parses a size such as 4096, 64K, 4M or 1G. Returns 0 if it is not valid.
+size_t parse_size(const char* str) {
+	char* end;
+	unsigned long long size = strtoull(str, &end, 10);
+	
+	if (end == str) {
+		return 0;
+	}
+	
+	switch (*end) {
+		case '\0':
+			return size;
+			
+		case 'k':
+		case 'K':
+			size <<= 10;
+			break;
+			
+		case 'm':
+		case 'M':
+			size <<= 20;
+			break;
+			
+		case 'g':
+		case 'G':
+			size <<= 30;
+			break;
+			
+		default:
+			return 0;
+	}
+	
+	// Only a single suffix character is allowed
+	if (end[1] != '\0') {
+		return 0;
+	}
+	
+	return size;
+}
+
 char** split_string(char* string) {
 	unsigned int len = strlen(string);
 	
 	if (len == 0) {
-		printf(ERROR_EMPTY_ARGUMENT);
+		fprintf(stderr, ERROR_EMPTY_ARGUMENT);
 		exit(1);
 	}
 	
@@ -113,7 +267,7 @@ char** split_string(char* string) {
 		} else {
 			
 			if (len_cnt == MAX_KEYWORD_STACK) {
-				printf(ERROR_INVALID_ARGUMENT, string);
+				fprintf(stderr, ERROR_INVALID_ARGUMENT, string);
 				exit(1);
 			}
 			
@@ -193,25 +347,59 @@ char** split_string(char* string) {
 	return result;
 }
 
-buffered_container* parse_keywords_to_output_bc(char* keywords) {
+void free_split_string(char** split) {
+	for (unsigned int i = 0; i < MAX_KEYWORD_STACK; i++) {
+		free(split[i]);
+	}
 	
-	char** keywords_split = split_string(keywords);
+	free(split);
+}
+
+// An encoded output goes to stdout, unless it is followed by FILE:<filename>
+buffered_container* encoded_output_bc(char* destination, char* keywords, unsigned int printformat) {
+	if (destination == NULL) {
+		return bc_new(printformat);
+	}
+	
+	if (strncasecmp(destination, "FILE:", 5) != 0) {
+		fprintf(stderr, WARNING_EXTRA_DATA, destination, keywords);
+		return bc_new(printformat);
+	}
+	
+	if (strlen(destination) == 5) {
+		fprintf(stderr, ERROR_NO_FILE_SPECIFIED);
+		exit(1);
+	}
+	
+	return bc_from_file(&destination[5], OUTPUT_FILE, printformat);
+}
+
+buffered_container* split_keywords_to_output_bc(char** keywords_split, char* keywords) {
 	
 	if (keywords_split[0] == NULL) {
-		printf(ERROR_EMPTY_ARGUMENT);
+		fprintf(stderr, ERROR_EMPTY_ARGUMENT);
 		exit(1);
 	}
 	
-	// Valid keywords here: FILE, TEXT, HEX, BASE64
+	// Valid keywords here: FILE, TEXT, HEX, BASE64, STDOUT
+	if (strcasecmp(keywords_split[0], "STDOUT") == 0) {
+		
+		if (keywords_split[1] != NULL) {
+			fprintf(stderr, WARNING_EXTRA_DATA, keywords_split[1], keywords);
+		}
+		
+		return bc_from_stream(stdout, false, NO_PRINT);
+	}
+	
 	if (strcasecmp(keywords_split[0], "FILE") == 0) {
 		
 		if (keywords_split[1] == NULL || strlen(keywords_split[1]) == 0) {
-			printf(ERROR_NO_FILE_SPECIFIED);
+			fprintf(stderr, ERROR_NO_FILE_SPECIFIED);
 			exit(1);
 		}
 		
 		if (keywords_split[2] != NULL) {
-			printf(WARNING_EXTRA_DATA, keywords_split[2], keywords);
+			fprintf(stderr, WARNING_EXTRA_DATA, keywords_split[2], keywords);
 		}
 	
 		return bc_from_file(keywords_split[1], OUTPUT_FILE, NO_PRINT);
@@ -221,57 +409,144 @@ buffered_container* parse_keywords_to_output_bc(char* keywords) {
 	if (strcasecmp(keywords_split[0], "TEXT") == 0) {
 		
 		if (keywords_split[1] != NULL) {
-			printf(WARNING_EXTRA_DATA, keywords_split[1], keywords);
+			fprintf(stderr, WARNING_EXTRA_DATA, keywords_split[1], keywords);
 		}
 		
 		if (keywords_split[2] != NULL) {
-			printf(WARNING_EXTRA_DATA, keywords_split[2], keywords);
+			fprintf(stderr, WARNING_EXTRA_DATA, keywords_split[2], keywords);
 		}
 		
 		return bc_new(PRINT_TEXT);
 	}
 	
-	// Create a new output buffer with PRINT_HEX as its output method
+	// Create a new output buffer with PRINT_HEX as its output method, to stdout
+	// or to FILE:<> after it
 	if (strcasecmp(keywords_split[0], "HEX") == 0) {
 		
-		if (keywords_split[1] != NULL) {
-			printf(WARNING_EXTRA_DATA, keywords_split[1], keywords);
-		}
-		
 		if (keywords_split[2] != NULL) {
-			printf(WARNING_EXTRA_DATA, keywords_split[2], keywords);
+			fprintf(stderr, WARNING_EXTRA_DATA, keywords_split[2], keywords);
 		}
 		
-		return bc_new(PRINT_HEX);
+		return encoded_output_bc(keywords_split[1], keywords, PRINT_HEX);
 	}
 	
-	// Create a new output buffer with PRINT_BASE64 as its output method
+	// Create a new output buffer with PRINT_BASE64 as its output method, to
+	// stdout or to FILE:<> after it
 	if (strcasecmp(keywords_split[0], "BASE64") == 0) {
 		
-		if (keywords_split[1] != NULL) {
-			printf(WARNING_EXTRA_DATA, keywords_split[1], keywords);
-		}
-		
 		if (keywords_split[2] != NULL) {
-			printf(WARNING_EXTRA_DATA, keywords_split[2], keywords);
+			fprintf(stderr, WARNING_EXTRA_DATA, keywords_split[2], keywords);
 		}
 		
-		return bc_new(PRINT_BASE64);
+		return encoded_output_bc(keywords_split[1], keywords, PRINT_BASE64);
 	}
 	
-	printf(ERROR_INVALID_ARGUMENT, keywords);
+	fprintf(stderr, ERROR_INVALID_ARGUMENT, keywords);
 	exit(1);
 }
+
+buffered_container* parse_keywords_to_output_bc(char* keywords) {
+	char** keywords_split = split_string(keywords);
+	buffered_container* bc = split_keywords_to_output_bc(keywords_split, keywords);
 	
-buffered_container* parse_keywords_to_input_bc(char* keywords) {
+	free_split_string(keywords_split);
+	return bc;
+}
+
+// If the data output is STDOUT. This is needed before anything is printed.
+bool output_is_stdout(int argc, char** argv) {
+	for (int i = 1; i + 1 < argc; i++) {
+		if (
+			(strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) &&
+			strcasecmp(argv[i + 1], "STDOUT") == 0
+		) {
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+// The file an -i or -o argument reads or writes, FILE:<> on its own or after
+// HEX: or BASE64:, otherwise NULL
+const char* argument_file(const char* arg) {
+	const char* colon = strchr(arg, KEYWORD_SEPARATOR);
+	if (colon != NULL && strncasecmp(colon + 1, "FILE:", 5) == 0) {
+		arg = colon + 1;
+	}
+	
+	return strncasecmp(arg, "FILE:", 5) == 0 && arg[5] != '\0' ? &arg[5] : NULL;
+}
+
+// Refuses an output that is also the input before either is opened, as
+// opening the output truncates it whichever comes first
+void refuse_same_file(int argc, char** argv) {
+	#if !defined(_WIN32)
+	for (int i = 1; i + 1 < argc; i++) {
+		bool input = strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--input") == 0;
+		bool output = strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0;
+		const char* fname = input || output ? argument_file(argv[i + 1]) : NULL;
+		struct stat st;
+		
+		if (fname != NULL && stat(fname, &st) == 0) {
+			bc_track_file(fname, &st, input);
+		}
+	}
+	#endif
+}
+
+// For --in-place, the output is the input file opened again for updating
+buffered_container* parse_keywords_to_in_place_bc(char* keywords, const bool resumable) {
 	
 	char** keywords_split = split_string(keywords);
 	
+	if (strcasecmp(keywords_split[0], "FILE") != 0) {
+		fprintf(stderr, ERROR_IN_PLACE_NOT_FILE);
+		exit(1);
+	}
+	
+	buffered_container* bc = bc_in_place(keywords_split[1], resumable);
+	
+	free_split_string(keywords_split);
+	return bc;
+}
+	
+// Encoded input is decoded as it is read when it comes from FILE:<filename>
+// or STDIN. Returns NULL for a literal, which is decoded up front.
+buffered_container* encoded_input_bc(char* source, unsigned int printformat) {
+	if (strcasecmp(source, "STDIN") == 0) {
+		return bc_from_stream(stdin, true, printformat);
+	}
+	
+	if (strncasecmp(source, "FILE:", 5) == 0) {
+		if (strlen(source) == 5) {
+			fprintf(stderr, ERROR_NO_FILE_SPECIFIED);
+			exit(1);
+		}
+		
+		return bc_from_file(&source[5], INPUT_FILE, printformat);
+	}
+	
+	return NULL;
+}
+
+buffered_container* split_keywords_to_input_bc(char** keywords_split, char* keywords) {
+	
+	// STDIN is the only input without a value
+	if (keywords_split[0] != NULL && strcasecmp(keywords_split[0], "STDIN") == 0) {
+		
+		if (keywords_split[1] != NULL) {
+			fprintf(stderr, WARNING_EXTRA_DATA, keywords_split[1], keywords);
+		}
+		
+		return bc_from_stream(stdin, true, NO_PRINT);
+	}
+	
 	if (
 		keywords_split[0] == NULL || 
 		keywords_split[1] == NULL
 	) {
-		printf(ERROR_INVALID_ARGUMENT, keywords);
+		fprintf(stderr, ERROR_INVALID_ARGUMENT, keywords);
 		exit(1);
 	}
 	
@@ -289,33 +564,109 @@ buffered_container* parse_keywords_to_input_bc(char* keywords) {
 	
 	if (strcasecmp(keywords_split[0], "HEX") == 0) {
 		
+		buffered_container* streamed = encoded_input_bc(keywords_split[1], PRINT_HEX);
+		if (streamed != NULL) {
+			return streamed;
+		}
+		
 		size_t buffersize = get_hex_size(strlen(keywords_split[1]));
 		byte* buffer = get_hex_bytes(keywords_split[1]);
 		
 		if (buffer == NULL) {
-			printf(ERROR_HEX_INVALID);
+			fprintf(stderr, ERROR_HEX_INVALID);
 			exit(1);
 		}
 		
-		return bc_from_buffer(buffer, buffersize, NO_PRINT);
+		buffered_container* bc = bc_from_buffer(buffer, buffersize, NO_PRINT);
+		free(buffer);
+		return bc;
 	}
 	
 	
 	if (strcasecmp(keywords_split[0], "BASE64") == 0) {
 		
+		buffered_container* streamed = encoded_input_bc(keywords_split[1], PRINT_BASE64);
+		if (streamed != NULL) {
+			return streamed;
+		}
+		
 		size_t buffersize = get_base64_size(keywords_split[1]);
 		byte* buffer = get_base64_bytes(keywords_split[1]);
 		
 		if (buffer == NULL) {
-			printf(ERROR_BASE64_INVALID);
+			fprintf(stderr, ERROR_BASE64_INVALID);
 			exit(1);
 		}		
 		
-		return bc_from_buffer(buffer, buffersize, NO_PRINT);
+		buffered_container* bc = bc_from_buffer(buffer, buffersize, NO_PRINT);
+		free(buffer);
+		return bc;
 	}
 	
-	printf(ERROR_INVALID_ARGUMENT, keywords);
+	fprintf(stderr, ERROR_INVALID_ARGUMENT, keywords);
 	exit(1);
 }
 
+buffered_container* parse_keywords_to_input_bc(char* keywords) {
+	char** keywords_split = split_string(keywords);
+	buffered_container* bc = split_keywords_to_input_bc(keywords_split, keywords);
+	
+	free_split_string(keywords_split);
+	return bc;
+}
+
+// The key size in bytes of an AES cipher name, 0 for other ciphers
+size_t argument_aes_key_size(const char* cipher) {
+	if (strncasecmp(cipher, "AES:", 4) != 0) {
+		return 0;
+	}
+	
+	if (strncmp(&cipher[4], "128", 3) == 0) {
+		return 16;
+	} else if (strncmp(&cipher[4], "192", 3) == 0) {
+		return 24;
+	} else if (strncmp(&cipher[4], "256", 3) == 0) {
+		return 32;
+	}
+	
+	return 0;
+}
+
+// Cuts or zero-pads an AES key to size as -k does, so a key works the same
+// in the daemon and in batch mode as on the command line. Returns the key to
+// use, which is sized when it had to change, updating key_len.
+const byte* argument_size_key(const char* cipher, const byte* key, size_t* key_len, byte* sized) {
+	size_t key_size = argument_aes_key_size(cipher);
+	
+	if (key == NULL || key_size == 0 || *key_len == key_size) {
+		return key;
+	}
+	
+	fprintf(stderr, *key_len > key_size ? WARNING_KEY_TRUNCATION : WARNING_KEY_ZERO_PADDING, (int)key_size * 8);
+	
+	memset(sized, 0, AES_MAX_KEY_SIZE);
+	memcpy(sized, key, *key_len < key_size ? *key_len : key_size);
+	*key_len = key_size;
+	return sized;
+}
+
+// Reads an IV given as for -iv into one block, sized as the tool does it
+void argument_parse_iv(char* arg, byte* iv) {
+	buffered_container* bc = parse_keywords_to_input_bc(arg);
+	
+	if (bc->buffer_len > AES_BLOCK_SIZE) {
+		fprintf(stderr, WARNING_IV_TOO_LONG);
+	}
+	
+	if (bc->buffer_len < AES_BLOCK_SIZE) {
+		fprintf(stderr, WARNING_PADDING_IV);
+	}
+	
+	memset(iv, 0, AES_BLOCK_SIZE);
+	memcpy(iv, bc->buffer, bc->buffer_len < AES_BLOCK_SIZE ? bc->buffer_len : AES_BLOCK_SIZE);
+	
+	bc_fclose(bc);
+	bc_free(bc);
+}
+
 #endif
\ No newline at end of file
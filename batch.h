@@ -0,0 +1,985 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#define BATCH_CHUNK_SIZE (8 << 20)	// Files twice this size or more are split, where the cipher allows
+#define BATCH_PATH_MAX 4096
+#define BATCH_IDLE_SPINS 64			// Failed steals before an idle worker starts sleeping
+
+#define ERROR_BATCH_UNSUPPORTED  "Error: --batch is not available on this platform.\n"
+#define ERROR_NO_BATCH           "Error: no directory or manifest provided (--batch).\n"
+#define ERROR_NO_OUTPUT_DIR      "Error: no output directory provided (--output-dir).\n"
+#define ERROR_NO_REPORT          "Error: no report file provided (--report).\n"
+#define ERROR_BATCH_READ         "Error: cannot read \"%s\": %s.\n"
+#define ERROR_BATCH_OUTPUT_DIR   "Error: cannot create output directory \"%s\": %s.\n"
+#define ERROR_BATCH_SAME_DIR     "Error: the output directory \"%s\" is where the inputs are read from, so they would be overwritten.\n"
+#define ERROR_BATCH_CIPHER       "Error: cannot set up the cipher: %s.\n"
+#define ERROR_BATCH_FILE         "Error: \"%s\": %s.\n"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if !defined(_WIN32)
+  #include <dirent.h>
+  #include <fcntl.h>
+  #include <pthread.h>
+  #include <sched.h>
+  #include <unistd.h>
+  #include <sys/stat.h>
+#endif
+
+#include "util.h"
+#include "buffered_container.h"
+#include "threads.h"
+#include "block/sparse.h"
+#include "arguments.h"
+
+// The library's contexts run the files, as they do the daemon's requests
+#include "lib/joelcrypto.c"
+
+// Batch mode runs one cipher over every file of a directory tree or a
+// manifest in a single process, instead of a process for each file. Files are
+// scheduled on a work-stealing pool: each worker keeps a deque of tasks, works
+// on the newest end of its own, and steals the oldest end of another's when it
+// runs dry. The list of files starts as one range task that is halved as it is
+// taken, so thieves get large ranges and only split them further as needed.
+//
+// A big file would keep one worker busy long after the rest are done, so in
+// modes where a block does not depend on the output before it the file is cut
+// into chunks that other workers can steal. Each chunk starts a context of its
+// own at its offset: the CTR counter moved on, or for CBC and CFB decryption
+// the ciphertext block before the chunk as the IV. Every worker reads with
+// pread and writes with pwrite, so chunks of a file can go in any order.
+
+// Failures other than a jc_status
+#define BATCH_ERROR_IO      1000	// Opening, reading or writing failed, error holds errno
+#define BATCH_ERROR_TYPE    1001	// Not a regular file
+#define BATCH_ERROR_PATH    1002	// The output would be outside the output directory, or the input itself
+#define BATCH_ERROR_CHANGED 1003	// The file changed size while it was being read
+
+typedef struct {
+	size_t path;				// Offset of the input path in batch_paths
+	size_t rel;					// Offset of the part repeated under the output directory
+	unsigned long long size;
+	unsigned long long written;
+	int in_fd;
+	int out_fd;
+	bool owns_output;			// Created or truncated by this run, so removed if it fails
+	unsigned int chunks_left;	// The last chunk to finish closes the file
+	int status;					// The first failure of any chunk
+	int error;
+} batch_file;
+
+typedef struct {
+	size_t first;				// Files first to last - 1, or the file of a chunk
+	size_t last;
+	unsigned long long offset;	// Chunks only
+	unsigned long long len;
+	bool chunk;
+} batch_task;
+
+typedef struct {
+	batch_task* tasks;			// Oldest at top, newest just below bottom
+	size_t capacity;
+	size_t top;
+	size_t bottom;
+	
+	#if !defined(_WIN32)
+	pthread_mutex_t lock;
+	#endif
+} batch_deque;
+
+typedef struct {
+	unsigned int index;
+	byte* in;
+	byte* out;
+	char* path;					// The output path being put together
+	
+	#if !defined(_WIN32)
+	pthread_t thread;
+	#endif
+} batch_worker;
+
+char* batch_paths = NULL;
+size_t batch_paths_len = 0;
+size_t batch_paths_capacity = 0;
+
+batch_file* batch_files = NULL;
+size_t batch_file_count = 0;
+size_t batch_file_capacity = 0;
+
+const char* batch_output_dir = NULL;
+dev_t batch_output_dev;
+ino_t batch_output_ino;
+
+// The cipher, set up once and copied for every file and chunk
+jc_ctx* batch_ctx = NULL;
+bool batch_has_iv = false;
+byte batch_iv[AES_BLOCK_SIZE];
+
+bool batch_split = false;		// Large files can be chunked
+bool batch_holds_back = false;	// ECB and CBC decryption hold the last block back
+bool batch_chain_iv = false;	// The IV of a chunk is the ciphertext block before it
+bool batch_counter = false;		// The IV of a chunk is the counter at its offset
+
+batch_deque* batch_deques = NULL;
+unsigned int batch_worker_count = 0;
+size_t batch_pending = 0;		// Tasks queued or running
+
+const char* batch_status_string(const batch_file* f) {
+	switch (f->status) {
+		case BATCH_ERROR_IO:
+			return strerror(f->error);
+		case BATCH_ERROR_TYPE:
+			return "not a regular file";
+		case BATCH_ERROR_PATH:
+			return "the output would be outside the output directory, or the input itself";
+		case BATCH_ERROR_CHANGED:
+			return "the file changed size while it was being read";
+	}
+	
+	return jc_status_string((jc_status)f->status);
+}
+
+#if defined(_WIN32)
+
+int batch_main(int argc, char** argv) {
+	fprintf(stderr, ERROR_BATCH_UNSUPPORTED);
+	return 1;
+}
+
+#else
+
+// Adds a file to the list. rel is where its path under the output directory
+// starts. A file that is already known to fail gets its status now.
+void batch_add(const char* path, const size_t rel, const int status, const int error) {
+	size_t len = strlen(path) + 1;
+	
+	if (batch_paths_len + len > batch_paths_capacity) {
+		batch_paths_capacity = (batch_paths_capacity + len) * 2;
+		batch_paths = (char*)realloc(batch_paths, batch_paths_capacity);
+		assert(batch_paths != NULL);
+	}
+	
+	if (batch_file_count == batch_file_capacity) {
+		batch_file_capacity = batch_file_capacity == 0 ? 1024 : batch_file_capacity * 2;
+		batch_files = (batch_file*)realloc(batch_files, batch_file_capacity * sizeof(batch_file));
+		assert(batch_files != NULL);
+	}
+	
+	batch_file* f = &batch_files[batch_file_count++];
+	memset(f, 0, sizeof(batch_file));
+	f->path = batch_paths_len;
+	f->rel = batch_paths_len + rel;
+	f->in_fd = -1;
+	f->out_fd = -1;
+	f->status = status;
+	f->error = error;
+	
+	memcpy(&batch_paths[batch_paths_len], path, len);
+	batch_paths_len += len;
+}
+
+// Adds every regular file under the directory in path, which is len long and
+// has room for BATCH_PATH_MAX, leaving out the output directory. Symbolic
+// links are not followed. rel is where paths under the output directory start.
+void batch_walk(char* path, const size_t len, const size_t rel) {
+	DIR* dir = opendir(path);
+	if (dir == NULL) {
+		batch_add(path, len < rel ? len : rel, BATCH_ERROR_IO, errno);
+		return;
+	}
+	
+	struct dirent* entry;
+	
+	while ((entry = readdir(dir)) != NULL) {
+		const char* name = entry->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+			continue;
+		}
+		
+		size_t name_len = strlen(name);
+		if (len + 1 + name_len >= BATCH_PATH_MAX) {
+			path[len] = '\0';
+			batch_add(path, len < rel ? len : rel, BATCH_ERROR_IO, ENAMETOOLONG);
+			continue;
+		}
+		
+		path[len] = '/';
+		memcpy(&path[len + 1], name, name_len + 1);
+		
+		// Most file systems give the type without a stat, directories are
+		// looked at anyway to keep out of the output directory
+		unsigned char type = entry->d_type;
+		struct stat st;
+		
+		if (type == DT_UNKNOWN || type == DT_DIR) {
+			if (lstat(path, &st) != 0) {
+				batch_add(path, rel, BATCH_ERROR_IO, errno);
+				continue;
+			}
+			
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+		
+		if (type == DT_DIR && !(st.st_dev == batch_output_dev && st.st_ino == batch_output_ino)) {
+			batch_walk(path, len + 1 + name_len, rel);
+		} else if (type == DT_REG) {
+			batch_add(path, rel, JC_OK, 0);
+		}
+	}
+	
+	closedir(dir);
+	path[len] = '\0';
+}
+
+// True if a relative path could leave the directory it is put under
+bool batch_escapes(const char* rel) {
+	for (const char* p = rel; *p != '\0'; ) {
+		size_t n = strcspn(p, "/");
+		
+		if (n == 2 && p[0] == '.' && p[1] == '.') {
+			return true;
+		}
+		
+		p += n;
+		p += strspn(p, "/");
+	}
+	
+	return false;
+}
+
+// Reads a manifest of one input path per line. Each is written to the same
+// path under the output directory, less any leading slashes.
+void batch_read_manifest(const char* manifest) {
+	FILE* f = fopen(manifest, "r");
+	if (f == NULL) {
+		fprintf(stderr, ERROR_BATCH_READ, manifest, strerror(errno));
+		exit(1);
+	}
+	
+	char line[BATCH_PATH_MAX];
+	
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0') {
+			continue;
+		}
+		
+		size_t rel = strspn(line, "/");
+		bool escapes = line[rel] == '\0' || batch_escapes(&line[rel]);
+		
+		batch_add(line, rel, escapes ? BATCH_ERROR_PATH : JC_OK, 0);
+	}
+	
+	fclose(f);
+}
+
+// Creates every directory in path up to its last component. The output
+// directory itself already exists.
+bool batch_make_dirs(char* path) {
+	size_t start = strlen(batch_output_dir) + 1;
+	
+	for (char* p = strchr(&path[start], '/'); p != NULL; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		bool made = mkdir(path, 0777) == 0 || errno == EEXIST;
+		*p = '/';
+		
+		if (!made) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+void batch_push(batch_deque* d, const batch_task* task) {
+	__atomic_add_fetch(&batch_pending, 1, __ATOMIC_RELAXED);
+	
+	pthread_mutex_lock(&d->lock);
+	
+	if (d->bottom == d->capacity) {
+		// Slide down what is left before growing
+		if (d->top > 0) {
+			memmove(d->tasks, &d->tasks[d->top], (d->bottom - d->top) * sizeof(batch_task));
+			d->bottom -= d->top;
+			d->top = 0;
+		}
+		
+		if (d->bottom == d->capacity) {
+			d->capacity = d->capacity == 0 ? 64 : d->capacity * 2;
+			d->tasks = (batch_task*)realloc(d->tasks, d->capacity * sizeof(batch_task));
+			assert(d->tasks != NULL);
+		}
+	}
+	
+	d->tasks[d->bottom++] = *task;
+	pthread_mutex_unlock(&d->lock);
+}
+
+// Takes the newest task, from the worker that owns the deque
+bool batch_pop(batch_deque* d, batch_task* task) {
+	pthread_mutex_lock(&d->lock);
+	
+	bool found = d->bottom > d->top;
+	if (found) {
+		*task = d->tasks[--d->bottom];
+	}
+	
+	if (d->bottom == d->top) {
+		d->top = d->bottom = 0;
+	}
+	
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+// Takes the oldest task, from any other worker
+bool batch_steal(batch_deque* d, batch_task* task) {
+	pthread_mutex_lock(&d->lock);
+	
+	bool found = d->bottom > d->top;
+	if (found) {
+		*task = d->tasks[d->top++];
+	}
+	
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+// Puts the output path of a file in path, which has room for BATCH_PATH_MAX
+bool batch_output_path(char* path, const batch_file* f) {
+	int len = snprintf(path, BATCH_PATH_MAX, "%s/%s", batch_output_dir, &batch_paths[f->rel]);
+	return len >= 0 && len < BATCH_PATH_MAX;
+}
+
+// Records the first failure of a file, later ones are side effects of it
+void batch_fail(batch_file* f, const int status, const int error) {
+	int expected = JC_OK;
+	
+	if (__atomic_compare_exchange_n(&f->status, &expected, status, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		f->error = error;
+	}
+}
+
+// Called as each chunk of a file is done, closing the file after the last
+void batch_chunk_done(batch_file* f) {
+	if (__atomic_sub_fetch(&f->chunks_left, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+	
+	close(f->in_fd);
+	
+	if (f->out_fd >= 0 && close(f->out_fd) != 0) {
+		batch_fail(f, BATCH_ERROR_IO, errno);
+	}
+	
+	f->in_fd = f->out_fd = -1;
+	
+	// A partly written output must not be taken for a good one, but a file
+	// that was there before and has not been touched is left alone
+	if (f->status != JC_OK && f->owns_output) {
+		char path[BATCH_PATH_MAX];
+		f->written = 0;
+		
+		if (batch_output_path(path, f)) {
+			unlink(path);
+		}
+	}
+}
+
+// Reads up to len bytes at offset, stopping early only at the end of the file.
+// Returns the bytes read, or -1.
+ssize_t batch_pread(const int fd, byte* data, const size_t len, const unsigned long long offset) {
+	size_t done = 0;
+	
+	while (done < len) {
+		ssize_t n = pread(fd, &data[done], len - done, offset + done);
+		
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		
+		if (n < 0) {
+			return -1;
+		}
+		
+		if (n == 0) {
+			break;
+		}
+		
+		done += n;
+	}
+	
+	return done;
+}
+
+bool batch_pwrite(const int fd, const byte* data, const size_t len, const unsigned long long offset) {
+	size_t done = 0;
+	
+	while (done < len) {
+		ssize_t n = pwrite(fd, &data[done], len - done, offset + done);
+		
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		
+		if (n <= 0) {
+			return false;
+		}
+		
+		done += n;
+	}
+	
+	return true;
+}
+
+// Runs len bytes of a file from offset through a fresh context. Output lands
+// at the same offset, as every cipher keeps the length up to its last block.
+void batch_run_chunk(batch_worker* w, batch_file* f, const unsigned long long offset, const unsigned long long len) {
+	if (__atomic_load_n(&f->status, __ATOMIC_RELAXED) != JC_OK) {
+		batch_chunk_done(f);
+		return;
+	}
+	
+	byte iv[AES_BLOCK_SIZE];
+	memcpy(iv, batch_iv, AES_BLOCK_SIZE);
+	
+	if (batch_counter) {
+		sparse_counter_at(iv, batch_iv, AES_BLOCK_SIZE, offset);
+	} else if (batch_chain_iv && offset > 0 && batch_pread(f->in_fd, iv, AES_BLOCK_SIZE, offset - AES_BLOCK_SIZE) != AES_BLOCK_SIZE) {
+		batch_fail(f, BATCH_ERROR_CHANGED, 0);
+		batch_chunk_done(f);
+		return;
+	}
+	
+	jc_ctx* ctx;
+	jc_status status = jc_clone(batch_ctx, &ctx, batch_has_iv ? iv : NULL, AES_BLOCK_SIZE);
+	
+	if (status != JC_OK) {
+		batch_fail(f, status, 0);
+		batch_chunk_done(f);
+		return;
+	}
+	
+	// A chunk before the last reads the first block of the next as well when
+	// a block is held back, so all of its own blocks come out
+	bool last = offset + len == f->size;
+	unsigned long long end = offset + len + (!last && batch_holds_back ? AES_BLOCK_SIZE : 0);
+	unsigned long long pos = offset, out_pos = offset;
+	size_t n;
+	
+	while (pos < end) {
+		size_t want = end - pos < bc_buffer_size ? end - pos : bc_buffer_size;
+		ssize_t got = batch_pread(f->in_fd, w->in, want, pos);
+		
+		if (got < 0) {
+			batch_fail(f, BATCH_ERROR_IO, errno);
+			break;
+		}
+		
+		if ((size_t)got < want) {
+			batch_fail(f, BATCH_ERROR_CHANGED, 0);
+			break;
+		}
+		
+		status = jc_update(ctx, w->in, w->out, got, &n);
+		
+		if (status != JC_OK) {
+			batch_fail(f, status, 0);
+			break;
+		}
+		
+		if (!batch_pwrite(f->out_fd, w->out, n, out_pos)) {
+			batch_fail(f, BATCH_ERROR_IO, errno);
+			break;
+		}
+		
+		pos += got;
+		out_pos += n;
+	}
+	
+	if (last && pos == end) {
+		status = jc_final(ctx, w->out, &n);
+		
+		if (status != JC_OK) {
+			batch_fail(f, status, 0);
+		} else if (!batch_pwrite(f->out_fd, w->out, n, out_pos)) {
+			batch_fail(f, BATCH_ERROR_IO, errno);
+		} else {
+			f->written = out_pos + n;
+		}
+	}
+	
+	jc_free(ctx);
+	batch_chunk_done(f);
+}
+
+// Opens a file and its output, then runs it whole or queues its chunks
+void batch_run_file(batch_worker* w, batch_file* f) {
+	if (f->status != JC_OK) {
+		return;
+	}
+	
+	if (!batch_output_path(w->path, f)) {
+		batch_fail(f, BATCH_ERROR_IO, ENAMETOOLONG);
+		return;
+	}
+	
+	f->in_fd = open(&batch_paths[f->path], O_RDONLY | O_CLOEXEC);
+	if (f->in_fd < 0) {
+		batch_fail(f, BATCH_ERROR_IO, errno);
+		return;
+	}
+	
+	struct stat st;
+	if (fstat(f->in_fd, &st) != 0) {
+		batch_fail(f, BATCH_ERROR_IO, errno);
+		close(f->in_fd);
+		return;
+	}
+	
+	if (!S_ISREG(st.st_mode)) {
+		batch_fail(f, BATCH_ERROR_TYPE, 0);
+		close(f->in_fd);
+		return;
+	}
+	
+	f->size = st.st_size;
+	
+	// An output that is already there is only truncated once it is known not
+	// to be the input, through a hard link or an output directory that leads
+	// back to the inputs
+	f->out_fd = open(w->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	
+	if (f->out_fd < 0 && errno == ENOENT && batch_make_dirs(w->path)) {
+		f->out_fd = open(w->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	}
+	
+	f->owns_output = f->out_fd >= 0;
+	
+	if (f->out_fd < 0 && errno == EEXIST) {
+		f->out_fd = open(w->path, O_WRONLY | O_CLOEXEC);
+	}
+	
+	if (f->out_fd < 0) {
+		batch_fail(f, BATCH_ERROR_IO, errno);
+		close(f->in_fd);
+		return;
+	}
+	
+	if (!f->owns_output) {
+		struct stat out_st;
+		int status = JC_OK;
+		int error = 0;
+		
+		if (fstat(f->out_fd, &out_st) != 0) {
+			status = BATCH_ERROR_IO;
+			error = errno;
+		} else if (out_st.st_dev == st.st_dev && out_st.st_ino == st.st_ino) {
+			status = BATCH_ERROR_PATH;
+		} else if (ftruncate(f->out_fd, 0) != 0) {
+			status = BATCH_ERROR_IO;
+			error = errno;
+		}
+		
+		if (status != JC_OK) {
+			batch_fail(f, status, error);
+			close(f->out_fd);
+			close(f->in_fd);
+			f->in_fd = f->out_fd = -1;
+			return;
+		}
+		
+		f->owns_output = true;
+	}
+	
+	unsigned long long chunks = 1;
+	if (batch_split && f->size >= 2 * (unsigned long long)BATCH_CHUNK_SIZE) {
+		chunks = (f->size + BATCH_CHUNK_SIZE - 1) / BATCH_CHUNK_SIZE;
+	}
+	
+	f->chunks_left = chunks;
+	
+	for (unsigned long long c = chunks - 1; c > 0; c--) {
+		unsigned long long offset = c * BATCH_CHUNK_SIZE;
+		batch_task task = { (size_t)(f - batch_files), 0, offset, f->size - offset < BATCH_CHUNK_SIZE ? f->size - offset : BATCH_CHUNK_SIZE, true };
+		batch_push(&batch_deques[w->index], &task);
+	}
+	
+	batch_run_chunk(w, f, 0, chunks > 1 ? BATCH_CHUNK_SIZE : f->size);
+}
+
+void batch_run_task(batch_worker* w, batch_task* task) {
+	if (task->chunk) {
+		batch_file* f = &batch_files[task->first];
+		batch_run_chunk(w, f, task->offset, task->len);
+		return;
+	}
+	
+	// Halves are left for thieves until a single file is left
+	while (task->last - task->first > 1) {
+		batch_task half = { task->first + (task->last - task->first) / 2, task->last, 0, 0, false };
+		batch_push(&batch_deques[w->index], &half);
+		task->last = half.first;
+	}
+	
+	batch_run_file(w, &batch_files[task->first]);
+}
+
+void* batch_work(void* arg) {
+	batch_worker* w = (batch_worker*)arg;
+	unsigned int victim = w->index;
+	unsigned int misses = 0;
+	
+	for (;;) {
+		batch_task task;
+		bool found = batch_pop(&batch_deques[w->index], &task);
+		
+		for (unsigned int k = 1; !found && k < batch_worker_count; k++) {
+			victim = (victim + 1) % batch_worker_count;
+			
+			if (victim != w->index) {
+				found = batch_steal(&batch_deques[victim], &task);
+			}
+		}
+		
+		if (!found) {
+			if (__atomic_load_n(&batch_pending, __ATOMIC_ACQUIRE) == 0) {
+				break;
+			}
+			
+			// Others are still on tasks that may split
+			if (++misses < BATCH_IDLE_SPINS) {
+				sched_yield();
+			} else {
+				usleep(100);
+			}
+			
+			continue;
+		}
+		
+		misses = 0;
+		batch_run_task(w, &task);
+		__atomic_sub_fetch(&batch_pending, 1, __ATOMIC_ACQ_REL);
+	}
+	
+	return NULL;
+}
+
+// joelcrypto --batch <directory | manifest> --output-dir <directory> --encrypt|--decrypt
+//     -c <cipher> [-k <key>] [-iv <iv>] [-t <count | auto>] [--report <file>]
+int batch_main(int argc, char** argv) {
+	const char* list_path = NULL;
+	const char* report_path = NULL;
+	char* cipher = NULL;
+	char* key_arg = NULL;
+	char* iv_arg = NULL;
+	bool operation_defined = false;
+	jc_op op = JC_ENCRYPT;
+	unsigned int workers = 0;
+	
+	for (int j = 1; j < argc; j++) {
+		bool last_arg = j + 1 == argc;
+		
+		if (strcmp(argv[j], "--batch") == 0) {
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_BATCH);
+				return 1;
+			}
+			
+			list_path = argv[++j];
+		} else if (strcmp(argv[j], "--output-dir") == 0) {
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_OUTPUT_DIR);
+				return 1;
+			}
+			
+			batch_output_dir = argv[++j];
+		} else if (strcmp(argv[j], "--report") == 0) {
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_REPORT);
+				return 1;
+			}
+			
+			report_path = argv[++j];
+		} else if (strcmp(argv[j], "--encrypt") == 0 || strcmp(argv[j], "--decrypt") == 0) {
+			if (operation_defined) {
+				fprintf(stderr, ERROR_MULTIPLE_OPERATION);
+				return 1;
+			}
+			
+			op = strcmp(argv[j], "--encrypt") == 0 ? JC_ENCRYPT : JC_DECRYPT;
+			operation_defined = true;
+		} else if (strcmp(argv[j], "-c") == 0 || strcmp(argv[j], "--cipher") == 0) {
+			if (cipher != NULL) {
+				fprintf(stderr, ERROR_MULTIPLE_CIPHER);
+				return 1;
+			}
+			
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_CIPHER);
+				return 1;
+			}
+			
+			cipher = argv[++j];
+		} else if (strcmp(argv[j], "-k") == 0 || strcmp(argv[j], "--key") == 0) {
+			if (key_arg != NULL) {
+				fprintf(stderr, ERROR_MULTIPLE_KEY);
+				return 1;
+			}
+			
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_KEY);
+				return 1;
+			}
+			
+			key_arg = argv[++j];
+		} else if (strcmp(argv[j], "-iv") == 0 || strcmp(argv[j], "--initialization-vector") == 0) {
+			if (iv_arg != NULL) {
+				fprintf(stderr, ERROR_MULTIPLE_IV);
+				return 1;
+			}
+			
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_IV);
+				return 1;
+			}
+			
+			iv_arg = argv[++j];
+		} else if (strcmp(argv[j], "-t") == 0 || strcmp(argv[j], "--threads") == 0) {
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_THREADS);
+				return 1;
+			}
+			
+			char* next_arg = argv[++j];
+			int count = strcasecmp(next_arg, "auto") == 0 ? (int)pool_auto_threads() : atoi(next_arg);
+			
+			if (count <= 0) {
+				fprintf(stderr, ERROR_INVALID_THREADS);
+				return 1;
+			}
+			
+			workers = count;
+		} else if (strcmp(argv[j], "--buffer-size") == 0) {
+			// Already handled before parsing, skip over the value
+			j++;
+		} else {
+			fprintf(stderr, ERROR_INVALID_ARGUMENT, argv[j]);
+			return 1;
+		}
+	}
+	
+	if (list_path == NULL) {
+		fprintf(stderr, ERROR_NO_BATCH);
+		return 1;
+	}
+	
+	if (batch_output_dir == NULL) {
+		fprintf(stderr, ERROR_NO_OUTPUT_DIR);
+		return 1;
+	}
+	
+	if (!operation_defined) {
+		fprintf(stderr, ERROR_NO_OPERATION);
+		return 1;
+	}
+	
+	if (cipher == NULL) {
+		fprintf(stderr, ERROR_NO_CIPHER);
+		return 1;
+	}
+	
+	if (workers == 0) {
+		workers = pool_auto_threads();
+	}
+	
+	// The cipher, with the key and IV taken as the tool takes them
+	buffered_container* key = key_arg != NULL ? parse_keywords_to_input_bc(key_arg) : NULL;
+	byte sized[AES_MAX_KEY_SIZE] = { 0 };
+	size_t key_len = key != NULL ? key->buffer_len : 0;
+	const byte* key_buffer = argument_size_key(cipher, key != NULL ? key->buffer : NULL, &key_len, sized);
+	
+	if (iv_arg != NULL) {
+		argument_parse_iv(iv_arg, batch_iv);
+		batch_has_iv = true;
+	}
+	
+	jc_status status = jc_init(&batch_ctx, cipher, op, key_buffer, key_len, batch_has_iv ? batch_iv : NULL, AES_BLOCK_SIZE);
+	
+	jc_wipe(sized, sizeof(sized));
+	
+	if (key != NULL) {
+		jc_wipe(key->buffer, key->buffer_len);
+		bc_fclose(key);
+		bc_free(key);
+	}
+	
+	if (status == JC_ERROR_IV && !batch_has_iv) {
+		fprintf(stderr, ERROR_NO_IV);
+		return 1;
+	}
+	
+	if (status == JC_ERROR_KEY && key_arg == NULL) {
+		fprintf(stderr, ERROR_NO_KEY);
+		return 1;
+	}
+	
+	if (status != JC_OK) {
+		fprintf(stderr, ERROR_BATCH_CIPHER, jc_status_string(status));
+		return 1;
+	}
+	
+	const jc_ctx* c = batch_ctx;
+	bool aes = c->cipher == AES;
+	
+	if (batch_has_iv && !(aes && c->mode != ECB)) {
+		fprintf(stderr, WARNING_IV_NOT_NEEDED);
+		batch_has_iv = false;
+	}
+	
+	batch_holds_back = aes && c->op == DECRYPT && (c->mode == ECB || c->mode == CBC);
+	batch_chain_iv = aes && c->op == DECRYPT && (c->mode == CBC || c->mode == CFB);
+	batch_counter = aes && c->mode == CTR;
+	batch_split = c->cipher == CAESAR || c->cipher == SHIFT || (aes && (c->mode == ECB || batch_counter || batch_chain_iv));
+	
+	// The output directory, which a directory walk must not go into
+	struct stat st;
+	
+	if ((mkdir(batch_output_dir, 0777) != 0 && errno != EEXIST) || stat(batch_output_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, ERROR_BATCH_OUTPUT_DIR, batch_output_dir, strerror(errno != 0 ? errno : ENOTDIR));
+		return 1;
+	}
+	
+	batch_output_dev = st.st_dev;
+	batch_output_ino = st.st_ino;
+	
+	if (stat(list_path, &st) != 0) {
+		fprintf(stderr, ERROR_BATCH_READ, list_path, strerror(errno));
+		return 1;
+	}
+	
+	// Outputs go to the same relative paths as the inputs, so they must not
+	// be under the same root: the directory walked, or for a manifest the
+	// root of its absolute paths and the directory of its relative ones
+	struct stat root;
+	bool same_root = S_ISDIR(st.st_mode) ? st.st_dev == batch_output_dev && st.st_ino == batch_output_ino :
+		(stat("/", &root) == 0 && root.st_dev == batch_output_dev && root.st_ino == batch_output_ino) ||
+		(stat(".", &root) == 0 && root.st_dev == batch_output_dev && root.st_ino == batch_output_ino);
+		
+	if (same_root) {
+		fprintf(stderr, ERROR_BATCH_SAME_DIR, batch_output_dir);
+		return 1;
+	}
+	
+	if (S_ISDIR(st.st_mode)) {
+		char* path = (char*)malloc(BATCH_PATH_MAX);
+		assert(path != NULL);
+		
+		size_t len = strlen(list_path);
+		while (len > 1 && list_path[len - 1] == '/') {
+			len--;
+		}
+		
+		if (len >= BATCH_PATH_MAX) {
+			fprintf(stderr, ERROR_BATCH_READ, list_path, strerror(ENAMETOOLONG));
+			return 1;
+		}
+		
+		memcpy(path, list_path, len);
+		path[len] = '\0';
+		
+		batch_walk(path, len, len + 1);
+		free(path);
+	} else {
+		batch_read_manifest(list_path);
+	}
+	
+	// The whole list starts as one task, which the workers break up
+	batch_worker_count = workers;
+	batch_deques = (batch_deque*)calloc(workers, sizeof(batch_deque));
+	batch_worker* w = (batch_worker*)calloc(workers, sizeof(batch_worker));
+	assert(batch_deques != NULL && w != NULL);
+	
+	for (unsigned int k = 0; k < workers; k++) {
+		pthread_mutex_init(&batch_deques[k].lock, NULL);
+		
+		w[k].index = k;
+		w[k].in = bc_alloc_buffer(bc_buffer_size);
+		w[k].out = bc_alloc_buffer(bc_buffer_size + AES_BLOCK_SIZE);
+		w[k].path = (char*)malloc(BATCH_PATH_MAX);
+		assert(w[k].path != NULL);
+	}
+	
+	if (batch_file_count > 0) {
+		batch_task all = { 0, batch_file_count, 0, 0, false };
+		batch_push(&batch_deques[0], &all);
+	}
+	
+	for (unsigned int k = 1; k < workers; k++) {
+		if (pthread_create(&w[k].thread, NULL, batch_work, &w[k]) != 0) {
+			workers = k;
+			break;
+		}
+	}
+	
+	batch_work(&w[0]);
+	
+	for (unsigned int k = 1; k < workers; k++) {
+		pthread_join(w[k].thread, NULL);
+	}
+	
+	// Results, failures on stderr and every file in the report
+	FILE* report = NULL;
+	if (report_path != NULL && (report = fopen(report_path, "w")) == NULL) {
+		fprintf(stderr, ERROR_BATCH_READ, report_path, strerror(errno));
+	}
+	
+	size_t failed = 0;
+	unsigned long long written = 0;
+	
+	for (size_t i = 0; i < batch_file_count; i++) {
+		const batch_file* f = &batch_files[i];
+		const char* path = &batch_paths[f->path];
+		
+		if (f->status != JC_OK) {
+			fprintf(stderr, ERROR_BATCH_FILE, path, batch_status_string(f));
+			failed++;
+		}
+		
+		written += f->written;
+		
+		if (report != NULL) {
+			fprintf(report, "%s\t%llu\t%s\n", f->status == JC_OK ? "OK" : batch_status_string(f), f->written, path);
+		}
+	}
+	
+	if (report != NULL) {
+		fclose(report);
+	}
+	
+	fprintf(MESSAGES, "%s %zu of %zu files, %llu bytes written\n",
+		op == JC_ENCRYPT ? "Encrypted" : "Decrypted", batch_file_count - failed, batch_file_count, written);
+		
+	for (unsigned int k = 0; k < batch_worker_count; k++) {
+		pthread_mutex_destroy(&batch_deques[k].lock);
+		free(batch_deques[k].tasks);
+		bc_free_buffer(w[k].in);
+		bc_free_buffer(w[k].out);
+		free(w[k].path);
+	}
+	
+	free(batch_deques);
+	free(w);
+	free(batch_files);
+	free(batch_paths);
+	jc_free(batch_ctx);
+	
+	return failed > 0 ? 1 : 0;
+}
+
+#endif
+
+#endif
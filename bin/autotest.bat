@@ -25,16 +25,37 @@ set /a key=%random% %% 26
 %executable% --decrypt -i file:test_alph.inprogress -o file:test_alph.end -c shift -k text:%key% > nul
 call :CheckResult "Shift cipher" "test_alph.txt" "test_alph.end"
 
+rem Keys past a byte wrap around the alphabet like any other
+%executable% --encrypt -i file:test_alph.txt -o file:test_alph.inprogress -c shift -k text:200 > nul
+%executable% --encrypt -i file:test_alph.txt -o file:test_alph.end -c shift -k text:18 > nul
+call :CheckResult "Shift cipher with a large key" "test_alph.inprogress" "test_alph.end"
+
 set /a key=WTGHYJUK
 %executable% --encrypt -i file:test_alph.txt -o file:test_alph.inprogress -c vigenere -k text:%key% > nul
 %executable% --decrypt -i file:test_alph.inprogress -o file:test_alph.end -c vigenere -k text:%key% > nul
 call :CheckResult "Vigenere cipher" "test_alph.txt" "test_alph.end"
 
+%executable% --encrypt -i file:test_alph.txt -o file:test_alph.inprogress -c vigenere -k text:%key% -t 4 > nul
+%executable% --decrypt -i file:test_alph.inprogress -o file:test_alph.end -c vigenere -k text:%key% -t 4 > nul
+call :CheckResult "Threaded Vigenere cipher" "test_alph.txt" "test_alph.end"
+
+%executable% --encrypt -i file:test_alph.txt -o file:test_alph.inprogress -c vigenere -k text:%key% -t auto > nul
+%executable% --decrypt -i file:test_alph.inprogress -o file:test_alph.end -c vigenere -k text:%key% -t 3 --cpus 0 > nul
+call :CheckResult "Vigenere cipher on the thread pool" "test_alph.txt" "test_alph.end"
+
 set key=6Hr4SdO9y7Hfw3y45Gk3dy1aqQshJou7TgrERRE610m=
 
 %executable% --encrypt -i file:test_ascii.txt -o file:test_ascii.inprogress -c RC4 -k base64:%key% > nul
 %executable% --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c RC4 -k base64:%key% > nul
 call :CheckResult "RC4 cipher" "test_ascii.txt" "test_ascii.end"
+
+%executable% --encrypt -i file:test_alph.txt -o file:test_alph.inprogress -c XOR -k file:test_ascii.txt > nul
+%executable% --decrypt -i file:test_alph.inprogress -o file:test_alph.end -c XOR -k file:test_ascii.txt > nul
+call :CheckResult "XOR cipher" "test_alph.txt" "test_alph.end"
+
+%executable% --encrypt -i file:test_ascii.txt -o file:test_ascii.inprogress -c XOR:CYCLE -k base64:%key% > nul
+%executable% --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c XOR:CYCLE -k base64:%key% > nul
+call :CheckResult "XOR:CYCLE cipher" "test_ascii.txt" "test_ascii.end"
 		
 set iv=qRA67ZlOFFnJj8cRTEt2hw==
 		
@@ -46,6 +67,33 @@ for %%b in (128 192 256) do (
 	)
 )
 
+%executable% --encrypt -i file:test_ascii.txt -o file:test_ascii.inprogress -c AES:128:CBC -k base64:%key% -iv base64:%iv% --buffer-size 64 > nul
+%executable% --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c AES:128:CBC -k base64:%key% -iv base64:%iv% --buffer-size 64 > nul
+call :CheckResult "AES:128:CBC cipher with 64 byte buffers" "test_ascii.txt" "test_ascii.end"
+
+%executable% --encrypt -i file:test_ascii.txt -o file:test_ascii.inprogress -c AES:256:CTR -k base64:%key% -iv base64:%iv% --async-io --buffer-size 64 > nul
+%executable% --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c AES:256:CTR -k base64:%key% -iv base64:%iv% --async-io > nul
+call :CheckResult "AES:256:CTR cipher with asynchronous I/O" "test_ascii.txt" "test_ascii.end"
+
+type test_ascii.txt | %executable% --encrypt -i STDIN -o STDOUT -c AES:128:CFB -k base64:%key% -iv base64:%iv% 2> nul | %executable% --decrypt -i STDIN -o STDOUT -c AES:128:CFB -k base64:%key% -iv base64:%iv% 2> nul > test_ascii.end
+call :CheckResult "AES:128:CFB cipher through pipes" "test_ascii.txt" "test_ascii.end"
+
+%executable% --encrypt -i file:test_ascii.txt -o BASE64:FILE:test_ascii.inprogress -c AES:256:OFB -k base64:%key% -iv base64:%iv% > nul
+%executable% --decrypt -i BASE64:FILE:test_ascii.inprogress -o file:test_ascii.end -c AES:256:OFB -k base64:%key% -iv base64:%iv% > nul
+call :CheckResult "AES:256:OFB cipher through BASE64 files" "test_ascii.txt" "test_ascii.end"
+
+%executable% --encrypt -i file:test_ascii.txt -o file:test_ascii.inprogress -c AES:128:CBC -k base64:%key% -iv base64:%iv% --direct-io > nul 2> nul
+%executable% --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c AES:128:CBC -k base64:%key% -iv base64:%iv% --direct-io > nul 2> nul
+call :CheckResult "AES:128:CBC cipher with direct I/O" "test_ascii.txt" "test_ascii.end"
+
+%executable% --encrypt -i file:test_ascii.txt -o file:test_ascii.inprogress -c AES:256:CBC -k base64:%key% -iv base64:%iv% --preallocate > nul 2> nul
+%executable% --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c AES:256:CBC -k base64:%key% -iv base64:%iv% --preallocate > nul 2> nul
+call :CheckResult "AES:256:CBC cipher with preallocated output" "test_ascii.txt" "test_ascii.end"
+
+%executable% --encrypt -i file:test_ascii.txt -o file:test_ascii.inprogress -c AES:192:CBC -k base64:%key% -iv base64:%iv% --huge-pages > nul
+%executable% --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c AES:192:CBC -k base64:%key% -iv base64:%iv% --huge-pages > nul
+call :CheckResult "AES:192:CBC cipher on huge pages" "test_ascii.txt" "test_ascii.end"
+
 del test_alph.inprogress
 del test_ascii.inprogress
 del test_alph.end
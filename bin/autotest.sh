@@ -34,17 +34,38 @@ key=$(($RANDOM % 26))
 ./joelcrypto --decrypt -i file:test_alph.inprogress -o file:test_alph.end -c shift -k text:$key > /dev/null
 check_result "Shift cipher" "test_alph.txt" "test_alph.end"
 
+# Keys past a byte wrap around the alphabet like any other
+./joelcrypto --encrypt -i file:test_alph.txt -o file:test_alph.inprogress -c shift -k text:200 > /dev/null
+./joelcrypto --encrypt -i file:test_alph.txt -o file:test_alph.end -c shift -k text:18 > /dev/null
+check_result "Shift cipher with a large key" "test_alph.inprogress" "test_alph.end"
+
 key="WTGHYJUK"
 ./joelcrypto --encrypt -i file:test_alph.txt -o file:test_alph.inprogress -c vigenere -k text:$key > /dev/null
 ./joelcrypto --decrypt -i file:test_alph.inprogress -o file:test_alph.end -c vigenere -k text:$key > /dev/null
 check_result "Vigenere cipher" "test_alph.txt" "test_alph.end"
 
+./joelcrypto --encrypt -i file:test_alph.txt -o file:test_alph.inprogress -c vigenere -k text:$key -t 4 > /dev/null
+./joelcrypto --decrypt -i file:test_alph.inprogress -o file:test_alph.end -c vigenere -k text:$key -t 4 > /dev/null
+check_result "Threaded Vigenere cipher" "test_alph.txt" "test_alph.end"
+
+./joelcrypto --encrypt -i file:test_alph.txt -o file:test_alph.inprogress -c vigenere -k text:$key -t auto > /dev/null
+./joelcrypto --decrypt -i file:test_alph.inprogress -o file:test_alph.end -c vigenere -k text:$key -t 3 --cpus 0 > /dev/null
+check_result "Vigenere cipher on the thread pool" "test_alph.txt" "test_alph.end"
+
 key="6Hr4SdO9y7Hfw3y45Gk3dy1aqQshJou7TgrERRE610m="
 
 ./joelcrypto --encrypt -i file:test_ascii.txt -o file:test_ascii.inprogress -c RC4 -k base64:$key > /dev/null
 ./joelcrypto --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c RC4 -k base64:$key > /dev/null
 check_result "RC4 cipher" "test_ascii.txt" "test_ascii.end"
 
+./joelcrypto --encrypt -i file:test_alph.txt -o file:test_alph.inprogress -c XOR -k file:test_ascii.txt > /dev/null
+./joelcrypto --decrypt -i file:test_alph.inprogress -o file:test_alph.end -c XOR -k file:test_ascii.txt > /dev/null
+check_result "XOR cipher" "test_alph.txt" "test_alph.end"
+
+./joelcrypto --encrypt -i file:test_ascii.txt -o file:test_ascii.inprogress -c XOR:CYCLE -k base64:$key > /dev/null
+./joelcrypto --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c XOR:CYCLE -k base64:$key > /dev/null
+check_result "XOR:CYCLE cipher" "test_ascii.txt" "test_ascii.end"
+
 iv="qRA67ZlOFFnJj8cRTEt2hw=="
 
 keysizes=(128 192 256)
@@ -59,6 +80,116 @@ do
 	done
 done
 
+./joelcrypto --encrypt -i file:test_ascii.txt -o file:test_ascii.inprogress -c AES:128:CBC -k base64:$key -iv base64:$iv --buffer-size 64 > /dev/null
+./joelcrypto --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c AES:128:CBC -k base64:$key -iv base64:$iv --buffer-size 64 > /dev/null
+check_result "AES:128:CBC cipher with 64 byte buffers" "test_ascii.txt" "test_ascii.end"
+
+./joelcrypto --encrypt -i file:test_ascii.txt -o file:test_ascii.inprogress -c AES:256:CTR -k base64:$key -iv base64:$iv --async-io --buffer-size 64 > /dev/null
+./joelcrypto --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c AES:256:CTR -k base64:$key -iv base64:$iv --async-io > /dev/null
+check_result "AES:256:CTR cipher with asynchronous I/O" "test_ascii.txt" "test_ascii.end"
+
+cat test_ascii.txt | ./joelcrypto --encrypt -i STDIN -o STDOUT -c AES:128:CFB -k base64:$key -iv base64:$iv 2> /dev/null | ./joelcrypto --decrypt -i STDIN -o STDOUT -c AES:128:CFB -k base64:$key -iv base64:$iv 2> /dev/null > test_ascii.end
+check_result "AES:128:CFB cipher through pipes" "test_ascii.txt" "test_ascii.end"
+
+./joelcrypto --encrypt -i file:test_ascii.txt -o BASE64:FILE:test_ascii.inprogress -c AES:256:OFB -k base64:$key -iv base64:$iv > /dev/null
+./joelcrypto --decrypt -i BASE64:FILE:test_ascii.inprogress -o file:test_ascii.end -c AES:256:OFB -k base64:$key -iv base64:$iv > /dev/null
+check_result "AES:256:OFB cipher through BASE64 files" "test_ascii.txt" "test_ascii.end"
+
+./joelcrypto --encrypt -i file:test_ascii.txt -o file:test_ascii.inprogress -c AES:128:CBC -k base64:$key -iv base64:$iv --direct-io > /dev/null
+./joelcrypto --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c AES:128:CBC -k base64:$key -iv base64:$iv --direct-io > /dev/null
+check_result "AES:128:CBC cipher with direct I/O" "test_ascii.txt" "test_ascii.end"
+
+./joelcrypto --encrypt -i file:test_ascii.txt -o file:test_ascii.inprogress -c AES:256:CBC -k base64:$key -iv base64:$iv --preallocate > /dev/null
+./joelcrypto --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c AES:256:CBC -k base64:$key -iv base64:$iv --preallocate > /dev/null
+check_result "AES:256:CBC cipher with preallocated output" "test_ascii.txt" "test_ascii.end"
+
+./joelcrypto --encrypt -i file:test_ascii.txt -o file:test_ascii.inprogress -c AES:192:CBC -k base64:$key -iv base64:$iv --huge-pages > /dev/null
+./joelcrypto --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c AES:192:CBC -k base64:$key -iv base64:$iv --huge-pages > /dev/null
+check_result "AES:192:CBC cipher on huge pages" "test_ascii.txt" "test_ascii.end"
+
+cp test_ascii.txt test_ascii.end
+./joelcrypto --encrypt -i file:test_ascii.end -c AES:256:CTR -k base64:$key -iv base64:$iv --in-place > /dev/null
+./joelcrypto --decrypt -i file:test_ascii.end -c AES:256:CTR -k base64:$key -iv base64:$iv --in-place > /dev/null
+check_result "AES:256:CTR cipher in place" "test_ascii.txt" "test_ascii.end"
+
+! ./joelcrypto --encrypt -o file:test_ascii.end -i file:test_ascii.end -c RC4 -k base64:$key > /dev/null 2>&1
+check_result "Refusing the same file as input and output" "test_ascii.txt" "test_ascii.end"
+
+./joelcrypto --encrypt -i file:test_ascii.txt -o file:test_ascii.inprogress -c AES:128:CTR -k base64:$key -iv base64:$iv --sparse > /dev/null
+./joelcrypto --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c AES:128:CTR -k base64:$key -iv base64:$iv --sparse > /dev/null
+check_result "AES:128:CTR cipher with sparse files" "test_ascii.txt" "test_ascii.end"
+
+echo "1 AES:256:CBC base64:$key" > test_serve.keys
+echo "2 AES:128:CTR base64:$key" >> test_serve.keys
+./joelcrypto --serve test_serve.sock --keys test_serve.keys -t 2 > /dev/null 2>&1 &
+serve_pid=$!
+for i in $(seq 50)
+do
+	[ -S test_serve.sock ] && break
+	sleep 0.1
+done
+./joelcrypto --client test_serve.sock --encrypt --key-id 1 -i file:test_ascii.txt -o file:test_ascii.inprogress -iv base64:$iv > /dev/null
+./joelcrypto --decrypt -i file:test_ascii.inprogress -o file:test_ascii.end -c AES:256:CBC -k base64:$key -iv base64:$iv > /dev/null
+check_result "AES:256:CBC cipher through the daemon" "test_ascii.txt" "test_ascii.end"
+./joelcrypto --client test_serve.sock --decrypt --key-id 1 -i file:test_ascii.inprogress -o file:test_ascii.end -iv base64:$iv --by-path > /dev/null
+check_result "AES:256:CBC cipher through the daemon by path" "test_ascii.txt" "test_ascii.end"
+cp test_ascii.txt test_ascii.inprogress
+./joelcrypto --client test_serve.sock --encrypt --key-id 2 -i file:test_ascii.inprogress --in-place -iv base64:$iv > /dev/null
+./joelcrypto --client test_serve.sock --decrypt --key-id 2 -i STDIN -o STDOUT -iv base64:$iv < test_ascii.inprogress > test_ascii.end
+check_result "AES:128:CTR cipher in shared memory through the daemon" "test_ascii.txt" "test_ascii.end"
+kill $serve_pid
+rm test_serve.keys
+
+mkdir -p test_batch
+cp test_alph.txt test_ascii.txt test_batch/
+./joelcrypto --batch test_batch --output-dir test_batch.inprogress --encrypt -c AES:256:CTR -k base64:$key -iv base64:$iv -t 2 > /dev/null
+./joelcrypto --batch test_batch.inprogress --output-dir test_batch.end --decrypt -c AES:256:CTR -k base64:$key -iv base64:$iv -t 2 > /dev/null
+check_result "AES:256:CTR cipher in batch mode" "test_batch/test_ascii.txt" "test_batch.end/test_ascii.txt"
+! ./joelcrypto --batch test_batch --output-dir test_batch --encrypt -c AES:256:CTR -k base64:$key -iv base64:$iv > /dev/null 2>&1
+check_result "Batch mode refusing to write over its inputs" "test_ascii.txt" "test_batch/test_ascii.txt"
+rm -r test_batch test_batch.inprogress test_batch.end
+
+# A file over twice BATCH_CHUNK_SIZE is split into chunks that must join up
+mkdir -p test_batch
+for i in $(seq 1300)
+do
+	cat test_ascii.txt
+done > test_batch/test_large.txt
+for mode in CBC CTR
+do
+	./joelcrypto --encrypt -i file:test_batch/test_large.txt -o file:test_large.inprogress -c AES:256:$mode -k base64:$key -iv base64:$iv > /dev/null
+	./joelcrypto --batch test_batch --output-dir test_batch.inprogress --encrypt -c AES:256:$mode -k base64:$key -iv base64:$iv -t 4 > /dev/null
+	check_result "AES:256:$mode encryption of a large file in batch mode" "test_large.inprogress" "test_batch.inprogress/test_large.txt"
+	./joelcrypto --batch test_batch.inprogress --output-dir test_batch.end --decrypt -c AES:256:$mode -k base64:$key -iv base64:$iv -t 4 > /dev/null
+	check_result "AES:256:$mode decryption of a large file in batch mode" "test_batch/test_large.txt" "test_batch.end/test_large.txt"
+	rm -r test_batch.inprogress test_batch.end test_large.inprogress
+done
+rm -r test_batch
+
+# The library is checked against the tool when its source is next to bin
+if [ -f ../lib/joelcrypto.c ] && command -v gcc > /dev/null
+then
+	if gcc -O2 -fPIC -shared -fvisibility=hidden -pthread -I.. ../lib/joelcrypto.c -o libjoelcrypto.so &&
+		gcc -O2 -I.. test_lib.c -L. -ljoelcrypto -pthread -o test_lib
+	then
+		LD_LIBRARY_PATH=. ./test_lib
+
+		# And the C++ header, where there is a C++20 compiler
+		if command -v g++ > /dev/null
+		then
+			if g++ -std=c++20 -O2 -I.. test_lib.cpp -L. -ljoelcrypto -pthread -o test_lib_cpp
+			then
+				LD_LIBRARY_PATH=. ./test_lib_cpp
+			else
+				echo "C++ header build test failed"
+			fi
+		fi
+	else
+		echo "Library build test failed"
+	fi
+	rm -f libjoelcrypto.so test_lib test_lib_cpp
+fi
+
 rm test_alph.inprogress
 rm test_ascii.inprogress
 rm test_alph.end
@@ -0,0 +1,56 @@
+#!/bin/bash
+
+# Compares output bandwidth with and without streaming stores. Runs each
+# cipher over a file much larger than the CPU cache, once writing the output
+# buffer through the cache and once with non-temporal stores.
+#
+# Usage: benchmark.sh [size in MiB, default 512] [directory, default /dev/shm]
+
+size=${1:-512}
+dir=${2:-/dev/shm}
+
+if ! [ -x joelcrypto ]
+then
+	echo Executable not found
+	exit 1
+fi
+
+if ! [ -d $dir ]
+then
+	dir=.
+fi
+
+key="6Hr4SdO9y7Hfw3y45Gk3dy1aqQshJou7TgrERRE610m="
+iv="qRA67ZlOFFnJj8cRTEt2hw=="
+
+input=$dir/benchmark.in
+output=$dir/benchmark.out
+
+# Cipher name, MiB to run it on, extra arguments
+run() {
+	head -c $(($2 << 20)) /dev/urandom > $input
+
+	for stores in off on
+	do
+		for buffer in 64M 256M
+		do
+			rm -f $output
+			start=$(date +%s%N)
+			./joelcrypto --encrypt -i file:$input -o file:$output -c $1 -k base64:$key --buffer-size $buffer --stream-stores $stores ${@:3} > /dev/null
+			end=$(date +%s%N)
+
+			echo "$1, $buffer buffers, streaming stores $stores: $(awk "BEGIN { printf \"%.1f\", $2 * 1000000000 / ($end - $start) }") MiB/s"
+		done
+	done
+}
+
+echo "Using executable joelcrypto"
+
+run XOR:CYCLE $size
+run AES:256:CTR $(($size / 32 > 0 ? $size / 32 : 1)) -iv base64:$iv
+run AES:256:ECB $(($size / 32 > 0 ? $size / 32 : 1))
+
+rm -f $input $output
+
+echo "Benchmark completed"
+exit
@@ -0,0 +1,781 @@
+// Checks libjoelcrypto against the joelcrypto tool next to it. autotest.sh
+// builds it from the bin directory with
+//
+//     gcc -O2 -fPIC -shared -fvisibility=hidden -pthread -I.. ../lib/joelcrypto.c -o libjoelcrypto.so
+//     gcc -O2 -I.. test_lib.c -L. -ljoelcrypto -pthread -o test_lib
+//
+// and prints a line for each test as autotest.sh does. Data, keys and the
+// sizes it is fed in are random, pass a seed to repeat a run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "lib/joelcrypto.h"
+
+#define TEST_ROUNDS 4			// Inputs tried for each cipher
+#define TEST_MAX_LEN 20000
+#define TEST_MAX_PIECE 300		// Largest piece handed to one update
+#define TEST_MAX_SEGMENTS 8		// Of each iovec array
+#define TEST_SEGMENT_GAP 8		// Most bytes left between scattered segments
+
+#define BATCH_TEST_KEYS 9			// Three of each key size
+#define BATCH_TEST_MESSAGES 50
+#define BATCH_TEST_MAX_LEN 2000
+
+#define RING_TEST_PRODUCERS 4
+#define RING_TEST_WORKERS 4			// Fixed, so contexts spread over workers on any machine
+#define RING_TEST_CONTEXTS 64		// Split evenly between the producers
+#define RING_TEST_MAX_LEN 65536
+#define RING_TEST_MAX_JOBS 16		// Most jobs one message is split over
+#define RING_TEST_ENTRIES 32		// Small, so producers also see JC_ERROR_BUSY
+
+#define TEST_IN   "test_lib.in"
+#define TEST_OUT  "test_lib.out"
+#define TEST_KEY  "test_lib.key"
+#define TEST_IV   "test_lib.iv"
+
+typedef unsigned char byte;
+
+typedef struct {
+	const char* name;
+	size_t key_len;				// 0 for a key sized to the data, or none for CAESAR
+	bool needs_iv;
+} test_cipher;
+
+const test_cipher test_ciphers[] = {
+	{ "CAESAR", 0, false },
+	{ "SHIFT", 2, false },
+	{ "VIGENERE", 9, false },
+	{ "RC4", 37, false },
+	{ "XOR", 0, false },
+	{ "XOR:CYCLE", 23, false },
+	{ "AES:128:ECB", 16, false },
+	{ "AES:128:CBC", 16, true },
+	{ "AES:128:OFB", 16, true },
+	{ "AES:128:CFB", 16, true },
+	{ "AES:128:CTR", 16, true },
+	{ "AES:192:ECB", 24, false },
+	{ "AES:192:CBC", 24, true },
+	{ "AES:192:OFB", 24, true },
+	{ "AES:192:CFB", 24, true },
+	{ "AES:192:CTR", 24, true },
+	{ "AES:256:ECB", 32, false },
+	{ "AES:256:CBC", 32, true },
+	{ "AES:256:OFB", 32, true },
+	{ "AES:256:CFB", 32, true },
+	{ "AES:256:CTR", 32, true }
+};
+
+#define TEST_CIPHER_COUNT (sizeof(test_ciphers) / sizeof(test_ciphers[0]))
+
+// One cipher's key, IV and data, with the tool's output for them
+typedef struct {
+	const test_cipher* cipher;
+	byte* key;
+	size_t key_len;
+	byte iv[JC_BLOCK_SIZE];
+	byte* plain;
+	size_t plain_len;
+	byte* encrypted;			// By the tool
+	size_t encrypted_len;
+} test_case;
+
+void test_random(byte* data, const size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		data[i] = rand() & 0xFF;
+	}
+}
+
+size_t test_random_below(const size_t max) {
+	return ((size_t)rand() * RAND_MAX + rand()) % max;
+}
+
+bool test_write_file(const char* path, const byte* data, const size_t len) {
+	FILE* f = fopen(path, "wb");
+	if (f == NULL) {
+		return false;
+	}
+	
+	bool written = fwrite(data, 1, len, f) == len;
+	return fclose(f) == 0 && written;
+}
+
+byte* test_read_file(const char* path, size_t* len) {
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) {
+		return NULL;
+	}
+	
+	fseek(f, 0, SEEK_END);
+	*len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	
+	byte* data = (byte*)malloc(*len + 1);
+	if (data != NULL && fread(data, 1, *len, f) != *len) {
+		free(data);
+		data = NULL;
+	}
+	
+	fclose(f);
+	return data;
+}
+
+// Makes a random key, IV and input for cipher and has the tool encrypt them.
+// Returns false if the tool could not be run.
+bool test_case_make(test_case* t, const test_cipher* cipher) {
+	memset(t, 0, sizeof(test_case));
+	t->cipher = cipher;
+	
+	t->plain_len = 1 + test_random_below(TEST_MAX_LEN);
+	if (rand() % 4 == 0) {
+		t->plain_len = (t->plain_len + JC_BLOCK_SIZE - 1) / JC_BLOCK_SIZE * JC_BLOCK_SIZE;
+	}
+	
+	t->plain = (byte*)malloc(t->plain_len);
+	test_random(t->plain, t->plain_len);
+	
+	t->key_len = strcmp(cipher->name, "XOR") == 0 ? t->plain_len : cipher->key_len;
+	t->key = (byte*)malloc(t->key_len + 1);
+	test_random(t->key, t->key_len);
+	
+	// SHIFT takes a number and VIGENERE letters
+	if (strcmp(cipher->name, "SHIFT") == 0) {
+		snprintf((char*)t->key, t->key_len + 1, "%d", 1 + rand() % 25);
+		t->key_len = strlen((char*)t->key);
+	} else if (strcmp(cipher->name, "VIGENERE") == 0) {
+		for (size_t i = 0; i < t->key_len; i++) {
+			t->key[i] = 'A' + t->key[i] % 26;
+		}
+	}
+	
+	test_random(t->iv, JC_BLOCK_SIZE);
+	
+	if (
+		!test_write_file(TEST_IN, t->plain, t->plain_len) ||
+		!test_write_file(TEST_KEY, t->key, t->key_len) ||
+		!test_write_file(TEST_IV, t->iv, JC_BLOCK_SIZE)
+	) {
+		return false;
+	}
+	
+	char command[512];
+	snprintf(command, sizeof(command), "./joelcrypto --encrypt -i file:" TEST_IN " -o file:" TEST_OUT " -c %s%s%s > /dev/null 2>&1",
+		cipher->name, t->key_len > 0 ? " -k file:" TEST_KEY : "", cipher->needs_iv ? " -iv file:" TEST_IV : "");
+		
+	if (system(command) != 0) {
+		return false;
+	}
+	
+	t->encrypted = test_read_file(TEST_OUT, &t->encrypted_len);
+	return t->encrypted != NULL;
+}
+
+void test_case_free(test_case* t) {
+	free(t->key);
+	free(t->plain);
+	free(t->encrypted);
+}
+
+jc_status test_init(jc_ctx** ctx, const test_case* t, const jc_op op) {
+	return jc_init(ctx, t->cipher->name, op, t->key_len > 0 ? t->key : NULL, t->key_len,
+		t->cipher->needs_iv ? t->iv : NULL, JC_BLOCK_SIZE);
+}
+
+// Runs in through a new context in pieces of random size, including empty
+// ones, and checks the result is expected
+bool test_update(const test_case* t, const jc_op op, const byte* in, const size_t len,
+	const byte* expected, const size_t expected_len) {
+	
+	jc_ctx* ctx;
+	if (test_init(&ctx, t, op) != JC_OK) {
+		return false;
+	}
+	
+	byte* out = (byte*)malloc(len + 2 * JC_BLOCK_SIZE);
+	size_t done = 0, out_len = 0, n;
+	bool ok = true;
+	
+	while (ok && done < len) {
+		size_t piece = test_random_below(TEST_MAX_PIECE);
+		if (piece > len - done) {
+			piece = len - done;
+		}
+		
+		ok = jc_update(ctx, &in[done], &out[out_len], piece, &n) == JC_OK;
+		done += piece;
+		out_len += n;
+	}
+	
+	ok = ok && jc_final(ctx, &out[out_len], &n) == JC_OK;
+	out_len += n;
+	
+	ok = ok && out_len == expected_len && memcmp(out, expected, out_len) == 0;
+	
+	free(out);
+	jc_free(ctx);
+	return ok;
+}
+
+// Cuts len bytes into up to TEST_MAX_SEGMENTS segments of random size, some
+// of them empty, laid out in scratch with random gaps between them. The
+// scratch must have room for len + TEST_MAX_SEGMENTS * TEST_SEGMENT_GAP.
+int test_scatter(byte* scratch, const size_t len, struct iovec* iov) {
+	int count = 1 + rand() % TEST_MAX_SEGMENTS;
+	size_t left = len;
+	
+	for (int i = 0; i < count; i++) {
+		size_t n = i == count - 1 ? left : test_random_below(left + 1);
+		
+		scratch += rand() % TEST_SEGMENT_GAP;
+		iov[i].iov_base = scratch;
+		iov[i].iov_len = n;
+		
+		scratch += n;
+		left -= n;
+	}
+	
+	return count;
+}
+
+// Copies the first len bytes held by the segments to data
+void test_gather(const struct iovec* iov, const int count, byte* data, size_t len) {
+	for (int i = 0; i < count && len > 0; i++) {
+		size_t n = iov[i].iov_len < len ? iov[i].iov_len : len;
+		memcpy(data, iov[i].iov_base, n);
+		data += n;
+		len -= n;
+	}
+}
+
+// As test_update, but each piece is scattered over segments for jc_updatev,
+// which writes to other scattered segments with a block to spare. jc_finalv
+// gets exactly one block, cut up the same way.
+bool test_updatev(const test_case* t, const jc_op op, const byte* in, const size_t len,
+	const byte* expected, const size_t expected_len) {
+	
+	jc_ctx* ctx;
+	if (test_init(&ctx, t, op) != JC_OK) {
+		return false;
+	}
+	
+	size_t scratch_size = TEST_MAX_PIECE + JC_BLOCK_SIZE + TEST_MAX_SEGMENTS * TEST_SEGMENT_GAP;
+	byte* in_scratch = (byte*)malloc(scratch_size);
+	byte* out_scratch = (byte*)malloc(scratch_size);
+	byte* out = (byte*)malloc(len + 2 * JC_BLOCK_SIZE);
+	
+	struct iovec in_iov[TEST_MAX_SEGMENTS], out_iov[TEST_MAX_SEGMENTS];
+	size_t done = 0, out_len = 0, n;
+	bool ok = true;
+	
+	while (ok && done < len) {
+		size_t piece = test_random_below(TEST_MAX_PIECE);
+		if (piece > len - done) {
+			piece = len - done;
+		}
+		
+		int in_count = test_scatter(in_scratch, piece, in_iov);
+		int out_count = test_scatter(out_scratch, piece + JC_BLOCK_SIZE, out_iov);
+		
+		for (int i = 0, at = 0; i < in_count; at += in_iov[i].iov_len, i++) {
+			memcpy(in_iov[i].iov_base, &in[done + at], in_iov[i].iov_len);
+		}
+		
+		ok = jc_updatev(ctx, in_iov, in_count, out_iov, out_count, &n) == JC_OK;
+		test_gather(out_iov, out_count, &out[out_len], n);
+		
+		done += piece;
+		out_len += n;
+	}
+	
+	int out_count = test_scatter(out_scratch, JC_BLOCK_SIZE, out_iov);
+	ok = ok && jc_finalv(ctx, out_iov, out_count, &n) == JC_OK;
+	test_gather(out_iov, out_count, &out[out_len], n);
+	out_len += n;
+	
+	ok = ok && out_len == expected_len && memcmp(out, expected, out_len) == 0;
+	
+	free(in_scratch);
+	free(out_scratch);
+	free(out);
+	jc_free(ctx);
+	return ok;
+}
+
+// Encrypts and decrypts in random pieces against the tool, for every cipher,
+// through jc_update and through jc_updatev
+void test_against_tool(void) {
+	const char* failed = NULL;
+	
+	for (unsigned int c = 0; c < TEST_CIPHER_COUNT && failed == NULL; c++) {
+		for (unsigned int r = 0; r < TEST_ROUNDS && failed == NULL; r++) {
+			test_case t;
+			
+			if (
+				!test_case_make(&t, &test_ciphers[c]) ||
+				!test_update(&t, JC_ENCRYPT, t.plain, t.plain_len, t.encrypted, t.encrypted_len) ||
+				!test_update(&t, JC_DECRYPT, t.encrypted, t.encrypted_len, t.plain, t.plain_len) ||
+				!test_updatev(&t, JC_ENCRYPT, t.plain, t.plain_len, t.encrypted, t.encrypted_len) ||
+				!test_updatev(&t, JC_DECRYPT, t.encrypted, t.encrypted_len, t.plain, t.plain_len)
+			) {
+				failed = test_ciphers[c].name;
+			}
+			
+			test_case_free(&t);
+		}
+	}
+	
+	if (failed == NULL) {
+		printf("Library against the tool test passed\n");
+	} else {
+		printf("Library against the tool test failed: %s does not match\n", failed);
+	}
+}
+
+// Output segments too small for what jc_updatev would write are refused
+// before anything is done
+void test_updatev_space(void) {
+	byte key[16] = { 0 }, data[48] = { 0 }, out[48];
+	struct iovec in_iov = { data, 40 };
+	struct iovec out_iov[2] = { { out, 16 }, { &out[16], 15 } };
+	jc_ctx* ctx;
+	size_t n;
+	
+	bool ok = jc_init(&ctx, "AES:128:ECB", JC_ENCRYPT, key, 16, NULL, 0) == JC_OK &&
+		jc_updatev(ctx, &in_iov, 1, out_iov, 2, &n) == JC_ERROR_SPACE && n == 0;
+		
+	// Nothing went through, so the whole input still comes out
+	out_iov[1].iov_len = 16;
+	ok = ok && jc_updatev(ctx, &in_iov, 1, out_iov, 2, &n) == JC_OK && n == 32;
+	ok = ok && jc_finalv(ctx, out_iov, 1, &n) == JC_OK && n == 16;
+	
+	jc_free(ctx);
+	printf("Library jc_updatev output space test %s\n", ok ? "passed" : "failed");
+}
+
+// Messages of random lengths under random handles go through jc_batch in every
+// mode, and must encrypt as a context for each does and decrypt back, half of
+// them in place
+void test_batch(void) {
+	const char* modes[] = { "ECB", "CBC", "CFB", "OFB", "CTR" };
+	
+	byte keys[BATCH_TEST_KEYS][32];
+	jc_keytab* tab;
+	bool ok = jc_keytab_create(&tab, BATCH_TEST_KEYS) == JC_OK;
+	
+	for (unsigned int k = 0; k < BATCH_TEST_KEYS && ok; k++) {
+		test_random(keys[k], sizeof(keys[k]));
+		ok = jc_keytab_set(tab, k, keys[k], 16 + 8 * (k % 3)) == JC_OK;
+	}
+	
+	for (unsigned int m = 0; m < sizeof(modes) / sizeof(modes[0]) && ok; m++) {
+		jc_msg msgs[BATCH_TEST_MESSAGES];
+		byte* plain[BATCH_TEST_MESSAGES];
+		size_t plain_len[BATCH_TEST_MESSAGES];
+		byte* expected[BATCH_TEST_MESSAGES];
+		size_t expected_len[BATCH_TEST_MESSAGES];
+		byte ivs[BATCH_TEST_MESSAGES][JC_BLOCK_SIZE];
+		
+		for (unsigned int i = 0; i < BATCH_TEST_MESSAGES; i++) {
+			size_t len = test_random_below(BATCH_TEST_MAX_LEN + 1);
+			if (rand() % 4 == 0) {
+				len = len / JC_BLOCK_SIZE * JC_BLOCK_SIZE;
+			}
+			
+			unsigned int key = rand() % BATCH_TEST_KEYS;
+			size_t key_len = 16 + 8 * (key % 3);
+			
+			plain[i] = (byte*)malloc(len + 1);
+			plain_len[i] = len;
+			expected[i] = (byte*)malloc(len + JC_BLOCK_SIZE);
+			test_random(plain[i], len);
+			test_random(ivs[i], JC_BLOCK_SIZE);
+			
+			// What a context of its own makes of the message
+			char name[16];
+			snprintf(name, sizeof(name), "AES:%u:%s", (unsigned int)key_len * 8, modes[m]);
+			
+			jc_ctx* ctx;
+			size_t n = 0;
+			expected_len[i] = 0;
+			ok = ok && jc_init(&ctx, name, JC_ENCRYPT, keys[key], key_len, ivs[i], JC_BLOCK_SIZE) == JC_OK;
+			if (ok) {
+				ok = jc_update(ctx, plain[i], expected[i], len, &expected_len[i]) == JC_OK &&
+					jc_final(ctx, &expected[i][expected_len[i]], &n) == JC_OK;
+				expected_len[i] += n;
+				jc_free(ctx);
+			}
+			
+			jc_msg msg = { key, ivs[i], plain[i], (byte*)malloc(len + JC_BLOCK_SIZE), len, 0, JC_OK };
+			msgs[i] = msg;
+		}
+		
+		ok = ok && jc_batch(tab, modes[m], JC_ENCRYPT, msgs, BATCH_TEST_MESSAGES) == JC_OK;
+		
+		for (unsigned int i = 0; i < BATCH_TEST_MESSAGES && ok; i++) {
+			ok = msgs[i].out_len == expected_len[i] && memcmp(msgs[i].out, expected[i], expected_len[i]) == 0;
+		}
+		
+		// Back again from the contexts' output, every other message in place
+		for (unsigned int i = 0; i < BATCH_TEST_MESSAGES; i++) {
+			if (i % 2 == 0) {
+				memcpy(msgs[i].out, expected[i], expected_len[i]);
+				msgs[i].in = msgs[i].out;
+			} else {
+				msgs[i].in = expected[i];
+			}
+			
+			msgs[i].len = expected_len[i];
+		}
+		
+		ok = ok && jc_batch(tab, modes[m], JC_DECRYPT, msgs, BATCH_TEST_MESSAGES) == JC_OK;
+		
+		for (unsigned int i = 0; i < BATCH_TEST_MESSAGES; i++) {
+			ok = ok && msgs[i].out_len == plain_len[i] && memcmp(msgs[i].out, plain[i], plain_len[i]) == 0;
+			
+			free(plain[i]);
+			free(expected[i]);
+			free(msgs[i].out);
+		}
+		
+		if (!ok) {
+			printf("AES %s in a batch does not match\n", modes[m]);
+		}
+	}
+	
+	jc_keytab_free(tab);
+	printf("Library batch against contexts test %s\n", ok ? "passed" : "failed");
+}
+
+// One job of a message on the ring, with where its output went
+typedef struct {
+	unsigned int message;
+	byte* out;
+	size_t out_len;
+	jc_status status;
+	bool done;
+} ring_test_job;
+
+// A message split over jobs that all go to the same context
+typedef struct {
+	jc_ctx* ctx;
+	byte* data;
+	size_t len;
+	byte* expected;
+	size_t expected_len;
+	ring_test_job jobs[RING_TEST_MAX_JOBS];
+	size_t job_len[RING_TEST_MAX_JOBS];
+	unsigned int job_count;
+} ring_test_message;
+
+typedef struct {
+	jc_ring* ring;
+	ring_test_message* messages;
+	unsigned int first;			// The producer's messages, first to last - 1
+	unsigned int last;
+} ring_test_producer;
+
+// Submits the jobs of a producer's messages, taking turns between messages so
+// jobs on different contexts are in the ring at once
+void* ring_test_produce(void* arg) {
+	ring_test_producer* p = (ring_test_producer*)arg;
+	
+	for (unsigned int j = 0; j < RING_TEST_MAX_JOBS; j++) {
+		for (unsigned int m = p->first; m < p->last; m++) {
+			ring_test_message* msg = &p->messages[m];
+			if (j >= msg->job_count) {
+				continue;
+			}
+			
+			size_t offset = 0;
+			for (unsigned int k = 0; k < j; k++) {
+				offset += msg->job_len[k];
+			}
+			
+			jc_job job = { msg->ctx, &msg->data[offset], msg->jobs[j].out, msg->job_len[j],
+				j == msg->job_count - 1, &msg->jobs[j] };
+				
+			while (jc_ring_submit(p->ring, &job) == JC_ERROR_BUSY) {
+				sched_yield();
+			}
+		}
+	}
+	
+	return NULL;
+}
+
+// Several threads submit messages on many contexts, each split over jobs in
+// order, while the main thread reaps. Reaping switches between jc_ring_wait
+// and polling the eventfd, where there is one. Every message must come out
+// as it does from one jc_update and jc_final.
+void test_ring(void) {
+	const char* names[] = { "AES:256:CBC", "AES:128:CTR", "AES:192:CFB", "RC4", "XOR:CYCLE" };
+	const unsigned int name_count = sizeof(names) / sizeof(names[0]);
+	
+	ring_test_message* messages = (ring_test_message*)calloc(RING_TEST_CONTEXTS, sizeof(ring_test_message));
+	unsigned int total_jobs = 0;
+	bool ok = true;
+	
+	for (unsigned int m = 0; m < RING_TEST_CONTEXTS && ok; m++) {
+		ring_test_message* msg = &messages[m];
+		byte key[32], iv[JC_BLOCK_SIZE];
+		const char* name = names[m % name_count];
+		size_t key_len = strncmp(name, "AES:", 4) == 0 ? (size_t)atoi(&name[4]) / 8 : 16;
+		
+		test_random(key, sizeof(key));
+		test_random(iv, sizeof(iv));
+		
+		msg->len = test_random_below(RING_TEST_MAX_LEN);
+		msg->data = (byte*)malloc(msg->len + 1);
+		msg->expected = (byte*)malloc(msg->len + JC_BLOCK_SIZE);
+		test_random(msg->data, msg->len);
+		
+		// What one plain update gives
+		jc_ctx* ctx;
+		size_t n;
+		ok = jc_init(&ctx, name, JC_ENCRYPT, key, key_len, iv, JC_BLOCK_SIZE) == JC_OK &&
+			jc_update(ctx, msg->data, msg->expected, msg->len, &msg->expected_len) == JC_OK &&
+			jc_final(ctx, &msg->expected[msg->expected_len], &n) == JC_OK;
+		msg->expected_len += n;
+		jc_free(ctx);
+		
+		ok = ok && jc_init(&msg->ctx, name, JC_ENCRYPT, key, key_len, iv, JC_BLOCK_SIZE) == JC_OK;
+		
+		// Random cuts, the last job finishing the message
+		msg->job_count = 1 + rand() % RING_TEST_MAX_JOBS;
+		size_t left = msg->len;
+		
+		for (unsigned int j = 0; j < msg->job_count; j++) {
+			msg->job_len[j] = j == msg->job_count - 1 ? left : test_random_below(left + 1);
+			left -= msg->job_len[j];
+			
+			msg->jobs[j].message = m;
+			msg->jobs[j].out = (byte*)malloc(msg->job_len[j] + 2 * JC_BLOCK_SIZE);
+		}
+		
+		total_jobs += msg->job_count;
+	}
+	
+	jc_ring* ring = NULL;
+	ok = ok && jc_ring_create(&ring, RING_TEST_WORKERS, RING_TEST_ENTRIES) == JC_OK;
+	
+	ring_test_producer producers[RING_TEST_PRODUCERS];
+	pthread_t threads[RING_TEST_PRODUCERS];
+	unsigned int started = 0;
+	unsigned int submitted = 0;		// Jobs of the producers that started
+	
+	for (unsigned int p = 0; p < RING_TEST_PRODUCERS && ok; p++) {
+		producers[p].ring = ring;
+		producers[p].messages = messages;
+		producers[p].first = p * RING_TEST_CONTEXTS / RING_TEST_PRODUCERS;
+		producers[p].last = (p + 1) * RING_TEST_CONTEXTS / RING_TEST_PRODUCERS;
+		
+		ok = pthread_create(&threads[p], NULL, ring_test_produce, &producers[p]) == 0;
+		if (ok) {
+			started++;
+			for (unsigned int m = producers[p].first; m < producers[p].last; m++) {
+				submitted += messages[m].job_count;
+			}
+		}
+	}
+	
+	// Reap everything even after a failure, the producers only finish once
+	// there is room for their jobs
+	unsigned int reaped = 0;
+	int fd = started > 0 ? jc_ring_fd(ring) : -1;
+	
+	for (unsigned int round = 0; reaped < submitted; round++) {
+		jc_completion completions[RING_TEST_ENTRIES];
+		unsigned int count;
+		
+		if (fd >= 0 && round % 2 == 1) {
+			struct pollfd pfd = { fd, POLLIN, 0 };
+			if (poll(&pfd, 1, 10000) != 1) {
+				// Never signalled, wait for the rest instead
+				ok = false;
+				fd = -1;
+				continue;
+			}
+			
+			count = jc_ring_poll(ring, completions, RING_TEST_ENTRIES);
+		} else {
+			count = jc_ring_wait(ring, completions, RING_TEST_ENTRIES);
+		}
+		
+		for (unsigned int c = 0; c < count; c++) {
+			ring_test_job* job = (ring_test_job*)completions[c].user_data;
+			
+			ok = ok && !job->done;
+			job->done = true;
+			job->status = completions[c].status;
+			job->out_len = completions[c].out_len;
+		}
+		
+		reaped += count;
+	}
+	
+	for (unsigned int p = 0; p < started; p++) {
+		pthread_join(threads[p], NULL);
+	}
+	
+	// Put each message back together in job order
+	for (unsigned int m = 0; m < RING_TEST_CONTEXTS && ok; m++) {
+		ring_test_message* msg = &messages[m];
+		byte* out = (byte*)malloc(msg->len + JC_BLOCK_SIZE * (msg->job_count + 1));
+		size_t out_len = 0;
+		
+		for (unsigned int j = 0; j < msg->job_count; j++) {
+			ok = ok && msg->jobs[j].status == JC_OK;
+			memcpy(&out[out_len], msg->jobs[j].out, msg->jobs[j].out_len);
+			out_len += msg->jobs[j].out_len;
+		}
+		
+		ok = ok && out_len == msg->expected_len && memcmp(out, msg->expected, out_len) == 0;
+		free(out);
+	}
+	
+	jc_ring_destroy(ring);
+	
+	for (unsigned int m = 0; m < RING_TEST_CONTEXTS; m++) {
+		for (unsigned int j = 0; j < messages[m].job_count; j++) {
+			free(messages[m].jobs[j].out);
+		}
+		
+		jc_free(messages[m].ctx);
+		free(messages[m].data);
+		free(messages[m].expected);
+	}
+	
+	free(messages);
+	printf("Library job ring with %d producers test %s\n", RING_TEST_PRODUCERS, ok ? "passed" : "failed");
+}
+
+// Submits jobs and reaps them all, each completion landing at its job's index
+bool ring_test_run(jc_ring* ring, jc_job* jobs, const unsigned int count, jc_completion* done) {
+	for (unsigned int i = 0; i < count; i++) {
+		jobs[i].user_data = &jobs[i];
+		
+		if (jc_ring_submit(ring, &jobs[i]) != JC_OK) {
+			return false;
+		}
+	}
+	
+	for (unsigned int reaped = 0; reaped < count; ) {
+		jc_completion completions[RING_TEST_ENTRIES];
+		unsigned int n = jc_ring_wait(ring, completions, RING_TEST_ENTRIES);
+		
+		for (unsigned int c = 0; c < n; c++) {
+			done[(jc_job*)completions[c].user_data - jobs] = completions[c];
+		}
+		
+		reaped += n;
+	}
+	
+	return true;
+}
+
+// Writes a file through the ring in pieces at their offsets, last piece first,
+// reads it back the same way, and reads past its end. A write on a descriptor
+// only open for reading must fail with that errno.
+void test_ring_io(void) {
+	size_t len = 1 + test_random_below(RING_TEST_MAX_LEN);
+	size_t piece = (len + RING_TEST_MAX_JOBS - 1) / RING_TEST_MAX_JOBS;
+	unsigned int count = (unsigned int)((len + piece - 1) / piece);
+	
+	byte* data = (byte*)malloc(len);
+	byte* back = (byte*)calloc(len + JC_BLOCK_SIZE, 1);
+	test_random(data, len);
+	
+	jc_job jobs[RING_TEST_MAX_JOBS + 1];
+	jc_completion done[RING_TEST_MAX_JOBS + 1];
+	jc_ring* ring = NULL;
+	
+	int fd = open(TEST_OUT, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	bool ok = fd >= 0 && jc_ring_create(&ring, RING_TEST_WORKERS, RING_TEST_ENTRIES) == JC_OK;
+	
+	memset(jobs, 0, sizeof(jobs));
+	for (unsigned int i = 0; i < count; i++) {
+		size_t offset = (count - 1 - i) * piece;
+		
+		jobs[i].kind = JC_JOB_WRITE;
+		jobs[i].fd = fd;
+		jobs[i].in = &data[offset];
+		jobs[i].len = offset + piece > len ? len - offset : piece;
+		jobs[i].offset = (long long)offset;
+	}
+	
+	ok = ok && ring_test_run(ring, jobs, count, done);
+	for (unsigned int i = 0; i < count && ok; i++) {
+		ok = done[i].status == JC_OK && done[i].out_len == jobs[i].len;
+	}
+	
+	// The same pieces back, and one more that starts at the end
+	for (unsigned int i = 0; i < count; i++) {
+		jobs[i].kind = JC_JOB_READ;
+		jobs[i].out = &back[jobs[i].in - data];
+		jobs[i].in = NULL;
+	}
+	
+	jobs[count].kind = JC_JOB_READ;
+	jobs[count].fd = fd;
+	jobs[count].out = &back[len];
+	jobs[count].len = JC_BLOCK_SIZE;
+	jobs[count].offset = (long long)len;
+	
+	ok = ok && ring_test_run(ring, jobs, count + 1, done);
+	for (unsigned int i = 0; i < count && ok; i++) {
+		ok = done[i].status == JC_OK && done[i].out_len == jobs[i].len;
+	}
+	
+	ok = ok && done[count].status == JC_OK && done[count].out_len == 0 && memcmp(data, back, len) == 0;
+	
+	int read_only = open(TEST_OUT, O_RDONLY);
+	jobs[0].kind = JC_JOB_WRITE;
+	jobs[0].fd = read_only;
+	jobs[0].in = data;
+	
+	ok = ok && read_only >= 0 && ring_test_run(ring, jobs, 1, done) &&
+		done[0].status == JC_ERROR_IO && done[0].error == EBADF;
+	
+	jc_ring_destroy(ring);
+	
+	if (fd >= 0) {
+		close(fd);
+	}
+	
+	if (read_only >= 0) {
+		close(read_only);
+	}
+	
+	free(data);
+	free(back);
+	printf("Library job ring file reads and writes test %s\n", ok ? "passed" : "failed");
+}
+
+int main(int argc, char** argv) {
+	unsigned int seed = argc > 1 ? (unsigned int)strtoul(argv[1], NULL, 10) : (unsigned int)time(NULL);
+	srand(seed);
+	
+	test_against_tool();
+	test_updatev_space();
+	test_batch();
+	test_ring();
+	test_ring_io();
+	
+	remove(TEST_IN);
+	remove(TEST_OUT);
+	remove(TEST_KEY);
+	remove(TEST_IV);
+	
+	printf("Library tests used seed %u\n", seed);
+	return 0;
+}
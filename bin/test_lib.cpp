@@ -0,0 +1,158 @@
+// Checks the C++ header, lib/joelcrypto.hpp, against the joelcrypto tool next
+// to it. autotest.sh builds it from the bin directory after the library with
+//
+//     g++ -std=c++20 -O2 -I.. test_lib.cpp -L. -ljoelcrypto -pthread -o test_lib_cpp
+//
+// Files for several ciphers are encrypted and decrypted by crypt_file all at
+// once on one executor, first running the cipher work inline and then on a
+// ring, and each must match what the tool makes of them.
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "lib/joelcrypto.hpp"
+
+using namespace joelcrypto;
+
+namespace {
+
+constexpr std::size_t max_len = 200000;
+constexpr std::size_t max_buffer = 5000;		// Small, so the streams take many turns
+
+const char* const in_path = "test_lib_cpp.in";
+const char* const key_path = "test_lib_cpp.key";
+const char* const iv_path = "test_lib_cpp.iv";
+
+std::vector<std::byte> random_bytes(const std::size_t len) {
+	std::vector<std::byte> data(len);
+	for (std::byte& b : data) {
+		b = std::byte(std::rand() & 0xFF);
+	}
+
+	return data;
+}
+
+bool write_file(const std::string& path, const std::vector<std::byte>& data) {
+	std::ofstream f(path, std::ios::binary);
+	f.write(reinterpret_cast<const char*>(data.data()), data.size());
+	return bool(f);
+}
+
+std::vector<std::byte> read_file(const std::string& path) {
+	std::ifstream f(path, std::ios::binary);
+	std::vector<char> data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+	return std::vector<std::byte>(reinterpret_cast<std::byte*>(data.data()),
+		reinterpret_cast<std::byte*>(data.data()) + data.size());
+}
+
+// One cipher's files, encrypted by the tool, then by crypt_file and back
+struct file_case {
+	std::string name;
+	std::string tool_path;			// The tool's encryption of in_path
+	std::string encrypted_path;
+	std::string decrypted_path;
+	bool made = false;
+};
+
+template <cipher C, mode M = mode::none>
+void spawn_case(executor& ex, file_case& c, const std::size_t id) {
+	using traits = cipher_traits<C, M>;
+
+	c.name = traits::name.data();
+	c.tool_path = "test_lib_cpp." + std::to_string(id) + ".tool";
+	c.encrypted_path = "test_lib_cpp." + std::to_string(id) + ".enc";
+	c.decrypted_path = "test_lib_cpp." + std::to_string(id) + ".dec";
+
+	std::vector<std::byte> key = random_bytes(traits::key_size != 0 ? traits::key_size : 31);
+	std::vector<std::byte> iv = random_bytes(traits::needs_iv ? JC_BLOCK_SIZE : 0);
+
+	std::string command = "./joelcrypto --encrypt -i file:" + std::string(in_path) + " -o file:" + c.tool_path +
+		" -c " + c.name + " -k file:" + key_path + (traits::needs_iv ? std::string(" -iv file:") + iv_path : "") +
+		" > /dev/null 2>&1";
+
+	c.made = write_file(key_path, key) && write_file(iv_path, iv) && std::system(command.c_str()) == 0;
+	if (!c.made) {
+		return;
+	}
+
+	const std::size_t buffer_size = 1 + std::rand() % max_buffer;
+
+	// The key and IV are copied in, the tasks only start once the executor runs
+	ex.spawn([](executor& ex, file_case& c, std::vector<std::byte> key, std::vector<std::byte> iv,
+		const std::size_t buffer_size) -> task<void> {
+
+		co_await crypt_file<C, M>(ex, JC_ENCRYPT, in_path, c.encrypted_path.c_str(), key, iv, buffer_size);
+		co_await crypt_file<C, M>(ex, JC_DECRYPT, c.tool_path.c_str(), c.decrypted_path.c_str(), key, iv, buffer_size);
+	}(ex, c, std::move(key), std::move(iv), buffer_size));
+}
+
+// Runs every cipher's files at once on an executor with or without a ring
+bool test_crypt_file(jc_ring* ring, const std::vector<std::byte>& plain) {
+	executor ex(ring);
+	file_case cases[8];
+	std::size_t count = 0;
+
+	spawn_case<cipher::rc4>(ex, cases[count], count); count++;
+	spawn_case<cipher::xor_cycle>(ex, cases[count], count); count++;
+	spawn_case<cipher::aes128, mode::ecb>(ex, cases[count], count); count++;
+	spawn_case<cipher::aes128, mode::ctr>(ex, cases[count], count); count++;
+	spawn_case<cipher::aes192, mode::cfb>(ex, cases[count], count); count++;
+	spawn_case<cipher::aes192, mode::ofb>(ex, cases[count], count); count++;
+	spawn_case<cipher::aes256, mode::cbc>(ex, cases[count], count); count++;
+	spawn_case<cipher::aes256, mode::ctr>(ex, cases[count], count); count++;
+
+	bool ok = true;
+	try {
+		ex.run();
+	} catch (const std::exception& e) {
+		std::printf("%s\n", e.what());
+		ok = false;
+	}
+
+	for (std::size_t i = 0; i < count; i++) {
+		file_case& c = cases[i];
+		if (!c.made || read_file(c.encrypted_path) != read_file(c.tool_path) || read_file(c.decrypted_path) != plain) {
+			if (ok) {
+				std::printf("%s does not match\n", c.name.c_str());
+			}
+
+			ok = false;
+		}
+
+		std::remove(c.tool_path.c_str());
+		std::remove(c.encrypted_path.c_str());
+		std::remove(c.decrypted_path.c_str());
+	}
+
+	return ok;
+}
+
+}
+
+int main(int argc, char** argv) {
+	unsigned int seed = argc > 1 ? unsigned(std::strtoul(argv[1], nullptr, 10)) : unsigned(std::time(nullptr));
+	std::srand(seed);
+
+	std::vector<std::byte> plain = random_bytes(1 + std::rand() % max_len);
+	bool made = write_file(in_path, plain);
+
+	bool inline_ok = made && test_crypt_file(nullptr, plain);
+	std::printf("C++ crypt_file test %s\n", inline_ok ? "passed" : "failed");
+
+	jc_ring* ring = nullptr;
+	bool ring_ok = made && jc_ring_create(&ring, 0, 16) == JC_OK && test_crypt_file(ring, plain);
+	jc_ring_destroy(ring);
+	std::printf("C++ crypt_file on a job ring test %s\n", ring_ok ? "passed" : "failed");
+
+	std::remove(in_path);
+	std::remove(key_path);
+	std::remove(iv_path);
+
+	std::printf("C++ tests used seed %u\n", seed);
+	return 0;
+}
@@ -6,10 +6,19 @@
 #include <assert.h>
 #include <sys/types.h>
 
+#if defined(__AES__)
+  #include <wmmintrin.h>
+#endif
+
 #include "util.h"
 #include "block/util.h"
 
 #define AES_BLOCK_SIZE 16
+#define AES_MAX_KEY_SIZE 32
+#define AES_MAX_ROUND_KEYS 240
+
+// Most independent blocks that go through the rounds together
+#define AES_LANES 8
 
 /*
 	AES matrix reference 
@@ -92,7 +101,7 @@ inline void schedule_core(byte* word, unsigned int rc) {
 	word[0] ^= Rcon[rc];
 }
 
-byte* key_schedule(const byte* key, const size_t key_len) {
+void key_schedule(byte* round_keys, const byte* key, const size_t key_len) {
 	
 	size_t n = key_len;
 	
@@ -109,7 +118,6 @@ byte* key_schedule(const byte* key, const size_t key_len) {
 		b = 240;
 	}
 	
-	byte* round_keys = (byte*)malloc(b * sizeof(byte));
 	memcpy(round_keys, key, key_len);
 	
 	while (c < b) {
@@ -134,8 +142,28 @@ byte* key_schedule(const byte* key, const size_t key_len) {
 		}
 		
 	}
+}
+
+// The round keys of the last key used on this thread. Every block of a run
+// uses the same key, so the schedule is only worked out once.
+typedef struct {
+	byte key[AES_MAX_KEY_SIZE];
+	size_t key_len;
+	byte round_keys[AES_MAX_ROUND_KEYS];
+} aes_key_cache;
+
+THREAD_LOCAL aes_key_cache aes_cached_key;
+
+const byte* aes_round_keys(const byte* key, const size_t key_len) {
+	aes_key_cache* cache = &aes_cached_key;
 	
-	return round_keys;
+	if (cache->key_len != key_len || memcmp(cache->key, key, key_len) != 0) {
+		key_schedule(cache->round_keys, key, key_len);
+		memcpy(cache->key, key, key_len);
+		cache->key_len = key_len;
+	}
+	
+	return cache->round_keys;
 }
 	
 void subbytes(byte* state) {
@@ -248,78 +276,211 @@ void Q_mixcolumns(byte* state) {
 	}
 }
 
-void AES_encrypt(byte* input, const size_t input_len, const byte* key, const size_t key_len) {
-	assert(input_len == AES_BLOCK_SIZE);
-	assert(key_len == 16 || key_len == 24 || key_len == 32);
-	
-	// Determine quantity of rounds based on key size
-	unsigned int rounds;
-	
+// Number of rounds for a key of key_len bytes
+unsigned int aes_rounds(const size_t key_len) {
 	if (key_len == 16) {
-		rounds = 10;
+		return 10;
 	} else if (key_len == 24) {
-		rounds = 12;
-	} else if (key_len == 32) {
-		rounds = 14;
+		return 12;
 	}
 	
-	// Schedule round keys
-	byte* round_keys = key_schedule(key, key_len);
+	return 14;
+}
+
+// The round keys aes_decrypt_lanes takes, from key_schedule's. The middle
+// ones go through InvMixColumns, which is what AESDEC wants and lets the
+// inverse rounds add the key after InvMixColumns, so it is done once per key
+// instead of once per block.
+void aes_decryption_keys(byte* decryption_keys, const byte* round_keys, const unsigned int rounds) {
+	memcpy(decryption_keys, round_keys, (rounds + 1) * AES_BLOCK_SIZE);
 	
+	for (unsigned int round = 1; round < rounds; round++) {
+		Q_mixcolumns(&decryption_keys[round*AES_BLOCK_SIZE]);
+	}
+}
+
+// Encrypts one block in place with round keys from key_schedule
+void aes_encrypt_block(byte* state, const byte* round_keys, const unsigned int rounds) {
 	// First round, only addroundkey
-	xor_buffer(input, round_keys, AES_BLOCK_SIZE);
+	xor_buffer(state, round_keys, AES_BLOCK_SIZE);
 	
 	// Main rounds except for last round
 	for (unsigned int round = 1; round < rounds; round++) {
-		subbytes(input);
-		shiftrows(input);
-		mixcolumns(input);
-		xor_buffer(input, &round_keys[round*AES_BLOCK_SIZE], AES_BLOCK_SIZE);
+		subbytes(state);
+		shiftrows(state);
+		mixcolumns(state);
+		xor_buffer(state, &round_keys[round*AES_BLOCK_SIZE], AES_BLOCK_SIZE);
 	}
 	
 	// Final round, no mixcolumns
-	subbytes(input);
-	shiftrows(input);
-	xor_buffer(input, &round_keys[rounds*AES_BLOCK_SIZE], AES_BLOCK_SIZE);
+	subbytes(state);
+	shiftrows(state);
+	xor_buffer(state, &round_keys[rounds*AES_BLOCK_SIZE], AES_BLOCK_SIZE);
+}
+
+void aes_decrypt_block(byte* state, const byte* round_keys, const unsigned int rounds) {
+	// Do everything in reverse, starting with last round
+	xor_buffer(state, &round_keys[rounds*AES_BLOCK_SIZE], AES_BLOCK_SIZE);
+	Q_shiftrows(state);
+	Q_subbytes(state);
+	
+	// Main rounds except for first round
+	for (unsigned int round = rounds - 1; round > 0; round--) {
+		xor_buffer(state, &round_keys[round*AES_BLOCK_SIZE], AES_BLOCK_SIZE);
+		Q_mixcolumns(state);
+		Q_shiftrows(state);
+		Q_subbytes(state);
+	}
 	
-	free(round_keys);
+	// First round, only addroundkey
+	xor_buffer(state, &round_keys[0], AES_BLOCK_SIZE);
 }
 
-void AES_decrypt(byte* input, const size_t input_len, const byte* key, const size_t key_len) {
-	assert(input_len == AES_BLOCK_SIZE);
-	assert(key_len == 16 || key_len == 24 || key_len == 32);
+// Encrypts n independent blocks in place, each under its own round keys and
+// number of rounds, a round at a time across all of them. Nothing in one lane
+// waits on another, so with AES-NI each lane's round instruction issues while
+// the others' are still in flight instead of stalling on its own last one.
+void aes_encrypt_lanes(byte states[][AES_BLOCK_SIZE], const byte* const* round_keys,
+	const unsigned int* rounds, const unsigned int n) {
+	
+	assert(n <= AES_LANES);
+	
+	unsigned int most = 0;
+	for (unsigned int l = 0; l < n; l++) {
+		if (rounds[l] > most) {
+			most = rounds[l];
+		}
+	}
 	
-	// Determine quantity of rounds based on key size
-	unsigned int rounds;
+	#if defined(__AES__)
+	__m128i s[AES_LANES];
 	
-	if (key_len == 16) {
-		rounds = 10;
-	} else if (key_len == 24) {
-		rounds = 12;
-	} else if (key_len == 32) {
-		rounds = 14;
+	for (unsigned int l = 0; l < n; l++) {
+		s[l] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)states[l]), _mm_loadu_si128((const __m128i*)round_keys[l]));
 	}
 	
-	// Schedule round keys
-	byte* round_keys = key_schedule(key, key_len);
+	for (unsigned int round = 1; round <= most; round++) {
+		for (unsigned int l = 0; l < n; l++) {
+			if (round < rounds[l]) {
+				s[l] = _mm_aesenc_si128(s[l], _mm_loadu_si128((const __m128i*)&round_keys[l][round*AES_BLOCK_SIZE]));
+			} else if (round == rounds[l]) {
+				s[l] = _mm_aesenclast_si128(s[l], _mm_loadu_si128((const __m128i*)&round_keys[l][round*AES_BLOCK_SIZE]));
+			}
+		}
+	}
 	
-	// Do everything in reverse, starting with last round
-	xor_buffer(input, &round_keys[rounds*AES_BLOCK_SIZE], AES_BLOCK_SIZE);
-	Q_shiftrows(input);
-	Q_subbytes(input);
+	for (unsigned int l = 0; l < n; l++) {
+		_mm_storeu_si128((__m128i*)states[l], s[l]);
+	}
+	#else
+	for (unsigned int l = 0; l < n; l++) {
+		xor_buffer(states[l], round_keys[l], AES_BLOCK_SIZE);
+	}
 	
-	// Main rounds except for first round
-	for (unsigned int round = rounds - 1; round > 0; round--) {
-		xor_buffer(input, &round_keys[round*AES_BLOCK_SIZE], AES_BLOCK_SIZE);
-		Q_mixcolumns(input);
-		Q_shiftrows(input);
-		Q_subbytes(input);
+	for (unsigned int round = 1; round <= most; round++) {
+		for (unsigned int l = 0; l < n; l++) {
+			if (round > rounds[l]) {
+				continue;
+			}
+			
+			subbytes(states[l]);
+			shiftrows(states[l]);
+			
+			// No mixcolumns in the final round
+			if (round < rounds[l]) {
+				mixcolumns(states[l]);
+			}
+			
+			xor_buffer(states[l], &round_keys[l][round*AES_BLOCK_SIZE], AES_BLOCK_SIZE);
+		}
 	}
+	#endif
+}
+
+// The inverse of aes_encrypt_lanes, with round keys from aes_decryption_keys
+void aes_decrypt_lanes(byte states[][AES_BLOCK_SIZE], const byte* const* round_keys,
+	const unsigned int* rounds, const unsigned int n) {
 	
-	// First round, only addroundkey
-	xor_buffer(input, &round_keys[0], AES_BLOCK_SIZE);
+	assert(n <= AES_LANES);
+	
+	unsigned int most = 0;
+	for (unsigned int l = 0; l < n; l++) {
+		if (rounds[l] > most) {
+			most = rounds[l];
+		}
+	}
+	
+	// Each lane starts from its own last round, so step counts down from there
+	#if defined(__AES__)
+	__m128i s[AES_LANES];
+	
+	for (unsigned int l = 0; l < n; l++) {
+		s[l] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)states[l]), _mm_loadu_si128((const __m128i*)&round_keys[l][rounds[l]*AES_BLOCK_SIZE]));
+	}
+	
+	for (unsigned int step = 1; step <= most; step++) {
+		for (unsigned int l = 0; l < n; l++) {
+			if (step > rounds[l]) {
+				continue;
+			}
+			
+			unsigned int round = rounds[l] - step;
+			__m128i k = _mm_loadu_si128((const __m128i*)&round_keys[l][round*AES_BLOCK_SIZE]);
+			
+			if (round > 0) {
+				s[l] = _mm_aesdec_si128(s[l], k);
+			} else {
+				s[l] = _mm_aesdeclast_si128(s[l], k);
+			}
+		}
+	}
+	
+	for (unsigned int l = 0; l < n; l++) {
+		_mm_storeu_si128((__m128i*)states[l], s[l]);
+	}
+	#else
+	for (unsigned int l = 0; l < n; l++) {
+		xor_buffer(states[l], &round_keys[l][rounds[l]*AES_BLOCK_SIZE], AES_BLOCK_SIZE);
+		Q_shiftrows(states[l]);
+		Q_subbytes(states[l]);
+	}
+	
+	for (unsigned int step = 1; step <= most; step++) {
+		for (unsigned int l = 0; l < n; l++) {
+			if (step > rounds[l]) {
+				continue;
+			}
+			
+			unsigned int round = rounds[l] - step;
+			
+			// The key is already through InvMixColumns, so it goes in after
+			if (round > 0) {
+				Q_mixcolumns(states[l]);
+			}
+			
+			xor_buffer(states[l], &round_keys[l][round*AES_BLOCK_SIZE], AES_BLOCK_SIZE);
+			
+			if (round > 0) {
+				Q_shiftrows(states[l]);
+				Q_subbytes(states[l]);
+			}
+		}
+	}
+	#endif
+}
+
+void AES_encrypt(byte* input, const size_t input_len, const byte* key, const size_t key_len) {
+	assert(input_len == AES_BLOCK_SIZE);
+	assert(key_len == 16 || key_len == 24 || key_len == 32);
+	
+	aes_encrypt_block(input, aes_round_keys(key, key_len), aes_rounds(key_len));
+}
+
+void AES_decrypt(byte* input, const size_t input_len, const byte* key, const size_t key_len) {
+	assert(input_len == AES_BLOCK_SIZE);
+	assert(key_len == 16 || key_len == 24 || key_len == 32);
 	
-	free(round_keys);
+	aes_decrypt_block(input, aes_round_keys(key, key_len), aes_rounds(key_len));
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,394 @@
+#ifndef BLOCK__SPARSE_H
+#define BLOCK__SPARSE_H
+
+#define SPARSE_MAGIC     "JCSPARSE"
+#define SPARSE_MAGIC_LEN 8
+
+#define ERROR_SPARSE_INPUT       "Error: --sparse encryption needs a FILE:<> input.\n"
+#define ERROR_SPARSE_DAMAGED     "Error: input was not encrypted with --sparse, or is damaged.\n"
+#define ERROR_SPARSE_UNSUPPORTED "Error: --sparse is not supported on this platform.\n"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#if !defined(_WIN32)
+  #include <unistd.h>
+  #include <sys/stat.h>
+#endif
+
+#include "util.h"
+#include "arena.h"
+#include "buffered_container.h"
+#include "block/util.h"
+
+// Sparse files, such as VM images, are mostly holes. With --sparse only the
+// data extents are read and encrypted, and the output is:
+//     JCSPARSE
+//     <file size> <extent count>
+//     <offset> <length>, for each extent
+//     the encrypted extents, one after another
+// with the numbers as 64 bit little endian. Each extent is encrypted with the
+// CTR counter it would have at its offset in the whole file, so its keystream
+// is the same as a plain CTR encryption of the file would use there.
+// Decrypting seeks over the holes to recreate them.
+
+typedef struct {
+	unsigned long long offset;
+	unsigned long long length;
+} sparse_extent;
+
+void sparse_put64(byte* dst, unsigned long long value) {
+	for (unsigned int i = 0; i < 8; i++) {
+		dst[i] = (byte)(value >> (8 * i));
+	}
+}
+
+unsigned long long sparse_get64(const byte* src) {
+	unsigned long long value = 0;
+	
+	for (unsigned int i = 0; i < 8; i++) {
+		value |= (unsigned long long)src[i] << (8 * i);
+	}
+	
+	return value;
+}
+
+// Sets counter to the IV advanced by the number of blocks before offset
+void sparse_counter_at(byte* counter, const byte* iv, const size_t block_size, const unsigned long long offset) {
+	memcpy(counter, iv, block_size);
+	
+	unsigned long long blocks = offset / block_size;
+	unsigned int carry = 0;
+	
+	for (int i = block_size - 1; i >= 0 && (blocks > 0 || carry > 0); i--) {
+		unsigned int sum = counter[i] + (blocks & 0xFF) + carry;
+		counter[i] = (byte)sum;
+		carry = sum >> 8;
+		blocks >>= 8;
+	}
+}
+
+// Encrypts or decrypts data in place with the keystream starting at counter,
+// leaving counter on the block after it
+void sparse_ctr(block_func encryptor, byte* data, const size_t len, byte* counter, byte* keystream,
+	const size_t block_size, const byte* key, const size_t key_size) {
+	
+	for (size_t i = 0; i < len; i += block_size) {
+		memcpy(keystream, counter, block_size);
+		encryptor(keystream, block_size, key, key_size);
+		increment_buffer(counter, block_size);
+		
+		xor_buffer(&data[i], keystream, len - i < block_size ? len - i : block_size);
+	}
+}
+
+#if !defined(_WIN32)
+// Lists the data extents of a file, with holes between them. Extents are
+// widened to whole blocks so each one starts on a counter boundary. A file
+// system that cannot report holes gives one extent for the whole file.
+sparse_extent* sparse_find_extents(const int fd, const unsigned long long size, const size_t block_size, size_t* count) {
+	size_t capacity = 16;
+	sparse_extent* extents = (sparse_extent*)malloc(capacity * sizeof(sparse_extent));
+	assert(extents != NULL);
+	
+	*count = 0;
+	unsigned long long pos = 0;
+	
+	while (pos < size) {
+		unsigned long long start = pos, end = size;
+		
+		#if defined(SEEK_DATA)
+		off_t data = lseek(fd, pos, SEEK_DATA);
+		
+		if (data < 0 && errno == ENXIO) {
+			// Only a hole is left
+			break;
+		}
+		
+		if (data >= 0) {
+			off_t hole = lseek(fd, data, SEEK_HOLE);
+			start = data;
+			end = hole >= 0 ? (unsigned long long)hole : size;
+		}
+		#endif
+		
+		pos = end;
+		
+		start -= start % block_size;
+		end = end % block_size == 0 ? end : end - end % block_size + block_size;
+		if (end > size) {
+			end = size;
+		}
+		
+		// Widening can run an extent into the one before it
+		if (*count > 0 && start <= extents[*count - 1].offset + extents[*count - 1].length) {
+			extents[*count - 1].length = end - extents[*count - 1].offset;
+			continue;
+		}
+		
+		if (*count == capacity) {
+			capacity *= 2;
+			extents = (sparse_extent*)realloc(extents, capacity * sizeof(sparse_extent));
+			assert(extents != NULL);
+		}
+		
+		extents[*count].offset = start;
+		extents[*count].length = end - start;
+		(*count)++;
+	}
+	
+	return extents;
+}
+
+bool sparse_read_at(const int fd, byte* buffer, const size_t len, const unsigned long long offset) {
+	size_t done = 0;
+	
+	while (done < len) {
+		ssize_t got = pread(fd, &buffer[done], len - done, offset + done);
+		
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		
+		if (got <= 0) {
+			return false;
+		}
+		
+		done += got;
+	}
+	
+	return true;
+}
+#endif
+
+// Takes exactly len bytes from the input, across as many buffers as it takes.
+// Returns false if the input ends first.
+bool sparse_take(buffered_container* input, size_t* pos, byte* dst, const size_t len) {
+	size_t done = 0;
+	
+	while (done < len) {
+		if (*pos == input->buffer_len) {
+			if (bc_rnext(input) == 0) {
+				return false;
+			}
+			
+			*pos = 0;
+		}
+		
+		size_t n = input->buffer_len - *pos;
+		if (len - done < n) {
+			n = len - done;
+		}
+		
+		memcpy(&dst[done], &input->buffer[*pos], n);
+		*pos += n;
+		done += n;
+	}
+	
+	return true;
+}
+
+// Writes len zero bytes, for holes in outputs that cannot seek
+void sparse_zero_fill(buffered_container* output, unsigned long long len) {
+	while (len > 0) {
+		size_t space;
+		byte* dst = bc_write_space(output, &space);
+		
+		if (len < space) {
+			space = len;
+		}
+		
+		memset(dst, 0, space);
+		bc_write_commit(output, space);
+		len -= space;
+	}
+}
+
+void SPARSE_CTR_encrypt(block_func encryptor, buffered_container* input, buffered_container* output,
+	const byte* iv, const size_t iv_size, const size_t block_size, const byte* key, const size_t key_size) {
+	
+	#if defined(_WIN32)
+	fprintf(stderr, ERROR_SPARSE_UNSUPPORTED);
+	exit(1);
+	#else
+	assert(iv_size == block_size);
+	
+	struct stat st;
+	if (input->fd == NULL || input->pf != NO_PRINT || fstat(fileno(input->fd), &st) != 0 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, ERROR_SPARSE_INPUT);
+		exit(1);
+	}
+	
+	int fd = fileno(input->fd);
+	size_t count;
+	sparse_extent* extents = sparse_find_extents(fd, st.st_size, block_size, &count);
+	
+	byte header[16];
+	bc_write_block(output, (const byte*)SPARSE_MAGIC, SPARSE_MAGIC_LEN);
+	
+	sparse_put64(header, st.st_size);
+	sparse_put64(&header[8], count);
+	bc_write_block(output, header, sizeof(header));
+	
+	for (size_t e = 0; e < count; e++) {
+		sparse_put64(header, extents[e].offset);
+		sparse_put64(&header[8], extents[e].length);
+		bc_write_block(output, header, sizeof(header));
+	}
+	
+	byte* chunk = bc_alloc_buffer(input->buffer_size);
+	byte* counter = (byte*)scratch_alloc(block_size);
+	byte* keystream = (byte*)scratch_alloc(block_size);
+	assert(counter != NULL && keystream != NULL);
+	
+	for (size_t e = 0; e < count; e++) {
+		sparse_counter_at(counter, iv, block_size, extents[e].offset);
+		
+		for (unsigned long long done = 0; done < extents[e].length; ) {
+			size_t n = input->buffer_size;
+			if (extents[e].length - done < n) {
+				n = extents[e].length - done;
+			}
+			
+			if (!sparse_read_at(fd, chunk, n, extents[e].offset + done)) {
+				perror("File read error");
+				exit(1);
+			}
+			
+			sparse_ctr(encryptor, chunk, n, counter, keystream, block_size, key, key_size);
+			bc_write_block(output, chunk, n);
+			done += n;
+		}
+	}
+	
+	bc_free_buffer(chunk);
+	scratch_free(counter);
+	scratch_free(keystream);
+	free(extents);
+	bc_flush(output);
+	#endif
+}
+
+void SPARSE_CTR_decrypt(block_func encryptor, buffered_container* input, buffered_container* output,
+	const byte* iv, const size_t iv_size, const size_t block_size, const byte* key, const size_t key_size) {
+	
+	#if defined(_WIN32)
+	fprintf(stderr, ERROR_SPARSE_UNSUPPORTED);
+	exit(1);
+	#else
+	assert(iv_size == block_size);
+	
+	size_t pos = 0;		// Position in the input buffer
+	byte header[16];
+	
+	if (
+		!sparse_take(input, &pos, header, SPARSE_MAGIC_LEN) ||
+		memcmp(header, SPARSE_MAGIC, SPARSE_MAGIC_LEN) != 0 ||
+		!sparse_take(input, &pos, header, sizeof(header))
+	) {
+		fprintf(stderr, ERROR_SPARSE_DAMAGED);
+		exit(1);
+	}
+	
+	unsigned long long size = sparse_get64(header);
+	unsigned long long count = sparse_get64(&header[8]);
+	
+	// Extents never overlap, so there can't be more of them than bytes
+	if (count > size || count > (size_t)-1 / sizeof(sparse_extent)) {
+		fprintf(stderr, ERROR_SPARSE_DAMAGED);
+		exit(1);
+	}
+	
+	sparse_extent* extents = (sparse_extent*)malloc(count > 0 ? count * sizeof(sparse_extent) : 1);
+	assert(extents != NULL);
+	
+	unsigned long long end = 0;
+	for (size_t e = 0; e < count; e++) {
+		if (!sparse_take(input, &pos, header, sizeof(header))) {
+			fprintf(stderr, ERROR_SPARSE_DAMAGED);
+			exit(1);
+		}
+		
+		extents[e].offset = sparse_get64(header);
+		extents[e].length = sparse_get64(&header[8]);
+		
+		if (extents[e].offset < end || extents[e].length > size - extents[e].offset) {
+			fprintf(stderr, ERROR_SPARSE_DAMAGED);
+			exit(1);
+		}
+		
+		end = extents[e].offset + extents[e].length;
+	}
+	
+	// Holes are recreated by seeking over them, in plain files. Anything else
+	// gets them written out as zeros.
+	struct stat st;
+	bool can_seek = output->fd != NULL && output->pf == NO_PRINT && output->map == NULL &&
+		output->async == NULL && output->journal == NULL && !output->direct &&
+		fstat(fileno(output->fd), &st) == 0 && S_ISREG(st.st_mode);
+		
+	byte* chunk = bc_alloc_buffer(input->buffer_size);
+	byte* counter = (byte*)scratch_alloc(block_size);
+	byte* keystream = (byte*)scratch_alloc(block_size);
+	assert(counter != NULL && keystream != NULL);
+	
+	unsigned long long written = 0;
+	
+	for (size_t e = 0; e < count; e++) {
+		if (can_seek) {
+			bc_flush(output);
+			
+			if (fseeko(output->fd, extents[e].offset, SEEK_SET) != 0) {
+				perror("File seek error");
+				exit(1);
+			}
+		} else {
+			sparse_zero_fill(output, extents[e].offset - written);
+		}
+		
+		sparse_counter_at(counter, iv, block_size, extents[e].offset);
+		
+		for (unsigned long long done = 0; done < extents[e].length; ) {
+			size_t n = input->buffer_size;
+			if (extents[e].length - done < n) {
+				n = extents[e].length - done;
+			}
+			
+			if (!sparse_take(input, &pos, chunk, n)) {
+				fprintf(stderr, ERROR_SPARSE_DAMAGED);
+				exit(1);
+			}
+			
+			sparse_ctr(encryptor, chunk, n, counter, keystream, block_size, key, key_size);
+			bc_write_block(output, chunk, n);
+			done += n;
+		}
+		
+		written = extents[e].offset + extents[e].length;
+	}
+	
+	// A hole at the end of the file is just its size
+	if (can_seek) {
+		bc_flush(output);
+		
+		if (fflush(output->fd) != 0 || ftruncate(fileno(output->fd), size) != 0) {
+			perror("File writing error");
+			exit(1);
+		}
+	} else {
+		sparse_zero_fill(output, size - written);
+	}
+	
+	bc_free_buffer(chunk);
+	scratch_free(counter);
+	scratch_free(keystream);
+	free(extents);
+	bc_flush(output);
+	#endif
+}
+
+#endif
@@ -1,10 +1,12 @@
 #ifndef BLOCK__UTIL_H
 #define BLOCK__UTIL_H
 
+#define WARNING_DATA_NOT_BLOCKED "Warning: the provided input data was not a multiple of the block size!\nThe ending bytes were ignored. Did you select the right cipher mode?\n"
 #define WARNING_KEY_INCORRECT "Warning: padding was not correct on decrypted data, key was most likely incorrect.\n"
 #define PADDING_UNKNOWN -1
 
 #include "util.h"
+#include "arena.h"
 
 enum cmode_t { ECB, CBC, CFB, OFB, CTR };
 typedef enum cmode_t cmode_t;
@@ -28,10 +30,11 @@ inline void increment_buffer(byte* buff, const size_t buff_len) {
 }
 
 bool try_padding(buffered_container* bc, const size_t block_size) {
-	// Padding can always be done if the buffer is not full, as long as the block
-	// size we are padding to is a power of two, which is very common.
+	// Padding can always be done at the end of the input if the buffer is not
+	// full, as long as the block size we are padding to is a power of two,
+	// which is very common.
 	
-	if (bc->buffer_len < BUFFER_SIZE) {
+	if (bc->eof && bc->buffer_len < bc->buffer_size) {
 		
 		// Floor divide, add one, multiple back, then subtract original length
 		size_t padding_len = (((int)(bc->buffer_len / block_size) + 1) * block_size) - bc->buffer_len;
@@ -52,6 +55,42 @@ bool try_padding(buffered_container* bc, const size_t block_size) {
 	return false;
 }
 
+// Checks the PKCS5 padding on the final block of decrypted data, giving the
+// number of pad bytes to drop through padding
+bool padding_valid(const byte* block, const size_t block_size, size_t* padding) {
+	byte pad = block[block_size - 1];
+	
+	// Check if padding is valid, first by comparing the
+	// pad bytes with the block size
+	if (pad > block_size) {
+		return false;
+	}
+	
+	// Next padding check, verify bytes prior to the padding 
+	for (unsigned int k = 0; k < pad; k++) {
+		if (block[block_size - 1 - k] != pad) {
+			return false;
+		}
+	}
+	
+	*padding = pad;
+	return true;
+}
+
+// Writes the final block of decrypted data without its PKCS5 padding
+void write_unpadded(buffered_container* output, const byte* block, const size_t block_size) {
+	size_t padding;
+	
+	if (!padding_valid(block, block_size, &padding)) {
+		fprintf(stderr, WARNING_KEY_INCORRECT);
+		bc_write_block(output, block, block_size);
+		return;
+	}
+	
+	// Padding check cleared, remove it
+	bc_write_block(output, block, block_size - padding);
+}
+
 void ECB_encrypt(block_func encryptor, buffered_container* input, buffered_container* output,
 	const size_t block_size, const byte* key, const size_t key_size) {
 	
@@ -60,7 +99,7 @@ void ECB_encrypt(block_func encryptor, buffered_container* input, buffered_conta
 	// Padding using PKCS5
 	bool padded = try_padding(input, block_size);
 	
-	byte* block = (byte*)malloc(block_size * sizeof(byte));
+	byte* block = (byte*)scratch_alloc(block_size * sizeof(byte));
 	
 	unsigned int i = 0;
 	while (i < input->buffer_len) {
@@ -96,7 +135,7 @@ void ECB_encrypt(block_func encryptor, buffered_container* input, buffered_conta
 		}
 	}
 	
-	free(block);
+	scratch_free(block);
 	bc_flush(output);
 }
 
@@ -105,7 +144,9 @@ void ECB_decrypt(block_func decryptor, buffered_container* input, buffered_conta
 	
 	assert(is_power_2(block_size));
 	
-	byte* block = (byte*)malloc(block_size * sizeof(byte));
+	byte* block = (byte*)scratch_alloc(block_size * sizeof(byte));
+	byte* last_block = (byte*)scratch_alloc(block_size * sizeof(byte));
+	bool have_last_block = false;
 	
 	unsigned int i = 0;
 	while (i < input->buffer_len) {
@@ -114,7 +155,15 @@ void ECB_decrypt(block_func decryptor, buffered_container* input, buffered_conta
 		
 		if (i % block_size == block_size - 1) {
 			decryptor(block, block_size, key, key_size);
-			bc_write_block(output, block, block_size);
+			
+			// The newest block is held back, as its padding can only be
+			// removed once we know it is the last one
+			if (have_last_block) {
+				bc_write_block(output, last_block, block_size);
+			}
+			
+			memcpy(last_block, block, block_size);
+			have_last_block = true;
 		}
 		
 		i++;
@@ -126,37 +175,19 @@ void ECB_decrypt(block_func decryptor, buffered_container* input, buffered_conta
 		}
 	}
 	
-	free(block);
-	
 	if (i % block_size != 0) {
-		printf(WARNING_DATA_NOT_BLOCKED);
-	} else {	
-		// Remove padding
-		byte padding = output->buffer[output->buffer_len - 1];
-		
-		// Check if padding is valid, first by comparing the
-		// pad bytes with the block size
-		if (padding > block_size) {
-			printf(WARNING_KEY_INCORRECT);
-		} else {
-			// Next padding check, verify bytes prior to the padding 
-			unsigned int k;
-			for (k = 0; k < padding; k++) {
-				int offset = output->buffer_len - 1 - k;
-				
-				if (output->buffer[offset] != padding) {
-					printf(WARNING_KEY_INCORRECT);
-					break;
-				}
-			}
-			
-			// Padding check cleared, remove it
-			if (k == padding) {
-				output->buffer_len -= padding;
-			}
+		fprintf(stderr, WARNING_DATA_NOT_BLOCKED);
+		
+		if (have_last_block) {
+			bc_write_block(output, last_block, block_size);
 		}
+	} else if (have_last_block) {
+		write_unpadded(output, last_block, block_size);
 	}
 	
+	scratch_free(block);
+	scratch_free(last_block);
+	
 	bc_flush(output);
 }
 
@@ -168,10 +199,10 @@ void CBC_encrypt(block_func encryptor, buffered_container* input, buffered_conta
 	// Padding using PKCS5
 	bool padded = try_padding(input, block_size);
 	
-	byte* block = (byte*)malloc(block_size * sizeof(byte));
+	byte* block = (byte*)scratch_alloc(block_size * sizeof(byte));
 	
 	// Set up IV
-	byte* previous_block = clone_buffer(iv, iv_size);
+	byte* previous_block = scratch_clone(iv, iv_size);
 	
 	unsigned int i = 0;
 	while (i < input->buffer_len) {
@@ -217,8 +248,8 @@ void CBC_encrypt(block_func encryptor, buffered_container* input, buffered_conta
 		}
 	}
 	
-	free(block);
-	free(previous_block);
+	scratch_free(block);
+	scratch_free(previous_block);
 	bc_flush(output);
 }
 
@@ -227,11 +258,13 @@ void CBC_decrypt(block_func decryptor, buffered_container* input, buffered_conta
 	
 	assert(is_power_2(block_size));
 	
-	byte* block = (byte*)malloc(block_size * sizeof(byte));
+	byte* block = (byte*)scratch_alloc(block_size * sizeof(byte));
 	
 	// Set up IV
-	byte* previous_block = clone_buffer(iv, iv_size);
-	byte* ct_block = (byte*)malloc(block_size * sizeof(byte));
+	byte* previous_block = scratch_clone(iv, iv_size);
+	byte* ct_block = (byte*)scratch_alloc(block_size * sizeof(byte));
+	byte* last_block = (byte*)scratch_alloc(block_size * sizeof(byte));
+	bool have_last_block = false;
 	
 	unsigned int i = 0;
 	while (i < input->buffer_len) {
@@ -250,8 +283,13 @@ void CBC_decrypt(block_func decryptor, buffered_container* input, buffered_conta
 			// Make ciphertext copied before into the previous block for next round
 			memcpy(previous_block, ct_block, block_size);
 			
-			// Write to output buffer
-			bc_write_block(output, block, block_size);
+			// Hold back the newest block until we know if it is padded
+			if (have_last_block) {
+				bc_write_block(output, last_block, block_size);
+			}
+			
+			memcpy(last_block, block, block_size);
+			have_last_block = true;
 		}
 		
 		i++;
@@ -263,39 +301,21 @@ void CBC_decrypt(block_func decryptor, buffered_container* input, buffered_conta
 		}
 	}
 	
-	free(block);
-	free(ct_block);
-	free(previous_block);
-	
 	if (i % block_size != 0) {
-		printf(WARNING_DATA_NOT_BLOCKED);
-	} else {
-		// Remove padding
-		byte padding = output->buffer[output->buffer_len - 1];
-		
-		// Check if padding is valid, first by comparing the
-		// pad bytes with the block size
-		if (padding > block_size) {
-			printf(WARNING_KEY_INCORRECT);
-		} else {
-			// Next padding check, verify bytes prior to the padding 
-			unsigned int k;
-			for (k = 0; k < padding; k++) {
-				int offset = output->buffer_len - 1 - k;
-				
-				if (output->buffer[offset] != padding) {
-					printf(WARNING_KEY_INCORRECT);
-					break;
-				}
-			}
-			
-			// Padding check cleared, remove it
-			if (k == padding) {
-				output->buffer_len -= padding;
-			}
+		fprintf(stderr, WARNING_DATA_NOT_BLOCKED);
+		
+		if (have_last_block) {
+			bc_write_block(output, last_block, block_size);
 		}
+	} else if (have_last_block) {
+		write_unpadded(output, last_block, block_size);
 	}
 	
+	scratch_free(block);
+	scratch_free(ct_block);
+	scratch_free(previous_block);
+	scratch_free(last_block);
+	
 	bc_flush(output);
 }
 
@@ -303,10 +323,10 @@ void CBC_decrypt(block_func decryptor, buffered_container* input, buffered_conta
 void CFB_encrypt(block_func encryptor, buffered_container* input, buffered_container* output,
 	const byte* iv, const size_t iv_size, const size_t block_size, const byte* key, const size_t key_size) {
 	
-	byte* block = (byte*)malloc(block_size * sizeof(byte));
+	byte* block = (byte*)scratch_alloc(block_size * sizeof(byte));
 	
 	// Set up IV
-	byte* previous_block = clone_buffer(iv, iv_size);
+	byte* previous_block = scratch_clone(iv, iv_size);
 	
 	unsigned int i = 0;
 	while (i < input->buffer_len) {
@@ -332,7 +352,7 @@ void CFB_encrypt(block_func encryptor, buffered_container* input, buffered_conta
 		
 		// The final block is encrypted here, this block does not need to be
 		// the full block size
-		if (i == input->buffer_len && input->buffer_len != BUFFER_SIZE) {
+		if (i == input->buffer_len && input->eof) {
 			// Do encryption on previous output
 			encryptor(previous_block, block_size, key, key_size);
 			
@@ -356,18 +376,18 @@ void CFB_encrypt(block_func encryptor, buffered_container* input, buffered_conta
 		}
 	}
 	
-	free(block);
-	free(previous_block);
+	scratch_free(block);
+	scratch_free(previous_block);
 	bc_flush(output);
 }
 
 void CFB_decrypt(block_func encryptor, buffered_container* input, buffered_container* output,
 	const byte* iv, const size_t iv_size, const size_t block_size, const byte* key, const size_t key_size) {
 	
-	byte* block = (byte*)malloc(block_size * sizeof(byte));
+	byte* block = (byte*)scratch_alloc(block_size * sizeof(byte));
 	
 	// Set up IV
-	byte* previous_ct = clone_buffer(iv, iv_size);
+	byte* previous_ct = scratch_clone(iv, iv_size);
 	
 	unsigned int i = 0;
 	while (i < input->buffer_len) {
@@ -393,7 +413,7 @@ void CFB_decrypt(block_func encryptor, buffered_container* input, buffered_conta
 		
 		// The final block is encrypted here, this block does not need to be
 		// the full block size
-		if (i == input->buffer_len && input->buffer_len != BUFFER_SIZE) {
+		if (i == input->buffer_len && input->eof) {
 			// Do encryption on previous output
 			encryptor(previous_ct, block_size, key, key_size);
 			
@@ -417,18 +437,18 @@ void CFB_decrypt(block_func encryptor, buffered_container* input, buffered_conta
 		}
 	}
 	
-	free(block);
-	free(previous_ct);
+	scratch_free(block);
+	scratch_free(previous_ct);
 	bc_flush(output);
 }
 
 void OFB_encrypt(block_func encryptor, buffered_container* input, buffered_container* output,
 	const byte* iv, const size_t iv_size, const size_t block_size, const byte* key, const size_t key_size) {
 	
-	byte* block = (byte*)malloc(block_size * sizeof(byte));
+	byte* block = (byte*)scratch_alloc(block_size * sizeof(byte));
 	
 	// Set up IV
-	byte* e_output = clone_buffer(iv, iv_size);
+	byte* e_output = scratch_clone(iv, iv_size);
 	
 	unsigned int i = 0;
 	while (i < input->buffer_len) {
@@ -452,7 +472,7 @@ void OFB_encrypt(block_func encryptor, buffered_container* input, buffered_conta
 		
 		// The final block is encrypted here, this block does not need to be
 		// the full block size
-		if (i == input->buffer_len && input->buffer_len != BUFFER_SIZE) {
+		if (i == input->buffer_len && input->eof) {
 			// Do encryption on previous output
 			encryptor(e_output, block_size, key, key_size);
 			
@@ -476,8 +496,8 @@ void OFB_encrypt(block_func encryptor, buffered_container* input, buffered_conta
 		}
 	}
 	
-	free(block);
-	free(e_output);
+	scratch_free(block);
+	scratch_free(e_output);
 	bc_flush(output);
 }
 
@@ -493,11 +513,11 @@ void CTR_encrypt(block_func encryptor, buffered_container* input, buffered_conta
 	
 	assert(iv_size == block_size);
 	
-	byte* block = (byte*)malloc(block_size * sizeof(byte));
+	byte* block = (byte*)scratch_alloc(block_size * sizeof(byte));
 	
 	// Set up IV
-	byte* counter = clone_buffer(iv, iv_size);
-	byte* counter_cpy = (byte*)malloc(block_size * sizeof(byte));
+	byte* counter = scratch_clone(iv, iv_size);
+	byte* counter_cpy = (byte*)scratch_alloc(block_size * sizeof(byte));
 	
 	unsigned int i = 0;
 	while (i < input->buffer_len) {
@@ -522,7 +542,7 @@ void CTR_encrypt(block_func encryptor, buffered_container* input, buffered_conta
 		
 		// The final block is encrypted here, this block does not need to be
 		// the full block size
-		if (i == input->buffer_len && input->buffer_len != BUFFER_SIZE) {
+		if (i == input->buffer_len && input->eof) {
 			// Do encryption on counter
 			encryptor(counter, block_size, key, key_size);
 			
@@ -546,9 +566,9 @@ void CTR_encrypt(block_func encryptor, buffered_container* input, buffered_conta
 		}
 	}
 	
-	free(block);
-	free(counter);
-	free(counter_cpy);
+	scratch_free(block);
+	scratch_free(counter);
+	scratch_free(counter_cpy);
 	bc_flush(output);
 }
 
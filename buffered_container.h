@@ -1,12 +1,22 @@
 #ifndef BUFFERED_CONTAINER_H
 #define BUFFERED_CONTAINER_H
 
-#define BUFFER_SIZE 4096
+#define DEFAULT_BUFFER_SIZE (1 << 16)
+#define BUFFER_ALIGNMENT 64
+#define DIRECT_ALIGNMENT 4096
 #define CHUNK_SIZE 6
-#define MAX_FLUSH_SIZE (BUFFER_SIZE / CHUNK_SIZE) * CHUNK_SIZE // 4092
+#define ASYNC_DEPTH 4
+#define DECODE_REFILL 64
+#define STREAM_THRESHOLD (8 << 20)
+#define BC_MAX_OPENED 8				// Regular files remembered for bc_track_file
+
+#define ERROR_ENCODED_INPUT_INVALID "Error: input is not valid %s.\n"
+#define ERROR_SAME_FILE             "Error: \"%s\" is both read and written, which would destroy it (use --in-place).\n"
+#define ERROR_MAP_SHRANK            "Error: a file shrank while it was mapped into memory.\n"
 
 #define OUTPUT_FILE "w+"
 #define INPUT_FILE "r"
+#define IN_PLACE_FILE "r+"
 #define NO_FILE ""
 
 #define PRINT_HEX 0
@@ -14,115 +24,1230 @@
 #define NO_PRINT 2
 #define PRINT_BASE64 3
 
+#define STREAM_AUTO 0
+#define STREAM_ON 1
+#define STREAM_OFF 2
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/types.h>
 
+#if defined(_MSC_VER)
+  #include <malloc.h>
+#endif
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+#if defined(_WIN32)
+  #include <io.h>
+  #include <fcntl.h>
+#endif
+
+#if !defined(_WIN32)
+  #include <unistd.h>
+  #include <fcntl.h>
+  #include <errno.h>
+  #include <signal.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+#endif
+
+#if defined(__linux__)
+  #include <errno.h>
+  #include "uring.h"
+  #define BC_ASYNC
+#endif
+
 #include "util.h"
 #include "types.h"
+#include "journal.h"
+#include "arena.h"
+
+#define ASYNC_NONE ASYNC_DEPTH
 
+enum async_state { ASYNC_IDLE, ASYNC_BUSY, ASYNC_READY };
+typedef enum async_state async_state;
+
+#if defined(BC_ASYNC)
+// A container doing its file I/O through io_uring. Several buffers rotate so
+// that reads ahead of, and writes behind, the buffer in use are in flight
+// while the cipher works.
+typedef struct bc_async {
+	uring ring;
+	int fd;
+	bool is_input;
+	bool seekable;
+	bool registered;			// Buffers are registered with the ring
+	bool eof;
+	unsigned long long offset;	// File offset of the next read or write
+	
+	byte* buffers[ASYNC_DEPTH];
+	async_state state[ASYNC_DEPTH];
+	size_t lens[ASYNC_DEPTH];	// Bytes read into, or to write from, each buffer
+	size_t done[ASYNC_DEPTH];	// Bytes of each buffer already written
+	unsigned long long offsets[ASYNC_DEPTH];
+	
+	unsigned int in_flight;
+	unsigned int current;		// Buffer the container is using
+	unsigned int next_submit;	// Next buffer to read into, reads go in order
+	unsigned int handout;		// Next buffer bc_rnext hands out
+} bc_async;
+#endif
+
+// Streaming state for HEX and BASE64 encoded input. Encoded characters are
+// read into the container's staging area, with whitespace removed, and
+// decoded from there into the buffer.
 typedef struct {
-	byte buffer[BUFFER_SIZE];
+	size_t len;			// Characters in the staging area
+	size_t pos;			// Next character to decode
+	bool eof;			// Nothing more to read from the file
+	bool padded;		// A padded base64 group ended the data
+	byte carry[3];		// Decoded bytes that did not fit in the last buffer
+	size_t carry_len;
+} bc_decoder;
+
+typedef struct {
+	byte* buffer;		// Current data, either storage or a window into map
 	size_t buffer_len;
+	size_t buffer_size;	// Capacity of the buffer
+	bool eof;			// There is no more input after the current buffer
+	bool direct;		// Opened with --direct-io, reads and writes bypass stdio
+	bool trim;			// Output was preallocated, cut back to what was written at close
+	bool stream;		// Output is written with non-temporal stores, see stream_copy
+	size_t flush_size;	// Output is flushed once this many bytes are buffered
+	byte* storage;		// The container's own allocation
+	byte* map;			// Memory mapped input file, or preallocated output file
+	size_t map_len;
+	size_t map_pos;		// Offset in map of the next window, or of the next write
+	struct bc_async* async;	// io_uring state, when --async-io is used
+	journal_t* journal;	// Crash safety for --in-place output
+	char* encoded;		// Staging for HEX and BASE64 output, or input
+	bc_decoder* decoder;	// Set for HEX and BASE64 encoded input
 	FILE* fd;
 	unsigned int pf;
 } buffered_container;
 
-buffered_container* bc_new(unsigned int printformat) {
-	buffered_container* bc = (buffered_container*)malloc(sizeof(buffered_container));
+// Size of the buffers for new containers, set with --buffer-size
+size_t bc_buffer_size = DEFAULT_BUFFER_SIZE;
+
+// If file containers should use io_uring, set with --async-io
+bool bc_use_async = false;
+
+// If files should be opened with O_DIRECT, set with --direct-io
+bool bc_use_direct = false;
+
+// If output files should be allocated up front, set with --preallocate
+bool bc_use_preallocate = false;
+
+// When output is written with non-temporal stores, set with --stream-stores
+int bc_stream_mode = STREAM_AUTO;
+
+// The size of the last level cache, or STREAM_THRESHOLD if it is not known
+size_t bc_cache_size(void) {
+	#if defined(_SC_LEVEL3_CACHE_SIZE)
+	long size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+	if (size > 0) {
+		return (size_t)size;
+	}
+	#endif
+	
+	return STREAM_THRESHOLD;
+}
+
+// If output going to a buffer or mapping of size bytes should bypass the
+// cache. Once the buffer is bigger than the last level cache, the start of it
+// has been evicted by the time it is flushed, and filling it only pushes out
+// the key schedule, the input and everything else the cipher still needs.
+bool bc_streams(const size_t size) {
+	if (bc_stream_mode == STREAM_AUTO) {
+		return size >= bc_cache_size();
+	}
+	
+	return bc_stream_mode == STREAM_ON;
+}
+
+// Copies len bytes to dst with non-temporal stores where the destination is
+// aligned for them, and plain ones for the rest. The stores are weakly ordered,
+// stream_fence must be called before anything else reads dst.
+void stream_copy(byte* dst, const byte* src, const size_t len) {
+	size_t i = 0;
+	
+	#if defined(__SSE2__)
+	// Plain stores up to the first 16 byte boundary
+	i = (16 - ((uintptr_t)dst & 15)) & 15;
+	if (i > len) {
+		i = len;
+	}
+	
+	memcpy(dst, src, i);
+	
+	#if defined(__AVX2__)
+	if (((uintptr_t)&dst[i] & 31) != 0 && i + 16 <= len) {
+		_mm_stream_si128((__m128i*)&dst[i], _mm_loadu_si128((const __m128i*)&src[i]));
+		i += 16;
+	}
+	
+	for (; i + 32 <= len; i += 32) {
+		_mm256_stream_si256((__m256i*)&dst[i], _mm256_loadu_si256((const __m256i*)&src[i]));
+	}
+	#endif
+	
+	for (; i + 16 <= len; i += 16) {
+		_mm_stream_si128((__m128i*)&dst[i], _mm_loadu_si128((const __m128i*)&src[i]));
+	}
+	#endif
+	
+	memcpy(&dst[i], &src[i], len - i);
+}
+
+void stream_fence(void) {
+	#if defined(__SSE2__)
+	_mm_sfence();
+	#endif
+}
+
+// Rounds a buffer size up to a whole number of BUFFER_ALIGNMENT blocks. This
+// also keeps it a multiple of every cipher block size.
+size_t bc_round_size(size_t);
+inline size_t bc_round_size(size_t size) {
+	if (size < BUFFER_ALIGNMENT) {
+		return BUFFER_ALIGNMENT;
+	}
+	
+	return (size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+}
+
+byte* bc_alloc_buffer(const size_t size) {
+	void* buffer = NULL;
+	
+	// O_DIRECT needs buffers on a sector boundary
+	size_t alignment = bc_use_direct ? DIRECT_ALIGNMENT : BUFFER_ALIGNMENT;
+	
+	buffer = arena_alloc(&run_arena, size, alignment);
+	if (buffer != NULL) {
+		return (byte*)buffer;
+	}
+	
+	#if defined(_MSC_VER)
+	buffer = _aligned_malloc(size, alignment);
+	#else
+	if (posix_memalign(&buffer, alignment, size) != 0) {
+		buffer = NULL;
+	}
+	#endif
+	
+	if (buffer == NULL) {
+		fprintf(stderr, "Error: could not allocate a %lu byte buffer.\n", (unsigned long)size);
+		exit(1);
+	}
+	
+	return (byte*)buffer;
+}
+
+void bc_free_buffer(byte* buffer) {
+	if (arena_owns(&run_arena, buffer)) {
+		return;
+	}
+	
+	#if defined(_MSC_VER)
+	_aligned_free(buffer);
+	#else
+	free(buffer);
+	#endif
+}
+
+#if defined(BC_ASYNC)
+void bc_async_queue(bc_async* a, const unsigned int k, const size_t from, const size_t len) {
+	unsigned long long offset = a->seekable ? a->offsets[k] + from : (unsigned long long)-1;
+	int op = a->is_input ? IORING_OP_READ : IORING_OP_WRITE;
+	
+	uring_queue_rw(&a->ring, op, a->fd, &a->buffers[k][from], len, offset,
+		a->registered ? (int)k : -1, k);
+	
+	a->in_flight++;
+}
+
+// Waits for one read or write to finish. Short reads and writes are continued
+// until the buffer is full or written, so the container only ever sees whole
+// buffers, except at the very end of the input.
+void bc_async_complete(buffered_container* bc) {
+	bc_async* a = bc->async;
+	struct io_uring_cqe cqe;
+	
+	uring_wait(&a->ring, &cqe);
+	a->in_flight--;
+	
+	unsigned int k = cqe.user_data;
+	
+	if (cqe.res < 0) {
+		errno = -cqe.res;
+		perror(a->is_input ? "File read error" : "File writing error");
+		exit(1);
+	}
+	
+	if (a->is_input) {
+		a->lens[k] += cqe.res;
+		
+		if (cqe.res == 0) {
+			a->eof = true;
+		} else if (a->lens[k] < bc->buffer_size) {
+			bc_async_queue(a, k, a->lens[k], bc->buffer_size - a->lens[k]);
+			uring_submit(&a->ring, 0);
+			return;
+		}
+	} else {
+		a->done[k] += cqe.res;
+		
+		if (a->done[k] < a->lens[k]) {
+			bc_async_queue(a, k, a->done[k], a->lens[k] - a->done[k]);
+			uring_submit(&a->ring, 0);
+			return;
+		}
+	}
+	
+	a->state[k] = a->is_input ? ASYNC_READY : ASYNC_IDLE;
+}
+
+void bc_async_drain(buffered_container* bc) {
+	while (bc->async->in_flight > 0) {
+		bc_async_complete(bc);
+	}
+}
+
+// Starts reads into free buffers, in order. A pipe only has one read in
+// flight, as reads from it could otherwise complete out of order.
+void bc_async_fill(buffered_container* bc) {
+	bc_async* a = bc->async;
+	unsigned int max_in_flight = a->seekable ? ASYNC_DEPTH - 1 : 1;
+	
+	while (!a->eof && a->in_flight < max_in_flight && a->state[a->next_submit] == ASYNC_IDLE) {
+		unsigned int k = a->next_submit;
+		
+		a->state[k] = ASYNC_BUSY;
+		a->lens[k] = 0;
+		a->offsets[k] = a->offset;
+		a->offset += bc->buffer_size;
+		
+		bc_async_queue(a, k, 0, bc->buffer_size);
+		a->next_submit = (k + 1) % ASYNC_DEPTH;
+	}
+	
+	uring_submit(&a->ring, 0);
+}
+
+int bc_async_rnext(buffered_container* bc) {
+	bc_async* a = bc->async;
+	
+	// The buffer we were using can be read into again
+	if (a->current != ASYNC_NONE) {
+		a->state[a->current] = ASYNC_IDLE;
+		a->current = ASYNC_NONE;
+	}
+	
+	bc_async_fill(bc);
+	
+	unsigned int k = a->handout;
+	while (a->state[k] == ASYNC_BUSY) {
+		bc_async_complete(bc);
+	}
+	
+	if (a->state[k] == ASYNC_IDLE) {
+		// Never read into, the input had already ended
+		bc->buffer_len = 0;
+		bc->eof = true;
+		return 0;
+	}
+	
+	a->current = k;
+	a->handout = (k + 1) % ASYNC_DEPTH;
+	
+	bc->buffer = a->buffers[k];
+	bc->buffer_len = a->lens[k];
+	bc->eof = a->lens[k] < bc->buffer_size;
+	
+	// Keep reading ahead while the cipher works on this buffer
+	bc_async_fill(bc);
+	
+	return bc->buffer_len;
+}
+
+void bc_async_rewind(buffered_container* bc) {
+	bc_async* a = bc->async;
+	
+	if (!a->seekable) {
+		fprintf(stderr, "Error rewinding input: input is not seekable.\n");
+		exit(1);
+	}
+	
+	bc_async_drain(bc);
+	
+	for (unsigned int k = 0; k < ASYNC_DEPTH; k++) {
+		a->state[k] = ASYNC_IDLE;
+	}
+	
+	a->eof = false;
+	a->offset = 0;
+	a->current = ASYNC_NONE;
+	a->next_submit = 0;
+	a->handout = 0;
+}
+
+// Sends the buffer off to be written and moves on to the next free one. Pipes
+// wait for the previous write first, to keep the output in order.
+void bc_async_flush(buffered_container* bc) {
+	bc_async* a = bc->async;
+	unsigned int k = a->current;
+	
+	if (!a->seekable) {
+		bc_async_drain(bc);
+	}
+	
+	a->state[k] = ASYNC_BUSY;
+	a->lens[k] = bc->buffer_len;
+	a->done[k] = 0;
+	a->offsets[k] = a->offset;
+	a->offset += bc->buffer_len;
+	
+	bc_async_queue(a, k, 0, bc->buffer_len);
+	uring_submit(&a->ring, 0);
+	
+	k = (k + 1) % ASYNC_DEPTH;
+	while (a->state[k] == ASYNC_BUSY) {
+		bc_async_complete(bc);
+	}
+	
+	a->current = k;
+	bc->buffer = a->buffers[k];
+}
+#endif
+
+// Moves a file container over to io_uring. Returns false, leaving it on
+// blocking stdio, if --async-io is off or io_uring is not available.
+bool bc_async_start(buffered_container* bc, const bool is_input) {
+	#if defined(BC_ASYNC)
+	if (!bc_use_async || bc->pf != NO_PRINT || bc->direct) {
+		return false;
+	}
+	
+	bc_async* a = (bc_async*)calloc(1, sizeof(bc_async));
+	assert(a != NULL);
+	
+	if (!uring_init(&a->ring, ASYNC_DEPTH * 2)) {
+		free(a);
+		return false;
+	}
+	
+	a->fd = fileno(bc->fd);
+	a->is_input = is_input;
+	
+	struct stat st;
+	off_t position = lseek(a->fd, 0, SEEK_CUR);
+	a->seekable = fstat(a->fd, &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) && position >= 0;
+	a->offset = a->seekable ? position : 0;
+	
+	struct iovec iovecs[ASYNC_DEPTH];
+	for (unsigned int k = 0; k < ASYNC_DEPTH; k++) {
+		a->buffers[k] = k == 0 ? bc->storage : bc_alloc_buffer(bc->buffer_size);
+		a->state[k] = ASYNC_IDLE;
+		
+		iovecs[k].iov_base = a->buffers[k];
+		iovecs[k].iov_len = bc->buffer_size;
+	}
+	
+	// Registration can fail on a low locked memory limit, plain reads and
+	// writes still work then
+	a->registered = uring_register_buffers(&a->ring, iovecs, ASYNC_DEPTH);
+	
+	a->current = is_input ? ASYNC_NONE : 0;
+	bc->buffer = a->buffers[0];
+	bc->async = a;
+	return true;
+	#else
+	return false;
+	#endif
+}
+
+// Waits for outstanding writes and shuts io_uring down
+void bc_async_stop(buffered_container* bc) {
+	#if defined(BC_ASYNC)
+	if (bc->async == NULL) {
+		return;
+	}
+	
+	bc_async_drain(bc);
+	uring_exit(&bc->async->ring);
+	
+	for (unsigned int k = 1; k < ASYNC_DEPTH; k++) {
+		bc_free_buffer(bc->async->buffers[k]);
+	}
+	
+	bc->buffer = bc->storage;
+	free(bc->async);
+	bc->async = NULL;
+	#endif
+}
+
+buffered_container* bc_alloc(const size_t size, unsigned int printformat) {
+	buffered_container* bc = (buffered_container*)scratch_alloc(sizeof(buffered_container));
+	
+	bc->buffer_size = bc_round_size(size);
+	bc->storage = bc_alloc_buffer(bc->buffer_size);
+	bc->buffer = bc->storage;
 	bc->buffer_len = 0;
+	bc->eof = true;
+	bc->direct = false;
+	bc->trim = false;
+	bc->stream = bc_streams(bc->buffer_size);
+	bc->map = NULL;
+	bc->map_len = 0;
+	bc->map_pos = 0;
+	bc->async = NULL;
+	bc->journal = NULL;
+	bc->decoder = NULL;
 	bc->fd = NULL;
 	bc->pf = printformat;
+	
+	// Encoded output must be flushed on a chunk edge, so base64 never needs
+	// padding in the middle of the data. Everything else can use the whole buffer.
+	if (printformat == PRINT_HEX || printformat == PRINT_BASE64) {
+		bc->flush_size = (bc->buffer_size / CHUNK_SIZE) * CHUNK_SIZE;
+		
+		// Hex doubles the size, base64 grows it by a third plus padding
+		bc->encoded = (char*)scratch_alloc(2 * bc->buffer_size + BUFFER_ALIGNMENT);
+	} else {
+		bc->flush_size = bc->buffer_size;
+		bc->encoded = NULL;
+	}
+	
 	return bc;
 }
 
+void bc_free(buffered_container* bc) {
+	bc_async_stop(bc);
+	
+	#if !defined(_WIN32)
+	if (bc->map != NULL) {
+		munmap(bc->map, bc->map_len);
+	}
+	#endif
+	
+	bc_free_buffer(bc->storage);
+	scratch_free(bc->encoded);
+	scratch_free(bc->decoder);
+	scratch_free(bc);
+}
+
+buffered_container* bc_new(unsigned int printformat) {
+	return bc_alloc(bc_buffer_size, printformat);
+}
+
 buffered_container* bc_from_str(const char* str, unsigned int printformat) {
 	assert(str != NULL);
 	
+	// Literals get room to spare, so there is always space to pad them
 	size_t len = strlen(str);
-	if (len > BUFFER_SIZE) {
-		printf("Error: input as a string literal must be less than %d bytes. For longer inputs, use a file instead.\n", BUFFER_SIZE);
-		exit(1);
-	}
+	size_t size = len + BUFFER_ALIGNMENT > bc_buffer_size ? len + BUFFER_ALIGNMENT : bc_buffer_size;
 	
-	buffered_container* bc = (buffered_container*)malloc(sizeof(buffered_container));
+	buffered_container* bc = bc_alloc(size, printformat);
 	memcpy(bc->buffer, str, len);
 	bc->buffer_len = len;
-	bc->fd = NULL;
-	bc->pf = printformat;
 	return bc;
 }
 
+// Makes an input container decode HEX or BASE64, following its print format
+void bc_decode_start(buffered_container* bc) {
+	bc->decoder = (bc_decoder*)scratch_alloc(sizeof(bc_decoder));
+	memset(bc->decoder, 0, sizeof(bc_decoder));
+}
+
+// Reads more encoded characters into the staging area, dropping whitespace
+void bc_decode_refill(buffered_container* bc) {
+	bc_decoder* d = bc->decoder;
+	
+	memmove(bc->encoded, &bc->encoded[d->pos], d->len - d->pos);
+	d->len -= d->pos;
+	d->pos = 0;
+	
+	size_t want = 2 * bc->buffer_size - d->len;
+	size_t got = fread(&bc->encoded[d->len], 1, want, bc->fd);
+	if (ferror(bc->fd) != 0) {
+		perror("File read error");
+		exit(1);
+	}
+	
+	d->eof = got < want;
+	
+	char* chars = &bc->encoded[d->len];
+	size_t kept = 0;
+	for (size_t i = 0; i < got; i++) {
+		char c = chars[i];
+		chars[kept] = c;
+		kept += c != ' ' && c != '\n' && c != '\r' && c != '\t';
+	}
+	
+	d->len += kept;
+}
+
+// Fills the buffer with decoded input. Whole groups of characters are decoded
+// straight into the buffer, and a base64 group that does not fit at the end
+// leaves its extra bytes in carry for the next buffer.
+int bc_decode_next(buffered_container* bc) {
+	bc_decoder* d = bc->decoder;
+	
+	bool hex = bc->pf == PRINT_HEX;
+	size_t group = hex ? 2 : 4;
+	size_t group_bytes = hex ? 1 : 3;
+	
+	memcpy(bc->buffer, d->carry, d->carry_len);
+	size_t out = d->carry_len;
+	d->carry_len = 0;
+	
+	while (out < bc->buffer_size) {
+		while (d->len - d->pos < DECODE_REFILL && !d->eof) {
+			bc_decode_refill(bc);
+		}
+		
+		size_t groups = (d->len - d->pos) / group;
+		if (groups == 0) {
+			break;
+		}
+		
+		// Nothing may follow padding
+		if (d->padded) {
+			fprintf(stderr, ERROR_ENCODED_INPUT_INVALID, "BASE64");
+			exit(1);
+		}
+		
+		size_t fit = (bc->buffer_size - out) / group_bytes;
+		byte partial[3];
+		byte* dst = &bc->buffer[out];
+		
+		if (fit == 0) {
+			// Decode one group aside, and split it over this buffer and the next
+			dst = partial;
+			groups = 1;
+		} else if (groups > fit) {
+			groups = fit;
+		}
+		
+		const char* src = &bc->encoded[d->pos];
+		size_t got = hex ? decode_hex(dst, src, groups * group) : decode_base64(dst, src, groups * group);
+		
+		if (got == (size_t)-1) {
+			fprintf(stderr, ERROR_ENCODED_INPUT_INVALID, hex ? "HEX" : "BASE64");
+			exit(1);
+		}
+		
+		d->pos += groups * group;
+		d->padded = got < groups * group_bytes;
+		
+		if (dst == partial) {
+			size_t used = bc->buffer_size - out < got ? bc->buffer_size - out : got;
+			memcpy(&bc->buffer[out], partial, used);
+			memcpy(d->carry, &partial[used], got - used);
+			d->carry_len = got - used;
+			out += used;
+		} else {
+			out += got;
+		}
+	}
+	
+	// Characters left over that do not make a whole group
+	if (out < bc->buffer_size && d->len != d->pos) {
+		fprintf(stderr, ERROR_ENCODED_INPUT_INVALID, hex ? "HEX" : "BASE64");
+		exit(1);
+	}
+	
+	bc->buffer_len = out;
+	bc->eof = out < bc->buffer_size;
+	return out;
+}
+
+#if !defined(_WIN32)
+// Regular files opened so far, so an output that is also an input is refused
+// before it is truncated, whichever of them was given first
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	bool input;
+} bc_opened_file;
+
+bc_opened_file bc_opened[BC_MAX_OPENED];
+unsigned int bc_opened_count = 0;
+
+// Exits if the file is already open the other way, otherwise remembers it
+void bc_track_file(const char* fname, const struct stat* st, const bool input) {
+	if (!S_ISREG(st->st_mode)) {
+		return;
+	}
+	
+	for (unsigned int i = 0; i < bc_opened_count; i++) {
+		if (bc_opened[i].dev == st->st_dev && bc_opened[i].ino == st->st_ino && bc_opened[i].input != input) {
+			fprintf(stderr, ERROR_SAME_FILE, fname);
+			exit(1);
+		}
+	}
+	
+	if (bc_opened_count < BC_MAX_OPENED) {
+		bc_opened_file f = { st->st_dev, st->st_ino, input };
+		bc_opened[bc_opened_count++] = f;
+	}
+}
+
+// A mapped file that shrinks faults on the pages past its new end. That
+// cannot be recovered from, but is reported instead of crashing.
+void bc_map_lost(int sig) {
+	(void)sig;
+	
+	static const char message[] = ERROR_MAP_SHRANK;
+	if (write(STDERR_FILENO, message, sizeof(message) - 1) < 0) {
+		// Exiting anyway
+	}
+	
+	_exit(1);
+}
+#endif
+
+// Opens a file for a container, with O_DIRECT if --direct-io was given and
+// the file system supports it
+FILE* bc_open(buffered_container* bc, const char* fname, const char* mode) {
+	FILE* file = NULL;
+	
+	#if !defined(_WIN32)
+	bool input = strcmp(mode, INPUT_FILE) == 0;
+	struct stat st;
+	
+	// An output is checked before it is opened, which truncates it
+	bool existed = !input && stat(fname, &st) == 0;
+	if (existed) {
+		bc_track_file(fname, &st, false);
+	}
+	#endif
+	
+	#if defined(O_DIRECT)
+	if (bc_use_direct && bc->pf == NO_PRINT) {
+		int flags = strcmp(mode, INPUT_FILE) == 0 ? O_RDONLY : O_RDWR | O_CREAT | O_TRUNC;
+		int fd = open(fname, flags | O_DIRECT, 0666);
+		
+		if (fd >= 0) {
+			bc->direct = true;
+		} else if (errno == EINVAL) {
+			fd = open(fname, flags, 0666);
+		}
+		
+		file = fd >= 0 ? fdopen(fd, mode) : NULL;
+	} else {
+		file = fopen(fname, mode);
+	}
+	#else
+	file = fopen(fname, mode);
+	#endif
+	
+	if (file == NULL) {
+		perror("Error opening file");
+		exit(1);
+	}
+	
+	#if !defined(_WIN32)
+	if (!existed && fstat(fileno(file), &st) == 0) {
+		bc_track_file(fname, &st, input);
+	}
+	#endif
+	
+	return file;
+}
+
+#if defined(O_DIRECT)
+// Drops O_DIRECT for the rest of the file, once an unaligned tail is reached.
+// Reads and writes still bypass stdio.
+void bc_direct_off(buffered_container* bc) {
+	int fd = fileno(bc->fd);
+	int flags = fcntl(fd, F_GETFL);
+	
+	if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) == -1) {
+		perror("File error");
+		exit(1);
+	}
+}
+#endif
+
+// Fills the buffer with read calls. O_DIRECT reads of whole aligned buffers
+// only come back short at the end of the file. If one does come back short
+// before that, the next read would be unaligned, so O_DIRECT is dropped.
+int bc_direct_read(buffered_container* bc) {
+	#if defined(O_DIRECT)
+	int fd = fileno(bc->fd);
+	size_t got = 0;
+	
+	while (got < bc->buffer_size) {
+		ssize_t n = read(fd, &bc->buffer[got], bc->buffer_size - got);
+		
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		
+		if (n < 0 && errno == EINVAL && got % DIRECT_ALIGNMENT != 0) {
+			bc_direct_off(bc);
+			continue;
+		}
+		
+		if (n < 0) {
+			perror("File read error");
+			exit(1);
+		}
+		
+		if (n == 0) {
+			break;
+		}
+		
+		got += n;
+	}
+	
+	bc->buffer_len = got;
+	bc->eof = got < bc->buffer_size;
+	return got;
+	#else
+	return 0;
+	#endif
+}
+
+// Writes the buffer with write calls. Whole sectors go straight to disk, and
+// an unaligned tail, such as the end of the output, goes through the page
+// cache once O_DIRECT is dropped.
+void bc_direct_write(buffered_container* bc) {
+	#if defined(O_DIRECT)
+	int fd = fileno(bc->fd);
+	size_t done = 0;
+	
+	while (done < bc->buffer_len) {
+		size_t n = (bc->buffer_len - done) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+		
+		if (n == 0 || done % DIRECT_ALIGNMENT != 0) {
+			bc_direct_off(bc);
+			n = bc->buffer_len - done;
+		}
+		
+		ssize_t put = write(fd, &bc->buffer[done], n);
+		
+		if (put < 0 && errno == EINTR) {
+			continue;
+		}
+		
+		if (put <= 0) {
+			perror("File writing error");
+			exit(1);
+		}
+		
+		done += put;
+	}
+	#endif
+}
+
+#if defined(__linux__)
+// Maps size bytes of a preallocated output file, for bc_sink_write
+bool bc_sink_map(buffered_container* bc, const unsigned long long size) {
+	if (size > (size_t)-1) {
+		return false;
+	}
+	
+	void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(bc->fd), 0);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	
+	madvise(map, size, MADV_SEQUENTIAL);
+	signal(SIGBUS, bc_map_lost);
+	
+	bc->map = (byte*)map;
+	bc->map_len = size;
+	return true;
+}
+
+// Copies the buffer into the mapped output. If the size was underestimated
+// the file is extended and mapped again, at least doubling each time.
+void bc_sink_write(buffered_container* bc) {
+	if (bc->buffer_len > bc->map_len - bc->map_pos) {
+		unsigned long long size = (unsigned long long)bc->map_len * 2;
+		if (size < bc->map_pos + bc->buffer_len) {
+			size = bc->map_pos + bc->buffer_len;
+		}
+		
+		munmap(bc->map, bc->map_len);
+		bc->map = NULL;
+		
+		if (fallocate(fileno(bc->fd), 0, 0, size) != 0 || !bc_sink_map(bc, size)) {
+			perror("File writing error");
+			exit(1);
+		}
+	}
+	
+	// Nothing reads the mapping back, so a large one is written past the cache
+	if (bc_streams(bc->map_len)) {
+		stream_copy(&bc->map[bc->map_pos], bc->buffer, bc->buffer_len);
+		stream_fence();
+	} else {
+		memcpy(&bc->map[bc->map_pos], bc->buffer, bc->buffer_len);
+	}
+	
+	bc->map_pos += bc->buffer_len;
+}
+
+// Cuts a preallocated output back to the bytes that were actually written,
+// such as when padding turned out shorter than the block reserved for it
+void bc_trim(buffered_container* bc) {
+	off_t end;
+	
+	if (bc->map != NULL) {
+		end = bc->map_pos;
+		munmap(bc->map, bc->map_len);
+		bc->map = NULL;
+	} else {
+		fflush(bc->fd);
+		end = lseek(fileno(bc->fd), 0, SEEK_CUR);
+	}
+	
+	if (end < 0 || ftruncate(fileno(bc->fd), end) != 0) {
+		perror("File writing error");
+		exit(1);
+	}
+	
+	bc->trim = false;
+}
+#endif
+
+// Loads the next buffer of input. Every buffer is filled completely except
+// the last, however the underlying reads come back, so ciphers can rely on
+// blocks never straddling a buffer edge. eof is set once the buffer holds the
+// end of the input.
 int bc_rnext(buffered_container* src) {
+	#if defined(BC_ASYNC)
+	if (src->async != NULL) {
+		return bc_async_rnext(src);
+	}
+	#endif
+	
+	if (src->decoder != NULL) {
+		return bc_decode_next(src);
+	}
+	
+	if (src->map != NULL) {
+		size_t remaining = src->map_len - src->map_pos;
+		
+		if (remaining >= src->buffer_size) {
+			// Hand out the mapping itself, no copy needed
+			src->buffer = &src->map[src->map_pos];
+			src->buffer_len = src->buffer_size;
+		} else {
+			// The final partial window is copied into storage, which leaves
+			// room after it for padding
+			src->buffer = src->storage;
+			memcpy(src->buffer, &src->map[src->map_pos], remaining);
+			src->buffer_len = remaining;
+		}
+		
+		src->map_pos += src->buffer_len;
+		src->eof = src->map_pos == src->map_len;
+		return src->buffer_len;
+	}
+	
 	if (src->fd == NULL) {
+		src->eof = true;
 		return 0;
 	}
 	
-	src->buffer_len = fread(src->buffer, 1, BUFFER_SIZE, src->fd);
+	if (src->direct) {
+		return bc_direct_read(src);
+	}
+	
+	// fread keeps reading through short reads from pipes until the buffer is
+	// full, so coming back short means the input has ended
+	src->buffer_len = fread(src->buffer, 1, src->buffer_size, src->fd);
+	if (ferror(src->fd) != 0) {
+		perror("File read error");
+		exit(1);
+	}
+	
+	src->eof = src->buffer_len < src->buffer_size;
 	return src->buffer_len;
 }
 
-buffered_container* bc_from_file(const char* fname, const char* mode, unsigned int printformat) {
-	buffered_container* bc = (buffered_container*)malloc(sizeof(buffered_container));
-	bc->fd = fopen(fname, mode);
+// Maps a regular input file into memory so bc_rnext can hand out windows of
+// it directly. Anything that can't be mapped, such as a pipe, keeps using fread.
+bool bc_map(buffered_container* bc) {
+	#if defined(_WIN32)
+	return false;
+	#else
+	struct stat st;
+	if (bc->pf != NO_PRINT || bc->direct || fstat(fileno(bc->fd), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		return false;
+	}
+	
+	if ((unsigned long long)st.st_size > (size_t)-1) {
+		return false;
+	}
+	
+	// Private and writable, so a cipher writing to its input buffer just gets
+	// its own copy of the page instead of a crash
+	void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(bc->fd), 0);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	
+	// These are only hints, it does not matter if the kernel ignores them
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	
+	#if defined(MADV_HUGEPAGE)
+	madvise(map, st.st_size, MADV_HUGEPAGE);
+	#endif
+	
+	// Another process can still truncate the file during the run
+	signal(SIGBUS, bc_map_lost);
+	
+	bc->map = (byte*)map;
+	bc->map_len = st.st_size;
+	bc->map_pos = 0;
+	return true;
+	#endif
+}
+
+// Finds how many bytes an input holds, if that is known before reading it
+bool bc_input_size(buffered_container* bc, unsigned long long* size) {
 	if (bc->fd == NULL) {
-		perror("Error opening file");
+		*size = bc->buffer_len;
+		return true;
+	}
+	
+	if (bc->map != NULL) {
+		*size = bc->map_len;
+		return true;
+	}
+	
+	#if defined(_WIN32)
+	return false;
+	#else
+	struct stat st;
+	if (bc->pf != NO_PRINT || fstat(fileno(bc->fd), &st) != 0 || !S_ISREG(st.st_mode)) {
+		return false;
+	}
+	
+	*size = st.st_size;
+	return true;
+	#endif
+}
+
+// Whether bc_rewind can go back to the start, which a pipe cannot
+bool bc_rewindable(buffered_container* bc) {
+	if (bc->fd == NULL || bc->map != NULL) {
+		return true;
+	}
+	
+	#if defined(BC_ASYNC)
+	if (bc->async != NULL) {
+		return true;
+	}
+	#endif
+	
+	return ftell(bc->fd) >= 0;
+}
+
+// Reserves space for an output file up front, so a large output is laid out
+// in one piece instead of growing a buffer at a time. Plain file outputs are
+// then written through a shared mapping of that space, which turns each flush
+// into a copy instead of a system call. Anything that is not a plain file,
+// or a file system that cannot reserve space, is written as usual.
+void bc_preallocate(buffered_container* bc, const unsigned long long size) {
+	#if defined(__linux__)
+	struct stat st;
+	if (
+		size == 0 || bc->fd == NULL || bc->pf != NO_PRINT || bc->journal != NULL ||
+		bc->async != NULL || fstat(fileno(bc->fd), &st) != 0 || !S_ISREG(st.st_mode)
+	) {
+		return;
+	}
+	
+	if (fallocate(fileno(bc->fd), 0, 0, size) != 0) {
+		if (errno == ENOSPC) {
+			perror("File writing error");
+			exit(1);
+		}
+		
+		return;
+	}
+	
+	bc->trim = true;
+	
+	// Direct I/O keeps its own writes, it only gains the reserved space
+	if (!bc->direct) {
+		bc_sink_map(bc, size);
+	}
+	#endif
+}
+
+// Goes back to the start of an input, for work that needs two passes over it
+void bc_rewind(buffered_container* bc) {
+	if (bc->map != NULL) {
+		bc->map_pos = 0;
+		bc_rnext(bc);
+		return;
+	}
+	
+	#if defined(BC_ASYNC)
+	if (bc->async != NULL) {
+		bc_async_rewind(bc);
+		bc_rnext(bc);
+		return;
+	}
+	#endif
+	
+	if (bc->fd == NULL) {
+		// Literals are always entirely in the buffer
+		return;
+	}
+	
+	if (fseek(bc->fd, 0, SEEK_SET) != 0) {
+		perror("Error rewinding input");
 		exit(1);
 	}
 	
+	if (bc->decoder != NULL) {
+		memset(bc->decoder, 0, sizeof(bc_decoder));
+	}
+	
+	bc_rnext(bc);
+}
+
+buffered_container* bc_from_file(const char* fname, const char* mode, unsigned int printformat) {
+	buffered_container* bc = bc_alloc(bc_buffer_size, printformat);
+	bc->fd = bc_open(bc, fname, mode);
+	
 	if (strcmp(mode, INPUT_FILE) == 0) {
+		if (bc->pf != NO_PRINT) {
+			bc_decode_start(bc);
+		}
+		
+		// Asked for io_uring, so that is used over mapping the file
+		else if (!bc_async_start(bc, true)) {
+			bc_map(bc);
+		}
+		
 		bc_rnext(bc);
 		if (ferror(bc->fd) != 0) {
 			perror("File read error");
 			exit(1);
 		}
+	} else {
+		bc_async_start(bc, false);
 	}
 	
-	bc->pf = printformat;
 	return bc;
 }
 
-buffered_container* bc_from_buffer(const byte* buffer, const size_t bufferlen, unsigned int printformat) {
-	assert(buffer != NULL);
+// Reads from stdin, or writes to stdout, for the STDIN and STDOUT endpoints.
+// The data is passed through as raw binary, or decoded from HEX or BASE64.
+buffered_container* bc_from_stream(FILE* stream, const bool is_input, unsigned int printformat) {
+	buffered_container* bc = bc_alloc(bc_buffer_size, printformat);
+	bc->fd = stream;
 	
-	if (bufferlen > BUFFER_SIZE) {
-		printf("Error: input as a buffer literal must be less than %d bytes. For longer inputs, use a file instead.\n", BUFFER_SIZE);
-		exit(1);
+	#if defined(_WIN32)
+	_setmode(_fileno(stream), _O_BINARY);
+	#endif
+	
+	if (is_input) {
+		if (printformat != NO_PRINT) {
+			bc_decode_start(bc);
+		} else {
+			bc_async_start(bc, true);
+		}
+		
+		bc_rnext(bc);
+	} else {
+		bc_async_start(bc, false);
 	}
 	
-	buffered_container* bc = (buffered_container*)malloc(sizeof(buffered_container));
-	memcpy(bc->buffer, buffer, bufferlen);
-	bc->buffer_len = bufferlen;
-	bc->fd = NULL;
-	bc->pf = printformat;
 	return bc;
 }
 
-void bc_fopen(buffered_container* bc, const char* fname, const char* mode) {
-	bc->fd = fopen(fname, mode);
+// Opens a file to be written back over as it is read, for --in-place. Only
+// ciphers that keep the length of the data can use this, as every write has
+// to land on bytes that have already been read.
+buffered_container* bc_in_place(const char* fname, const bool resumable) {
+	buffered_container* bc = bc_alloc(bc_buffer_size, NO_PRINT);
+	bc->fd = fopen(fname, IN_PLACE_FILE);
 	if (bc->fd == NULL) {
 		perror("Error opening file");
 		exit(1);
 	}
 	
+	bc->journal = journal_open(fname, bc->fd, resumable);
+	return bc;
+}
+
+buffered_container* bc_from_buffer(const byte* buffer, const size_t bufferlen, unsigned int printformat) {
+	assert(buffer != NULL);
+	
+	size_t size = bufferlen + BUFFER_ALIGNMENT > bc_buffer_size ? bufferlen + BUFFER_ALIGNMENT : bc_buffer_size;
+	
+	buffered_container* bc = bc_alloc(size, printformat);
+	memcpy(bc->buffer, buffer, bufferlen);
+	bc->buffer_len = bufferlen;
+	return bc;
+}
+
+void bc_fopen(buffered_container* bc, const char* fname, const char* mode) {
+	bc->fd = bc_open(bc, fname, mode);
+	
 	if (strcmp(mode, INPUT_FILE) == 0) {
+		if (bc->pf != NO_PRINT) {
+			bc_decode_start(bc);
+		}
+		
+		// Asked for io_uring, so that is used over mapping the file
+		else if (!bc_async_start(bc, true)) {
+			bc_map(bc);
+		}
+		
 		bc_rnext(bc);
+	} else {
+		bc_async_start(bc, false);
 	}
 }
 
 void bc_fclose(buffered_container* bc) {
-	if (bc->fd != NULL) {
+	bc_async_stop(bc);
+	
+	if (bc->journal != NULL) {
+		journal_close(bc->journal, bc->fd);
+		bc->journal = NULL;
+	}
+	
+	#if defined(__linux__)
+	if (bc->trim) {
+		bc_trim(bc);
+	}
+	#endif
+	
+	if (bc->fd == stdin || bc->fd == stdout) {
+		// Never close the standard streams, messages may still follow
+		fflush(bc->fd);
+		bc->fd = NULL;
+	} else if (bc->fd != NULL) {
 		fclose(bc->fd);
+		bc->fd = NULL;
 	}
 }
 
 size_t bc_extendbuffer(buffered_container* bc, unsigned int amt) {
 	unsigned int start = bc->buffer_len;
 	
-	if (bc->buffer_len + amt > BUFFER_SIZE) {
-		bc->buffer_len = BUFFER_SIZE;
+	if (bc->buffer_len + amt > bc->buffer_size) {
+		bc->buffer_len = bc->buffer_size;
 	} else {
 		bc->buffer_len += amt;
 	}
@@ -135,41 +1260,68 @@ size_t bc_extendbuffer(buffered_container* bc, unsigned int amt) {
 	return size;
 }
 
+// Writes the buffer out in the container's print format, to its file if it
+// has one or stdout otherwise. HEX and BASE64 are encoded in one go into the
+// staging area, so every flush is a single write.
 void bc_printcontents(buffered_container* bc) {
+	const char* data = (const char*)bc->buffer;
+	size_t len = bc->buffer_len;
+	
 	switch(bc->pf) {
 		case PRINT_HEX:
-			print_hex(bc->buffer, bc->buffer_len);
+			len = encode_hex(bc->encoded, bc->buffer, bc->buffer_len);
+			data = bc->encoded;
 			break;
 			
 		case PRINT_TEXT:
-			for (unsigned int i = 0; i < bc->buffer_len; i++) {
-				printf("%c", bc->buffer[i]);
-			}
-			
 			break;
 			
 		case PRINT_BASE64:
-			print_base64(bc->buffer, bc->buffer_len);
+			len = encode_base64(bc->encoded, bc->buffer, bc->buffer_len);
+			data = bc->encoded;
 			break;
 			
 		case NO_PRINT:
 			return;
 	}
 	
-	fflush(stdout);
+	FILE* out = bc->fd != NULL ? bc->fd : stdout;
+	if (fwrite(data, 1, len, out) != len) {
+		perror("File writing error");
+		exit(1);
+	}
 }
 
 void bc_flush(buffered_container* bc) {
-	if (bc->fd == NULL) {
+	if (bc->stream) {
+		stream_fence();
+	}
+	
+	if (bc->fd == NULL || bc->pf != NO_PRINT) {
 		bc_printcontents(bc);
-	} else {
+	}
+	#if defined(BC_ASYNC)
+	else if (bc->async != NULL) {
+		bc_async_flush(bc);
+	}
+	#endif
+	else if (bc->journal != NULL) {
+		journal_write(bc->journal, bc->fd, bc->buffer, bc->buffer_len);
+	}
+	else if (bc->direct) {
+		bc_direct_write(bc);
+	}
+	#if defined(__linux__)
+	else if (bc->map != NULL) {
+		bc_sink_write(bc);
+	}
+	#endif
+	else {
 		size_t s = fwrite(bc->buffer, 1, bc->buffer_len, bc->fd);
 		if (s != bc->buffer_len) {
 			perror("File writing error");
 			exit(1);
 		}
-		
-		fflush(bc->fd);
 	}
 	
 	bc->buffer_len = 0;
@@ -177,24 +1329,25 @@ void bc_flush(buffered_container* bc) {
 
 void bc_write_byte(buffered_container* bc, const byte data) {
 	
-	#if BUFFER_SIZE != MAX_FLUSH_SIZE
 	// Truncate data, flush, and then move truncated data to the start of the buffer
-	if (bc->buffer_len > MAX_FLUSH_SIZE) {
-		size_t extra_bytes = bc->buffer_len - MAX_FLUSH_SIZE;
-		bc->buffer_len = MAX_FLUSH_SIZE;
+	if (bc->buffer_len > bc->flush_size) {
+		size_t extra_bytes = bc->buffer_len - bc->flush_size;
+		byte* flushed = bc->buffer;
+		bc->buffer_len = bc->flush_size;
 		bc_flush(bc);
-		memmove(bc->buffer, &bc->buffer[MAX_FLUSH_SIZE], extra_bytes);
+		
+		// Flushing may have moved to a different buffer
+		memmove(bc->buffer, &flushed[bc->flush_size], extra_bytes);
 		bc->buffer_len = extra_bytes;
 	}
-	#endif
 	
-	if (bc->buffer_len == MAX_FLUSH_SIZE) {
+	if (bc->buffer_len == bc->flush_size) {
 		bc_flush(bc);
 	}
 	
 	bc->buffer[bc->buffer_len++] = data;
 	
-	if (bc->buffer_len == MAX_FLUSH_SIZE) {
+	if (bc->buffer_len == bc->flush_size) {
 		bc_flush(bc);
 	}
 }
@@ -207,15 +1360,15 @@ void bc_write_block(buffered_container* bc, const byte* data, const size_t block
 	
 	while (data_remaining > 0) {
 		// Check if there is free space in the buffer
-		if (bc->buffer_len < MAX_FLUSH_SIZE) {
+		if (bc->buffer_len < bc->flush_size) {
 			
 			// We want the data to be flushed on a chunk edge,
 			// determine the maximum number of bytes we can copy 
 			// into the buffer and still achieve that
 			size_t target_size = bc->buffer_len + data_remaining;
 			
-			if (target_size > BUFFER_SIZE) {
-				target_size = BUFFER_SIZE;
+			if (target_size > bc->buffer_size) {
+				target_size = bc->buffer_size;
 			}
 			
 			// We have our target size, compute how many bytes we can
@@ -224,7 +1377,11 @@ void bc_write_block(buffered_container* bc, const byte* data, const size_t block
 			
 			
 			if (copy_bytes > 0) {
-				memcpy(&bc->buffer[bc->buffer_len], &data[data_pointer], copy_bytes);
+				if (bc->stream) {
+					stream_copy(&bc->buffer[bc->buffer_len], &data[data_pointer], copy_bytes);
+				} else {
+					memcpy(&bc->buffer[bc->buffer_len], &data[data_pointer], copy_bytes);
+				}
 				bc->buffer_len += copy_bytes;
 				data_pointer += copy_bytes;
 				data_remaining -= copy_bytes;
@@ -233,21 +1390,45 @@ void bc_write_block(buffered_container* bc, const byte* data, const size_t block
 		
 		// The buffer now contains as many new bytes as possible
 		
-		#if BUFFER_SIZE != MAX_FLUSH_SIZE
 		// Truncate data and save how much we truncated, if applicable
-		if (bc->buffer_len > MAX_FLUSH_SIZE) {
-			size_t extra_bytes = bc->buffer_len - MAX_FLUSH_SIZE;
-			bc->buffer_len = MAX_FLUSH_SIZE;
+		if (bc->buffer_len > bc->flush_size) {
+			size_t extra_bytes = bc->buffer_len - bc->flush_size;
+			byte* flushed = bc->buffer;
+			bc->buffer_len = bc->flush_size;
 			bc_flush(bc);
-			memmove(bc->buffer, &bc->buffer[MAX_FLUSH_SIZE], extra_bytes);
+			
+			// Flushing may have moved to a different buffer
+			memmove(bc->buffer, &flushed[bc->flush_size], extra_bytes);
 			bc->buffer_len = extra_bytes;
 		}
-		#endif
 		
-		if (bc->buffer_len == MAX_FLUSH_SIZE) {
+		if (bc->buffer_len == bc->flush_size) {
 			bc_flush(bc);
 		}
 	}
 }
 
+// Returns a pointer to the free space at the end of the buffer, along with how
+// many bytes can be written there before the buffer must be flushed. Ciphers can
+// write their output straight into it instead of going through a scratch block.
+byte* bc_write_space(buffered_container* bc, size_t* space) {
+	if (bc->buffer_len >= bc->flush_size) {
+		bc_flush(bc);
+	}
+	
+	*space = bc->flush_size - bc->buffer_len;
+	return &bc->buffer[bc->buffer_len];
+}
+
+// Marks bytes written through bc_write_space as used
+void bc_write_commit(buffered_container* bc, const size_t amt) {
+	assert(bc->buffer_len + amt <= bc->flush_size);
+	
+	bc->buffer_len += amt;
+	
+	if (bc->buffer_len == bc->flush_size) {
+		bc_flush(bc);
+	}
+}
+
 #endif
\ No newline at end of file
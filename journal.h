@@ -0,0 +1,267 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_SUFFIX ".joelcrypto-journal"
+#define JOURNAL_MAGIC  "joelcrypto journal"
+#define JOURNAL_SPAN   (16 << 20)
+
+#define ERROR_IN_PLACE_NOT_REGULAR    "Error: --in-place needs a regular file.\n"
+#define ERROR_IN_PLACE_UNSUPPORTED    "Error: --in-place is not supported on this platform.\n"
+#define ERROR_JOURNAL_DAMAGED         "Error: journal \"%s\" is damaged.\n"
+#define ERROR_JOURNAL_NOT_RESUMABLE   "Error: an earlier in-place run on \"%s\" was interrupted. The first %llu bytes are already done, and this cipher cannot carry on from there. The original bytes after that point are in \"%s\".\n"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/types.h>
+
+#if !defined(_WIN32)
+  #include <unistd.h>
+  #include <fcntl.h>
+  #include <sys/stat.h>
+#endif
+
+#include "util.h"
+
+// Crash safety for --in-place. The file is rewritten in spans, and before a
+// span is overwritten its original bytes are saved to a journal next to the
+// file, along with the offset the span starts at. Everything before that
+// offset is already on disk. If the run is interrupted, the next run puts the
+// span back and carries on from the offset.
+//
+// The journal file is:
+//     joelcrypto journal\n
+//     <offset> <length>\n
+//     <length original bytes>
+
+typedef struct {
+	char* path;
+	int fd;							// The file being rewritten
+	unsigned long long file_size;
+	unsigned long long position;	// File offset of the next write
+	unsigned long long span_end;	// End of the span the journal covers
+	unsigned long long skip;		// Writes below this are already done
+} journal_t;
+
+#if !defined(_WIN32)
+bool journal_read_fully(const int fd, byte* buffer, const size_t len, const unsigned long long offset) {
+	size_t done = 0;
+	
+	while (done < len) {
+		ssize_t got = pread(fd, &buffer[done], len - done, offset + done);
+		if (got <= 0) {
+			return false;
+		}
+		
+		done += got;
+	}
+	
+	return true;
+}
+
+bool journal_write_fully(const int fd, const byte* buffer, const size_t len, const unsigned long long offset) {
+	size_t done = 0;
+	
+	while (done < len) {
+		ssize_t put = pwrite(fd, &buffer[done], len - done, offset + done);
+		if (put <= 0) {
+			return false;
+		}
+		
+		done += put;
+	}
+	
+	return true;
+}
+
+// Puts back the span saved by an interrupted run, returning the offset it
+// starts at. Everything from there on is then as it was originally.
+unsigned long long journal_restore(journal_t* j, FILE* old, const char* fname, const bool resumable) {
+	unsigned long long offset, len;
+	char magic[sizeof(JOURNAL_MAGIC)];
+	
+	if (
+		fread(magic, 1, sizeof(magic), old) != sizeof(magic) ||
+		memcmp(magic, JOURNAL_MAGIC "\n", sizeof(magic)) != 0 ||
+		fscanf(old, "%llu %llu", &offset, &len) != 2 ||
+		fgetc(old) != '\n'
+	) {
+		fprintf(stderr, ERROR_JOURNAL_DAMAGED, j->path);
+		exit(1);
+	}
+	
+	if (!resumable) {
+		fprintf(stderr, ERROR_JOURNAL_NOT_RESUMABLE, fname, offset, j->path);
+		exit(1);
+	}
+	
+	byte* original = (byte*)malloc(len > 0 ? len : 1);
+	assert(original != NULL);
+	
+	if (fread(original, 1, len, old) != len) {
+		fprintf(stderr, ERROR_JOURNAL_DAMAGED, j->path);
+		exit(1);
+	}
+	
+	if (!journal_write_fully(j->fd, original, len, offset) || fdatasync(j->fd) != 0) {
+		perror("File writing error");
+		exit(1);
+	}
+	
+	free(original);
+	fprintf(MESSAGES, "Resuming interrupted in-place run at byte %llu.\n", offset);
+	return offset;
+}
+#endif
+
+// Starts journaling writes to file, which has been opened for updating. If
+// an earlier run left a journal behind it is rolled back, and writes below
+// where it stopped are skipped. Ciphers whose state depends on the data before
+// the resume point cannot carry on, and pass resumable as false.
+journal_t* journal_open(const char* fname, FILE* file, const bool resumable) {
+	#if !defined(_WIN32)
+	journal_t* j = (journal_t*)calloc(1, sizeof(journal_t));
+	assert(j != NULL);
+	
+	j->path = (char*)malloc(strlen(fname) + sizeof(JOURNAL_SUFFIX));
+	assert(j->path != NULL);
+	sprintf(j->path, "%s" JOURNAL_SUFFIX, fname);
+	
+	j->fd = fileno(file);
+	
+	struct stat st;
+	if (fstat(j->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, ERROR_IN_PLACE_NOT_REGULAR);
+		exit(1);
+	}
+	
+	j->file_size = st.st_size;
+	
+	FILE* old = fopen(j->path, "rb");
+	if (old != NULL) {
+		j->skip = journal_restore(j, old, fname, resumable);
+		fclose(old);
+		
+		if (fseeko(file, j->skip, SEEK_SET) != 0) {
+			perror("File seek error");
+			exit(1);
+		}
+	}
+	
+	j->span_end = j->skip;
+	return j;
+	#else
+	fprintf(stderr, ERROR_IN_PLACE_UNSUPPORTED);
+	exit(1);
+	#endif
+}
+
+#if !defined(_WIN32)
+// Makes sure everything written so far is on disk, then saves the original
+// bytes of the next span. The new journal is written to the side and renamed
+// over the old one, so there is always one whole journal to go back to.
+void journal_next_span(journal_t* j, FILE* file) {
+	if (fflush(file) != 0 || fdatasync(j->fd) != 0) {
+		perror("File writing error");
+		exit(1);
+	}
+	
+	size_t len = JOURNAL_SPAN;
+	if (j->position >= j->file_size) {
+		len = 0;
+	} else if (j->file_size - j->position < len) {
+		len = j->file_size - j->position;
+	}
+	
+	byte* original = (byte*)malloc(len > 0 ? len : 1);
+	assert(original != NULL);
+	
+	if (!journal_read_fully(j->fd, original, len, j->position)) {
+		perror("File read error");
+		exit(1);
+	}
+	
+	char* tmp_path = (char*)malloc(strlen(j->path) + 5);
+	assert(tmp_path != NULL);
+	sprintf(tmp_path, "%s.tmp", j->path);
+	
+	FILE* tmp = fopen(tmp_path, "wb");
+	if (tmp == NULL) {
+		perror("Error opening journal");
+		exit(1);
+	}
+	
+	fprintf(tmp, JOURNAL_MAGIC "\n%llu %llu\n", j->position, (unsigned long long)len);
+	
+	if (
+		fwrite(original, 1, len, tmp) != len ||
+		fflush(tmp) != 0 ||
+		fdatasync(fileno(tmp)) != 0 ||
+		fclose(tmp) != 0 ||
+		rename(tmp_path, j->path) != 0
+	) {
+		perror("Journal writing error");
+		exit(1);
+	}
+	
+	// A write past the end of the file has nothing to save, so the span
+	// never needs to end
+	j->span_end = len > 0 ? j->position + len : (unsigned long long)-1;
+	
+	free(tmp_path);
+	free(original);
+}
+#endif
+
+// Writes data at the journal's position, saving each span before any of it
+// is overwritten
+void journal_write(journal_t* j, FILE* file, const byte* data, const size_t len) {
+	#if !defined(_WIN32)
+	size_t done = 0;
+	
+	while (done < len) {
+		size_t n = len - done;
+		
+		if (j->position < j->skip) {
+			// Already done by the interrupted run
+			if (j->skip - j->position < n) {
+				n = j->skip - j->position;
+			}
+		} else {
+			if (j->position == j->span_end) {
+				journal_next_span(j, file);
+			}
+			
+			if (j->span_end - j->position < n) {
+				n = j->span_end - j->position;
+			}
+			
+			if (fwrite(&data[done], 1, n, file) != n) {
+				perror("File writing error");
+				exit(1);
+			}
+		}
+		
+		j->position += n;
+		done += n;
+	}
+	#endif
+}
+
+// The whole file has been rewritten, so the journal is no longer needed
+void journal_close(journal_t* j, FILE* file) {
+	#if !defined(_WIN32)
+	if (fflush(file) != 0 || fdatasync(j->fd) != 0) {
+		perror("File writing error");
+		exit(1);
+	}
+	
+	remove(j->path);
+	#endif
+	
+	free(j->path);
+	free(j);
+}
+
+#endif
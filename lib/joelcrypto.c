@@ -0,0 +1,1180 @@
+// The tool compiles the library into its single translation unit, from both
+// serve.h and batch.h
+#ifndef LIB__JOELCRYPTO_C
+#define LIB__JOELCRYPTO_C
+
+// O_DIRECT is only declared by glibc with _GNU_SOURCE
+#if defined(__linux__)
+  #define _GNU_SOURCE
+#endif
+
+#define JC_MAX_CIPHER_NAME 32
+#define JC_MAX_SHIFT_TEXT 16
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/joelcrypto.h"
+
+#include "windows.h"
+#include "util.h"
+#include "buffered_container.h"
+#include "alph/util.h"
+#include "alph/vigenere.h"
+#include "block/util.h"
+#include "block/aes.h"
+#include "stream/rc4.h"
+#include "stream/xor.h"
+#include "lib/ring.h"
+
+// The cipher cores are shared with the tool, only the buffered_container
+// loops around them are replaced. A context keeps everything the loops kept in
+// locals, so data can stop and carry on at any byte.
+struct jc_ctx {
+	cipher_t cipher;
+	cmode_t mode;
+	crypto_op op;
+	bool finished;
+	
+	// AES
+	byte round_keys[AES_MAX_ROUND_KEYS];
+	byte decryption_keys[AES_MAX_ROUND_KEYS];	// From aes_decryption_keys, for the lanes
+	unsigned int rounds;
+	byte chain[AES_BLOCK_SIZE];		// CBC previous block, CFB and OFB feedback, or CTR counter
+	byte stream[AES_BLOCK_SIZE];	// CFB, OFB and CTR keystream
+	byte block[AES_BLOCK_SIZE];		// ECB and CBC partial block
+	size_t block_len;				// Bytes in block, or keystream bytes used
+	byte held[AES_BLOCK_SIZE];		// Last decrypted block, held back for its padding
+	bool have_held;
+	
+	// RC4
+	byte S[256];
+	byte i, j;
+	
+	// CAESAR and SHIFT
+	byte amount;
+	
+	// VIGENERE shifts, or the XOR key
+	byte* key;
+	size_t key_len;
+	size_t key_pos;
+	bool cycle;
+};
+
+// Clears secrets before their memory is given back. The volatile pointer keeps
+// the compiler from dropping the stores as dead.
+void jc_wipe(void* p, const size_t len) {
+	volatile byte* v = (volatile byte*)p;
+	
+	for (size_t i = 0; i < len; i++) {
+		v[i] = 0;
+	}
+}
+
+bool jc_parse_mode(const char* name, cmode_t* mode) {
+	if (strcasecmp(name, "ECB") == 0) {
+		*mode = ECB;
+	} else if (strcasecmp(name, "CBC") == 0) {
+		*mode = CBC;
+	} else if (strcasecmp(name, "CFB") == 0) {
+		*mode = CFB;
+	} else if (strcasecmp(name, "OFB") == 0) {
+		*mode = OFB;
+	} else if (strcasecmp(name, "CTR") == 0) {
+		*mode = CTR;
+	} else {
+		return false;
+	}
+	
+	return true;
+}
+
+jc_status jc_init_aes(jc_ctx* ctx, const char* size, const char* mode,
+	const byte* key, const size_t key_len, const byte* iv, const size_t iv_len) {
+	
+	size_t key_size;
+	
+	if (size == NULL || mode == NULL) {
+		return JC_ERROR_CIPHER;
+	}
+	
+	if (strcmp(size, "128") == 0) {
+		key_size = 16;
+	} else if (strcmp(size, "192") == 0) {
+		key_size = 24;
+	} else if (strcmp(size, "256") == 0) {
+		key_size = 32;
+	} else {
+		return JC_ERROR_CIPHER;
+	}
+	
+	if (!jc_parse_mode(mode, &ctx->mode)) {
+		return JC_ERROR_CIPHER;
+	}
+	
+	if (key == NULL || key_len != key_size) {
+		return JC_ERROR_KEY;
+	}
+	
+	if (ctx->mode != ECB) {
+		if (iv == NULL || iv_len != AES_BLOCK_SIZE) {
+			return JC_ERROR_IV;
+		}
+		
+		memcpy(ctx->chain, iv, AES_BLOCK_SIZE);
+	}
+	
+	key_schedule(ctx->round_keys, key, key_len);
+	ctx->rounds = aes_rounds(key_len);
+	aes_decryption_keys(ctx->decryption_keys, ctx->round_keys, ctx->rounds);
+	
+	// The stream modes start with no keystream left
+	ctx->block_len = (ctx->mode == ECB || ctx->mode == CBC) ? 0 : AES_BLOCK_SIZE;
+	
+	return JC_OK;
+}
+
+jc_status jc_init_cipher(jc_ctx* ctx, char** name, const byte* key, const size_t key_len,
+	const byte* iv, const size_t iv_len) {
+	
+	if (strcasecmp(name[0], "AES") == 0) {
+		ctx->cipher = AES;
+		return jc_init_aes(ctx, name[1], name[2], key, key_len, iv, iv_len);
+	}
+	
+	if (name[2] != NULL) {
+		return JC_ERROR_CIPHER;
+	}
+	
+	if (strcasecmp(name[0], "XOR") == 0) {
+		ctx->cipher = XOR;
+		
+		if (name[1] != NULL) {
+			if (strcasecmp(name[1], "CYCLE") != 0) {
+				return JC_ERROR_CIPHER;
+			}
+			
+			ctx->cycle = true;
+		}
+		
+		if (key == NULL || key_len == 0) {
+			return JC_ERROR_KEY;
+		}
+		
+		ctx->key = (byte*)malloc(key_len);
+		if (ctx->key == NULL) {
+			return JC_ERROR_MEMORY;
+		}
+		
+		memcpy(ctx->key, key, key_len);
+		ctx->key_len = key_len;
+		return JC_OK;
+	}
+	
+	if (name[1] != NULL) {
+		return JC_ERROR_CIPHER;
+	}
+	
+	if (strcasecmp(name[0], "CAESAR") == 0) {
+		ctx->cipher = CAESAR;
+		ctx->amount = alph_amount(ctx->op == ENCRYPT ? 3 : -3);
+		return JC_OK;
+	}
+	
+	if (strcasecmp(name[0], "SHIFT") == 0) {
+		ctx->cipher = SHIFT;
+		
+		char text[JC_MAX_SHIFT_TEXT];
+		if (key == NULL || key_len == 0 || key_len >= sizeof(text)) {
+			return JC_ERROR_KEY;
+		}
+		
+		memcpy(text, key, key_len);
+		text[key_len] = '\0';
+		
+		// Same as the tool, where 0 is also what atoi gives for non-numbers
+		int amt = atoi(text);
+		if (amt == 0) {
+			return JC_ERROR_KEY;
+		}
+		
+		ctx->amount = alph_amount(ctx->op == ENCRYPT ? amt : -amt);
+		return JC_OK;
+	}
+	
+	if (strcasecmp(name[0], "VIGENERE") == 0) {
+		ctx->cipher = VIGENERE;
+		
+		if (key == NULL || key_len == 0 || !vigenere_keycheck(key, key_len)) {
+			return JC_ERROR_KEY;
+		}
+		
+		ctx->key = (byte*)malloc(key_len + 16);
+		if (ctx->key == NULL) {
+			return JC_ERROR_MEMORY;
+		}
+		
+		vigenere_fill_shifts(ctx->key, key, key_len, ctx->op);
+		ctx->key_len = key_len;
+		return JC_OK;
+	}
+	
+	if (strcasecmp(name[0], "RC4") == 0) {
+		ctx->cipher = RC4;
+		
+		if (key == NULL || key_len == 0) {
+			return JC_ERROR_KEY;
+		}
+		
+		rc4_schedule(ctx->S, key, key_len);
+		return JC_OK;
+	}
+	
+	return JC_ERROR_CIPHER;
+}
+
+jc_status jc_init(jc_ctx** ctx, const char* cipher, jc_op op,
+	const unsigned char* key, size_t key_len, const unsigned char* iv, size_t iv_len) {
+	
+	if (ctx == NULL || cipher == NULL || (op != JC_ENCRYPT && op != JC_DECRYPT)) {
+		return JC_ERROR_ARGUMENT;
+	}
+	
+	*ctx = NULL;
+	
+	// Split the name on colons, as the tool does, into at most three parts
+	char copy[JC_MAX_CIPHER_NAME];
+	char* name[3] = { copy, NULL, NULL };
+	unsigned int parts = 1;
+	
+	if (strlen(cipher) >= sizeof(copy)) {
+		return JC_ERROR_CIPHER;
+	}
+	
+	strcpy(copy, cipher);
+	
+	for (char* c = copy; *c != '\0'; c++) {
+		if (*c == ':') {
+			if (parts == 3) {
+				return JC_ERROR_CIPHER;
+			}
+			
+			*c = '\0';
+			name[parts++] = c + 1;
+		}
+	}
+	
+	jc_ctx* c = (jc_ctx*)calloc(1, sizeof(jc_ctx));
+	if (c == NULL) {
+		return JC_ERROR_MEMORY;
+	}
+	
+	c->op = op == JC_ENCRYPT ? ENCRYPT : DECRYPT;
+	
+	jc_status status = jc_init_cipher(c, name, key, key_len, iv, iv_len);
+	if (status != JC_OK) {
+		jc_free(c);
+		return status;
+	}
+	
+	*ctx = c;
+	return JC_OK;
+}
+
+jc_status jc_clone(const jc_ctx* ctx, jc_ctx** copy, const unsigned char* iv, size_t iv_len) {
+	if (ctx == NULL || copy == NULL) {
+		return JC_ERROR_ARGUMENT;
+	}
+	
+	*copy = NULL;
+	
+	bool takes_iv = ctx->cipher == AES && ctx->mode != ECB;
+	if (iv != NULL && takes_iv && iv_len != AES_BLOCK_SIZE) {
+		return JC_ERROR_IV;
+	}
+	
+	jc_ctx* c = (jc_ctx*)malloc(sizeof(jc_ctx));
+	if (c == NULL) {
+		return JC_ERROR_MEMORY;
+	}
+	
+	memcpy(c, ctx, sizeof(jc_ctx));
+	
+	// The Vigenere shifts are followed by a copy of their first 16
+	if (ctx->key != NULL) {
+		size_t size = ctx->cipher == VIGENERE ? ctx->key_len + 16 : ctx->key_len;
+		
+		c->key = (byte*)malloc(size);
+		if (c->key == NULL) {
+			free(c);
+			return JC_ERROR_MEMORY;
+		}
+		
+		memcpy(c->key, ctx->key, size);
+	}
+	
+	if (iv != NULL && takes_iv) {
+		memcpy(c->chain, iv, AES_BLOCK_SIZE);
+	}
+	
+	*copy = c;
+	return JC_OK;
+}
+
+// Works out the next block of keystream for CFB, OFB and CTR
+void jc_next_stream(jc_ctx* ctx) {
+	switch (ctx->mode) {
+		case OFB:
+			aes_encrypt_block(ctx->chain, ctx->round_keys, ctx->rounds);
+			memcpy(ctx->stream, ctx->chain, AES_BLOCK_SIZE);
+			break;
+			
+		case CTR:
+			memcpy(ctx->stream, ctx->chain, AES_BLOCK_SIZE);
+			aes_encrypt_block(ctx->stream, ctx->round_keys, ctx->rounds);
+			increment_buffer(ctx->chain, AES_BLOCK_SIZE);
+			break;
+			
+		default:
+			// CFB, the ciphertext is copied into chain as it is made
+			memcpy(ctx->stream, ctx->chain, AES_BLOCK_SIZE);
+			aes_encrypt_block(ctx->stream, ctx->round_keys, ctx->rounds);
+			break;
+	}
+}
+
+// Runs up to AES_LANES whole blocks of CTR, or of CFB decryption, whose
+// keystream blocks do not wait on each other, through aes_encrypt_lanes at
+// once. Called with the keystream used up, which it leaves used up, and returns
+// how many bytes were done. OFB and CFB encryption feed each block into the
+// next, so they stay with jc_next_stream.
+size_t jc_stream_lanes(jc_ctx* ctx, const byte* in, byte* out, const size_t len) {
+	byte states[AES_LANES][AES_BLOCK_SIZE];
+	const byte* round_keys[AES_LANES];
+	unsigned int rounds[AES_LANES];
+	size_t n = len / AES_BLOCK_SIZE;
+	if (n > AES_LANES) {
+		n = AES_LANES;
+	}
+	
+	for (size_t l = 0; l < n; l++) {
+		round_keys[l] = ctx->round_keys;
+		rounds[l] = ctx->rounds;
+		
+		if (ctx->mode == CTR) {
+			memcpy(states[l], ctx->chain, AES_BLOCK_SIZE);
+			increment_buffer(ctx->chain, AES_BLOCK_SIZE);
+		} else {
+			memcpy(states[l], l == 0 ? ctx->chain : &in[(l - 1) * AES_BLOCK_SIZE], AES_BLOCK_SIZE);
+		}
+	}
+	
+	// The last ciphertext block is saved before out, which may be in, is written
+	if (ctx->mode == CFB) {
+		memcpy(ctx->chain, &in[(n - 1) * AES_BLOCK_SIZE], AES_BLOCK_SIZE);
+	}
+	
+	aes_encrypt_lanes(states, round_keys, rounds, (unsigned int)n);
+	xor_bytes(out, in, &states[0][0], n * AES_BLOCK_SIZE);
+	
+	jc_wipe(states, sizeof(states));
+	return n * AES_BLOCK_SIZE;
+}
+
+void jc_update_stream(jc_ctx* ctx, const byte* in, byte* out, const size_t len) {
+	size_t done = 0;
+	
+	while (done < len) {
+		if (ctx->block_len == AES_BLOCK_SIZE && len - done >= AES_BLOCK_SIZE &&
+			(ctx->mode == CTR || (ctx->mode == CFB && ctx->op == DECRYPT))) {
+			
+			done += jc_stream_lanes(ctx, &in[done], &out[done], len - done);
+			continue;
+		}
+		
+		if (ctx->block_len == AES_BLOCK_SIZE) {
+			jc_next_stream(ctx);
+			ctx->block_len = 0;
+		}
+		
+		size_t n = AES_BLOCK_SIZE - ctx->block_len;
+		if (len - done < n) {
+			n = len - done;
+		}
+		
+		// CFB feeds back the ciphertext, which is the input when decrypting.
+		// It is saved before out, which may be the same memory, is written.
+		if (ctx->mode == CFB && ctx->op == DECRYPT) {
+			memcpy(&ctx->chain[ctx->block_len], &in[done], n);
+		}
+		
+		xor_bytes(&out[done], &in[done], &ctx->stream[ctx->block_len], n);
+		
+		if (ctx->mode == CFB && ctx->op == ENCRYPT) {
+			memcpy(&ctx->chain[ctx->block_len], &out[done], n);
+		}
+		
+		ctx->block_len += n;
+		done += n;
+	}
+}
+
+// Runs the whole block in ctx->block through ECB or CBC, returning how many
+// bytes were written to out. Decrypted blocks come out one block late.
+size_t jc_block(jc_ctx* ctx, byte* out) {
+	if (ctx->op == ENCRYPT) {
+		if (ctx->mode == CBC) {
+			xor_buffer(ctx->block, ctx->chain, AES_BLOCK_SIZE);
+		}
+		
+		aes_encrypt_block(ctx->block, ctx->round_keys, ctx->rounds);
+		
+		if (ctx->mode == CBC) {
+			memcpy(ctx->chain, ctx->block, AES_BLOCK_SIZE);
+		}
+		
+		memcpy(out, ctx->block, AES_BLOCK_SIZE);
+		ctx->block_len = 0;
+		return AES_BLOCK_SIZE;
+	}
+	
+	byte ct[AES_BLOCK_SIZE];
+	memcpy(ct, ctx->block, AES_BLOCK_SIZE);
+	
+	aes_decrypt_block(ctx->block, ctx->round_keys, ctx->rounds);
+	
+	if (ctx->mode == CBC) {
+		xor_buffer(ctx->block, ctx->chain, AES_BLOCK_SIZE);
+		memcpy(ctx->chain, ct, AES_BLOCK_SIZE);
+	}
+	
+	size_t written = 0;
+	if (ctx->have_held) {
+		memcpy(out, ctx->held, AES_BLOCK_SIZE);
+		written = AES_BLOCK_SIZE;
+	}
+	
+	memcpy(ctx->held, ctx->block, AES_BLOCK_SIZE);
+	ctx->have_held = true;
+	ctx->block_len = 0;
+	return written;
+}
+
+// Runs up to AES_LANES whole blocks of ECB, or of CBC decryption, straight
+// from in through the lane kernels, with the same output as that many
+// jc_block calls. Returns how many bytes of in were used, and adds the bytes
+// written to out to *written. CBC encryption chains every block into the next,
+// so it stays with jc_block.
+size_t jc_block_lanes(jc_ctx* ctx, const byte* in, byte* out, const size_t len, size_t* written) {
+	byte states[AES_LANES][AES_BLOCK_SIZE];
+	byte ct[AES_LANES][AES_BLOCK_SIZE];
+	const byte* round_keys[AES_LANES];
+	unsigned int rounds[AES_LANES];
+	size_t n = len / AES_BLOCK_SIZE;
+	if (n > AES_LANES) {
+		n = AES_LANES;
+	}
+	
+	// Copied first, out may be the same memory as in
+	memcpy(states, in, n * AES_BLOCK_SIZE);
+	
+	for (size_t l = 0; l < n; l++) {
+		round_keys[l] = ctx->op == ENCRYPT ? ctx->round_keys : ctx->decryption_keys;
+		rounds[l] = ctx->rounds;
+	}
+	
+	if (ctx->op == ENCRYPT) {
+		aes_encrypt_lanes(states, round_keys, rounds, (unsigned int)n);
+		memcpy(out, states, n * AES_BLOCK_SIZE);
+		*written += n * AES_BLOCK_SIZE;
+		return n * AES_BLOCK_SIZE;
+	}
+	
+	memcpy(ct, states, n * AES_BLOCK_SIZE);
+	aes_decrypt_lanes(states, round_keys, rounds, (unsigned int)n);
+	
+	if (ctx->mode == CBC) {
+		xor_buffer(states[0], ctx->chain, AES_BLOCK_SIZE);
+		xor_buffer(states[1], ct[0], (n - 1) * AES_BLOCK_SIZE);
+		memcpy(ctx->chain, ct[n - 1], AES_BLOCK_SIZE);
+	}
+	
+	// As with jc_block, everything comes out one block late
+	size_t w = 0;
+	if (ctx->have_held) {
+		memcpy(out, ctx->held, AES_BLOCK_SIZE);
+		w = AES_BLOCK_SIZE;
+	}
+	
+	memcpy(&out[w], states, (n - 1) * AES_BLOCK_SIZE);
+	memcpy(ctx->held, states[n - 1], AES_BLOCK_SIZE);
+	ctx->have_held = true;
+	*written += w + (n - 1) * AES_BLOCK_SIZE;
+	
+	jc_wipe(states, sizeof(states));
+	return n * AES_BLOCK_SIZE;
+}
+
+size_t jc_update_blocks(jc_ctx* ctx, const byte* in, byte* out, const size_t len) {
+	size_t done = 0, written = 0;
+	
+	while (done < len) {
+		if (ctx->block_len == 0 && len - done >= AES_BLOCK_SIZE && (ctx->mode == ECB || ctx->op == DECRYPT)) {
+			done += jc_block_lanes(ctx, &in[done], &out[written], len - done, &written);
+			continue;
+		}
+		
+		size_t n = AES_BLOCK_SIZE - ctx->block_len;
+		if (len - done < n) {
+			n = len - done;
+		}
+		
+		memcpy(&ctx->block[ctx->block_len], &in[done], n);
+		ctx->block_len += n;
+		done += n;
+		
+		if (ctx->block_len == AES_BLOCK_SIZE) {
+			written += jc_block(ctx, &out[written]);
+		}
+	}
+	
+	return written;
+}
+
+jc_status jc_update_xor(jc_ctx* ctx, const byte* in, byte* out, const size_t len) {
+	if (!ctx->cycle && len > ctx->key_len - ctx->key_pos) {
+		return JC_ERROR_KEY_USED_UP;
+	}
+	
+	size_t done = 0;
+	
+	while (done < len) {
+		if (ctx->key_pos == ctx->key_len) {
+			ctx->key_pos = 0;
+		}
+		
+		size_t n = ctx->key_len - ctx->key_pos;
+		if (len - done < n) {
+			n = len - done;
+		}
+		
+		xor_bytes(&out[done], &in[done], &ctx->key[ctx->key_pos], n);
+		ctx->key_pos += n;
+		done += n;
+	}
+	
+	return JC_OK;
+}
+
+jc_status jc_update(jc_ctx* ctx, const unsigned char* in, unsigned char* out,
+	size_t len, size_t* out_len) {
+	
+	if (ctx == NULL || out_len == NULL || (len > 0 && (in == NULL || out == NULL))) {
+		return JC_ERROR_ARGUMENT;
+	}
+	
+	*out_len = 0;
+	
+	if (ctx->finished) {
+		return JC_ERROR_FINISHED;
+	}
+	
+	switch (ctx->cipher) {
+		case CAESAR:
+		case SHIFT:
+			shift_bytes(out, in, len, ctx->amount);
+			break;
+			
+		case VIGENERE:
+			vigenere_bytes(out, in, len, ctx->key, ctx->key_len, &ctx->key_pos);
+			break;
+			
+		case RC4:
+			rc4_bytes(ctx->S, &ctx->i, &ctx->j, out, in, len);
+			break;
+			
+		case XOR: {
+			jc_status status = jc_update_xor(ctx, in, out, len);
+			if (status != JC_OK) {
+				return status;
+			}
+			
+			break;
+		}
+		
+		case AES:
+			if (ctx->mode == ECB || ctx->mode == CBC) {
+				*out_len = jc_update_blocks(ctx, in, out, len);
+				return JC_OK;
+			}
+			
+			jc_update_stream(ctx, in, out, len);
+			break;
+	}
+	
+	*out_len = len;
+	return JC_OK;
+}
+
+jc_status jc_final(jc_ctx* ctx, unsigned char* out, size_t* out_len) {
+	if (ctx == NULL || out == NULL || out_len == NULL) {
+		return JC_ERROR_ARGUMENT;
+	}
+	
+	*out_len = 0;
+	
+	if (ctx->finished) {
+		return JC_ERROR_FINISHED;
+	}
+	
+	ctx->finished = true;
+	
+	if (ctx->cipher != AES || (ctx->mode != ECB && ctx->mode != CBC)) {
+		return JC_OK;
+	}
+	
+	if (ctx->op == ENCRYPT) {
+		// PKCS5, a whole block of it if the data ended on a block edge
+		byte pad = (byte)(AES_BLOCK_SIZE - ctx->block_len);
+		memset(&ctx->block[ctx->block_len], pad, pad);
+		
+		*out_len = jc_block(ctx, out);
+		return JC_OK;
+	}
+	
+	if (ctx->block_len != 0) {
+		return JC_ERROR_LENGTH;
+	}
+	
+	if (!ctx->have_held) {
+		return JC_OK;
+	}
+	
+	size_t padding;
+	if (!padding_valid(ctx->held, AES_BLOCK_SIZE, &padding)) {
+		return JC_ERROR_PADDING;
+	}
+	
+	memcpy(out, ctx->held, AES_BLOCK_SIZE - padding);
+	*out_len = AES_BLOCK_SIZE - padding;
+	return JC_OK;
+}
+
+// Position in an iovec array, skipping over empty segments
+typedef struct {
+	const struct iovec* iov;
+	int count;
+	int index;
+	size_t offset;		// Into the current segment
+} jc_iov_cursor;
+
+size_t jc_iov_total(const struct iovec* iov, const int count) {
+	size_t total = 0;
+	
+	for (int i = 0; i < count; i++) {
+		total += iov[i].iov_len;
+	}
+	
+	return total;
+}
+
+// The bytes left in the current segment, moving past any that are used up.
+// Returns 0 at the end of the array.
+size_t jc_iov_left(jc_iov_cursor* c) {
+	while (c->index < c->count && c->offset == c->iov[c->index].iov_len) {
+		c->index++;
+		c->offset = 0;
+	}
+	
+	return c->index < c->count ? c->iov[c->index].iov_len - c->offset : 0;
+}
+
+byte* jc_iov_ptr(const jc_iov_cursor* c) {
+	return &((byte*)c->iov[c->index].iov_base)[c->offset];
+}
+
+// Writes len bytes across the segments, for a block that straddles them
+void jc_iov_put(jc_iov_cursor* c, const byte* data, const size_t len) {
+	size_t done = 0;
+	
+	while (done < len) {
+		size_t n = jc_iov_left(c);
+		if (len - done < n) {
+			n = len - done;
+		}
+		
+		memcpy(jc_iov_ptr(c), &data[done], n);
+		c->offset += n;
+		done += n;
+	}
+}
+
+// How many bytes jc_update would write for len more bytes of input
+size_t jc_output_size(const jc_ctx* ctx, const size_t len) {
+	if (ctx->cipher != AES || (ctx->mode != ECB && ctx->mode != CBC)) {
+		return len;
+	}
+	
+	size_t blocks = (ctx->block_len + len) / AES_BLOCK_SIZE;
+	
+	// Decrypting holds the newest block back
+	if (ctx->op == DECRYPT && !ctx->have_held && blocks > 0) {
+		blocks--;
+	}
+	
+	return blocks * AES_BLOCK_SIZE;
+}
+
+jc_status jc_updatev(jc_ctx* ctx, const struct iovec* in, int in_count,
+	const struct iovec* out, int out_count, size_t* out_len) {
+	
+	if (
+		ctx == NULL || out_len == NULL || in_count < 0 || out_count < 0 ||
+		(in_count > 0 && in == NULL) || (out_count > 0 && out == NULL)
+	) {
+		return JC_ERROR_ARGUMENT;
+	}
+	
+	*out_len = 0;
+	
+	if (ctx->finished) {
+		return JC_ERROR_FINISHED;
+	}
+	
+	// Everything is checked up front, so an error never leaves the context
+	// part way through the data
+	size_t len = jc_iov_total(in, in_count);
+	size_t need = jc_output_size(ctx, len);
+	
+	if (need > jc_iov_total(out, out_count)) {
+		return JC_ERROR_SPACE;
+	}
+	
+	if (ctx->cipher == XOR && !ctx->cycle && len > ctx->key_len - ctx->key_pos) {
+		return JC_ERROR_KEY_USED_UP;
+	}
+	
+	jc_iov_cursor src = { in, in_count, 0, 0 };
+	jc_iov_cursor dst = { out, out_count, 0, 0 };
+	
+	if (ctx->cipher == AES && (ctx->mode == ECB || ctx->mode == CBC)) {
+		size_t n;
+		
+		while ((n = jc_iov_left(&src)) > 0) {
+			if (AES_BLOCK_SIZE - ctx->block_len < n) {
+				n = AES_BLOCK_SIZE - ctx->block_len;
+			}
+			
+			memcpy(&ctx->block[ctx->block_len], jc_iov_ptr(&src), n);
+			ctx->block_len += n;
+			src.offset += n;
+			
+			if (ctx->block_len == AES_BLOCK_SIZE) {
+				// Straight into the output unless the block straddles segments
+				if (jc_iov_left(&dst) >= AES_BLOCK_SIZE) {
+					dst.offset += jc_block(ctx, jc_iov_ptr(&dst));
+				} else {
+					byte block[AES_BLOCK_SIZE];
+					jc_iov_put(&dst, block, jc_block(ctx, block));
+				}
+			}
+		}
+	} else {
+		size_t n;
+		
+		// Every other cipher writes as much as it reads, so each run where
+		// both segments overlap goes through in one call
+		while ((n = jc_iov_left(&src)) > 0) {
+			size_t space = jc_iov_left(&dst);
+			if (space < n) {
+				n = space;
+			}
+			
+			size_t written;
+			jc_update(ctx, jc_iov_ptr(&src), jc_iov_ptr(&dst), n, &written);
+			
+			src.offset += n;
+			dst.offset += n;
+		}
+	}
+	
+	*out_len = need;
+	return JC_OK;
+}
+
+jc_status jc_finalv(jc_ctx* ctx, const struct iovec* out, int out_count, size_t* out_len) {
+	if (ctx == NULL || out_len == NULL || out_count < 0 || (out_count > 0 && out == NULL)) {
+		return JC_ERROR_ARGUMENT;
+	}
+	
+	*out_len = 0;
+	
+	// Only ECB and CBC write anything, and at most a block
+	if (
+		ctx->cipher == AES && (ctx->mode == ECB || ctx->mode == CBC) &&
+		jc_iov_total(out, out_count) < AES_BLOCK_SIZE
+	) {
+		return JC_ERROR_SPACE;
+	}
+	
+	byte block[AES_BLOCK_SIZE];
+	jc_status status = jc_final(ctx, block, out_len);
+	
+	if (status == JC_OK) {
+		jc_iov_cursor dst = { out, out_count, 0, 0 };
+		jc_iov_put(&dst, block, *out_len);
+	}
+	
+	jc_wipe(block, sizeof(block));
+	return status;
+}
+
+typedef struct {
+	byte round_keys[AES_MAX_ROUND_KEYS];
+	byte decryption_keys[AES_MAX_ROUND_KEYS];	// From aes_decryption_keys
+	unsigned int rounds;		// 0 for a handle with no key
+} jc_key;
+
+struct jc_keytab {
+	jc_key* keys;
+	unsigned int size;
+};
+
+jc_status jc_keytab_create(jc_keytab** tab, unsigned int size) {
+	if (tab == NULL || size == 0) {
+		return JC_ERROR_ARGUMENT;
+	}
+	
+	*tab = NULL;
+	
+	jc_keytab* t = (jc_keytab*)malloc(sizeof(jc_keytab));
+	if (t == NULL) {
+		return JC_ERROR_MEMORY;
+	}
+	
+	t->keys = (jc_key*)calloc(size, sizeof(jc_key));
+	if (t->keys == NULL) {
+		free(t);
+		return JC_ERROR_MEMORY;
+	}
+	
+	t->size = size;
+	*tab = t;
+	return JC_OK;
+}
+
+jc_status jc_keytab_set(jc_keytab* tab, unsigned int handle,
+	const unsigned char* key, size_t key_len) {
+	
+	if (tab == NULL || key == NULL) {
+		return JC_ERROR_ARGUMENT;
+	}
+	
+	if (handle >= tab->size || (key_len != 16 && key_len != 24 && key_len != 32)) {
+		return JC_ERROR_KEY;
+	}
+	
+	jc_key* k = &tab->keys[handle];
+	
+	key_schedule(k->round_keys, key, key_len);
+	k->rounds = aes_rounds(key_len);
+	aes_decryption_keys(k->decryption_keys, k->round_keys, k->rounds);
+	return JC_OK;
+}
+
+void jc_keytab_free(jc_keytab* tab) {
+	if (tab == NULL) {
+		return;
+	}
+	
+	jc_wipe(tab->keys, tab->size * sizeof(jc_key));
+	free(tab->keys);
+	free(tab);
+}
+
+// A message going through a batch
+typedef struct {
+	jc_msg* msg;
+	const jc_key* key;
+	byte chain[AES_BLOCK_SIZE];		// As in jc_ctx
+	byte in[AES_BLOCK_SIZE];		// The ciphertext block being decrypted, for CBC
+	size_t pos;						// Bytes of input done
+	size_t n;						// Bytes of input in the block in flight
+} jc_lane;
+
+void jc_msg_done(jc_msg* msg, const jc_status status, const size_t out_len) {
+	msg->status = status;
+	msg->out_len = status == JC_OK ? out_len : 0;
+}
+
+// Checks a message and sets up its lane. Returns false if the message is
+// already done, because it failed or has nothing to run through the rounds.
+bool jc_lane_start(jc_lane* lane, const jc_keytab* tab, const cmode_t mode, const crypto_op op,
+	jc_msg* msg) {
+	
+	bool blocked = mode == ECB || mode == CBC;
+	
+	if ((msg->len > 0 && msg->in == NULL) || msg->out == NULL) {
+		jc_msg_done(msg, JC_ERROR_ARGUMENT, 0);
+		return false;
+	}
+	
+	if (msg->key >= tab->size || tab->keys[msg->key].rounds == 0) {
+		jc_msg_done(msg, JC_ERROR_KEY, 0);
+		return false;
+	}
+	
+	if (mode != ECB && msg->iv == NULL) {
+		jc_msg_done(msg, JC_ERROR_IV, 0);
+		return false;
+	}
+	
+	if (blocked && op == DECRYPT && msg->len % AES_BLOCK_SIZE != 0) {
+		jc_msg_done(msg, JC_ERROR_LENGTH, 0);
+		return false;
+	}
+	
+	// Encrypting with padding always makes at least one block
+	if (msg->len == 0 && !(blocked && op == ENCRYPT)) {
+		jc_msg_done(msg, JC_OK, 0);
+		return false;
+	}
+	
+	lane->msg = msg;
+	lane->key = &tab->keys[msg->key];
+	lane->pos = 0;
+	
+	if (mode != ECB) {
+		memcpy(lane->chain, msg->iv, AES_BLOCK_SIZE);
+	}
+	
+	return true;
+}
+
+// Fills state with the lane's next block to go through the rounds
+void jc_lane_block(jc_lane* lane, const cmode_t mode, const crypto_op op, byte* state) {
+	const jc_msg* msg = lane->msg;
+	
+	lane->n = msg->len - lane->pos < AES_BLOCK_SIZE ? msg->len - lane->pos : AES_BLOCK_SIZE;
+	
+	switch (mode) {
+		case ECB:
+		case CBC:
+			if (op == DECRYPT) {
+				memcpy(lane->in, &msg->in[lane->pos], AES_BLOCK_SIZE);
+				memcpy(state, lane->in, AES_BLOCK_SIZE);
+				break;
+			}
+			
+			// PKCS5, a whole block of it if the data ended on a block edge
+			memcpy(state, &msg->in[lane->pos], lane->n);
+			memset(&state[lane->n], (int)(AES_BLOCK_SIZE - lane->n), AES_BLOCK_SIZE - lane->n);
+			
+			if (mode == CBC) {
+				xor_buffer(state, lane->chain, AES_BLOCK_SIZE);
+			}
+			
+			break;
+			
+		case CTR:
+			memcpy(state, lane->chain, AES_BLOCK_SIZE);
+			increment_buffer(lane->chain, AES_BLOCK_SIZE);
+			break;
+			
+		default:
+			memcpy(state, lane->chain, AES_BLOCK_SIZE);
+			break;
+	}
+}
+
+// Takes the lane's block back out of the rounds and writes its output.
+// Returns true once the message is done.
+bool jc_lane_output(jc_lane* lane, const cmode_t mode, const crypto_op op, byte* state) {
+	jc_msg* msg = lane->msg;
+	size_t pos = lane->pos;
+	
+	lane->pos += lane->n;
+	
+	if (mode == ECB || mode == CBC) {
+		if (op == ENCRYPT) {
+			if (mode == CBC) {
+				memcpy(lane->chain, state, AES_BLOCK_SIZE);
+			}
+			
+			// Output runs a block ahead of input only after the padding
+			memcpy(&msg->out[pos], state, AES_BLOCK_SIZE);
+			
+			if (lane->n < AES_BLOCK_SIZE) {
+				jc_msg_done(msg, JC_OK, pos + AES_BLOCK_SIZE);
+				return true;
+			}
+			
+			return false;
+		}
+		
+		if (mode == CBC) {
+			xor_buffer(state, lane->chain, AES_BLOCK_SIZE);
+			memcpy(lane->chain, lane->in, AES_BLOCK_SIZE);
+		}
+		
+		if (lane->pos < msg->len) {
+			memcpy(&msg->out[pos], state, AES_BLOCK_SIZE);
+			return false;
+		}
+		
+		size_t padding;
+		if (!padding_valid(state, AES_BLOCK_SIZE, &padding)) {
+			jc_msg_done(msg, JC_ERROR_PADDING, 0);
+			return true;
+		}
+		
+		memcpy(&msg->out[pos], state, AES_BLOCK_SIZE - padding);
+		jc_msg_done(msg, JC_OK, pos + AES_BLOCK_SIZE - padding);
+		return true;
+	}
+	
+	// CFB feeds back the ciphertext, saved before out, which may be the same
+	// memory as in, is written
+	if (mode == CFB && op == DECRYPT) {
+		memcpy(lane->chain, &msg->in[pos], lane->n);
+	}
+	
+	xor_bytes(&msg->out[pos], &msg->in[pos], state, lane->n);
+	
+	if (mode == CFB && op == ENCRYPT) {
+		memcpy(lane->chain, &msg->out[pos], lane->n);
+	} else if (mode == OFB) {
+		memcpy(lane->chain, state, AES_BLOCK_SIZE);
+	}
+	
+	if (lane->pos == msg->len) {
+		jc_msg_done(msg, JC_OK, msg->len);
+		return true;
+	}
+	
+	return false;
+}
+
+jc_status jc_batch(const jc_keytab* tab, const char* mode, jc_op op, jc_msg* msgs, size_t count) {
+	cmode_t m;
+	
+	if (tab == NULL || mode == NULL || (count > 0 && msgs == NULL) || (op != JC_ENCRYPT && op != JC_DECRYPT)) {
+		return JC_ERROR_ARGUMENT;
+	}
+	
+	if (!jc_parse_mode(mode, &m)) {
+		return JC_ERROR_CIPHER;
+	}
+	
+	crypto_op o = op == JC_ENCRYPT ? ENCRYPT : DECRYPT;
+	
+	// Only ECB and CBC decryption run the inverse cipher
+	bool inverse = o == DECRYPT && (m == ECB || m == CBC);
+	
+	jc_lane lanes[AES_LANES];
+	byte states[AES_LANES][AES_BLOCK_SIZE];
+	const byte* round_keys[AES_LANES];
+	unsigned int rounds[AES_LANES];
+	unsigned int active = 0;
+	size_t next = 0;
+	
+	for (;;) {
+		// A lane that frees up takes the next message straight away, so short
+		// messages do not leave lanes idle while long ones finish
+		while (active < AES_LANES && next < count) {
+			if (jc_lane_start(&lanes[active], tab, m, o, &msgs[next++])) {
+				active++;
+			}
+		}
+		
+		if (active == 0) {
+			break;
+		}
+		
+		for (unsigned int l = 0; l < active; l++) {
+			jc_lane_block(&lanes[l], m, o, states[l]);
+			round_keys[l] = inverse ? lanes[l].key->decryption_keys : lanes[l].key->round_keys;
+			rounds[l] = lanes[l].key->rounds;
+		}
+		
+		if (inverse) {
+			aes_decrypt_lanes(states, round_keys, rounds, active);
+		} else {
+			aes_encrypt_lanes(states, round_keys, rounds, active);
+		}
+		
+		// Finished lanes are filled from the end, the order does not matter
+		for (unsigned int l = 0; l < active;) {
+			if (jc_lane_output(&lanes[l], m, o, states[l])) {
+				active--;
+				lanes[l] = lanes[active];
+				memcpy(states[l], states[active], AES_BLOCK_SIZE);
+			} else {
+				l++;
+			}
+		}
+	}
+	
+	jc_wipe(states, sizeof(states));
+	jc_wipe(lanes, sizeof(lanes));
+	
+	for (size_t k = 0; k < count; k++) {
+		if (msgs[k].status != JC_OK) {
+			return msgs[k].status;
+		}
+	}
+	
+	return JC_OK;
+}
+
+void jc_free(jc_ctx* ctx) {
+	if (ctx == NULL) {
+		return;
+	}
+	
+	if (ctx->key != NULL) {
+		jc_wipe(ctx->key, ctx->cipher == VIGENERE ? ctx->key_len + 16 : ctx->key_len);
+		free(ctx->key);
+	}
+	
+	jc_wipe(ctx, sizeof(jc_ctx));
+	free(ctx);
+}
+
+const char* jc_status_string(jc_status status) {
+	switch (status) {
+		case JC_OK:
+			return "success";
+		case JC_ERROR_ARGUMENT:
+			return "a required argument is missing";
+		case JC_ERROR_CIPHER:
+			return "unknown cipher";
+		case JC_ERROR_KEY:
+			return "key is invalid for this cipher";
+		case JC_ERROR_IV:
+			return "an IV of one block is required for this cipher mode";
+		case JC_ERROR_MEMORY:
+			return "out of memory";
+		case JC_ERROR_KEY_USED_UP:
+			return "XOR key is shorter than the input, use XOR:CYCLE to repeat a short key";
+		case JC_ERROR_LENGTH:
+			return "ciphertext is not a multiple of the block size";
+		case JC_ERROR_PADDING:
+			return "padding was not correct on decrypted data, key was most likely incorrect";
+		case JC_ERROR_FINISHED:
+			return "the context has already been finished";
+		case JC_ERROR_SPACE:
+			return "output buffers are too small";
+		case JC_ERROR_BUSY:
+			return "the job ring is full";
+		case JC_ERROR_IO:
+			return "reading or writing the file failed";
+		case JC_ERROR_UNSUPPORTED:
+			return "not supported on this platform";
+	}
+	
+	return "unknown status";
+}
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef LIB__JOELCRYPTO_H
+#define LIB__JOELCRYPTO_H
+
+// libjoelcrypto, the ciphers of the joelcrypto tool as a library. Data is
+// passed through a cipher context in pieces of any size, working on the
+// caller's memory. Nothing here prints or exits, every call reports how it
+// went through its return value.
+//
+//     jc_ctx* ctx;
+//     if (jc_init(&ctx, "AES:256:CTR", JC_ENCRYPT, key, 32, iv, 16) != JC_OK) ...
+//     jc_update(ctx, in, out, len, &out_len);    // As many times as needed
+//     jc_final(ctx, out, &out_len);
+//     jc_free(ctx);
+//
+// The output matches the tool's for the same cipher, key and IV. Build it from
+// the top of the source tree with
+//
+//     gcc -O2 -fPIC -shared -fvisibility=hidden -pthread -I. lib/joelcrypto.c -o libjoelcrypto.so
+//
+// or compile lib/joelcrypto.c into the program using it. C++20 programs can
+// use the coroutines in lib/joelcrypto.hpp on top of this.
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+  // Laid out as on POSIX systems
+  struct iovec {
+	void* iov_base;
+	size_t iov_len;
+  };
+#else
+  #include <sys/uio.h>
+#endif
+
+#if defined(__GNUC__)
+  #define JC_API __attribute__((visibility("default")))
+#else
+  #define JC_API
+#endif
+
+#define JC_BLOCK_SIZE 16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	JC_OK = 0,
+	JC_ERROR_ARGUMENT,		// A required pointer was NULL
+	JC_ERROR_CIPHER,		// The cipher name was not recognised
+	JC_ERROR_KEY,			// The key is missing or not valid for the cipher
+	JC_ERROR_IV,			// The IV is missing or not one block long
+	JC_ERROR_MEMORY,		// The context could not be allocated
+	JC_ERROR_KEY_USED_UP,	// The data is longer than an XOR key without CYCLE
+	JC_ERROR_LENGTH,		// ECB or CBC ciphertext is not a whole number of blocks
+	JC_ERROR_PADDING,		// The padding of the last block is wrong, most likely the key is
+	JC_ERROR_FINISHED,		// jc_final has already been called
+	JC_ERROR_SPACE,			// The output iovecs cannot hold the result
+	JC_ERROR_BUSY,			// The job ring is full, reap some completions first
+	JC_ERROR_IO,			// A read or write job failed, the completion has its errno
+	JC_ERROR_UNSUPPORTED	// Not available on this platform
+} jc_status;
+
+typedef enum {
+	JC_ENCRYPT,
+	JC_DECRYPT
+} jc_op;
+
+typedef struct jc_ctx jc_ctx;
+
+// Sets up a context for cipher, named as on the command line: CAESAR, SHIFT,
+// VIGENERE, RC4, XOR, XOR:CYCLE, or AES:<128|192|256>:<ECB|CBC|CFB|OFB|CTR>.
+// Case does not matter. The key is copied, and is:
+//     CAESAR       not used, may be NULL
+//     SHIFT        the shift amount as decimal text, such as "7"
+//     VIGENERE     letters only
+//     RC4          at least one byte
+//     XOR          as long as all of the data, or repeated with XOR:CYCLE
+//     AES          exactly 16, 24 or 32 bytes for the key size
+// AES in every mode but ECB needs a 16 byte IV, the other ciphers ignore it.
+// On success *ctx is set and must be released with jc_free.
+JC_API jc_status jc_init(jc_ctx** ctx, const char* cipher, jc_op op,
+	const unsigned char* key, size_t key_len, const unsigned char* iv, size_t iv_len);
+
+// Copies a context as it stands, so a key set up once can start any number
+// of messages without its schedule being worked out again. iv, unless NULL,
+// replaces the IV of the copy, which only makes sense before any data has gone
+// through. The copy is released with jc_free as usual.
+JC_API jc_status jc_clone(const jc_ctx* ctx, jc_ctx** copy, const unsigned char* iv, size_t iv_len);
+
+// Passes len bytes of in through the cipher into out, setting *out_len to the
+// bytes written. Only ECB and CBC hold data back, a partial block and, when
+// decrypting, the last whole block, so out must have room for
+// len + JC_BLOCK_SIZE bytes. out may be the same buffer as in for every cipher
+// except AES in ECB and CBC mode, otherwise they must not overlap.
+JC_API jc_status jc_update(jc_ctx* ctx, const unsigned char* in, unsigned char* out,
+	size_t len, size_t* out_len);
+
+// Finishes the data, writing up to JC_BLOCK_SIZE more bytes to out. ECB and
+// CBC add PKCS5 padding when encrypting and check and remove it when
+// decrypting. The context cannot be updated after this.
+JC_API jc_status jc_final(jc_ctx* ctx, unsigned char* out, size_t* out_len);
+
+// jc_update and jc_final across arrays of segments, as for readv and writev.
+// The input and output segments do not have to line up, and the cipher state
+// carries over from one segment to the next, so the result is the same as for
+// the data laid end to end. Nothing is gathered into a staging copy, only a
+// block that straddles output segments goes through a 16 byte one. The output
+// must have room for what jc_update would write, checked before anything is
+// done, and jc_finalv needs room for JC_BLOCK_SIZE bytes with ECB and CBC.
+JC_API jc_status jc_updatev(jc_ctx* ctx, const struct iovec* in, int in_count,
+	const struct iovec* out, int out_count, size_t* out_len);
+
+JC_API jc_status jc_finalv(jc_ctx* ctx, const struct iovec* out, int out_count, size_t* out_len);
+
+// Wipes and releases a context, NULL is ignored
+JC_API void jc_free(jc_ctx* ctx);
+
+// Batches of small AES messages under many keys, for packet sized work where
+// setting up a context per message would cost more than the message. Keys are
+// expanded once into a table and named by handle. A batch then runs up to
+// eight messages at a time through the rounds side by side, so the chained
+// blocks of CBC encryption, CFB and OFB, which cannot overlap within one
+// message, overlap across messages instead. Each message is whole, as from
+// jc_init, one jc_update and jc_final.
+typedef struct jc_keytab jc_keytab;
+
+typedef struct {
+	unsigned int key;			// Handle in the key table
+	const unsigned char* iv;	// One block, not used with ECB
+	const unsigned char* in;
+	unsigned char* out;			// Room for len, plus JC_BLOCK_SIZE with ECB and CBC, may be in
+	size_t len;
+	size_t out_len;				// Set by the batch
+	jc_status status;			// Set by the batch
+} jc_msg;
+
+// Makes a table for handles 0 to size - 1, none of them with a key yet
+JC_API jc_status jc_keytab_create(jc_keytab** tab, unsigned int size);
+
+// Expands an AES key of 16, 24 or 32 bytes into handle, replacing any key it
+// had. Not to be called while a batch using the table is running.
+JC_API jc_status jc_keytab_set(jc_keytab* tab, unsigned int handle,
+	const unsigned char* key, size_t key_len);
+
+// Wipes and releases a table, NULL is ignored
+JC_API void jc_keytab_free(jc_keytab* tab);
+
+// Encrypts or decrypts count messages in mode, one of ECB, CBC, CFB, OFB or
+// CTR, each with the key size of its handle. Every message gets its own
+// status and out_len, out_len being 0 when it failed. Returns JC_OK if they
+// all succeeded, otherwise the status of the first that did not.
+JC_API jc_status jc_batch(const jc_keytab* tab, const char* mode, jc_op op,
+	jc_msg* msgs, size_t count);
+
+// A job ring, for running cipher work on a pool of worker threads without
+// blocking, along the lines of io_uring. Jobs go in through lock-free
+// submission queues, one per worker, so any number of threads can submit.
+// Workers take them in batches and post the results to a completion queue,
+// which the caller polls, waits on, or watches through an eventfd from an
+// event loop. All jobs on one context go to the same worker and run in the
+// order they were submitted, so a message can be split over several jobs.
+// Jobs on different contexts run in parallel. Workers can also read and write
+// files, so a caller never blocks on a disk either. Not available with MSVC,
+// and reads and writes are not available on Windows.
+typedef struct jc_ring jc_ring;
+
+typedef enum {
+	JC_JOB_CIPHER,				// jc_update on ctx, then jc_final if final
+	JC_JOB_READ,				// Reads len bytes of fd into out, fewer only at the end of the file
+	JC_JOB_WRITE				// Writes len bytes of in to fd
+} jc_job_kind;
+
+typedef struct {
+	jc_ctx* ctx;				// For a read or write, NULL, or a context to keep it in order with
+	const unsigned char* in;	// Must stay valid until the job completes
+	unsigned char* out;			// Room as for jc_update, plus JC_BLOCK_SIZE if final
+	size_t len;
+	int final;					// Also call jc_final, its output follows the update's
+	void* user_data;			// Handed back in the completion
+	jc_job_kind kind;			// JC_JOB_CIPHER when left at 0
+	int fd;						// Read or written, jobs without a context on one fd run in order
+	long long offset;			// Where in the file to read or write, -1 for the fd's position
+} jc_job;
+
+typedef struct {
+	void* user_data;
+	jc_status status;
+	size_t out_len;				// Bytes written to the job's out, or read or written by it
+	int error;					// The errno of JC_ERROR_IO
+} jc_completion;
+
+// Starts a ring with workers threads, 0 for one per allowed CPU, taking up to
+// entries jobs that have not been reaped yet
+JC_API jc_status jc_ring_create(jc_ring** ring, unsigned int workers, unsigned int entries);
+
+// Queues a job, from any thread. Returns JC_ERROR_BUSY if entries jobs are
+// already submitted and not yet reaped.
+JC_API jc_status jc_ring_submit(jc_ring* ring, const jc_job* job);
+
+// Reaps up to max completions without blocking, returning how many there
+// were. Completions are reaped from one thread at a time.
+JC_API unsigned int jc_ring_poll(jc_ring* ring, jc_completion* completions, unsigned int max);
+
+// As jc_ring_poll, but blocks until there is at least one completion
+JC_API unsigned int jc_ring_wait(jc_ring* ring, jc_completion* completions, unsigned int max);
+
+// An eventfd that is readable while there may be completions to reap, or -1
+// where there is no eventfd. jc_ring_poll clears it.
+JC_API int jc_ring_fd(jc_ring* ring);
+
+// Stops the workers and releases the ring. Jobs that have not completed are
+// dropped, so wait for them first.
+JC_API void jc_ring_destroy(jc_ring* ring);
+
+// A short description of a status, for messages
+JC_API const char* jc_status_string(jc_status status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,587 @@
+#ifndef LIB__JOELCRYPTO_HPP
+#define LIB__JOELCRYPTO_HPP
+
+// C++20 coroutines over libjoelcrypto. The cipher and mode are template
+// parameters, so their name, key size, IV and output room are all worked out
+// at compile time, and using AES without a mode or CAESAR with one does not
+// compile. Operations are co_awaited on an executor, a run queue that one
+// thread drives, so thousands of streams can be interleaved without a thread
+// each. Given a jc_ring the executor runs the cipher work and file_stream's
+// reads and writes on the ring's workers, and resumes each stream when its
+// job completes, so a slow disk only holds up the streams waiting on it.
+// Without a ring the work is done inline, and files go through stdio.
+//
+//     joelcrypto::executor ex(ring);
+//     ex.spawn(joelcrypto::crypt_file<cipher::aes256, mode::ctr>(ex, JC_ENCRYPT,
+//         "in.bin", "out.bin", key, iv));
+//     ex.run();
+//
+// Link with libjoelcrypto, see lib/joelcrypto.h. Errors are thrown as
+// joelcrypto::error.
+
+#include <array>
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "lib/joelcrypto.h"
+
+namespace joelcrypto {
+
+enum class cipher { caesar, shift, vigenere, rc4, xor_once, xor_cycle, aes128, aes192, aes256 };
+enum class mode { none, ecb, cbc, cfb, ofb, ctr };
+
+constexpr bool is_aes(const cipher c) {
+	return c == cipher::aes128 || c == cipher::aes192 || c == cipher::aes256;
+}
+
+// What the library needs to know about a cipher and mode, all at compile time
+template <cipher C, mode M>
+struct cipher_traits {
+	static_assert(is_aes(C) == (M != mode::none), "AES needs a mode, the other ciphers take none");
+
+	static constexpr bool blocked = M == mode::ecb || M == mode::cbc;
+	static constexpr bool needs_iv = is_aes(C) && M != mode::ecb;
+
+	// Bytes an update can write beyond its input, and a final can write
+	static constexpr std::size_t overhead = blocked ? JC_BLOCK_SIZE : 0;
+
+	// 0 where any length goes
+	static constexpr std::size_t key_size =
+		C == cipher::aes128 ? 16 : C == cipher::aes192 ? 24 : C == cipher::aes256 ? 32 : 0;
+
+	// The name jc_init takes, such as AES:256:CTR
+	static constexpr std::array<char, 16> name = [] {
+		std::array<char, 16> n {};
+		const char* parts[2] = { nullptr, nullptr };
+
+		switch (C) {
+			case cipher::caesar: parts[0] = "CAESAR"; break;
+			case cipher::shift: parts[0] = "SHIFT"; break;
+			case cipher::vigenere: parts[0] = "VIGENERE"; break;
+			case cipher::rc4: parts[0] = "RC4"; break;
+			case cipher::xor_once: parts[0] = "XOR"; break;
+			case cipher::xor_cycle: parts[0] = "XOR:CYCLE"; break;
+			case cipher::aes128: parts[0] = "AES:128"; break;
+			case cipher::aes192: parts[0] = "AES:192"; break;
+			case cipher::aes256: parts[0] = "AES:256"; break;
+		}
+
+		switch (M) {
+			case mode::none: break;
+			case mode::ecb: parts[1] = ":ECB"; break;
+			case mode::cbc: parts[1] = ":CBC"; break;
+			case mode::cfb: parts[1] = ":CFB"; break;
+			case mode::ofb: parts[1] = ":OFB"; break;
+			case mode::ctr: parts[1] = ":CTR"; break;
+		}
+
+		std::size_t i = 0;
+		for (const char* part : parts) {
+			for (; part != nullptr && *part != '\0'; part++) {
+				n[i++] = *part;
+			}
+		}
+
+		return n;
+	}();
+};
+
+class error : public std::runtime_error {
+public:
+	explicit error(const jc_status status)
+		: std::runtime_error(jc_status_string(status)), status_(status) {}
+
+	jc_status status() const noexcept { return status_; }
+
+private:
+	jc_status status_;
+};
+
+inline void check(const jc_status status) {
+	if (status != JC_OK) {
+		throw error(status);
+	}
+}
+
+inline const unsigned char* bytes(std::span<const std::byte> s) {
+	return reinterpret_cast<const unsigned char*>(s.data());
+}
+
+inline unsigned char* bytes(std::span<std::byte> s) {
+	return reinterpret_cast<unsigned char*>(s.data());
+}
+
+class executor;
+
+// A lazily started coroutine returning T. Awaiting it starts it, and the
+// awaiter carries on from where it finishes.
+template <typename T = void>
+class task;
+
+namespace detail {
+
+template <typename T>
+struct task_promise_base {
+	std::coroutine_handle<> continuation = std::noop_coroutine();
+	std::exception_ptr exception;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	struct final_awaiter {
+		bool await_ready() noexcept { return false; }
+
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+			return h.promise().continuation;
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	final_awaiter final_suspend() noexcept { return {}; }
+
+	void unhandled_exception() noexcept { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct task_promise : task_promise_base<T> {
+	std::optional<T> value;
+
+	task<T> get_return_object() noexcept;
+
+	template <typename U>
+	void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+
+	T result() {
+		if (this->exception) {
+			std::rethrow_exception(this->exception);
+		}
+
+		return std::move(*value);
+	}
+};
+
+template <>
+struct task_promise<void> : task_promise_base<void> {
+	task<void> get_return_object() noexcept;
+
+	void return_void() noexcept {}
+
+	void result() {
+		if (exception) {
+			std::rethrow_exception(exception);
+		}
+	}
+};
+
+}
+
+template <typename T>
+class task {
+public:
+	using promise_type = detail::task_promise<T>;
+
+	explicit task(std::coroutine_handle<promise_type> h) noexcept : handle_(h) {}
+	task(task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+	task(const task&) = delete;
+	task& operator=(const task&) = delete;
+
+	task& operator=(task&& other) noexcept {
+		if (this != &other) {
+			if (handle_) {
+				handle_.destroy();
+			}
+
+			handle_ = std::exchange(other.handle_, nullptr);
+		}
+
+		return *this;
+	}
+
+	~task() {
+		if (handle_) {
+			handle_.destroy();
+		}
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+		handle_.promise().continuation = awaiting;
+		return handle_;
+	}
+
+	T await_resume() { return handle_.promise().result(); }
+
+private:
+	std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+template <typename T>
+task<T> task_promise<T>::get_return_object() noexcept {
+	return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() noexcept {
+	return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+}
+
+// Runs coroutines on the thread that calls run(). Cipher jobs go to the ring
+// if there is one, and their coroutines are resumed as completions come in.
+class executor {
+public:
+	explicit executor(jc_ring* ring = nullptr) noexcept : ring_(ring) {}
+
+	executor(const executor&) = delete;
+	executor& operator=(const executor&) = delete;
+
+	jc_ring* ring() const noexcept { return ring_; }
+
+	void post(std::coroutine_handle<> h) { ready_.push_back(h); }
+
+	// Suspends the current coroutine until everything already queued has had a turn
+	auto yield() noexcept {
+		struct awaiter {
+			executor& ex;
+
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> h) { ex.post(h); }
+			void await_resume() const noexcept {}
+		};
+
+		return awaiter { *this };
+	}
+
+	// Starts t, which then runs by itself. An exception it throws comes out
+	// of run().
+	void spawn(task<void> t) { post(detached_start(*this, std::move(t)).handle); }
+
+	// Runs until every coroutine has finished
+	void run() {
+		while (!ready_.empty() || in_ring_ > 0) {
+			while (!ready_.empty()) {
+				std::coroutine_handle<> h = ready_.front();
+				ready_.pop_front();
+				h.resume();
+			}
+
+			if (in_ring_ > 0) {
+				reap();
+			}
+		}
+
+		if (error_) {
+			std::rethrow_exception(std::exchange(error_, nullptr));
+		}
+	}
+
+	// A job on the ring, the coroutine waiting for it is resumed once it is reaped
+	struct ring_op {
+		executor& ex;
+		jc_job job;
+		jc_completion done {};
+		std::coroutine_handle<> waiting {};
+
+		bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> h) {
+			waiting = h;
+			job.user_data = this;
+
+			// A full ring means completions are waiting to be reaped
+			jc_status status;
+			while ((status = jc_ring_submit(ex.ring_, &job)) == JC_ERROR_BUSY) {
+				ex.reap();
+			}
+
+			check(status);
+			ex.in_ring_++;
+		}
+
+		std::size_t await_resume() const {
+			if (done.status == JC_ERROR_IO) {
+				throw std::system_error(done.error, std::generic_category(), jc_status_string(done.status));
+			}
+
+			check(done.status);
+			return done.out_len;
+		}
+	};
+
+private:
+	struct detached {
+		struct promise_type {
+			executor& ex;
+
+			promise_type(executor& e, task<void>&) noexcept : ex(e) {}
+
+			detached get_return_object() noexcept {
+				return { std::coroutine_handle<promise_type>::from_promise(*this) };
+			}
+
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() noexcept {}
+
+			void unhandled_exception() noexcept {
+				if (!ex.error_) {
+					ex.error_ = std::current_exception();
+				}
+			}
+		};
+
+		std::coroutine_handle<promise_type> handle;
+	};
+
+	static detached detached_start(executor&, task<void> t) { co_await t; }
+
+	// Waits for jobs to complete and queues their coroutines
+	void reap() {
+		jc_completion done[64];
+		unsigned int count = jc_ring_wait(ring_, done, 64);
+
+		for (unsigned int i = 0; i < count; i++) {
+			ring_op* op = static_cast<ring_op*>(done[i].user_data);
+			op->done = done[i];
+			in_ring_--;
+			post(op->waiting);
+		}
+	}
+
+	jc_ring* ring_;
+	std::deque<std::coroutine_handle<>> ready_;
+	std::size_t in_ring_ = 0;
+	std::exception_ptr error_;
+};
+
+// A cipher context for one message. update and final work in place on the
+// calling thread, async_update and async_final are co_awaited and run on the
+// executor's ring if it has one.
+template <cipher C, mode M = mode::none>
+class stream {
+public:
+	using traits = cipher_traits<C, M>;
+
+	// The room out needs beyond the input for an update, and for final
+	static constexpr std::size_t overhead = traits::overhead;
+
+	stream(const jc_op op, std::span<const std::byte> key, std::span<const std::byte> iv = {}) {
+		if (traits::key_size != 0 && key.size() != traits::key_size) {
+			throw error(JC_ERROR_KEY);
+		}
+
+		if (traits::needs_iv && iv.size() != JC_BLOCK_SIZE) {
+			throw error(JC_ERROR_IV);
+		}
+
+		check(jc_init(&ctx_, traits::name.data(), op, bytes(key), key.size(), bytes(iv), iv.size()));
+	}
+
+	stream(stream&& other) noexcept : ctx_(std::exchange(other.ctx_, nullptr)) {}
+	stream(const stream&) = delete;
+	stream& operator=(const stream&) = delete;
+
+	stream& operator=(stream&& other) noexcept {
+		if (this != &other) {
+			jc_free(ctx_);
+			ctx_ = std::exchange(other.ctx_, nullptr);
+		}
+
+		return *this;
+	}
+
+	~stream() { jc_free(ctx_); }
+
+	std::size_t update(std::span<const std::byte> in, std::span<std::byte> out) {
+		check_room(in.size(), out.size());
+
+		std::size_t written;
+		check(jc_update(ctx_, bytes(in), bytes(out), in.size(), &written));
+		return written;
+	}
+
+	std::size_t final(std::span<std::byte> out) {
+		check_room(0, out.size());
+
+		std::size_t written;
+		check(jc_final(ctx_, bytes(out), &written));
+		return written;
+	}
+
+	task<std::size_t> async_update(executor& ex, std::span<const std::byte> in, std::span<std::byte> out) {
+		if (ex.ring() == nullptr) {
+			co_return update(in, out);
+		}
+
+		check_room(in.size(), out.size());
+		co_return co_await executor::ring_op { ex, { ctx_, bytes(in), bytes(out), in.size(), 0, nullptr, JC_JOB_CIPHER, -1, 0 } };
+	}
+
+	task<std::size_t> async_final(executor& ex, std::span<std::byte> out) {
+		if (ex.ring() == nullptr) {
+			co_return final(out);
+		}
+
+		check_room(0, out.size());
+		co_return co_await executor::ring_op { ex, { ctx_, nullptr, bytes(out), 0, 1, nullptr, JC_JOB_CIPHER, -1, 0 } };
+	}
+
+private:
+	static void check_room(const std::size_t in, const std::size_t out) {
+		if (out < in + overhead) {
+			throw error(JC_ERROR_SPACE);
+		}
+	}
+
+	jc_ctx* ctx_ = nullptr;
+};
+
+// Encrypts or decrypts all of in to out as one message, returning the bytes
+// written. out needs room for in plus stream<C, M>::overhead.
+template <cipher C, mode M = mode::none>
+task<std::size_t> crypt(executor& ex, const jc_op op, std::span<const std::byte> key,
+	std::span<const std::byte> iv, std::span<const std::byte> in, std::span<std::byte> out) {
+
+	stream<C, M> s(op, key, iv);
+
+	std::size_t written = co_await s.async_update(ex, in, out);
+	written += co_await s.async_final(ex, out.subspan(written));
+	co_return written;
+}
+
+template <cipher C, mode M = mode::none>
+task<std::size_t> encrypt(executor& ex, std::span<const std::byte> key, std::span<const std::byte> iv,
+	std::span<const std::byte> in, std::span<std::byte> out) {
+
+	return crypt<C, M>(ex, JC_ENCRYPT, key, iv, in, out);
+}
+
+template <cipher C, mode M = mode::none>
+task<std::size_t> decrypt(executor& ex, std::span<const std::byte> key, std::span<const std::byte> iv,
+	std::span<const std::byte> in, std::span<std::byte> out) {
+
+	return crypt<C, M>(ex, JC_DECRYPT, key, iv, in, out);
+}
+
+// A file read or written a buffer at a time. On an executor with a ring, each
+// read and write is a job on the ring, on the file's descriptor. Otherwise it
+// yields to the executor first, so the streams on it take turns, then blocks
+// in stdio on the executor's thread. stdio's buffer and the descriptor's
+// position are not kept in step, so a file_stream is used with one executor.
+class file_stream {
+public:
+	file_stream(const char* path, const char* mode) : file_(std::fopen(path, mode)) {
+		if (file_ == nullptr) {
+			throw std::system_error(errno, std::generic_category(), path);
+		}
+	}
+
+	file_stream(const file_stream&) = delete;
+	file_stream& operator=(const file_stream&) = delete;
+
+	~file_stream() {
+		if (file_ != nullptr) {
+			std::fclose(file_);
+		}
+	}
+
+	// Returns how many bytes were read, 0 at the end of the file
+	task<std::size_t> read(executor& ex, std::span<std::byte> buffer) {
+		if (ex.ring() != nullptr) {
+			jc_job job {};
+			job.kind = JC_JOB_READ;
+			job.fd = fileno(file_);
+			job.out = bytes(buffer);
+			job.len = buffer.size();
+			job.offset = -1;
+
+			co_return co_await executor::ring_op { ex, job };
+		}
+
+		co_await ex.yield();
+
+		std::size_t got = std::fread(buffer.data(), 1, buffer.size(), file_);
+		if (got < buffer.size() && std::ferror(file_)) {
+			throw std::system_error(errno, std::generic_category(), "File read error");
+		}
+
+		co_return got;
+	}
+
+	task<void> write(executor& ex, std::span<const std::byte> data) {
+		if (ex.ring() != nullptr) {
+			jc_job job {};
+			job.kind = JC_JOB_WRITE;
+			job.fd = fileno(file_);
+			job.in = bytes(data);
+			job.len = data.size();
+			job.offset = -1;
+
+			if (co_await executor::ring_op { ex, job } != data.size()) {
+				throw std::system_error(std::make_error_code(std::errc::io_error), "File writing error");
+			}
+
+			co_return;
+		}
+
+		co_await ex.yield();
+
+		if (std::fwrite(data.data(), 1, data.size(), file_) != data.size()) {
+			throw std::system_error(errno, std::generic_category(), "File writing error");
+		}
+	}
+
+	void close() {
+		std::FILE* f = std::exchange(file_, nullptr);
+		if (std::fclose(f) != 0) {
+			throw std::system_error(errno, std::generic_category(), "File writing error");
+		}
+	}
+
+private:
+	std::FILE* file_;
+};
+
+// Encrypts or decrypts the file at in_path into out_path, buffer_size bytes
+// at a time. The output matches the joelcrypto tool's.
+template <cipher C, mode M = mode::none>
+task<void> crypt_file(executor& ex, const jc_op op, const char* in_path, const char* out_path,
+	std::span<const std::byte> key, std::span<const std::byte> iv = {},
+	const std::size_t buffer_size = 1 << 16) {
+
+	stream<C, M> s(op, key, iv);
+	file_stream input(in_path, "rb");
+	file_stream output(out_path, "wb");
+
+	std::vector<std::byte> in(buffer_size);
+	std::vector<std::byte> out(buffer_size + stream<C, M>::overhead);
+
+	while (std::size_t got = co_await input.read(ex, in)) {
+		std::size_t written = co_await s.async_update(ex, std::span(in).first(got), out);
+		co_await output.write(ex, std::span(out).first(written));
+	}
+
+	std::size_t written = co_await s.async_final(ex, out);
+	co_await output.write(ex, std::span(out).first(written));
+
+	output.close();
+}
+
+}
+
+#endif
@@ -0,0 +1,523 @@
+#ifndef LIB__RING_H
+#define LIB__RING_H
+
+#define RING_BATCH 32			// Jobs a worker takes off its queue at a time
+#define RING_MAX_ENTRIES (1 << 20)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#if !defined(_MSC_VER)
+  #include <pthread.h>
+#endif
+
+#if !defined(_WIN32)
+  #include <unistd.h>
+#endif
+
+#if defined(__linux__)
+  #include <sys/eventfd.h>
+#endif
+
+#include "lib/joelcrypto.h"
+#include "util.h"
+#include "threads.h"
+
+// The job ring behind jc_ring_*. Each worker has its own submission queue,
+// and there is one completion queue. Both are bounded queues where each slot
+// carries a sequence number, so producers only need a compare and swap on the
+// tail to claim a slot, and the single consumer never takes a lock. A worker
+// that finds its queue empty sleeps on its condition variable, and is only
+// woken if a producer sees it asleep.
+//
+// The number of jobs submitted but not reaped is capped at the ring's entries,
+// so no queue can ever fill up and completions always have somewhere to go.
+//
+// Reads and writes block the worker that runs them, not the caller, which is
+// what lets an event loop or the C++ executor go on with other streams while
+// one waits on its disk.
+
+typedef struct {
+	size_t sequence;
+	union {
+		jc_job job;
+		jc_completion done;
+	} u;
+} ring_slot;
+
+typedef struct {
+	ring_slot* slots;
+	size_t mask;
+	size_t tail;		// Next slot producers claim
+	size_t head;		// Next slot the consumer reads
+} ring_queue;
+
+#if !defined(_MSC_VER)
+typedef struct {
+	struct jc_ring* ring;
+	ring_queue queue;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int sleeping;
+} ring_worker;
+
+struct jc_ring {
+	ring_worker* workers;
+	unsigned int worker_count;
+	unsigned int entries;
+	unsigned int in_flight;		// Submitted and not yet reaped
+	int stop;
+	
+	ring_queue completions;
+	pthread_mutex_t lock;
+	pthread_cond_t completed;
+	int waiting;				// The caller is in jc_ring_wait
+	int event_fd;
+};
+#endif
+
+bool ring_queue_init(ring_queue* q, const size_t entries) {
+	size_t size = 1;
+	while (size < entries) {
+		size <<= 1;
+	}
+	
+	q->slots = (ring_slot*)malloc(size * sizeof(ring_slot));
+	if (q->slots == NULL) {
+		return false;
+	}
+	
+	for (size_t i = 0; i < size; i++) {
+		q->slots[i].sequence = i;
+	}
+	
+	q->mask = size - 1;
+	q->tail = 0;
+	q->head = 0;
+	return true;
+}
+
+// Claims the next slot and fills it, from any thread. Returns false if the
+// queue is full.
+bool ring_queue_push(ring_queue* q, const ring_slot* item) {
+	size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	ring_slot* slot;
+	
+	while (true) {
+		slot = &q->slots[pos & q->mask];
+		size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+		
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+	
+	slot->u = item->u;
+	
+	// Hands the slot to the consumer
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Takes the oldest item, from the queue's one consumer. Returns false if there
+// is nothing ready.
+bool ring_queue_pop(ring_queue* q, ring_slot* item) {
+	ring_slot* slot = &q->slots[q->head & q->mask];
+	
+	if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != q->head + 1) {
+		return false;
+	}
+	
+	item->u = slot->u;
+	
+	// Hands the slot back to producers for the next lap
+	__atomic_store_n(&slot->sequence, q->head + q->mask + 1, __ATOMIC_RELEASE);
+	q->head++;
+	return true;
+}
+
+bool ring_queue_empty(ring_queue* q) {
+	ring_slot* slot = &q->slots[q->head & q->mask];
+	return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != q->head + 1;
+}
+
+#if !defined(_MSC_VER)
+// Posts a batch of results, then wakes whoever is waiting for them
+void ring_complete(jc_ring* ring, ring_slot* done, const unsigned int count) {
+	for (unsigned int i = 0; i < count; i++) {
+		// Cannot fail, there is never more in flight than the queue holds
+		ring_queue_push(&ring->completions, &done[i]);
+	}
+	
+	#if defined(__linux__)
+	if (ring->event_fd >= 0) {
+		uint64_t n = count;
+		if (write(ring->event_fd, &n, sizeof(n)) != sizeof(n)) {
+			// Only fails if the counter would overflow, it is readable anyway
+		}
+	}
+	#endif
+	
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	
+	if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&ring->lock);
+		pthread_cond_broadcast(&ring->completed);
+		pthread_mutex_unlock(&ring->lock);
+	}
+}
+
+// Runs a read or write job, going on after short transfers as the daemon's
+// serve_read_all does, so a read only comes up short at the end of the file.
+// Sets how many bytes were moved, and the errno if it fails.
+jc_status ring_run_io(const jc_job* job, size_t* moved, int* error) {
+	*moved = 0;
+	
+	#if defined(_WIN32)
+	*error = ENOSYS;
+	return JC_ERROR_UNSUPPORTED;
+	#else
+	while (*moved < job->len) {
+		size_t left = job->len - *moved;
+		off_t at = (off_t)(job->offset + *moved);
+		ssize_t n;
+		
+		if (job->kind == JC_JOB_READ) {
+			n = job->offset < 0 ? read(job->fd, &job->out[*moved], left) : pread(job->fd, &job->out[*moved], left, at);
+		} else {
+			n = job->offset < 0 ? write(job->fd, &job->in[*moved], left) : pwrite(job->fd, &job->in[*moved], left, at);
+		}
+		
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		
+		if (n < 0) {
+			*error = errno;
+			return JC_ERROR_IO;
+		}
+		
+		// The end of the file, or a write that cannot go on
+		if (n == 0) {
+			break;
+		}
+		
+		*moved += n;
+	}
+	
+	return JC_OK;
+	#endif
+}
+
+void* ring_worker_run(void* arg) {
+	ring_worker* w = (ring_worker*)arg;
+	jc_ring* ring = w->ring;
+	
+	ring_slot batch[RING_BATCH];
+	
+	while (true) {
+		unsigned int count = 0;
+		while (count < RING_BATCH && ring_queue_pop(&w->queue, &batch[count])) {
+			count++;
+		}
+		
+		if (count == 0) {
+			pthread_mutex_lock(&w->lock);
+			__atomic_store_n(&w->sleeping, 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			
+			// Check again now that producers can see we are asleep
+			while (ring_queue_empty(&w->queue) && !__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE)) {
+				pthread_cond_wait(&w->wake, &w->lock);
+			}
+			
+			__atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&w->lock);
+			
+			if (__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE)) {
+				break;
+			}
+			
+			continue;
+		}
+		
+		for (unsigned int i = 0; i < count; i++) {
+			jc_job job = batch[i].u.job;
+			jc_completion* done = &batch[i].u.done;
+			
+			size_t out_len = 0;
+			int error = 0;
+			jc_status status;
+			
+			if (job.kind != JC_JOB_CIPHER) {
+				status = ring_run_io(&job, &out_len, &error);
+			} else {
+				status = jc_update(job.ctx, job.in, job.out, job.len, &out_len);
+				
+				if (status == JC_OK && job.final) {
+					size_t final_len;
+					status = jc_final(job.ctx, &job.out[out_len], &final_len);
+					out_len += final_len;
+				}
+			}
+			
+			done->user_data = job.user_data;
+			done->status = status;
+			done->out_len = out_len;
+			done->error = error;
+		}
+		
+		ring_complete(ring, batch, count);
+	}
+	
+	return NULL;
+}
+#endif
+
+jc_status jc_ring_create(jc_ring** ring, unsigned int workers, unsigned int entries) {
+	if (ring == NULL || entries == 0 || entries > RING_MAX_ENTRIES) {
+		return JC_ERROR_ARGUMENT;
+	}
+	
+	*ring = NULL;
+	
+	#if defined(_MSC_VER)
+	(void)workers;
+	return JC_ERROR_UNSUPPORTED;
+	#else
+	if (workers == 0) {
+		workers = pool_auto_threads();
+	}
+	
+	jc_ring* r = (jc_ring*)calloc(1, sizeof(jc_ring));
+	if (r == NULL) {
+		return JC_ERROR_MEMORY;
+	}
+	
+	r->entries = entries;
+	r->event_fd = -1;
+	
+	r->workers = (ring_worker*)calloc(workers, sizeof(ring_worker));
+	if (r->workers == NULL || !ring_queue_init(&r->completions, entries)) {
+		free(r->workers);
+		free(r);
+		return JC_ERROR_MEMORY;
+	}
+	
+	#if defined(__linux__)
+	r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	#endif
+	
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->completed, NULL);
+	
+	// Workers that fail to start are left out, the ring runs on the rest
+	for (unsigned int i = 0; i < workers; i++) {
+		ring_worker* w = &r->workers[r->worker_count];
+		w->ring = r;
+		
+		if (!ring_queue_init(&w->queue, entries)) {
+			break;
+		}
+		
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->wake, NULL);
+		
+		if (pthread_create(&w->thread, NULL, ring_worker_run, w) != 0) {
+			pthread_mutex_destroy(&w->lock);
+			pthread_cond_destroy(&w->wake);
+			free(w->queue.slots);
+			break;
+		}
+		
+		r->worker_count++;
+	}
+	
+	if (r->worker_count == 0) {
+		jc_ring_destroy(r);
+		return JC_ERROR_MEMORY;
+	}
+	
+	*ring = r;
+	return JC_OK;
+	#endif
+}
+
+jc_status jc_ring_submit(jc_ring* ring, const jc_job* job) {
+	if (ring == NULL || job == NULL) {
+		return JC_ERROR_ARGUMENT;
+	}
+	
+	if (job->kind == JC_JOB_CIPHER ? job->ctx == NULL : (job->kind != JC_JOB_READ && job->kind != JC_JOB_WRITE) || job->fd < 0) {
+		return JC_ERROR_ARGUMENT;
+	}
+	
+	#if defined(_MSC_VER)
+	return JC_ERROR_UNSUPPORTED;
+	#else
+	// Reserve room for the job and its completion
+	unsigned int in_flight = __atomic_load_n(&ring->in_flight, __ATOMIC_RELAXED);
+	do {
+		if (in_flight == ring->entries) {
+			return JC_ERROR_BUSY;
+		}
+	} while (!__atomic_compare_exchange_n(&ring->in_flight, &in_flight, in_flight + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	
+	// A context always goes to the same worker, which keeps its jobs in order,
+	// and so does a descriptor read or written without one. Either is hashed,
+	// as the low bits of a context's address are the same for every context.
+	uintptr_t order = job->ctx != NULL ? (uintptr_t)job->ctx : (uintptr_t)job->fd;
+	uint64_t hash = ((uint64_t)order * 0x9E3779B97F4A7C15ULL) >> 32;
+	ring_worker* w = &ring->workers[hash % ring->worker_count];
+	
+	ring_slot slot;
+	slot.u.job = *job;
+	ring_queue_push(&w->queue, &slot);
+	
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	
+	if (__atomic_load_n(&w->sleeping, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_signal(&w->wake);
+		pthread_mutex_unlock(&w->lock);
+	}
+	
+	return JC_OK;
+	#endif
+}
+
+unsigned int jc_ring_poll(jc_ring* ring, jc_completion* completions, unsigned int max) {
+	if (ring == NULL || completions == NULL) {
+		return 0;
+	}
+	
+	#if defined(_MSC_VER)
+	(void)max;
+	return 0;
+	#else
+	#if defined(__linux__)
+	// Cleared first, so a completion posted after the queue is read still
+	// leaves the eventfd readable
+	if (ring->event_fd >= 0) {
+		uint64_t n;
+		if (read(ring->event_fd, &n, sizeof(n)) != sizeof(n)) {
+			// Nothing was posted since the last poll
+		}
+	}
+	#endif
+	
+	unsigned int count = 0;
+	ring_slot slot;
+	
+	while (count < max && ring_queue_pop(&ring->completions, &slot)) {
+		completions[count++] = slot.u.done;
+	}
+	
+	if (count > 0) {
+		__atomic_sub_fetch(&ring->in_flight, count, __ATOMIC_RELEASE);
+	}
+	
+	#if defined(__linux__)
+	// Completions left behind for the next poll keep the eventfd readable
+	if (ring->event_fd >= 0 && count == max && !ring_queue_empty(&ring->completions)) {
+		uint64_t n = 1;
+		if (write(ring->event_fd, &n, sizeof(n)) != sizeof(n)) {
+			// Already readable
+		}
+	}
+	#endif
+	
+	return count;
+	#endif
+}
+
+unsigned int jc_ring_wait(jc_ring* ring, jc_completion* completions, unsigned int max) {
+	if (ring == NULL || completions == NULL || max == 0) {
+		return 0;
+	}
+	
+	#if defined(_MSC_VER)
+	return 0;
+	#else
+	while (true) {
+		unsigned int count = jc_ring_poll(ring, completions, max);
+		if (count > 0) {
+			return count;
+		}
+		
+		// Nothing would ever complete
+		if (__atomic_load_n(&ring->in_flight, __ATOMIC_ACQUIRE) == 0) {
+			return 0;
+		}
+		
+		pthread_mutex_lock(&ring->lock);
+		__atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		
+		while (ring_queue_empty(&ring->completions)) {
+			pthread_cond_wait(&ring->completed, &ring->lock);
+		}
+		
+		__atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&ring->lock);
+	}
+	#endif
+}
+
+int jc_ring_fd(jc_ring* ring) {
+	#if defined(_MSC_VER)
+	(void)ring;
+	return -1;
+	#else
+	return ring != NULL ? ring->event_fd : -1;
+	#endif
+}
+
+void jc_ring_destroy(jc_ring* ring) {
+	if (ring == NULL) {
+		return;
+	}
+	
+	#if !defined(_MSC_VER)
+	__atomic_store_n(&ring->stop, 1, __ATOMIC_RELEASE);
+	
+	for (unsigned int i = 0; i < ring->worker_count; i++) {
+		ring_worker* w = &ring->workers[i];
+		
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_signal(&w->wake);
+		pthread_mutex_unlock(&w->lock);
+		
+		pthread_join(w->thread, NULL);
+		
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->wake);
+		free(w->queue.slots);
+	}
+	
+	#if defined(__linux__)
+	if (ring->event_fd >= 0) {
+		close(ring->event_fd);
+	}
+	#endif
+	
+	pthread_mutex_destroy(&ring->lock);
+	pthread_cond_destroy(&ring->completed);
+	free(ring->completions.slots);
+	free(ring->workers);
+	free(ring);
+	#endif
+}
+
+#endif
@@ -1,3 +1,8 @@
+// O_DIRECT is only declared by glibc with _GNU_SOURCE
+#if defined(__linux__)
+  #define _GNU_SOURCE
+#endif
+
 #define ERROR_NO_INPUT                "Error: no input provided (-i, --input).\n"
 #define ERROR_MULTIPLE_INPUT          "Error: input is multiply defined.\n"
 #define ERROR_NO_OUTPUT               "Error: no output provided (-o, --output).\n"
@@ -9,7 +14,7 @@
 #define ERROR_CANNOT_GENERATE_IV      "Error: IVs can only be generated while encrypting.\n"
 #define ERROR_KEY_INVALID             "Error: key is invalid.\n"
 #define ERROR_KEY_INVALID_SIZE        "Error: key is not the correct size (%d bytes instead of %d bytes).\n"
-#define ERROR_NO_OPERATION            "Error: no operation provided (--encrypt, --decrypt).\n"
+#define ERROR_NO_OPERATION            "Error: no operation provided (--encrypt, --decrypt, --crack).\n"
 #define ERROR_MULTIPLE_OPERATION      "Error: operation is multiply defined.\n"
 #define ERROR_NO_CIPHER               "Error: no cipher provided (-c, --cipher).\n"
 #define ERROR_MULTIPLE_CIPHER         "Error: cipher is multiply defined.\n"
@@ -21,6 +26,23 @@
 #define ERROR_HEX_INVALID             "Error: HEX:<> contains invalid characters.\n"
 #define ERROR_BASE64_INVALID          "Error: BASE64:<> is not valid base64. Did you forget padding?\n"
 #define ERROR_NO_FILE_SPECIFIED       "Error: no file has been specified in FILE:<>\n"
+#define ERROR_NO_THREADS              "Error: no thread count provided (-t, --threads).\n"
+#define ERROR_MULTIPLE_THREADS        "Error: thread count is multiply defined.\n"
+#define ERROR_NO_BUFFER_SIZE          "Error: no buffer size provided (--buffer-size).\n"
+#define ERROR_MULTIPLE_BUFFER_SIZE    "Error: buffer size is multiply defined.\n"
+#define ERROR_INVALID_BUFFER_SIZE     "Error: invalid buffer size \"%s\".\n"
+#define ERROR_CANNOT_CRACK            "Error: only SHIFT, CAESAR and VIGENERE can be cracked.\n"
+#define ERROR_CRACK_REWIND            "Error: --crack reads the input twice, so it cannot be a pipe (-i FILE:<>).\n"
+#define ERROR_INVALID_THREADS         "Error: thread count must be a positive integer or auto.\n"
+#define ERROR_NO_CPUS                 "Error: no CPU list provided (--cpus).\n"
+#define ERROR_NO_STREAM_STORES        "Error: no setting provided (--stream-stores).\n"
+#define ERROR_INVALID_STREAM_STORES   "Error: --stream-stores must be auto, on or off.\n"
+#define ERROR_IN_PLACE_OUTPUT         "Error: --in-place writes back over the input, no output should be given.\n"
+#define ERROR_IN_PLACE_LENGTH         "Error: --in-place cannot be used with ECB or CBC, as padding changes the length of the data.\n"
+#define ERROR_IV_PRINT_STDOUT         "Error: a generated IV cannot be printed while the output goes to STDOUT, save it with FILE:<>.\n"
+#define ERROR_IN_PLACE_NOT_FILE       "Error: --in-place needs a FILE:<> input.\n"
+#define ERROR_SPARSE_MODE             "Error: --sparse needs AES in CTR mode.\n"
+#define ERROR_SPARSE_IN_PLACE         "Error: --sparse cannot be used with --in-place.\n"
 
 #define WARNING_IV_NOT_NEEDED         "Warning: an IV is not used by the selected cipher, and will be ignored.\n"
 #define WARNING_IV_TOO_LONG           "Warning: IV exceeds 128 bits, only the first 128 bits will be used.\n"
@@ -29,7 +51,9 @@
 #define WARNING_PADDING_IV            "Warning: the provided IV is too short and will be zero-padded to 128 bits.\n"
 #define WARNING_KEY_TRUNCATION        "Warning: the provided key is too long and will be truncated to %d bits.\n"
 #define WARNING_KEY_ZERO_PADDING      "Warning: the provided key is too short and will be zero-padded to %d bits.\n"
-#define WARNING_DATA_NOT_BLOCKED      "Warning: the provided input data was not a multiple of the block size!\nThe ending bytes were ignored. Did you select the right cipher mode?\n" 
+#define WARNING_DIRECT_UNSUPPORTED    "Warning: --direct-io is not supported on this platform, and will be ignored.\n"
+#define WARNING_PREALLOCATE_UNSUPPORTED "Warning: --preallocate is not supported on this platform, and will be ignored.\n"
+#define WARNING_THREADS_NOT_USED      "Warning: the selected cipher runs on a single thread, --threads will be ignored.\n"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,23 +63,37 @@
 #include "windows.h"
 #include "util.h"
 #include "buffered_container.h"
+#include "threads.h"
 #include "alph/util.h"
 #include "block/util.h"
 #include "types.h"
 #include "alph/vigenere.h"
 #include "alph/caesar_shift.h"
 #include "block/aes.h"
+#include "block/sparse.h"
 #include "stream/rc4.h"
+#include "stream/xor.h"
+#include "alph/crack.h"
+#include "serve.h"
+#include "batch.h"
 
 #include "arguments.h"
 	
 int main(int argc, char** argv) {
-	printf("\n");
+	stdout_is_data = output_is_stdout(argc, argv);
+	refuse_same_file(argc, argv);
+	
+	if (!stdout_is_data) {
+		printf("\n");
+	}
 	
 	if (argc == 1) {
 		print_help_msg();
 	}
 	
+	bool buffer_size_defined = false,
+	     huge_pages = false;
+	
 	for (int i = 0; i < argc; i++) {
 		if (
 			strcmp(argv[i], "-h") == 0 ||
@@ -63,8 +101,110 @@ int main(int argc, char** argv) {
 		) {
 			print_help_msg();
 		}
+		
+		// The buffer size has to be known before any input or output is opened
+		if (strcmp(argv[i], "--buffer-size") == 0) {
+			if (buffer_size_defined) {
+				fprintf(stderr, ERROR_MULTIPLE_BUFFER_SIZE);
+				return 1;
+			}
+			
+			if (i + 1 == argc) {
+				fprintf(stderr, ERROR_NO_BUFFER_SIZE);
+				return 1;
+			}
+			
+			size_t size = parse_size(argv[i + 1]);
+			if (size == 0) {
+				fprintf(stderr, ERROR_INVALID_BUFFER_SIZE, argv[i + 1]);
+				return 1;
+			}
+			
+			bc_buffer_size = bc_round_size(size);
+			buffer_size_defined = true;
+		}
+		
+		// Same for how files are read and written
+		if (strcmp(argv[i], "--async-io") == 0) {
+			bc_use_async = true;
+		}
+		
+		if (strcmp(argv[i], "--direct-io") == 0) {
+			#if defined(O_DIRECT)
+			bc_use_direct = true;
+			#else
+			fprintf(stderr, WARNING_DIRECT_UNSUPPORTED);
+			#endif
+		}
+		
+		// The CPU list is needed before --threads auto is worked out
+		if (strcmp(argv[i], "--cpus") == 0) {
+			if (i + 1 == argc) {
+				fprintf(stderr, ERROR_NO_CPUS);
+				return 1;
+			}
+			
+			if (!pool_parse_cpus(argv[i + 1])) {
+				fprintf(stderr, ERROR_INVALID_CPUS, argv[i + 1]);
+				return 1;
+			}
+		}
+		
+		if (strcmp(argv[i], "--huge-pages") == 0) {
+			huge_pages = true;
+		}
+		
+		if (strcmp(argv[i], "--stream-stores") == 0) {
+			if (i + 1 == argc) {
+				fprintf(stderr, ERROR_NO_STREAM_STORES);
+				return 1;
+			}
+			
+			if (strcasecmp(argv[i + 1], "auto") == 0) {
+				bc_stream_mode = STREAM_AUTO;
+			} else if (strcasecmp(argv[i + 1], "on") == 0) {
+				bc_stream_mode = STREAM_ON;
+			} else if (strcasecmp(argv[i + 1], "off") == 0) {
+				bc_stream_mode = STREAM_OFF;
+			} else {
+				fprintf(stderr, ERROR_INVALID_STREAM_STORES);
+				return 1;
+			}
+		}
+		
+		if (strcmp(argv[i], "--preallocate") == 0) {
+			#if defined(__linux__)
+			bc_use_preallocate = true;
+			#else
+			fprintf(stderr, WARNING_PREALLOCATE_UNSUPPORTED);
+			#endif
+		}
+	}
+	
+	// The daemon, its client and batch mode take the rest of the arguments themselves
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--serve") == 0) {
+			return serve_main(argc, argv);
+		}
+		
+		if (strcmp(argv[i], "--client") == 0) {
+			return client_main(argc, argv);
+		}
+		
+		if (strcmp(argv[i], "--batch") == 0) {
+			return batch_main(argc, argv);
+		}
 	}
 	
+	// O_DIRECT transfers whole sectors, so file buffers are a multiple of them
+	if (bc_use_direct) {
+		bc_buffer_size = (bc_buffer_size + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+	}
+	
+	// Room for the input, output, key and IV buffers along with their
+	// io_uring and encoding buffers, and the ciphers' scratch state
+	arena_init(&run_arena, ARENA_BUFFERS * bc_buffer_size + ARENA_HUGE_PAGE, huge_pages);
+	
 	// Default assumptions
 	bool input_defined = false,		// If input has been defined
 	     output_defined = false,	// If output has been defined
@@ -75,9 +215,13 @@ int main(int argc, char** argv) {
 		 will_generate_iv =	false,	// If we will generate an IV for encryption
 		 key_needed = true,			// If we need a key for selected cipher
 		 key_defined = false,		// If the key has been defined
-		 cipher_defined = false;	// If the cipher has been choosen
+		 cipher_defined = false,	// If the cipher has been choosen
+		 threads_defined = false,	// If a thread count has been given
+		 in_place = false,			// If the input is rewritten with the output
+		 sparse = false;			// If only the data extents of a sparse file are encrypted
 	
 	char* iv_arguments;
+	char* input_arguments = NULL;
 	
 	buffered_container* input  = NULL;
 	buffered_container* output = NULL;
@@ -93,6 +237,10 @@ int main(int argc, char** argv) {
 	unsigned int key_size_bytes;
 	bool use_key_size_bytes = false;
 	
+	bool xor_cycle_key = false;
+	
+	unsigned int threads = 1;
+	
 	cipher_t choosen_cipher;
 	cmode_t choosen_mode;
 	crypto_op operation;
@@ -111,17 +259,18 @@ int main(int argc, char** argv) {
 		) {
 			
 			if (input_defined) {
-				printf(ERROR_MULTIPLE_INPUT);
+				fprintf(stderr, ERROR_MULTIPLE_INPUT);
 				return 1;
 			}
 			
 			if (last_arg) {
-				printf(ERROR_NO_INPUT);
+				fprintf(stderr, ERROR_NO_INPUT);
 				return 1;
 			}
 			
 			char* next_arg = argv[++j];
 			input = parse_keywords_to_input_bc(next_arg);
+			input_arguments = next_arg;
 			input_defined = true;
 			
 		}
@@ -137,12 +286,12 @@ int main(int argc, char** argv) {
 		) {
 			
 			if (output_defined) {
-				printf(ERROR_MULTIPLE_OUTPUT);
+				fprintf(stderr, ERROR_MULTIPLE_OUTPUT);
 				return 1;
 			}
 			
 			if (last_arg) {
-				printf(ERROR_NO_OUTPUT);
+				fprintf(stderr, ERROR_NO_OUTPUT);
 				return 1;
 			}
 			
@@ -160,7 +309,7 @@ int main(int argc, char** argv) {
 			strcmp(argv[j], "--encrypt") == 0
 		) {			
 			if (operation_defined) {
-				printf(ERROR_MULTIPLE_OPERATION);
+				fprintf(stderr, ERROR_MULTIPLE_OPERATION);
 				return 1;
 			}
 			
@@ -177,13 +326,13 @@ int main(int argc, char** argv) {
 			strcmp(argv[j], "--decrypt") == 0
 		) {			
 			if (operation_defined) {
-				printf(ERROR_MULTIPLE_OPERATION);
+				fprintf(stderr, ERROR_MULTIPLE_OPERATION);
 				return 1;
 			}
 			
 			can_generate_iv = false;
 			if (will_generate_iv) {
-				printf(ERROR_CANNOT_GENERATE_IV);
+				fprintf(stderr, ERROR_CANNOT_GENERATE_IV);
 				return 1;
 			}
 			
@@ -194,6 +343,29 @@ int main(int argc, char** argv) {
 		
 		
 		
+		// Handle crack operation
+		//---------------------------
+		else if (
+			strcmp(argv[j], "--crack") == 0
+		) {			
+			if (operation_defined) {
+				fprintf(stderr, ERROR_MULTIPLE_OPERATION);
+				return 1;
+			}
+			
+			can_generate_iv = false;
+			if (will_generate_iv) {
+				fprintf(stderr, ERROR_CANNOT_GENERATE_IV);
+				return 1;
+			}
+			
+			operation = CRACK;
+			operation_defined = true;
+		}
+		//---------------------------
+		
+		
+		
 		// Handle IV
 		//---------------------------
 		else if (
@@ -202,16 +374,16 @@ int main(int argc, char** argv) {
 		) {
 			
 			if (iv_defined) {
-				printf(ERROR_MULTIPLE_IV);
+				fprintf(stderr, ERROR_MULTIPLE_IV);
 				return 1;
 			}
 			
 			if (!iv_needed) {
-				printf(WARNING_IV_NOT_NEEDED);
+				fprintf(stderr, WARNING_IV_NOT_NEEDED);
 			}
 			
 			if (last_arg) {
-				printf(ERROR_NO_IV);
+				fprintf(stderr, ERROR_NO_IV);
 				return 1;
 			}
 			
@@ -223,7 +395,7 @@ int main(int argc, char** argv) {
 			if (strncasecmp(next_arg, GEN, GENlen) == 0) {
 				// Argument begins with GENERATE, create an IV
 				if (!can_generate_iv) {
-					printf(ERROR_CANNOT_GENERATE_IV);
+					fprintf(stderr, ERROR_CANNOT_GENERATE_IV);
 					return 1;
 				}
 				
@@ -237,11 +409,11 @@ int main(int argc, char** argv) {
 				iv_buffer = iv->buffer;
 				iv_len = iv->buffer_len;
 				if (iv_len > 16) {
-					printf(WARNING_IV_TOO_LONG);
+					fprintf(stderr, WARNING_IV_TOO_LONG);
 				}
 				
 				if (iv_len < 16) {
-					printf(WARNING_PADDING_IV);
+					fprintf(stderr, WARNING_PADDING_IV);
 				}
 			}
 			
@@ -259,12 +431,12 @@ int main(int argc, char** argv) {
 		) {
 			
 			if (key_defined) {
-				printf(ERROR_MULTIPLE_KEY);
+				fprintf(stderr, ERROR_MULTIPLE_KEY);
 				return 1;
 			}
 			
 			if (last_arg) {
-				printf(ERROR_NO_KEY);
+				fprintf(stderr, ERROR_NO_KEY);
 				return 1;
 			}
 			
@@ -280,6 +452,98 @@ int main(int argc, char** argv) {
 		
 		
 		
+		// Handle buffer size and streaming stores
+		//---------------------------
+		else if (
+			strcmp(argv[j], "--buffer-size") == 0 ||
+			strcmp(argv[j], "--stream-stores") == 0
+		) {
+			// Already handled before parsing, skip over the value
+			j++;
+		}
+		//---------------------------
+		
+		
+		
+		// Handle in-place
+		//---------------------------
+		else if (
+			strcmp(argv[j], "--in-place") == 0
+		) {
+			in_place = true;
+		}
+		//---------------------------
+		
+		
+		
+		// Handle sparse files
+		//---------------------------
+		else if (
+			strcmp(argv[j], "--sparse") == 0
+		) {
+			sparse = true;
+		}
+		//---------------------------
+		
+		
+		
+		// Handle asynchronous I/O
+		//---------------------------
+		else if (
+			strcmp(argv[j], "--async-io") == 0 ||
+			strcmp(argv[j], "--direct-io") == 0 ||
+			strcmp(argv[j], "--preallocate") == 0 ||
+			strcmp(argv[j], "--huge-pages") == 0
+		) {
+			// Already handled before parsing
+		}
+		//---------------------------
+		
+		
+		
+		// Handle thread count
+		//---------------------------
+		else if (
+			strcmp(argv[j], "-t") == 0 ||
+			strcmp(argv[j], "--threads") == 0
+		) {
+			if (threads_defined) {
+				fprintf(stderr, ERROR_MULTIPLE_THREADS);
+				return 1;
+			}
+			
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_THREADS);
+				return 1;
+			}
+			
+			char* next_arg = argv[++j];
+			int count = strcasecmp(next_arg, "auto") == 0 ? (int)pool_auto_threads() : atoi(next_arg);
+			
+			if (count <= 0) {
+				fprintf(stderr, ERROR_INVALID_THREADS);
+				return 1;
+			}
+			
+			threads = count;
+			threads_defined = true;
+		}
+		//---------------------------
+		
+		
+		
+		// Handle CPU list
+		//---------------------------
+		else if (
+			strcmp(argv[j], "--cpus") == 0
+		) {
+			// Already handled before parsing
+			j++;
+		}
+		//---------------------------
+		
+		
+		
 		// Handle cipher
 		//---------------------------
 		else if (
@@ -287,12 +551,12 @@ int main(int argc, char** argv) {
 			strcmp(argv[j], "--cipher") == 0
 		) {
 			if (cipher_defined) {
-				printf(ERROR_MULTIPLE_CIPHER);
+				fprintf(stderr, ERROR_MULTIPLE_CIPHER);
 				return 1;
 			}
 			
 			if (last_arg) {
-				printf(ERROR_NO_CIPHER);
+				fprintf(stderr, ERROR_NO_CIPHER);
 				return 1;
 			}
 			
@@ -306,11 +570,11 @@ int main(int argc, char** argv) {
 				iv_needed = false;
 				
 				if (cipher_args[1] != NULL) {
-					printf(WARNING_EXTRA_DATA, cipher_args[1], next_arg);
+					fprintf(stderr, WARNING_EXTRA_DATA, cipher_args[1], next_arg);
 				}
 				
 				if (cipher_args[2] != NULL) {
-					printf(WARNING_EXTRA_DATA, cipher_args[2], next_arg);
+					fprintf(stderr, WARNING_EXTRA_DATA, cipher_args[2], next_arg);
 				}
 				
 			}
@@ -326,15 +590,15 @@ int main(int argc, char** argv) {
 				key_needed = false;
 				
 				if (key_defined) {
-					printf(WARNING_KEY_NOT_NEEDED);
+					fprintf(stderr, WARNING_KEY_NOT_NEEDED);
 				}
 				
 				if (cipher_args[1] != NULL) {
-					printf(WARNING_EXTRA_DATA, cipher_args[1], next_arg);
+					fprintf(stderr, WARNING_EXTRA_DATA, cipher_args[1], next_arg);
 				}
 				
 				if (cipher_args[2] != NULL) {
-					printf(WARNING_EXTRA_DATA, cipher_args[2], next_arg);
+					fprintf(stderr, WARNING_EXTRA_DATA, cipher_args[2], next_arg);
 				}
 				
 			}
@@ -349,11 +613,11 @@ int main(int argc, char** argv) {
 				iv_needed = false;
 				
 				if (cipher_args[1] != NULL) {
-					printf(WARNING_EXTRA_DATA, cipher_args[1], next_arg);
+					fprintf(stderr, WARNING_EXTRA_DATA, cipher_args[1], next_arg);
 				}
 				
 				if (cipher_args[2] != NULL) {
-					printf(WARNING_EXTRA_DATA, cipher_args[2], next_arg);
+					fprintf(stderr, WARNING_EXTRA_DATA, cipher_args[2], next_arg);
 				}
 				
 			}
@@ -368,11 +632,35 @@ int main(int argc, char** argv) {
 				iv_needed = false;
 				
 				if (cipher_args[1] != NULL) {
-					printf(WARNING_EXTRA_DATA, cipher_args[1], next_arg);
+					fprintf(stderr, WARNING_EXTRA_DATA, cipher_args[1], next_arg);
+				}
+				
+				if (cipher_args[2] != NULL) {
+					fprintf(stderr, WARNING_EXTRA_DATA, cipher_args[2], next_arg);
+				}
+				
+			}
+			//---------------------------
+			
+			
+			
+			// XOR cipher
+			//---------------------------
+			else if (strcasecmp(cipher_args[0], "XOR") == 0) {
+				choosen_cipher = XOR;
+				iv_needed = false;
+				
+				if (cipher_args[1] != NULL) {
+					if (strcasecmp(cipher_args[1], "CYCLE") == 0) {
+						xor_cycle_key = true;
+					} else {
+						fprintf(stderr, ERROR_INVALID_ARGUMENT, cipher_args[1]);
+						return 1;
+					}
 				}
 				
 				if (cipher_args[2] != NULL) {
-					printf(WARNING_EXTRA_DATA, cipher_args[2], next_arg);
+					fprintf(stderr, WARNING_EXTRA_DATA, cipher_args[2], next_arg);
 				}
 				
 			}
@@ -388,7 +676,7 @@ int main(int argc, char** argv) {
 				
 				// Empty key size
 				if (cipher_args[1] == NULL) {
-					printf(ERROR_MUST_SELECT_CIPHER_KS);
+					fprintf(stderr, ERROR_MUST_SELECT_CIPHER_KS);
 					exit(1);
 				}
 			
@@ -419,7 +707,7 @@ int main(int argc, char** argv) {
 				// Invalid key size
 				//---------------------------
 				else {
-					printf(ERROR_INVALID_ARGUMENT, cipher_args[1]);
+					fprintf(stderr, ERROR_INVALID_ARGUMENT, cipher_args[1]);
 					return 1;
 				}
 				//---------------------------
@@ -427,7 +715,7 @@ int main(int argc, char** argv) {
 				
 				// Empty mode
 				if (cipher_args[2] == NULL) {
-					printf(ERROR_MUST_SELECT_CIPHER_MODE);
+					fprintf(stderr, ERROR_MUST_SELECT_CIPHER_MODE);
 					exit(1);
 				}
 				
@@ -475,7 +763,7 @@ int main(int argc, char** argv) {
 				// Invalid mode
 				//---------------------------
 				else {
-					printf(ERROR_INVALID_ARGUMENT, cipher_args[2]);
+					fprintf(stderr, ERROR_INVALID_ARGUMENT, cipher_args[2]);
 					return 1;
 				}
 				//---------------------------
@@ -484,7 +772,7 @@ int main(int argc, char** argv) {
 			// Invalid cipher
 			//---------------------------
 			} else {
-				printf(ERROR_INVALID_CIPHER, cipher_args[0]);
+				fprintf(stderr, ERROR_INVALID_CIPHER, cipher_args[0]);
 				return 1;
 			}
 			//---------------------------
@@ -492,10 +780,11 @@ int main(int argc, char** argv) {
 			
 			// Check IV status for choosen cipher
 			if (!iv_needed && iv_defined) {
-				printf(WARNING_IV_NOT_NEEDED);
+				fprintf(stderr, WARNING_IV_NOT_NEEDED);
 			}
 				
 			
+			free_split_string(cipher_args);
 			cipher_defined = true;
 		}
 		//---------------------------
@@ -505,7 +794,7 @@ int main(int argc, char** argv) {
 		// Handle invalid argument
 		//---------------------------
 		else {
-			printf(ERROR_INVALID_ARGUMENT, argv[j]);
+			fprintf(stderr, ERROR_INVALID_ARGUMENT, argv[j]);
 			exit(1);
 		}
 		//---------------------------
@@ -514,38 +803,105 @@ int main(int argc, char** argv) {
 	
 	// Post-parsing validity checks
 	if (!input_defined) {
-		printf(ERROR_NO_INPUT);
+		fprintf(stderr, ERROR_NO_INPUT);
 		return 1;
 	}
 	
-	if (!output_defined) {
-		printf(ERROR_NO_OUTPUT);
+	if (in_place && output_defined) {
+		fprintf(stderr, ERROR_IN_PLACE_OUTPUT);
+		return 1;
+	}
+	
+	if (!output_defined && !in_place) {
+		fprintf(stderr, ERROR_NO_OUTPUT);
 		return 1;
 	}
 	
 	if (!cipher_defined) {
-		printf(ERROR_NO_CIPHER);
+		fprintf(stderr, ERROR_NO_CIPHER);
 		return 1;
 	}
 	
 	if (!operation_defined) {
-		printf(ERROR_NO_OPERATION);
+		fprintf(stderr, ERROR_NO_OPERATION);
 		return 1;
 	}
 	
+	if (operation == CRACK) {
+		if (
+			choosen_cipher != SHIFT &&
+			choosen_cipher != CAESAR &&
+			choosen_cipher != VIGENERE
+		) {
+			fprintf(stderr, ERROR_CANNOT_CRACK);
+			return 1;
+		}
+		
+		// The key is found in one pass and the text decrypted in a second
+		if (!bc_rewindable(input)) {
+			fprintf(stderr, ERROR_CRACK_REWIND);
+			return 1;
+		}
+		
+		// Finding the key is the whole point
+		if (key_defined) {
+			fprintf(stderr, WARNING_KEY_NOT_NEEDED);
+		}
+		
+		key_needed = false;
+	}
+	
 	if (key_needed && !key_defined) {
-		printf(ERROR_NO_KEY);
+		fprintf(stderr, ERROR_NO_KEY);
 		return 1;
 	}
 	
 	if (iv_needed && !iv_defined) {
-		printf(ERROR_NO_IV);
+		fprintf(stderr, ERROR_NO_IV);
+		return 1;
+	}
+	
+	if (threads > 1 && choosen_cipher != VIGENERE && operation != CRACK) {
+		fprintf(stderr, WARNING_THREADS_NOT_USED);
+	}
+	
+	if (sparse && (operation == CRACK || choosen_cipher != AES || choosen_mode != CTR)) {
+		fprintf(stderr, ERROR_SPARSE_MODE);
+		return 1;
+	}
+	
+	if (sparse && in_place) {
+		fprintf(stderr, ERROR_SPARSE_IN_PLACE);
 		return 1;
 	}
 	
+	if (in_place) {
+		if (choosen_cipher == AES && (choosen_mode == ECB || choosen_mode == CBC)) {
+			fprintf(stderr, ERROR_IN_PLACE_LENGTH);
+			return 1;
+		}
+		
+		// An interrupted run can only be picked up again if the cipher's
+		// state at any offset does not depend on the data before it
+		bool resumable = operation != CRACK && !(choosen_cipher == AES && choosen_mode == CFB);
+		
+		output = parse_keywords_to_in_place_bc(input_arguments, resumable);
+		
+		// The journal may have put back bytes the input had already read
+		bc_rewind(input);
+	}
+	
+	// The output is the same length as the input, apart from padding, which
+	// adds at most one block. Decrypting only ever makes it shorter.
+	unsigned long long input_size;
+	if (bc_use_preallocate && !in_place && !sparse && operation != CRACK && bc_input_size(input, &input_size)) {
+		bool padded = choosen_cipher == AES && (choosen_mode == ECB || choosen_mode == CBC);
+		bc_preallocate(output, input_size + (padded && operation == ENCRYPT ? AES_BLOCK_SIZE : 0));
+	}
+	
 	// Key checks
 	if (use_key_size_bytes && key_len > key_size_bytes) {
-		printf(WARNING_KEY_TRUNCATION, key_size_bytes * 8);
+		fprintf(stderr, WARNING_KEY_TRUNCATION, key_size_bytes * 8);
 		
 		key->buffer_len = key_size_bytes;
 		key_len = key_size_bytes;
@@ -553,9 +909,9 @@ int main(int argc, char** argv) {
 	
 	if (use_key_size_bytes && key_len < key_size_bytes) {
 		// This should never trigger
-		assert(key_size_bytes < BUFFER_SIZE);
+		assert(key_size_bytes < key->buffer_size);
 		
-		printf(WARNING_KEY_ZERO_PADDING, key_size_bytes * 8);
+		fprintf(stderr, WARNING_KEY_ZERO_PADDING, key_size_bytes * 8);
 		
 		for (unsigned int y = key->buffer_len; y < key_size_bytes; y++) {
 			key->buffer[y] = 0;
@@ -584,35 +940,62 @@ int main(int argc, char** argv) {
 		iv_len = AES_BLOCK_SIZE;
 		
 		iv = parse_keywords_to_output_bc(iv_arguments);
+		
+		if (stdout_is_data && iv->pf != NO_PRINT) {
+			fprintf(stderr, ERROR_IV_PRINT_STDOUT);
+			return 1;
+		}
+		
 		memcpy(iv->buffer, state, AES_BLOCK_SIZE);
 		iv->buffer_len = iv_len;
 		
-		printf("IV generated ");
+		fprintf(MESSAGES, "IV generated ");
 		iv_buffer = iv->buffer;
 		bc_flush(iv);
-		printf("\n");
+		fprintf(MESSAGES, "\n");
 		bc_fclose(iv);
 	}
 	
-	printf("\n");
+	if (!stdout_is_data) {
+		printf("\n");
+	}
 	
 	switch (choosen_cipher) {
 		case VIGENERE:
+			if (operation == CRACK) {
+				crack_vigenere(input, output, threads);
+				break;
+			}
+			
 			if (vigenere_keycheck(key_buffer, key_len)) {
-				vigenere(input, output, key_buffer, key_len, operation);
+				if (threads > 1) {
+					vigenere_mt(input, output, key_buffer, key_len, operation, threads);
+				} else {
+					vigenere(input, output, key_buffer, key_len, operation);
+				}
 				break;
 			} else {
-				printf("Error: key is invalid for Vigenere cipher.\n");
+				fprintf(stderr, "Error: key is invalid for Vigenere cipher.\n");
 				break;
 			}
 		
 		case CAESAR: 
+			if (operation == CRACK) {
+				crack_shift(input, output);
+				break;
+			}
+			
 			caesar(input, output, operation);
 			break;
 			
 		case SHIFT:
+			if (operation == CRACK) {
+				crack_shift(input, output);
+				break;
+			}
+			
 			if (atoi((char*)key_buffer) == 0) {
-				printf("Error: key is invalid for shift cipher.\n");
+				fprintf(stderr, "Error: key is invalid for shift cipher.\n");
 				break;
 			}
 			
@@ -622,6 +1005,10 @@ int main(int argc, char** argv) {
 		case RC4:
 			rc4(input, output, key_buffer, key_len, operation);
 			break;
+			
+		case XOR:
+			xor_cipher(input, output, key, xor_cycle_key, operation);
+			break;
 		
 		case AES:
 			switch (choosen_mode) {
@@ -637,7 +1024,7 @@ int main(int argc, char** argv) {
 							
 						default:
 							// Future-proofing, should never print
-							printf("Error: Unsupported operation for AES: '%d'\n", operation);
+							fprintf(stderr, "Error: Unsupported operation for AES: '%d'\n", operation);
 							break;
 					}
 					
@@ -655,7 +1042,7 @@ int main(int argc, char** argv) {
 							
 						default:
 							// Future-proofing, should never print
-							printf("Error: Unsupported operation for AES: '%d'\n", operation);
+							fprintf(stderr, "Error: Unsupported operation for AES: '%d'\n", operation);
 							break;
 					}
 					
@@ -673,7 +1060,7 @@ int main(int argc, char** argv) {
 							
 						default:
 							// Future-proofing, should never print
-							printf("Error: Unsupported operation for AES: '%d'\n", operation);
+							fprintf(stderr, "Error: Unsupported operation for AES: '%d'\n", operation);
 							break;
 					}
 					
@@ -691,7 +1078,7 @@ int main(int argc, char** argv) {
 							
 						default:
 							// Future-proofing, should never print
-							printf("Error: Unsupported operation for AES: '%d'\n", operation);
+							fprintf(stderr, "Error: Unsupported operation for AES: '%d'\n", operation);
 							break;
 					}
 					
@@ -700,16 +1087,24 @@ int main(int argc, char** argv) {
 				case CTR:
 					switch (operation) {
 						case ENCRYPT:
-							CTR_encrypt(AES_encrypt, input, output, iv_buffer, AES_BLOCK_SIZE, AES_BLOCK_SIZE, key_buffer, key_len);
+							if (sparse) {
+								SPARSE_CTR_encrypt(AES_encrypt, input, output, iv_buffer, AES_BLOCK_SIZE, AES_BLOCK_SIZE, key_buffer, key_len);
+							} else {
+								CTR_encrypt(AES_encrypt, input, output, iv_buffer, AES_BLOCK_SIZE, AES_BLOCK_SIZE, key_buffer, key_len);
+							}
 							break;
 					
 						case DECRYPT:
-							CTR_decrypt(AES_encrypt, input, output, iv_buffer, AES_BLOCK_SIZE, AES_BLOCK_SIZE, key_buffer, key_len);
+							if (sparse) {
+								SPARSE_CTR_decrypt(AES_encrypt, input, output, iv_buffer, AES_BLOCK_SIZE, AES_BLOCK_SIZE, key_buffer, key_len);
+							} else {
+								CTR_decrypt(AES_encrypt, input, output, iv_buffer, AES_BLOCK_SIZE, AES_BLOCK_SIZE, key_buffer, key_len);
+							}
 							break;
 							
 						default:
 							// Future-proofing, should never print
-							printf("Error: Unsupported operation for AES: '%d'\n", operation);
+							fprintf(stderr, "Error: Unsupported operation for AES: '%d'\n", operation);
 							break;
 					}
 					
@@ -717,18 +1112,26 @@ int main(int argc, char** argv) {
 			}
 	}
 	
-	printf("\n");
+	if (!stdout_is_data) {
+		printf("\n");
+	}
 	
-	free(input);
-	free(output);
+	bc_fclose(input);
+	bc_fclose(output);
+	bc_free(input);
+	bc_free(output);
 	
 	if (key != NULL) {
-		free(key);
+		bc_fclose(key);
+		bc_free(key);
 	}
 	
 	if (iv != NULL) {
-		free(iv);
+		bc_fclose(iv);
+		bc_free(iv);
 	}
 	
+	pool_stop();
+	arena_release(&run_arena);
 	return 0;
 }
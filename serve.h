@@ -0,0 +1,1185 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#define SERVE_MAGIC 0x3153434A		// JCS1 in memory on little endian machines
+#define SERVE_MAX_PATHS 8192		// Both paths of a SERVE_PATHS request
+#define SERVE_KEY_LINE 8192
+#define SERVE_ACCEPT_BACKOFF 10000	// Microseconds a worker waits when out of descriptors
+
+#define ERROR_SERVE_UNSUPPORTED  "Error: --serve and --client need UNIX domain sockets, which this platform does not have.\n"
+#define ERROR_NO_SOCKET          "Error: no socket path provided (--serve, --client).\n"
+#define ERROR_SOCKET_TOO_LONG    "Error: socket path \"%s\" is too long.\n"
+#define ERROR_SOCKET             "Error: socket \"%s\": %s.\n"
+#define ERROR_ALREADY_SERVING    "Error: a daemon is already serving on \"%s\".\n"
+#define ERROR_NO_KEY_FILE        "Error: no key file provided (--keys).\n"
+#define ERROR_KEY_FILE           "Error: cannot read key file \"%s\".\n"
+#define ERROR_KEY_FILE_LINE      "Error: line %u of the key file is not <id> <cipher> [key].\n"
+#define ERROR_KEY_FILE_KEY       "Error: key %u in the key file: %s.\n"
+#define ERROR_KEY_FILE_DUPLICATE "Error: key %u is defined more than once in the key file.\n"
+#define ERROR_NO_KEY_ID          "Error: no key id provided (--key-id).\n"
+#define ERROR_INVALID_KEY_ID     "Error: invalid key id \"%s\".\n"
+#define ERROR_CLIENT_FILE        "Error: the client only takes FILE:<> inputs and outputs, or STDIN with STDOUT.\n"
+#define ERROR_CLIENT_STDIO       "Error: the client takes STDIN and STDOUT only as a pair.\n"
+#define ERROR_CLIENT_IN_PLACE    "Error: --in-place needs a FILE:<> input and no output.\n"
+#define ERROR_CLIENT_BY_PATH     "Error: --by-path needs a FILE:<> input and output, and cannot be used with --in-place.\n"
+#define ERROR_CLIENT_PATHS_LONG  "Error: the input and output paths are too long to send (--by-path).\n"
+#define ERROR_CLIENT_OPEN        "Error: cannot open \"%s\": %s.\n"
+#define ERROR_SERVE_FAILED       "Error: %s.\n"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#if !defined(_WIN32)
+  #include <unistd.h>
+  #include <fcntl.h>
+  #include <signal.h>
+  #include <pthread.h>
+  #include <sys/mman.h>
+  #include <sys/socket.h>
+  #include <sys/stat.h>
+  #include <sys/un.h>
+#endif
+
+#include "util.h"
+#include "buffered_container.h"
+#include "threads.h"
+#include "arguments.h"
+
+// Requests run through the library, whose contexts report errors instead of
+// exiting, so one bad request cannot take the daemon down with it. The tool is
+// a single translation unit, so the library is compiled in here.
+#include "lib/joelcrypto.c"
+
+// A local daemon that keeps keys set up, so scripts encrypting many small
+// files pay for a connection per file instead of a process start, argument
+// parsing and key schedule. Keys are loaded once from a key file and named by
+// id, and never cross the socket. A pool of workers, each blocked in accept,
+// takes connections, and each connection may send any number of requests.
+//
+// The protocol is a fixed size request and reply. The client opens the files
+// itself and passes the descriptors along with SCM_RIGHTS, so the daemon reads
+// and writes with the client's access to them. Absolute paths can be sent
+// instead, which the daemon opens itself with its own access.
+//
+// For large payloads the client can also pass a single descriptor, usually a
+// memfd it has filled, which the daemon runs through the cipher in place. The
+// data never crosses the socket, the reply only says it is done. A memfd
+// sealed against shrinking is mapped, so it is not even copied into a buffer.
+// Anything else, such as a file the client could truncate while the daemon
+// has it mapped, which would kill the daemon with SIGBUS, is read and written
+// back a buffer at a time. Only ciphers that keep the length of the data can
+// work this way, so not ECB or CBC.
+
+enum serve_type {
+	SERVE_FDS = 1,				// The input and output descriptors come with the request
+	SERVE_PATHS = 2,			// The input path and output path follow the request
+	SERVE_MAP = 3				// One descriptor, a memfd or file, worked on in place
+};
+
+// Both ends are on the same machine, so everything is in its byte order
+typedef struct {
+	uint32_t magic;
+	uint8_t type;
+	uint8_t op;					// JC_ENCRYPT or JC_DECRYPT
+	uint8_t iv_len;				// 0 or AES_BLOCK_SIZE
+	uint8_t reserved;
+	uint32_t key_id;
+	uint32_t paths_len;			// For SERVE_PATHS, both paths with their terminators
+	uint8_t iv[AES_BLOCK_SIZE];
+} serve_request;
+
+// Statuses beyond the library's
+#define SERVE_ERROR_REQUEST 1000	// The request was not understood
+#define SERVE_ERROR_NO_KEY  1001	// No key has the id
+#define SERVE_ERROR_IO      1002	// Opening, reading or writing failed, error holds errno
+#define SERVE_ERROR_IN_PLACE 1003	// SERVE_MAP with a cipher that changes the length
+
+typedef struct {
+	uint32_t status;			// A jc_status or SERVE_ERROR_*
+	int32_t error;
+	uint64_t written;			// Bytes written to the output
+} serve_reply;
+
+const char* serve_status_string(const serve_reply* reply) {
+	switch (reply->status) {
+		case SERVE_ERROR_REQUEST:
+			return "the daemon did not understand the request";
+		case SERVE_ERROR_NO_KEY:
+			return "the daemon has no key with this id";
+		case SERVE_ERROR_IO:
+			return strerror(reply->error);
+		case SERVE_ERROR_IN_PLACE:
+			return "ECB and CBC change the length of the data, so cannot work in place";
+	}
+	
+	return jc_status_string((jc_status)reply->status);
+}
+
+#if defined(_WIN32)
+
+int serve_main(int argc, char** argv) {
+	fprintf(stderr, ERROR_SERVE_UNSUPPORTED);
+	return 1;
+}
+
+int client_main(int argc, char** argv) {
+	fprintf(stderr, ERROR_SERVE_UNSUPPORTED);
+	return 1;
+}
+
+#else
+
+typedef struct {
+	unsigned int id;
+	jc_ctx* ctx[2];				// Set up for each jc_op, copied for every request
+	bool needs_iv;
+	bool in_place;				// Keeps the length of the data, for SERVE_MAP
+} serve_key;
+
+serve_key* serve_keys = NULL;
+unsigned int serve_key_count = 0;
+
+char serve_socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+serve_key* serve_find_key(const unsigned int id) {
+	for (unsigned int k = 0; k < serve_key_count; k++) {
+		if (serve_keys[k].id == id) {
+			return &serve_keys[k];
+		}
+	}
+	
+	return NULL;
+}
+
+// Reads lines of <id> <cipher> [key], the key given as for -k. Blank lines
+// and lines starting with # are skipped.
+void serve_load_keys(const char* path) {
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, ERROR_KEY_FILE, path);
+		exit(1);
+	}
+	
+	char line[SERVE_KEY_LINE];
+	unsigned int line_no = 0;
+	
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line_no++;
+		
+		char* id_text = strtok(line, " \t\r\n");
+		if (id_text == NULL || id_text[0] == '#') {
+			continue;
+		}
+		
+		char* cipher = strtok(NULL, " \t\r\n");
+		char* key_text = strtok(NULL, " \t\r\n");
+		
+		char* end;
+		unsigned long id = strtoul(id_text, &end, 10);
+		
+		if (*end != '\0' || id > UINT32_MAX || cipher == NULL || strtok(NULL, " \t\r\n") != NULL) {
+			fprintf(stderr, ERROR_KEY_FILE_LINE, line_no);
+			exit(1);
+		}
+		
+		if (serve_find_key(id) != NULL) {
+			fprintf(stderr, ERROR_KEY_FILE_DUPLICATE, (unsigned int)id);
+			exit(1);
+		}
+		
+		buffered_container* key = key_text != NULL ? parse_keywords_to_input_bc(key_text) : NULL;
+		const byte* key_buffer = key != NULL ? key->buffer : NULL;
+		size_t key_len = key != NULL ? key->buffer_len : 0;
+		
+		byte sized[AES_MAX_KEY_SIZE] = { 0 };
+		key_buffer = argument_size_key(cipher, key_buffer, &key_len, sized);
+		
+		serve_keys = (serve_key*)realloc(serve_keys, (serve_key_count + 1) * sizeof(serve_key));
+		assert(serve_keys != NULL);
+		
+		serve_key* k = &serve_keys[serve_key_count];
+		k->id = id;
+		
+		// Set up without an IV to find out whether the cipher takes one, the
+		// requests then bring their own
+		byte zero_iv[AES_BLOCK_SIZE] = { 0 };
+		jc_status status = jc_init(&k->ctx[JC_ENCRYPT], cipher, JC_ENCRYPT, key_buffer, key_len, NULL, 0);
+		
+		k->needs_iv = status == JC_ERROR_IV;
+		if (k->needs_iv) {
+			status = jc_init(&k->ctx[JC_ENCRYPT], cipher, JC_ENCRYPT, key_buffer, key_len, zero_iv, AES_BLOCK_SIZE);
+		}
+		
+		if (status == JC_OK) {
+			status = jc_init(&k->ctx[JC_DECRYPT], cipher, JC_DECRYPT, key_buffer, key_len, zero_iv, AES_BLOCK_SIZE);
+		}
+		
+		if (status != JC_OK) {
+			fprintf(stderr, ERROR_KEY_FILE_KEY, (unsigned int)id, jc_status_string(status));
+			exit(1);
+		}
+		
+		// The same rule as --in-place
+		const jc_ctx* ctx = k->ctx[JC_ENCRYPT];
+		k->in_place = !(ctx->cipher == AES && (ctx->mode == ECB || ctx->mode == CBC));
+		
+		jc_wipe(sized, sizeof(sized));
+		
+		if (key != NULL) {
+			jc_wipe(key->buffer, key->buffer_len);
+			bc_fclose(key);
+			bc_free(key);
+		}
+		
+		serve_key_count++;
+	}
+	
+	jc_wipe(line, sizeof(line));
+	fclose(f);
+}
+
+bool serve_write_all(const int fd, const byte* data, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		
+		if (n <= 0) {
+			return false;
+		}
+		
+		data += n;
+		len -= n;
+	}
+	
+	return true;
+}
+
+bool serve_pwrite_all(const int fd, const byte* data, size_t len, off_t offset) {
+	while (len > 0) {
+		ssize_t n = pwrite(fd, data, len, offset);
+		
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		
+		if (n <= 0) {
+			return false;
+		}
+		
+		data += n;
+		len -= n;
+		offset += n;
+	}
+	
+	return true;
+}
+
+bool serve_read_all(const int fd, byte* data, size_t len) {
+	while (len > 0) {
+		ssize_t n = read(fd, data, len);
+		
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		
+		// The other end closing early is reported as a reset connection
+		if (n == 0) {
+			errno = ECONNRESET;
+		}
+		
+		if (n <= 0) {
+			return false;
+		}
+		
+		data += n;
+		len -= n;
+	}
+	
+	return true;
+}
+
+// Sends data with the descriptors attached to its first byte
+bool serve_send_fds(const int sock, const void* data, const size_t len, const int* fds, const int count) {
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	memset(control, 0, sizeof(control));
+	
+	struct iovec iov = { (void*)data, len };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+	
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+	
+	ssize_t n;
+	do {
+		n = sendmsg(sock, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+	
+	if (n <= 0) {
+		return false;
+	}
+	
+	// The descriptors went with the first part, the rest goes on its own
+	return serve_write_all(sock, (const byte*)data + n, len - n);
+}
+
+// Reads a request, along with up to two descriptors. Any others that came
+// with it are closed. If some were cut off for want of room, none are kept
+// and fd_count is -1, so the request is refused. Returns false once the
+// client has gone, with nothing left open.
+bool serve_recv_request(const int sock, serve_request* req, int* fds, int* fd_count) {
+	char control[CMSG_SPACE(4 * sizeof(int))];
+	struct iovec iov = { req, sizeof(serve_request) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	
+	ssize_t n;
+	do {
+		n = recvmsg(sock, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+	
+	if (n <= 0) {
+		return false;
+	}
+	
+	*fd_count = 0;
+	
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		
+		int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int received[4];
+		memcpy(received, CMSG_DATA(cmsg), count * sizeof(int));
+		
+		for (int i = 0; i < count; i++) {
+			if (*fd_count < 2) {
+				fds[(*fd_count)++] = received[i];
+			} else {
+				close(received[i]);
+			}
+		}
+	}
+	
+	bool read = serve_read_all(sock, (byte*)req + n, sizeof(serve_request) - n);
+	
+	if (!read || (msg.msg_flags & MSG_CTRUNC)) {
+		for (int i = 0; i < *fd_count; i++) {
+			close(fds[i]);
+		}
+		
+		*fd_count = -1;
+	}
+	
+	return read;
+}
+
+// Copies the context of the request's key, with its IV. Returns NULL with
+// the reason in reply if it cannot.
+jc_ctx* serve_start(const serve_request* req, serve_reply* reply, const bool in_place) {
+	serve_key* key = serve_find_key(req->key_id);
+	if (key == NULL) {
+		reply->status = SERVE_ERROR_NO_KEY;
+		return NULL;
+	}
+	
+	if (key->needs_iv && req->iv_len != AES_BLOCK_SIZE) {
+		reply->status = JC_ERROR_IV;
+		return NULL;
+	}
+	
+	if (in_place && !key->in_place) {
+		reply->status = SERVE_ERROR_IN_PLACE;
+		return NULL;
+	}
+	
+	jc_ctx* ctx;
+	jc_status status = jc_clone(key->ctx[req->op], &ctx, req->iv, AES_BLOCK_SIZE);
+	
+	if (status != JC_OK) {
+		reply->status = status;
+		return NULL;
+	}
+	
+	return ctx;
+}
+
+// Runs everything in in_fd through a copy of the key's context into out_fd
+serve_reply serve_run(const serve_request* req, const int in_fd, const int out_fd, byte* in, byte* out) {
+	serve_reply reply = { JC_OK, 0, 0 };
+	
+	jc_ctx* ctx = serve_start(req, &reply, false);
+	if (ctx == NULL) {
+		return reply;
+	}
+	
+	jc_status status;
+	size_t n;
+	
+	for (;;) {
+		ssize_t got = read(in_fd, in, bc_buffer_size);
+		
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		
+		if (got < 0) {
+			reply.status = SERVE_ERROR_IO;
+			reply.error = errno;
+			break;
+		}
+		
+		if (got == 0) {
+			status = jc_final(ctx, out, &n);
+		} else {
+			status = jc_update(ctx, in, out, got, &n);
+		}
+		
+		if (status != JC_OK) {
+			reply.status = status;
+			break;
+		}
+		
+		if (!serve_write_all(out_fd, out, n)) {
+			reply.status = SERVE_ERROR_IO;
+			reply.error = errno;
+			break;
+		}
+		
+		reply.written += n;
+		
+		if (got == 0) {
+			break;
+		}
+	}
+	
+	jc_free(ctx);
+	return reply;
+}
+
+// Whether fd is sealed so it cannot shrink, which makes it safe to map
+bool serve_sealed(const int fd) {
+	#if defined(F_GET_SEALS)
+	int seals = fcntl(fd, F_GET_SEALS);
+	return seals >= 0 && (seals & F_SEAL_SHRINK) != 0;
+	#else
+	(void)fd;
+	return false;
+	#endif
+}
+
+// Runs all of fd through the cipher where it is, mapping it if it is sealed
+// and otherwise a buffer at a time, so it shrinking only cuts the run short
+serve_reply serve_map(const serve_request* req, const int fd, byte* buffer) {
+	serve_reply reply = { JC_OK, 0, 0 };
+	
+	jc_ctx* ctx = serve_start(req, &reply, true);
+	if (ctx == NULL) {
+		return reply;
+	}
+	
+	struct stat st;
+	byte* map = NULL;
+	size_t size = 0;
+	
+	if (fstat(fd, &st) != 0) {
+		reply.status = SERVE_ERROR_IO;
+		reply.error = errno;
+	} else if (st.st_size > 0 && serve_sealed(fd)) {
+		size = st.st_size;
+		map = (byte*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		
+		if (map == MAP_FAILED) {
+			reply.status = SERVE_ERROR_IO;
+			reply.error = errno;
+		}
+	}
+	
+	// Nothing is held back by the ciphers allowed here, so update writes as
+	// much as it is given and final has nothing to write
+	jc_status status = JC_OK;
+	size_t n;
+	
+	if (reply.status == JC_OK && map != NULL) {
+		status = jc_update(ctx, map, map, size, &n);
+	} else if (reply.status == JC_OK) {
+		for (off_t offset = 0;; offset += n) {
+			ssize_t got = pread(fd, buffer, bc_buffer_size, offset);
+			
+			if (got < 0 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			
+			if (got <= 0) {
+				if (got < 0) {
+					reply.status = SERVE_ERROR_IO;
+					reply.error = errno;
+				}
+				
+				break;
+			}
+			
+			status = jc_update(ctx, buffer, buffer, got, &n);
+			if (status != JC_OK) {
+				break;
+			}
+			
+			if (!serve_pwrite_all(fd, buffer, n, offset)) {
+				reply.status = SERVE_ERROR_IO;
+				reply.error = errno;
+				break;
+			}
+			
+			size += n;
+		}
+	}
+	
+	if (reply.status == JC_OK) {
+		byte tail[AES_BLOCK_SIZE];
+		
+		if (status == JC_OK) {
+			status = jc_final(ctx, tail, &n);
+		}
+		
+		reply.status = status;
+		reply.written = status == JC_OK ? size : 0;
+	}
+	
+	if (map != NULL && map != MAP_FAILED) {
+		munmap(map, size);
+	}
+	
+	jc_free(ctx);
+	return reply;
+}
+
+// Opens the input and output of a SERVE_PATHS request. fds are always set,
+// to -1 where nothing was opened.
+serve_reply serve_open_paths(const int sock, const serve_request* req, int* fds) {
+	serve_reply reply = { JC_OK, 0, 0 };
+	char paths[SERVE_MAX_PATHS];
+	
+	fds[0] = -1;
+	fds[1] = -1;
+	
+	if (req->paths_len < 4 || req->paths_len > sizeof(paths) || !serve_read_all(sock, (byte*)paths, req->paths_len)) {
+		reply.status = SERVE_ERROR_REQUEST;
+		return reply;
+	}
+	
+	// Two terminated paths, the second ending the request
+	const char* input = paths;
+	size_t input_len = strnlen(paths, req->paths_len);
+	const char* output = &paths[input_len + 1];
+	
+	if (input_len == 0 || input_len + 2 >= req->paths_len || paths[req->paths_len - 1] != '\0') {
+		reply.status = SERVE_ERROR_REQUEST;
+		return reply;
+	}
+	
+	fds[0] = open(input, O_RDONLY);
+	fds[1] = fds[0] < 0 ? -1 : open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	
+	if (fds[0] < 0 || fds[1] < 0) {
+		reply.status = SERVE_ERROR_IO;
+		reply.error = errno;
+	}
+	
+	return reply;
+}
+
+// Answers requests on a connection until the client closes it
+void serve_connection(const int sock, byte* in, byte* out) {
+	serve_request req;
+	int fds[2];
+	int fd_count;
+	
+	while (serve_recv_request(sock, &req, fds, &fd_count)) {
+		serve_reply reply = { SERVE_ERROR_REQUEST, 0, 0 };
+		bool valid = req.magic == SERVE_MAGIC && (req.op == JC_ENCRYPT || req.op == JC_DECRYPT) &&
+			(req.iv_len == 0 || req.iv_len == AES_BLOCK_SIZE);
+			
+		if (valid && req.type == SERVE_FDS && fd_count == 2) {
+			reply = serve_run(&req, fds[0], fds[1], in, out);
+		} else if (valid && req.type == SERVE_MAP && fd_count == 1) {
+			reply = serve_map(&req, fds[0], in);
+		} else if (valid && req.type == SERVE_PATHS && fd_count == 0) {
+			reply = serve_open_paths(sock, &req, fds);
+			fd_count = 2;
+			
+			if (reply.status == JC_OK) {
+				reply = serve_run(&req, fds[0], fds[1], in, out);
+			}
+			
+			// Paths that were not all read leave the stream out of step
+			valid = reply.status != SERVE_ERROR_REQUEST;
+		} else {
+			valid = false;
+		}
+		
+		for (int i = 0; i < fd_count; i++) {
+			if (fds[i] >= 0) {
+				close(fds[i]);
+			}
+		}
+		
+		jc_wipe(req.iv, sizeof(req.iv));
+		
+		// A request that was not understood leaves the stream out of step
+		if (!serve_write_all(sock, (const byte*)&reply, sizeof(reply)) || !valid) {
+			return;
+		}
+	}
+}
+
+void* serve_worker(void* arg) {
+	int listener = *(int*)arg;
+	
+	byte* in = bc_alloc_buffer(bc_buffer_size);
+	byte* out = bc_alloc_buffer(bc_buffer_size + AES_BLOCK_SIZE);
+	
+	for (;;) {
+		int sock = accept(listener, NULL, NULL);
+		
+		if (sock < 0) {
+			// Only a closed listener stops a worker
+			if (errno == EBADF || errno == EINVAL) {
+				break;
+			}
+			
+			// The connection stays queued, so wait for descriptors to be
+			// closed instead of failing to take it over and over
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+				usleep(SERVE_ACCEPT_BACKOFF);
+			}
+			
+			continue;
+		}
+		
+		serve_connection(sock, in, out);
+		close(sock);
+	}
+	
+	bc_free_buffer(in);
+	bc_free_buffer(out);
+	return NULL;
+}
+
+bool serve_address(struct sockaddr_un* addr, const char* path) {
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, ERROR_SOCKET_TOO_LONG, path);
+		return false;
+	}
+	
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+int serve_listen(const char* path) {
+	struct sockaddr_un addr;
+	if (!serve_address(&addr, path)) {
+		exit(1);
+	}
+	
+	// A socket left behind by a daemon that did not shut down is replaced,
+	// one that is still being served is not
+	int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, ERROR_ALREADY_SERVING, path);
+		exit(1);
+	}
+	
+	if (probe >= 0) {
+		close(probe);
+	}
+	
+	unlink(path);
+	
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	
+	// Anyone who can connect can use the keys, so only the owner can
+	mode_t mask = umask(0177);
+	bool bound = listener >= 0 && bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+	umask(mask);
+	
+	if (!bound || listen(listener, SOMAXCONN) != 0) {
+		fprintf(stderr, ERROR_SOCKET, path, strerror(errno));
+		exit(1);
+	}
+	
+	return listener;
+}
+
+void serve_stop(int sig) {
+	(void)sig;
+	unlink(serve_socket_path);
+	_exit(0);
+}
+
+// joelcrypto --serve <socket> --keys <file> [-t <count | auto>] [--buffer-size <size>]
+int serve_main(int argc, char** argv) {
+	const char* socket_path = NULL;
+	const char* keys_path = NULL;
+	unsigned int workers = 0;
+	
+	for (int j = 1; j < argc; j++) {
+		bool last_arg = j + 1 == argc;
+		
+		if (strcmp(argv[j], "--serve") == 0) {
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_SOCKET);
+				return 1;
+			}
+			
+			socket_path = argv[++j];
+		} else if (strcmp(argv[j], "--keys") == 0) {
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_KEY_FILE);
+				return 1;
+			}
+			
+			keys_path = argv[++j];
+		} else if (strcmp(argv[j], "-t") == 0 || strcmp(argv[j], "--threads") == 0) {
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_THREADS);
+				return 1;
+			}
+			
+			char* next_arg = argv[++j];
+			int count = strcasecmp(next_arg, "auto") == 0 ? (int)pool_auto_threads() : atoi(next_arg);
+			
+			if (count <= 0) {
+				fprintf(stderr, ERROR_INVALID_THREADS);
+				return 1;
+			}
+			
+			workers = count;
+		} else if (strcmp(argv[j], "--buffer-size") == 0) {
+			// Already handled before parsing, skip over the value
+			j++;
+		} else {
+			fprintf(stderr, ERROR_INVALID_ARGUMENT, argv[j]);
+			return 1;
+		}
+	}
+	
+	if (keys_path == NULL) {
+		fprintf(stderr, ERROR_NO_KEY_FILE);
+		return 1;
+	}
+	
+	if (workers == 0) {
+		workers = pool_auto_threads();
+	}
+	
+	serve_load_keys(keys_path);
+	
+	int listener = serve_listen(socket_path);
+	strcpy(serve_socket_path, socket_path);
+	
+	// A client that goes away mid-reply must not stop the daemon
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, serve_stop);
+	signal(SIGTERM, serve_stop);
+	
+	fprintf(MESSAGES, "Serving %u keys on %s with %u workers\n", serve_key_count, socket_path, workers);
+	fflush(MESSAGES);
+	
+	pthread_t* threads = (pthread_t*)malloc(workers * sizeof(pthread_t));
+	assert(threads != NULL);
+	
+	for (unsigned int w = 1; w < workers; w++) {
+		if (pthread_create(&threads[w], NULL, serve_worker, &listener) != 0) {
+			workers = w;
+			break;
+		}
+	}
+	
+	serve_worker(&listener);
+	
+	for (unsigned int w = 1; w < workers; w++) {
+		pthread_join(threads[w], NULL);
+	}
+	
+	free(threads);
+	return 0;
+}
+
+// Takes FILE:<filename>, or NULL for stdio, named STDIN or STDOUT
+const char* client_file(const char* arg, const char* stdio) {
+	if (strcasecmp(arg, stdio) == 0) {
+		return NULL;
+	}
+	
+	if (strncasecmp(arg, "FILE:", 5) != 0 || arg[5] == '\0') {
+		fprintf(stderr, ERROR_CLIENT_FILE);
+		exit(1);
+	}
+	
+	return &arg[5];
+}
+
+// Makes path absolute in out, which has room for size, as the daemon would
+// otherwise look for it from its own directory. Returns the length with the
+// terminator, or 0 if it does not fit.
+size_t client_absolute_path(const char* path, char* out, const size_t size) {
+	char cwd[SERVE_MAX_PATHS];
+	int len;
+	
+	if (path[0] == '/') {
+		len = snprintf(out, size, "%s", path);
+	} else if (getcwd(cwd, sizeof(cwd)) != NULL) {
+		len = snprintf(out, size, "%s/%s", cwd, path);
+	} else {
+		return 0;
+	}
+	
+	return len < 0 || (size_t)len >= size ? 0 : len + 1;
+}
+
+// Sends a request with its descriptors and waits for the reply
+bool client_request(const int sock, const serve_request* req, const int* fds, const int count, serve_reply* reply) {
+	return serve_send_fds(sock, req, sizeof(*req), fds, count) &&
+		serve_read_all(sock, (byte*)reply, sizeof(*reply));
+}
+
+#if defined(__linux__)
+// Reads all of fd into a new memfd, sealed so it cannot shrink, ready to be
+// mapped by the daemon
+int client_memfd(const int fd) {
+	int mem = memfd_create("joelcrypto", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (mem < 0) {
+		return -1;
+	}
+	
+	byte* buffer = bc_alloc_buffer(bc_buffer_size);
+	
+	for (;;) {
+		ssize_t got = read(fd, buffer, bc_buffer_size);
+		
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		
+		if (got <= 0 || !serve_write_all(mem, buffer, got)) {
+			if (got != 0) {
+				close(mem);
+				mem = -1;
+			}
+			
+			break;
+		}
+	}
+	
+	// The daemon only maps what cannot be shrunk under it, anything else it
+	// reads and writes back
+	if (mem >= 0 && fcntl(mem, F_ADD_SEALS, F_SEAL_SHRINK) != 0) {
+		// Still works, only without the mapping
+	}
+	
+	bc_free_buffer(buffer);
+	return mem;
+}
+
+// Writes the whole of a memfd the daemon has worked on to fd
+bool client_memfd_out(const int mem, const int fd) {
+	struct stat st;
+	if (fstat(mem, &st) != 0) {
+		return false;
+	}
+	
+	if (st.st_size == 0) {
+		return true;
+	}
+	
+	byte* map = (byte*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, mem, 0);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	
+	bool written = serve_write_all(fd, map, st.st_size);
+	munmap(map, st.st_size);
+	return written;
+}
+#endif
+
+// joelcrypto --client <socket> --encrypt|--decrypt --key-id <id> -i FILE:<> -o FILE:<> [-iv <iv>]
+//     -i FILE:<> --in-place      Has the daemon map the file and work on it where it is
+//     -i STDIN -o STDOUT         Passes the data in a memfd, where there is one
+//     --by-path                  Sends the paths, for the daemon to open itself
+int client_main(int argc, char** argv) {
+	const char* socket_path = NULL;
+	const char* input_path = NULL;
+	const char* output_path = NULL;
+	bool input_defined = false,
+	     output_defined = false,
+	     operation_defined = false,
+	     key_id_defined = false,
+	     in_place = false,
+	     by_path = false;
+	
+	serve_request req;
+	memset(&req, 0, sizeof(req));
+	req.magic = SERVE_MAGIC;
+	req.type = SERVE_FDS;
+	
+	for (int j = 1; j < argc; j++) {
+		bool last_arg = j + 1 == argc;
+		
+		if (strcmp(argv[j], "--client") == 0) {
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_SOCKET);
+				return 1;
+			}
+			
+			socket_path = argv[++j];
+		} else if (strcmp(argv[j], "--encrypt") == 0 || strcmp(argv[j], "--decrypt") == 0) {
+			if (operation_defined) {
+				fprintf(stderr, ERROR_MULTIPLE_OPERATION);
+				return 1;
+			}
+			
+			req.op = strcmp(argv[j], "--encrypt") == 0 ? JC_ENCRYPT : JC_DECRYPT;
+			operation_defined = true;
+		} else if (strcmp(argv[j], "--key-id") == 0) {
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_KEY_ID);
+				return 1;
+			}
+			
+			char* end;
+			unsigned long id = strtoul(argv[++j], &end, 10);
+			
+			if (*end != '\0' || end == argv[j] || id > UINT32_MAX) {
+				fprintf(stderr, ERROR_INVALID_KEY_ID, argv[j]);
+				return 1;
+			}
+			
+			req.key_id = id;
+			key_id_defined = true;
+		} else if (strcmp(argv[j], "-i") == 0 || strcmp(argv[j], "--input") == 0) {
+			if (input_defined) {
+				fprintf(stderr, ERROR_MULTIPLE_INPUT);
+				return 1;
+			}
+			
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_INPUT);
+				return 1;
+			}
+			
+			input_path = client_file(argv[++j], "STDIN");
+			input_defined = true;
+		} else if (strcmp(argv[j], "-o") == 0 || strcmp(argv[j], "--output") == 0) {
+			if (output_defined) {
+				fprintf(stderr, ERROR_MULTIPLE_OUTPUT);
+				return 1;
+			}
+			
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_OUTPUT);
+				return 1;
+			}
+			
+			output_path = client_file(argv[++j], "STDOUT");
+			output_defined = true;
+		} else if (strcmp(argv[j], "--in-place") == 0) {
+			in_place = true;
+		} else if (strcmp(argv[j], "--by-path") == 0) {
+			by_path = true;
+		} else if (strcmp(argv[j], "-iv") == 0 || strcmp(argv[j], "--initialization-vector") == 0) {
+			if (req.iv_len != 0) {
+				fprintf(stderr, ERROR_MULTIPLE_IV);
+				return 1;
+			}
+			
+			if (last_arg) {
+				fprintf(stderr, ERROR_NO_IV);
+				return 1;
+			}
+			
+			argument_parse_iv(argv[++j], req.iv);
+			req.iv_len = AES_BLOCK_SIZE;
+		} else {
+			fprintf(stderr, ERROR_INVALID_ARGUMENT, argv[j]);
+			return 1;
+		}
+	}
+	
+	if (!input_defined) {
+		fprintf(stderr, ERROR_NO_INPUT);
+		return 1;
+	}
+	
+	if (by_path && (in_place || input_path == NULL || output_path == NULL)) {
+		fprintf(stderr, ERROR_CLIENT_BY_PATH);
+		return 1;
+	}
+	
+	if (in_place) {
+		if (input_path == NULL || output_defined) {
+			fprintf(stderr, ERROR_CLIENT_IN_PLACE);
+			return 1;
+		}
+	} else if (!output_defined) {
+		fprintf(stderr, ERROR_NO_OUTPUT);
+		return 1;
+	} else if ((input_path == NULL) != (output_path == NULL)) {
+		fprintf(stderr, ERROR_CLIENT_STDIO);
+		return 1;
+	}
+	
+	if (!operation_defined) {
+		fprintf(stderr, ERROR_NO_OPERATION);
+		return 1;
+	}
+	
+	if (!key_id_defined) {
+		fprintf(stderr, ERROR_NO_KEY_ID);
+		return 1;
+	}
+	
+	struct sockaddr_un addr;
+	if (socket_path == NULL || !serve_address(&addr, socket_path)) {
+		fprintf(stderr, ERROR_NO_SOCKET);
+		return 1;
+	}
+	
+	int fds[2] = { STDIN_FILENO, STDOUT_FILENO };
+	int mem = -1;
+	
+	// The request, followed by both paths with --by-path
+	byte message[sizeof(serve_request) + SERVE_MAX_PATHS];
+	
+	if (by_path) {
+		char* paths = (char*)&message[sizeof(serve_request)];
+		size_t input_len = client_absolute_path(input_path, paths, SERVE_MAX_PATHS);
+		size_t output_len = input_len == 0 ? 0 :
+			client_absolute_path(output_path, &paths[input_len], SERVE_MAX_PATHS - input_len);
+			
+		if (output_len == 0) {
+			fprintf(stderr, ERROR_CLIENT_PATHS_LONG);
+			return 1;
+		}
+		
+		req.type = SERVE_PATHS;
+		req.paths_len = input_len + output_len;
+	} else if (in_place) {
+		fds[0] = open(input_path, O_RDWR);
+		if (fds[0] < 0) {
+			fprintf(stderr, ERROR_CLIENT_OPEN, input_path, strerror(errno));
+			return 1;
+		}
+		
+		req.type = SERVE_MAP;
+	} else if (input_path != NULL) {
+		fds[0] = open(input_path, O_RDONLY);
+		if (fds[0] < 0) {
+			fprintf(stderr, ERROR_CLIENT_OPEN, input_path, strerror(errno));
+			return 1;
+		}
+		
+		fds[1] = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fds[1] < 0) {
+			fprintf(stderr, ERROR_CLIENT_OPEN, output_path, strerror(errno));
+			return 1;
+		}
+	} else {
+		// Elsewhere the daemon reads and writes the pipes themselves
+		#if defined(__linux__)
+		mem = client_memfd(STDIN_FILENO);
+		if (mem < 0) {
+			fprintf(stderr, ERROR_CLIENT_OPEN, "STDIN", strerror(errno));
+			return 1;
+		}
+		
+		req.type = SERVE_MAP;
+		#endif
+	}
+	
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		fprintf(stderr, ERROR_SOCKET, socket_path, strerror(errno));
+		return 1;
+	}
+	
+	serve_reply reply;
+	bool sent;
+	
+	if (by_path) {
+		memcpy(message, &req, sizeof(req));
+		sent = serve_write_all(sock, message, sizeof(req) + req.paths_len) &&
+			serve_read_all(sock, (byte*)&reply, sizeof(reply));
+	} else {
+		sent = client_request(sock, &req, mem >= 0 ? &mem : fds, req.type == SERVE_MAP ? 1 : 2, &reply);
+	}
+	
+	// ECB and CBC cannot work in place, so the memfd is read as a file instead
+	if (sent && mem >= 0 && reply.status == SERVE_ERROR_IN_PLACE) {
+		fds[0] = mem;
+		mem = -1;
+		req.type = SERVE_FDS;
+		
+		sent = lseek(fds[0], 0, SEEK_SET) == 0 && client_request(sock, &req, fds, 2, &reply);
+	}
+	
+	if (!sent) {
+		fprintf(stderr, ERROR_SOCKET, socket_path, strerror(errno));
+		return 1;
+	}
+	
+	close(sock);
+	
+	#if defined(__linux__)
+	if (mem >= 0) {
+		if (reply.status == JC_OK && !client_memfd_out(mem, STDOUT_FILENO)) {
+			fprintf(stderr, ERROR_CLIENT_OPEN, "STDOUT", strerror(errno));
+			return 1;
+		}
+		
+		close(mem);
+	}
+	#endif
+	
+	if (fds[0] != STDIN_FILENO) {
+		close(fds[0]);
+	}
+	
+	if (fds[1] != STDOUT_FILENO) {
+		close(fds[1]);
+	}
+	
+	if (reply.status != JC_OK) {
+		fprintf(stderr, ERROR_SERVE_FAILED, serve_status_string(&reply));
+		return 1;
+	}
+	
+	return 0;
+}
+
+#endif
+
+#endif
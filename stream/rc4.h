@@ -7,49 +7,69 @@
 #include <sys/types.h>
 
 #include "util.h"
+#include "arena.h"
 #include "buffered_container.h"
 
+// The RC4 key schedule, setting up the 256 byte state S
+void rc4_schedule(byte* S, const byte* key, const size_t key_len) {
+	for (unsigned int i = 0; i < 256; i++) {
+		S[i] = i;
+	}
+	
+	byte j = 0;
+	for (unsigned int i = 0; i < 256; i++) {
+		j = j + S[i] + key[i % key_len];
+		swap(&S[i], &S[j]);
+	}
+}
+
+// XORs len bytes of src with the keystream into dst. i and j are the stream
+// position, starting at zero, and carry on from one call to the next.
+void rc4_bytes(byte* S, byte* i, byte* j, byte* dst, const byte* src, const size_t len) {
+	byte a = *i, b = *j;
+	
+	for (size_t p = 0; p < len; p++) {
+		a++;
+		b += S[a];
+		swap(&S[a], &S[b]);
+		
+		dst[p] = src[p] ^ S[(byte)(S[a] + S[b])];
+	}
+	
+	*i = a;
+	*j = b;
+}
+
 void rc4(buffered_container* input, buffered_container* output, 
 	const byte* key, const size_t key_len, const crypto_op operation) {
 	
 	// Allocate and set up state buffer
-	byte* S = (byte*)malloc(256);
+	byte* S = (byte*)scratch_alloc(256);
 	assert(S != NULL);
 	
-	unsigned short j, i;
-	
 	switch(operation) {
 		case ENCRYPT:
-		case DECRYPT:
-		
-			for (i = 0; i < 256; i++) {
-				S[i] = i;
-			}
+		case DECRYPT: {
 			
-			// RC4 key schedule
-			j = 0;
-			for (i = 0; i < 256; i++) {
-				j = (j + S[i] + key[i % key_len]) % 256;
-				swap(&S[i], &S[j]);
-			}
+			rc4_schedule(S, key, key_len);
 			
-			// Stream encryption
-			j = 0;
-			i = 0;
-			byte K;
+			// Stream encryption, straight into the output buffer
+			byte i = 0, j = 0;
 			
 			unsigned int p = 0;
 			while (p < input->buffer_len) {
-				i = (i + 1) % 256;
-				j = (j + S[i]) % 256;
-				swap(&S[i], &S[j]);
+				size_t space;
+				byte* dst = bc_write_space(output, &space);
 				
-				K = S[(S[i] + S[j]) % 256];
+				size_t n = input->buffer_len - p;
+				if (space < n) {
+					n = space;
+				}
 				
-				bc_write_byte(output, input->buffer[p] ^ K);
+				rc4_bytes(S, &i, &j, dst, &input->buffer[p], n);
+				bc_write_commit(output, n);
 				
-				p++;
-				// Execute this check on the last loop before we would finish
+				p += n;
 				if (p == input->buffer_len) {
 					if (bc_rnext(input) != 0) {
 						// There is more data! Reset iterator
@@ -58,12 +78,13 @@ void rc4(buffered_container* input, buffered_container* output,
 				}
 			}
 			
-			free(S);
+			scratch_free(S);
 			bc_flush(output);
 			break;
+		}
 			
 		default:
-			printf("Error: Unsupported operation: '%d'\n", operation);
+			fprintf(stderr, "Error: Unsupported operation: '%d'\n", operation);
 			exit(1);
 	}
 }
@@ -0,0 +1,209 @@
+#ifndef STREAM__XOR_H
+#define STREAM__XOR_H
+
+#define ERROR_XOR_KEY_TOO_SHORT "Error: XOR key is shorter than the input. Use XOR:CYCLE to repeat a short key.\n"
+#define ERROR_XOR_KEY_EMPTY     "Error: XOR key is empty.\n"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+#include "util.h"
+#include "buffered_container.h"
+
+void xor_bytes(byte* dst, const byte* src, const byte* key, const size_t len) {
+	size_t i = 0;
+	
+	// Wide kernels first, the compiler picks whichever the target supports
+	#if defined(__AVX2__)
+	for (; i + 32 <= len; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)&src[i]);
+		__m256i b = _mm256_loadu_si256((const __m256i*)&key[i]);
+		_mm256_storeu_si256((__m256i*)&dst[i], _mm256_xor_si256(a, b));
+	}
+	#endif
+	
+	#if defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)&src[i]);
+		__m128i b = _mm_loadu_si128((const __m128i*)&key[i]);
+		_mm_storeu_si128((__m128i*)&dst[i], _mm_xor_si128(a, b));
+	}
+	#endif
+	
+	// Word at a time, memcpy keeps this safe for unaligned buffers
+	for (; i + 8 <= len; i += 8) {
+		uint64_t a, b;
+		memcpy(&a, &src[i], 8);
+		memcpy(&b, &key[i], 8);
+		a ^= b;
+		memcpy(&dst[i], &a, 8);
+	}
+	
+	for (; i < len; i++) {
+		dst[i] = src[i] ^ key[i];
+	}
+}
+
+// xor_bytes for output that bypasses the cache, see stream_copy. The plain
+// kernel handles the bytes before dst is aligned and after the last full vector.
+void xor_bytes_stream(byte* dst, const byte* src, const byte* key, const size_t len) {
+	size_t i = 0;
+	
+	#if defined(__SSE2__)
+	i = (16 - ((uintptr_t)dst & 15)) & 15;
+	if (i > len) {
+		i = len;
+	}
+	
+	xor_bytes(dst, src, key, i);
+	
+	#if defined(__AVX2__)
+	if (((uintptr_t)&dst[i] & 31) != 0 && i + 16 <= len) {
+		__m128i a = _mm_loadu_si128((const __m128i*)&src[i]);
+		__m128i b = _mm_loadu_si128((const __m128i*)&key[i]);
+		_mm_stream_si128((__m128i*)&dst[i], _mm_xor_si128(a, b));
+		i += 16;
+	}
+	
+	for (; i + 32 <= len; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)&src[i]);
+		__m256i b = _mm256_loadu_si256((const __m256i*)&key[i]);
+		_mm256_stream_si256((__m256i*)&dst[i], _mm256_xor_si256(a, b));
+	}
+	#endif
+	
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)&src[i]);
+		__m128i b = _mm_loadu_si128((const __m128i*)&key[i]);
+		_mm_stream_si128((__m128i*)&dst[i], _mm_xor_si128(a, b));
+	}
+	#endif
+	
+	xor_bytes(&dst[i], &src[i], &key[i], len - i);
+}
+
+// Loads the next run of key bytes into the key container, returning the number
+// of bytes now available. When cycling, the key restarts from its beginning.
+size_t xor_next_key(buffered_container* key, const bool cycle_key) {
+	if (key->fd == NULL) {
+		// Literal keys are entirely in memory, they can only be reused
+		return cycle_key ? key->buffer_len : 0;
+	}
+	
+	size_t got = bc_rnext(key);
+	
+	if (got == 0 && cycle_key) {
+		bc_rewind(key);
+		got = key->buffer_len;
+	}
+	
+	return got;
+}
+
+void xor_cipher(buffered_container* input, buffered_container* output,
+	buffered_container* key, const bool cycle_key, const crypto_op operation) {
+	
+	if (key->buffer_len == 0) {
+		fprintf(stderr, ERROR_XOR_KEY_EMPTY);
+		exit(1);
+	}
+	
+	bool key_in_memory = key->eof;
+	
+	byte* expanded_key = NULL;
+	const byte* key_bytes = key->buffer;
+	size_t key_len = key->buffer_len;
+	
+	// A short cycling key is repeated until it fills a buffer, so the kernel
+	// always gets long runs instead of a handful of bytes at a time
+	if (cycle_key && key_in_memory && key->buffer_len < key->buffer_size) {
+		size_t repeats = (key->buffer_size + key->buffer_len - 1) / key->buffer_len;
+		key_len = repeats * key->buffer_len;
+		
+		expanded_key = (byte*)malloc(key_len);
+		assert(expanded_key != NULL);
+		
+		for (unsigned int r = 0; r < repeats; r++) {
+			memcpy(&expanded_key[r * key->buffer_len], key->buffer, key->buffer_len);
+		}
+		
+		key_bytes = expanded_key;
+	}
+	
+	switch(operation) {
+		case ENCRYPT:
+		case DECRYPT: {
+			
+			size_t i = 0;	// Position in the input buffer
+			size_t k = 0;	// Position in the key buffer
+			
+			while (i < input->buffer_len) {
+				
+				if (k == key_len) {
+					if (key_in_memory && cycle_key) {
+						// Wrap around the in-memory key
+						k = 0;
+					} else {
+						key_len = xor_next_key(key, cycle_key);
+						key_bytes = key->buffer;
+						k = 0;
+						
+						if (key_len == 0) {
+							fprintf(stderr, ERROR_XOR_KEY_TOO_SHORT);
+							exit(1);
+						}
+					}
+				}
+				
+				// Process as many bytes as the input, key, and output all allow
+				size_t space;
+				byte* dst = bc_write_space(output, &space);
+				
+				size_t n = input->buffer_len - i;
+				if (key_len - k < n) {
+					n = key_len - k;
+				}
+				
+				if (space < n) {
+					n = space;
+				}
+				
+				if (output->stream) {
+					xor_bytes_stream(dst, &input->buffer[i], &key_bytes[k], n);
+				} else {
+					xor_bytes(dst, &input->buffer[i], &key_bytes[k], n);
+				}
+				bc_write_commit(output, n);
+				
+				i += n;
+				k += n;
+				
+				if (i == input->buffer_len) {
+					if (bc_rnext(input) != 0) {
+						// There is more data! Reset iterator
+						i = 0;
+					}
+				}
+			}
+			
+			free(expanded_key);
+			bc_flush(output);
+			break;
+		}
+		
+		default:
+			fprintf(stderr, "Error: Unsupported operation: '%d'\n", operation);
+			exit(1);
+	}
+}
+
+#endif
\ No newline at end of file
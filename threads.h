@@ -0,0 +1,410 @@
+#ifndef THREADS_H
+#define THREADS_H
+
+#define POOL_MAX_CPUS 1024
+
+#define ERROR_INVALID_CPUS "Error: invalid CPU list \"%s\", expected something like 0-3,8.\n"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#if !defined(_MSC_VER)
+  #include <pthread.h>
+#endif
+
+#if defined(__linux__)
+  #include <sched.h>
+#endif
+
+#include "util.h"
+#include "buffered_container.h"
+
+typedef void (*task_func)(void*);
+
+// One pool of threads serves every parallel job of a run, instead of threads
+// being created and joined for each one. The calling thread is worker 0 and
+// takes part in every job. Task i always goes to worker i % size, so a buffer
+// slice that worker first touched, and that sits on its NUMA node, keeps being
+// worked on there. On Linux the workers are pinned to the allowed CPUs in order.
+typedef struct {
+	unsigned int size;			// Workers, including the calling thread
+	bool started;
+	
+	#if !defined(_MSC_VER)
+	pthread_t* workers;
+	pthread_mutex_t lock;
+	pthread_cond_t posted;		// A new job is ready
+	pthread_cond_t finished;	// The last worker is done with the job
+	#endif
+	
+	task_func func;				// The current job
+	byte* args;
+	size_t arg_size;
+	unsigned int count;
+	
+	unsigned long generation;	// Bumped for every job
+	unsigned int running;		// Workers still on the current job
+	bool stop;
+} thread_pool;
+
+thread_pool pool;
+
+// CPUs the workers are pinned to, set with --cpus or taken from the process
+// affinity when the pool starts
+int pool_cpus[POOL_MAX_CPUS];
+unsigned int pool_cpu_count = 0;
+
+// Parses a CPU list such as 0-3,8 into pool_cpus. Returns false if it is not
+// a valid list.
+bool pool_parse_cpus(const char* list) {
+	pool_cpu_count = 0;
+	const char* p = list;
+	
+	while (*p != '\0') {
+		char* end;
+		long first = strtol(p, &end, 10);
+		long last = first;
+		
+		if (end == p || first < 0) {
+			return false;
+		}
+		
+		p = end;
+		if (*p == '-') {
+			p++;
+			last = strtol(p, &end, 10);
+			
+			if (end == p || last < first) {
+				return false;
+			}
+			
+			p = end;
+		}
+		
+		for (long cpu = first; cpu <= last; cpu++) {
+			if (pool_cpu_count == POOL_MAX_CPUS) {
+				return false;
+			}
+			
+			pool_cpus[pool_cpu_count++] = (int)cpu;
+		}
+		
+		if (*p == ',') {
+			p++;
+		} else if (*p != '\0') {
+			return false;
+		}
+	}
+	
+	return pool_cpu_count > 0;
+}
+
+// Fills pool_cpus from the CPUs the process may run on, unless --cpus did
+void pool_find_cpus(void) {
+	if (pool_cpu_count > 0) {
+		return;
+	}
+	
+	#if defined(__linux__)
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int cpu = 0; cpu < CPU_SETSIZE && pool_cpu_count < POOL_MAX_CPUS; cpu++) {
+			if (CPU_ISSET(cpu, &set)) {
+				pool_cpus[pool_cpu_count++] = cpu;
+			}
+		}
+	}
+	#endif
+}
+
+#if defined(__linux__)
+// Reads a cgroup v2 cpu.max, returning the CPUs the quota allows or 0 if there
+// is no quota
+unsigned int pool_read_cpu_max(const char* path) {
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+	
+	char quota[32];
+	unsigned long long period = 0;
+	unsigned int cpus = 0;
+	
+	if (fscanf(f, "%31s %llu", quota, &period) == 2 && strcmp(quota, "max") != 0 && period > 0) {
+		unsigned long long q = strtoull(quota, NULL, 10);
+		cpus = (unsigned int)((q + period - 1) / period);
+	}
+	
+	fclose(f);
+	return cpus;
+}
+#endif
+
+// How many CPUs the cgroup quota allows, or 0 if there is no quota
+unsigned int pool_cgroup_cpus(void) {
+	#if defined(__linux__)
+	// cgroup v2, in this process's own group first
+	char line[512];
+	FILE* f = fopen("/proc/self/cgroup", "r");
+	
+	if (f != NULL) {
+		while (fgets(line, sizeof(line), f) != NULL) {
+			if (strncmp(line, "0::", 3) == 0) {
+				line[strcspn(line, "\n")] = '\0';
+				
+				char path[640];
+				snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", &line[3]);
+				
+				unsigned int cpus = pool_read_cpu_max(path);
+				if (cpus > 0) {
+					fclose(f);
+					return cpus;
+				}
+			}
+		}
+		
+		fclose(f);
+	}
+	
+	unsigned int cpus = pool_read_cpu_max("/sys/fs/cgroup/cpu.max");
+	if (cpus > 0) {
+		return cpus;
+	}
+	
+	// cgroup v1
+	long long quota = 0, period = 0;
+	
+	f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%lld", &quota) != 1) {
+			quota = 0;
+		}
+		
+		fclose(f);
+	}
+	
+	f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%lld", &period) != 1) {
+			period = 0;
+		}
+		
+		fclose(f);
+	}
+	
+	if (quota > 0 && period > 0) {
+		return (unsigned int)((quota + period - 1) / period);
+	}
+	#endif
+	
+	return 0;
+}
+
+// The thread count for --threads auto: every allowed CPU, but no more than
+// the cgroup quota pays for
+unsigned int pool_auto_threads(void) {
+	pool_find_cpus();
+	
+	unsigned int count = pool_cpu_count > 0 ? pool_cpu_count : 1;
+	unsigned int quota = pool_cgroup_cpus();
+	
+	if (quota > 0 && quota < count) {
+		count = quota;
+	}
+	
+	return count;
+}
+
+void pool_pin(const unsigned int worker) {
+	#if defined(__linux__)
+	if (pool_cpu_count == 0) {
+		return;
+	}
+	
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(pool_cpus[worker % pool_cpu_count], &set);
+	
+	// Only a hint, a worker that cannot be pinned still runs
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	#else
+	(void)worker;
+	#endif
+}
+
+// Runs this worker's share of the current job
+void pool_run_share(const unsigned int worker) {
+	for (unsigned int i = worker; i < pool.count; i += pool.size) {
+		pool.func(&pool.args[i * pool.arg_size]);
+	}
+}
+
+#if !defined(_MSC_VER)
+void* pool_worker(void* arg) {
+	unsigned int worker = (unsigned int)(uintptr_t)arg;
+	unsigned long seen = 0;
+	
+	pool_pin(worker);
+	
+	pthread_mutex_lock(&pool.lock);
+	
+	while (true) {
+		while (pool.generation == seen && !pool.stop) {
+			pthread_cond_wait(&pool.posted, &pool.lock);
+		}
+		
+		if (pool.stop) {
+			break;
+		}
+		
+		seen = pool.generation;
+		pthread_mutex_unlock(&pool.lock);
+		
+		pool_run_share(worker);
+		
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.running == 0) {
+			pthread_cond_signal(&pool.finished);
+		}
+	}
+	
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+#endif
+
+// Starts the pool with size workers, the calling thread being the first
+void pool_start(const unsigned int size) {
+	assert(!pool.started && size > 0);
+	
+	pool_find_cpus();
+	
+	pool.size = size;
+	pool.started = true;
+	pool.generation = 0;
+	pool.stop = false;
+	
+	#if !defined(_MSC_VER)
+	if (size > 1) {
+		pool_pin(0);
+	}
+	
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.posted, NULL);
+	pthread_cond_init(&pool.finished, NULL);
+	
+	pool.workers = (pthread_t*)malloc(size * sizeof(pthread_t));
+	assert(pool.workers != NULL);
+	
+	for (unsigned int w = 1; w < size; w++) {
+		if (pthread_create(&pool.workers[w], NULL, pool_worker, (void*)(uintptr_t)w) != 0) {
+			perror("Error creating thread");
+			exit(1);
+		}
+	}
+	#endif
+}
+
+void pool_stop(void) {
+	if (!pool.started) {
+		return;
+	}
+	
+	#if !defined(_MSC_VER)
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = true;
+	pthread_cond_broadcast(&pool.posted);
+	pthread_mutex_unlock(&pool.lock);
+	
+	for (unsigned int w = 1; w < pool.size; w++) {
+		pthread_join(pool.workers[w], NULL);
+	}
+	
+	free(pool.workers);
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.posted);
+	pthread_cond_destroy(&pool.finished);
+	#endif
+	
+	pool.started = false;
+}
+
+// Runs func once for each of the count argument structs in args, each being
+// arg_size bytes, on the thread pool. The calling thread runs its share too
+// and returns once every task has finished. The pool is started with count
+// workers if it is not running yet.
+void run_parallel(task_func func, void* args, const size_t arg_size, const unsigned int count) {
+	if (count == 0) {
+		return;
+	}
+	
+	if (!pool.started) {
+		pool_start(count);
+	}
+	
+	pool.func = func;
+	pool.args = (byte*)args;
+	pool.arg_size = arg_size;
+	pool.count = count;
+	
+	#if defined(_MSC_VER)
+	// No pthreads, run each task in turn
+	for (unsigned int i = 0; i < count; i++) {
+		func(&pool.args[i * arg_size]);
+	}
+	#else
+	if (pool.size > 1) {
+		pthread_mutex_lock(&pool.lock);
+		pool.running = pool.size - 1;
+		pool.generation++;
+		pthread_cond_broadcast(&pool.posted);
+		pthread_mutex_unlock(&pool.lock);
+	}
+	
+	pool_run_share(0);
+	
+	if (pool.size > 1) {
+		pthread_mutex_lock(&pool.lock);
+		while (pool.running > 0) {
+			pthread_cond_wait(&pool.finished, &pool.lock);
+		}
+		pthread_mutex_unlock(&pool.lock);
+	}
+	#endif
+}
+
+typedef struct {
+	byte* slice;
+	size_t len;
+} touch_task;
+
+void touch_task_run(void* arg) {
+	touch_task* task = (touch_task*)arg;
+	memset(task->slice, 0, task->len);
+}
+
+// Allocates count slices of slice bytes, where slice i is used by task i.
+// Each slice is first touched by the worker that will run its task, so the
+// kernel places its pages on that worker's NUMA node. Free with bc_free_buffer.
+byte* pool_alloc_local(const size_t slice, const unsigned int count) {
+	byte* buffer = bc_alloc_buffer(slice * count);
+	
+	touch_task* tasks = (touch_task*)malloc(count * sizeof(touch_task));
+	assert(tasks != NULL);
+	
+	for (unsigned int i = 0; i < count; i++) {
+		tasks[i].slice = &buffer[i * slice];
+		tasks[i].len = slice;
+	}
+	
+	run_parallel(touch_task_run, tasks, sizeof(touch_task), count);
+	free(tasks);
+	
+	return buffer;
+}
+
+#endif
@@ -8,44 +8,118 @@
 #include <sys/types.h>
 #include <ctype.h>
 
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSSE3__)
+  #include <tmmintrin.h>
+#endif
+
 #include "util.h"
 #include "alph/util.h"
 
 const char base64_lookup[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-void print_base64(const byte* buffer, const size_t buffer_len) {
-	unsigned int iterations = ((int)(buffer_len / 3) * 3);
-	unsigned int extra_chars = buffer_len - iterations;
+#if defined(__SSSE3__)
+// Spreads 12 bytes over the 16 lanes as 6 bit base64 indices
+__m128i base64_indices_sse(const __m128i in) {
+	__m128i x = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	
+	__m128i t0 = _mm_mulhi_epu16(_mm_and_si128(x, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+	__m128i t1 = _mm_mullo_epi16(_mm_and_si128(x, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(t0, t1);
+}
+
+// Turns base64 indices into characters. Each range of the alphabet differs
+// from its index by a constant, picked with a shuffle.
+__m128i base64_chars_sse(const __m128i indices) {
+	__m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	__m128i is_upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+	range = _mm_or_si128(range, _mm_and_si128(is_upper, _mm_set1_epi8(13)));
+	
+	const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	
+	return _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, range));
+}
+#endif
+
+#if defined(__AVX2__)
+__m256i base64_chars_avx2(const __m256i indices) {
+	__m256i range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+	__m256i is_upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+	range = _mm256_or_si256(range, _mm256_and_si256(is_upper, _mm256_set1_epi8(13)));
+	
+	const __m256i offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	
+	return _mm256_add_epi8(indices, _mm256_shuffle_epi8(offsets, range));
+}
+#endif
+
+// Encodes buffer as base64 into dst, padding the end. Returns the number of
+// characters written, 4 for every 3 bytes or part of them. dst is not
+// terminated.
+size_t encode_base64(char* dst, const byte* buffer, const size_t buffer_len) {
+	size_t i = 0;
+	size_t o = 0;
+	
+	// The vector loops load 16 bytes but only use 12 of them, so they stop
+	// while there are still 4 spare bytes after the last group
+	#if defined(__AVX2__)
+	for (; i + 28 <= buffer_len; i += 24, o += 32) {
+		__m128i lo = base64_indices_sse(_mm_loadu_si128((const __m128i*)&buffer[i]));
+		__m128i hi = base64_indices_sse(_mm_loadu_si128((const __m128i*)&buffer[i + 12]));
+		
+		__m256i indices = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		_mm256_storeu_si256((__m256i*)&dst[o], base64_chars_avx2(indices));
+	}
+	#endif
+	
+	#if defined(__SSSE3__)
+	for (; i + 16 <= buffer_len; i += 12, o += 16) {
+		__m128i indices = base64_indices_sse(_mm_loadu_si128((const __m128i*)&buffer[i]));
+		_mm_storeu_si128((__m128i*)&dst[o], base64_chars_sse(indices));
+	}
+	#endif
 	
 	byte b1, b2, b3;
 	
-	for (unsigned int i = 0; i < iterations; i += 3) {
+	for (; i + 3 <= buffer_len; i += 3) {
 		
 		b1 = buffer[i];
 		b2 = buffer[i+1];
 		b3 = buffer[i+2];
 		
-		printf("%c", base64_lookup[ b1 >> 2 ]);
-		printf("%c", base64_lookup[ ((b1 << 4) & 63) | (b2 >> 4) ]);
-		printf("%c", base64_lookup[ ((b2 << 2) & 63) | (b3 >> 6) ]);
-		printf("%c", base64_lookup[ b3 & 63 ]);
+		dst[o++] = base64_lookup[ b1 >> 2 ];
+		dst[o++] = base64_lookup[ ((b1 << 4) & 63) | (b2 >> 4) ];
+		dst[o++] = base64_lookup[ ((b2 << 2) & 63) | (b3 >> 6) ];
+		dst[o++] = base64_lookup[ b3 & 63 ];
 	}
 	
+	size_t extra_chars = buffer_len - i;
+	
 	if (extra_chars == 1) {
-		b1 = buffer[buffer_len - 1];
-		printf("%c", base64_lookup[ b1 >> 2 ]);
-		printf("%c==", base64_lookup[(b1 << 4) & 63]);
+		b1 = buffer[i];
+		dst[o++] = base64_lookup[ b1 >> 2 ];
+		dst[o++] = base64_lookup[(b1 << 4) & 63];
+		dst[o++] = '=';
+		dst[o++] = '=';
 	}
 	
 	if (extra_chars == 2) {
 		
-		b1 = buffer[buffer_len - 2];
-		b2 = buffer[buffer_len - 1];
+		b1 = buffer[i];
+		b2 = buffer[i+1];
 		
-		printf("%c", base64_lookup[ b1 >> 2 ]);
-		printf("%c", base64_lookup[ ((b1 << 4) & 63) | (b2 >> 4) ]);
-		printf("%c=", base64_lookup[ (b2 << 2) & 63 ]);
+		dst[o++] = base64_lookup[ b1 >> 2 ];
+		dst[o++] = base64_lookup[ ((b1 << 4) & 63) | (b2 >> 4) ];
+		dst[o++] = base64_lookup[ (b2 << 2) & 63 ];
+		dst[o++] = '=';
 	}
+	
+	return o;
 }
 
 int base64_value(char);
@@ -147,11 +221,168 @@ byte* get_base64_bytes(char* str) {
 }
 
 
-void print_hex(const byte*, const size_t);
-inline void print_hex(const byte* buffer, const size_t buffer_len) {
-	for (unsigned int i = 0; i < buffer_len; i++) {
-		printf("%0x", buffer[i]);
+#if defined(__SSSE3__)
+// Checks 16 base64 characters and turns them into their 6 bit values, using
+// lookups on the low and high nibble of each character. Returns false if any
+// of them is not in the alphabet.
+bool base64_values_sse(__m128i* x) {
+	const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2f = _mm_set1_epi8(0x2f);
+	
+	__m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(*x, 4), mask_2f);
+	__m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(*x, mask_2f));
+	__m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+	
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff) {
+		return false;
+	}
+	
+	__m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(*x, mask_2f), hi_nibbles));
+	*x = _mm_add_epi8(*x, roll);
+	return true;
+}
+
+// Packs 16 6 bit values into 12 bytes, at the bottom of the vector
+__m128i base64_pack_sse(const __m128i values) {
+	__m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+	__m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(words, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+#endif
+
+// Decodes len base64 characters, a multiple of 4, into dst. Padding is only
+// accepted in the last group. Returns the number of bytes written, or -1 if
+// the characters are not valid base64.
+size_t decode_base64(byte* dst, const char* src, const size_t len) {
+	size_t i = 0;
+	size_t o = 0;
+	
+	// The vector loops stop before the last group, which may be padded
+	#if defined(__AVX2__)
+	for (; i + 32 < len; i += 32, o += 24) {
+		__m128i lo = _mm_loadu_si128((const __m128i*)&src[i]);
+		__m128i hi = _mm_loadu_si128((const __m128i*)&src[i + 16]);
+		
+		if (!base64_values_sse(&lo) || !base64_values_sse(&hi)) {
+			return -1;
+		}
+		
+		__m256i values = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		__m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+		__m256i words = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+		__m256i packed = _mm256_shuffle_epi8(words, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+		
+		_mm_storeu_si128((__m128i*)&dst[o], _mm256_castsi256_si128(packed));
+		_mm_storel_epi64((__m128i*)&dst[o + 16], _mm256_extracti128_si256(packed, 1));
+	}
+	#endif
+	
+	#if defined(__SSSE3__)
+	for (; i + 16 < len; i += 16, o += 12) {
+		__m128i x = _mm_loadu_si128((const __m128i*)&src[i]);
+		
+		if (!base64_values_sse(&x)) {
+			return -1;
+		}
+		
+		__m128i packed = base64_pack_sse(x);
+		_mm_storel_epi64((__m128i*)&dst[o], packed);
+		
+		int last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+		memcpy(&dst[o + 8], &last, 4);
+	}
+	#endif
+	
+	for (; i < len; i += 4) {
+		int v1 = base64_value(src[i]);
+		int v2 = base64_value(src[i+1]);
+		int v3 = base64_value(src[i+2]);
+		int v4 = base64_value(src[i+3]);
+		
+		bool last_group = i + 4 == len;
+		
+		// base64_value gives -1 for anything outside the alphabet, so padding
+		// has to be told apart from invalid characters
+		if (
+			v1 == -1 || v2 == -1 ||
+			(v3 == -1 && !(last_group && src[i+2] == '=' && src[i+3] == '=')) ||
+			(v4 == -1 && !(last_group && src[i+3] == '='))
+		) {
+			return -1;
+		}
+		
+		dst[o++] = ((v1 << 2) & 0xFF) | (v2 >> 4);
+		
+		if (v3 == -1) {
+			break;
+		}
+		
+		dst[o++] = ((v2 << 4) & 0xFF) | (v3 >> 2);
+		
+		if (v4 == -1) {
+			break;
+		}
+		
+		dst[o++] = ((v3 << 6) & 0xFF) | v4;
+	}
+	
+	return o;
+}
+
+// Encodes buffer as lowercase hex into dst, two characters for every byte.
+// Returns the number of characters written. dst is not terminated.
+size_t encode_hex(char* dst, const byte* buffer, const size_t buffer_len) {
+	size_t i = 0;
+	
+	#if defined(__AVX2__)
+	const __m256i digits_256 = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+		'a', 'b', 'c', 'd', 'e', 'f', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+		'a', 'b', 'c', 'd', 'e', 'f');
+	const __m256i nibble_256 = _mm256_set1_epi8(0x0f);
+	
+	for (; i + 32 <= buffer_len; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)&buffer[i]);
+		__m256i hi = _mm256_shuffle_epi8(digits_256, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble_256));
+		__m256i lo = _mm256_shuffle_epi8(digits_256, _mm256_and_si256(x, nibble_256));
+		
+		// Interleaving works within each 128 bit lane, so the halves are
+		// put back in order afterwards
+		__m256i a = _mm256_unpacklo_epi8(hi, lo);
+		__m256i b = _mm256_unpackhi_epi8(hi, lo);
+		_mm256_storeu_si256((__m256i*)&dst[2 * i], _mm256_permute2x128_si256(a, b, 0x20));
+		_mm256_storeu_si256((__m256i*)&dst[2 * i + 32], _mm256_permute2x128_si256(a, b, 0x31));
 	}
+	#endif
+	
+	#if defined(__SSSE3__)
+	const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+		'a', 'b', 'c', 'd', 'e', 'f');
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	
+	for (; i + 16 <= buffer_len; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)&buffer[i]);
+		__m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(x, 4), nibble));
+		__m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(x, nibble));
+		
+		_mm_storeu_si128((__m128i*)&dst[2 * i], _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i*)&dst[2 * i + 16], _mm_unpackhi_epi8(hi, lo));
+	}
+	#endif
+	
+	const char* hex_digits = "0123456789abcdef";
+	
+	for (; i < buffer_len; i++) {
+		dst[2 * i] = hex_digits[buffer[i] >> 4];
+		dst[2 * i + 1] = hex_digits[buffer[i] & 0x0f];
+	}
+	
+	return 2 * buffer_len;
 }
 
 unsigned int get_hex_size(const unsigned int chars) {
@@ -221,4 +452,61 @@ byte* get_hex_bytes(const char* str) {
 	return result;
 }
 
+#if defined(__SSSE3__)
+// Turns 16 hex characters into their nibble values. Returns false if any of
+// them is not a hex digit.
+bool hex_values_sse(__m128i* x) {
+	__m128i digit = _mm_sub_epi8(*x, _mm_set1_epi8('0'));
+	__m128i letter = _mm_sub_epi8(_mm_or_si128(*x, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	
+	__m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+	__m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+	
+	if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) != 0xffff) {
+		return false;
+	}
+	
+	letter = _mm_add_epi8(letter, _mm_set1_epi8(10));
+	*x = _mm_or_si128(_mm_and_si128(is_digit, digit), _mm_andnot_si128(is_digit, letter));
+	return true;
+}
+#endif
+
+// Decodes len hex characters, an even number, into dst. Returns the number of
+// bytes written, or -1 if the characters are not valid hex.
+size_t decode_hex(byte* dst, const char* src, const size_t len) {
+	size_t i = 0;
+	
+	#if defined(__SSSE3__)
+	// Each pair of nibbles becomes high * 16 + low
+	const __m128i weights = _mm_set1_epi16(0x0110);
+	
+	for (; i + 32 <= len; i += 32) {
+		__m128i a = _mm_loadu_si128((const __m128i*)&src[i]);
+		__m128i b = _mm_loadu_si128((const __m128i*)&src[i + 16]);
+		
+		if (!hex_values_sse(&a) || !hex_values_sse(&b)) {
+			return -1;
+		}
+		
+		__m128i bytes = _mm_packus_epi16(_mm_maddubs_epi16(a, weights), _mm_maddubs_epi16(b, weights));
+		_mm_storeu_si128((__m128i*)&dst[i / 2], bytes);
+	}
+	#endif
+	
+	for (; i < len; i += 2) {
+		byte hi = src[i], lo = src[i + 1];
+		
+		if (!isxdigit(hi) || !isxdigit(lo)) {
+			return -1;
+		}
+		
+		hi = isdigit(hi) ? hi - '0' : (hi | 0x20) - 'a' + 10;
+		lo = isdigit(lo) ? lo - '0' : (lo | 0x20) - 'a' + 10;
+		dst[i / 2] = (hi << 4) | lo;
+	}
+	
+	return len / 2;
+}
+
 #endif
\ No newline at end of file
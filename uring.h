@@ -0,0 +1,198 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "util.h"
+
+// A minimal io_uring wrapper over the raw system calls, just enough for the
+// buffered_container reads and writes. There is no liburing dependency.
+
+typedef struct {
+	int fd;
+	unsigned int entries;
+	
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	struct io_uring_sqe* sqes;
+	unsigned int sq_pending;	// Queued entries not yet given to the kernel
+	
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_cqe* cqes;
+	
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+} uring;
+
+// Sets up a ring with room for the given number of entries. Returns false if
+// io_uring is not available, so the caller can fall back to blocking I/O.
+bool uring_init(uring* ring, const unsigned int entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	memset(ring, 0, sizeof(uring));
+	
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) {
+		return false;
+	}
+	
+	ring->entries = params.sq_entries;
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	
+	// Newer kernels share a single mapping between both rings
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+		
+	if (ring->sq_ring == MAP_FAILED) {
+		close(ring->fd);
+		return false;
+	}
+	
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+			
+		if (ring->cq_ring == MAP_FAILED) {
+			munmap(ring->sq_ring, ring->sq_ring_size);
+			close(ring->fd);
+			return false;
+		}
+	}
+	
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+		
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_ring != ring->sq_ring) {
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		}
+		
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+		return false;
+	}
+	
+	byte* sq = (byte*)ring->sq_ring;
+	ring->sq_head = (unsigned int*)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int*)(sq + params.sq_off.array);
+	
+	byte* cq = (byte*)ring->cq_ring;
+	ring->cq_head = (unsigned int*)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	
+	return true;
+}
+
+void uring_exit(uring* ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	
+	if (ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+// Registers buffers with the kernel so reads and writes can use them without
+// pinning the pages every time
+bool uring_register_buffers(uring* ring, const struct iovec* iovecs, const unsigned int count) {
+	return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iovecs, count) == 0;
+}
+
+// Queues a read or write, to be sent to the kernel by uring_submit. A
+// buf_index of -1 means the buffer is not a registered one.
+void uring_queue_rw(uring* ring, const int op, const int fd, void* buffer, const unsigned int len,
+	const unsigned long long offset, const int buf_index, const unsigned long long user_data) {
+	
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index = tail & *ring->sq_mask;
+	
+	// Callers never have more in flight than the ring has room for
+	assert(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) < ring->entries);
+	
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	
+	sqe->fd = fd;
+	sqe->addr = (unsigned long long)(uintptr_t)buffer;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+	
+	if (buf_index >= 0) {
+		sqe->opcode = op == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+		sqe->buf_index = buf_index;
+	} else {
+		sqe->opcode = op;
+	}
+	
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->sq_pending++;
+}
+
+// Hands queued entries to the kernel, optionally waiting for a completion
+int uring_submit(uring* ring, const unsigned int wait_for) {
+	unsigned int flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0;
+	int ret = syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending, wait_for, flags, NULL, 0);
+	
+	if (ret >= 0) {
+		ring->sq_pending -= ret;
+	}
+	
+	return ret;
+}
+
+// Waits for the next completion and copies it into cqe
+void uring_wait(uring* ring, struct io_uring_cqe* cqe) {
+	while (true) {
+		unsigned int head = *ring->cq_head;
+		
+		if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			*cqe = ring->cqes[head & *ring->cq_mask];
+			__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+			return;
+		}
+		
+		if (uring_submit(ring, 1) < 0 && errno != EINTR) {
+			perror("io_uring error");
+			exit(1);
+		}
+	}
+}
+
+#endif
\ No newline at end of file
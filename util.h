@@ -14,10 +14,22 @@ typedef unsigned char bool;
 
 typedef unsigned char byte;
 
-enum crypto_op { ENCRYPT, DECRYPT };
+// State kept per thread, such as cached key schedules
+#if defined(_MSC_VER)
+  #define THREAD_LOCAL __declspec(thread)
+#else
+  #define THREAD_LOCAL __thread
+#endif
+
+// Messages that are not data go to stderr while the output itself is written
+// to STDOUT, and the blank lines that frame them are left out
+bool stdout_is_data = false;
+#define MESSAGES (stdout_is_data ? stderr : stdout)
+
+enum crypto_op { ENCRYPT, DECRYPT, CRACK };
 typedef enum crypto_op crypto_op;
 
-enum cipher_t { VIGENERE, CAESAR, SHIFT, AES, RC4 };
+enum cipher_t { VIGENERE, CAESAR, SHIFT, AES, RC4, XOR };
 typedef enum cipher_t cipher_t;
 
 void* clone_buffer(const void*, const size_t);